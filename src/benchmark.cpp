@@ -0,0 +1,1834 @@
+#include "benchmark.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cuda_runtime.h>
+#include <algorithm>
+#include <cstring>
+#include <random>
+#include <vector>
+#include <glm/gtc/matrix_inverse.hpp>
+
+#include "bvh.h"
+#include "interactions.h"
+#include "intersections.h"
+#include "lbvh.h"
+#include "lights.h"
+#include "morton.h"
+#include "pathState.h"
+#include "pathtraceCpu.h"
+#include "rayPacket.h"
+#include "simdIntersections.h"
+#include "threadPool.h"
+#include "wideBvh.h"
+
+// Iterations rendered to collect path statistics
+#define BENCH_ITERATIONS 8
+// First-hit cache check: longest image side, and iterations rendered after
+// each change, the first of which fills the cache
+#define BENCH_CACHE_MAX_RES 128
+#define BENCH_CACHE_ITERATIONS 3
+// Random rays traced per scene size by the BVH benchmark
+#define BENCH_RAYS 200000
+// The linear search is only timed on this many rays, and only up to this
+// many primitives
+#define BENCH_LINEAR_RAYS 20000
+#define BENCH_LINEAR_MAX_PRIMS 10000
+// Device builds timed per scene by the LBVH benchmark, after a warm-up
+#define BENCH_GPU_BUILDS 4
+// Frames animated per scene by the refit benchmark, and the share of geoms
+// that move in each
+#define BENCH_REFIT_FRAMES 30
+#define BENCH_REFIT_MOVING 0.01f
+// Shadow rays traced after the frames to check that the CPU backend
+// picked up every move
+#define BENCH_REFIT_CHECK_RAYS 100000
+// Instances of one mesh placed by the instancing benchmark, and the rings
+// and segments of that mesh, a torus of 2 * 316 * 158 = 99,856 triangles
+#define BENCH_MAX_INSTANCES 10000
+#define BENCH_TORUS_RINGS 316
+#define BENCH_TORUS_SEGMENTS 158
+// Geoms every ray is tested against by the SIMD benchmark, the rays, and
+// the size of the scene its BVH part traces
+#define BENCH_SIMD_GEOMS 1024
+#define BENCH_SIMD_RAYS 20000
+#define BENCH_SIMD_BVH_PRIMS 100000
+// Shadow rays traced per scene size by the occlusion benchmark
+#define BENCH_SHADOW_RAYS 200000
+// Objects in the scene the geom record benchmark traces, and the rays
+// traced on each thread per chunk
+#define BENCH_GEOM_RECORDS 10000
+#define BENCH_GEOM_CHUNK 4096
+// Random scenes the packet benchmark looks into besides the loaded one
+#define BENCH_PACKET_MAX_PRIMS 100000
+// Convergence renders with and without next-event estimation: longest image
+// side, iterations of the reference and of the compared renders, and the
+// first iteration of the reference, so it shares no samples with them
+#define BENCH_NEE_MAX_RES 128
+#define BENCH_NEE_REFERENCE 1024
+#define BENCH_NEE_MAX_ITERATIONS 256
+#define BENCH_NEE_REFERENCE_SEED 1000000
+// Light tree against power sampling: the most emitters in the generated
+// rig, the shading points on its floor and the light samples taken at each
+#define BENCH_LIGHT_MAX_EMITTERS 16384
+#define BENCH_LIGHT_POINTS 4096
+#define BENCH_LIGHT_SAMPLES 64
+// Random number generators: paths are pixels times samples, each drawing
+// as many numbers as a bounce with light sampling does when timed; the
+// chi-square tests use this many bins, per axis for pairs
+#define BENCH_SAMPLER_PIXELS 65536
+#define BENCH_SAMPLER_SAMPLES 64
+#define BENCH_SAMPLER_DRAWS 8
+#define BENCH_SAMPLER_BINS_1D 1024
+#define BENCH_SAMPLER_BINS_2D 64
+
+typedef std::chrono::high_resolution_clock Clock;
+
+// Changes the first-hit cache check renders after, in order
+enum CacheStep
+{
+    CACHE_STEP_FIRST,
+    CACHE_STEP_CAMERA,
+    CACHE_STEP_UPLOAD,
+    CACHE_STEP_MOVE,
+    CACHE_STEP_ANTIALIAS_ON,
+    CACHE_STEP_ANTIALIAS_OFF,
+    NUM_CACHE_STEPS
+};
+
+static const char* cacheStepNames[NUM_CACHE_STEPS] = {
+    "first render", "camera moved", "scene rebuilt", "geom moved", "antialias on", "antialias off"
+};
+
+/**
+ * Apply `step` to the scene. `geom` is a non-emissive geom to move, and
+ * `offset` how far the camera and that geom move.
+ */
+static void applyCacheStep(Scene* scene, int step, int geom, const glm::vec3& offset)
+{
+    RenderState& state = scene->state;
+    Geom& g = scene->geoms[geom];
+    switch (step)
+    {
+    case CACHE_STEP_CAMERA:
+        state.camera.position += offset;
+        break;
+    case CACHE_STEP_UPLOAD:
+        // An edit outside updateGeoms(), so the renderer has to take the
+        // whole scene again
+        g.translation -= offset;
+        g.transform = utilityCore::buildTransformationMatrix(g.translation, g.rotation, g.scale);
+        g.inverseTransform = glm::inverse(g.transform);
+        g.invTranspose = glm::inverseTranspose(g.transform);
+        scene->buildBvh();
+        break;
+    case CACHE_STEP_MOVE:
+        scene->setGeomTransform(geom, g.translation + 2.0f * offset, g.rotation, g.scale);
+        scene->updateGeoms();
+        break;
+    case CACHE_STEP_ANTIALIAS_ON:
+        state.antialias = true;
+        break;
+    case CACHE_STEP_ANTIALIAS_OFF:
+        state.antialias = false;
+        break;
+    }
+}
+
+/**
+ * Check that the first-hit cache never changes the image. Each pipeline
+ * renders the loaded scene at a lower resolution once with the cache on,
+ * on one backend instance that sees the camera move, the scene rebuilt
+ * after an edit, a geom moved by updateGeoms() and ANTIALIAS switched on
+ * and off again. A fresh instance with the cache off then renders the same
+ * steps. The images have to match exactly; rays saved shows that the cache
+ * was used.
+ */
+static void benchFirstHits(Scene* scene, int numThreads)
+{
+    RenderState& state = scene->state;
+    const Camera sceneCamera = state.camera;
+    const std::vector<Geom> sceneGeoms = scene->geoms;
+    const bool sceneCache = state.cacheFirstHits;
+    const bool sceneAntialias = state.antialias;
+
+    const int divisor = (std::max(sceneCamera.resolution.x, sceneCamera.resolution.y) + BENCH_CACHE_MAX_RES - 1)
+        / BENCH_CACHE_MAX_RES;
+    int geom = (int)scene->geoms.size() - 1;
+    while (geom > 0 && scene->materials[scene->geoms[geom].materialid].emittance > 0.0f)
+    {
+        geom--;
+    }
+    const AABB bounds = scene->bvh.bounds();
+    const glm::vec3 offset = sceneCamera.right * 0.05f * glm::length(bounds.max - bounds.min);
+
+    printf("%-10s %-14s %12s %11s\n", "pipeline", "after", "max diff", "rays saved");
+    int mismatches = 0;
+    for (int pipeline = 0; pipeline < 2; pipeline++)
+    {
+        std::vector<glm::vec3> cached[NUM_CACHE_STEPS];
+        long long cachedRays[NUM_CACHE_STEPS];
+        for (int cache = 1; cache >= 0; cache--)
+        {
+            state.camera = sceneCamera;
+            state.camera.resolution = sceneCamera.resolution / divisor;
+            state.camera.pixelLength = sceneCamera.pixelLength * (float)divisor;
+            state.image.assign(state.camera.resolution.x * state.camera.resolution.y, glm::vec3(0.0f));
+            state.cacheFirstHits = cache != 0;
+            state.antialias = false;
+            scene->geoms = sceneGeoms;
+            scene->buildBvh();
+
+            if (cache)
+            {
+                pathtraceCpuInit(scene, numThreads, (CpuPipeline)pipeline);
+            }
+            for (int step = 0; step < NUM_CACHE_STEPS; step++)
+            {
+                applyCacheStep(scene, step, geom, offset);
+                if (!cache)
+                {
+                    pathtraceCpuInit(scene, numThreads, (CpuPipeline)pipeline);
+                }
+                std::fill(state.image.begin(), state.image.end(), glm::vec3(0.0f));
+                const long long raysBefore = pathtraceCpuStats().rays;
+                for (int iter = 1; iter <= BENCH_CACHE_ITERATIONS; iter++)
+                {
+                    pathtraceCpu(iter);
+                }
+                const long long rays = pathtraceCpuStats().rays - raysBefore;
+                if (!cache)
+                {
+                    pathtraceCpuFree();
+                }
+
+                if (cache)
+                {
+                    cached[step] = state.image;
+                    cachedRays[step] = rays;
+                    continue;
+                }
+                float maxDiff = 0.0f;
+                for (size_t i = 0; i < state.image.size(); i++)
+                {
+                    const glm::vec3 diff = glm::abs(state.image[i] - cached[step][i]);
+                    maxDiff = std::max(maxDiff, std::max(diff.x, std::max(diff.y, diff.z)));
+                }
+                mismatches += maxDiff > 0.0f;
+                printf("%-10s %-14s %12g %10.1f%%\n", pipeline == CPU_PIPELINE_TILES ? "tiles" : "wavefront",
+                    cacheStepNames[step], maxDiff, 100.0 * (1.0 - (double)cachedRays[step] / rays));
+            }
+            if (cache)
+            {
+                pathtraceCpuFree();
+            }
+        }
+    }
+    printf("%s\n", mismatches == 0 ? "All images match" : "Images differ with the cache on");
+
+    state.camera = sceneCamera;
+    state.image.assign(sceneCamera.resolution.x * sceneCamera.resolution.y, glm::vec3(0.0f));
+    state.cacheFirstHits = sceneCache;
+    state.antialias = sceneAntialias;
+    scene->geoms = sceneGeoms;
+    scene->buildBvh();
+}
+
+/**
+ * Bytes of path and intersection state one wavefront stage moves per path.
+ * Alive/partition flags and queue indices are the same for both layouts and
+ * left out.
+ */
+struct StageBytes
+{
+    double generate;        // per pixel
+    double extend;          // per active path
+    double sort;            // per active path, if the material sort is on
+    double shade;           // per active path
+    double compactAlive;    // per path that survives the bounce
+    double compactDead;     // per path that terminates in the bounce
+    double gather;          // per path that terminates in the bounce
+};
+
+// Array-of-structs: PathSegment and ShadeableIntersection are loaded and
+// stored whole, so every access moves the full struct.
+static StageBytes aosBytes()
+{
+    const double P = sizeof(PathSegment);
+    const double I = sizeof(ShadeableIntersection);
+    StageBytes b;
+    b.generate = P;
+    b.extend = P + I;
+    b.sort = I + 2 * (P + I);
+    b.shade = P + I + P;
+    b.compactAlive = 2 * P;
+    b.compactDead = 2 * P;
+    b.gather = P;
+    return b;
+}
+
+// Structure-of-arrays (pathState.h): each stage touches only the arrays it
+// uses.
+static StageBytes soaBytes()
+{
+    const double vec3 = 3 * sizeof(float);
+    const double ray = 2 * vec3;
+    const double path = ray + 2 * vec3 + sizeof(float) + 3 * sizeof(int);
+    const double result = vec3 + 2 * sizeof(int);       // radiance, pixel, sample
+    const double bounce = ray + 2 * vec3 + sizeof(float) + sizeof(int);   // PathView::storeBounce
+    const double hit = sizeof(float4) + 2 * sizeof(int);    // normal and t, material, geom
+    const double hitKey = sizeof(float) + sizeof(int);  // t, material
+    StageBytes b;
+    b.generate = path;
+    b.extend = ray + hit;
+    b.sort = hitKey + 2 * (path + hit);
+    b.shade = path + hit + bounce;
+    b.compactAlive = 2 * path;
+    b.compactDead = 2 * result;
+    b.gather = result;
+    return b;
+}
+
+static double bounceBytes(const StageBytes& b, int active, int alive, bool sorted)
+{
+    int dead = active - alive;
+    return active * (b.extend + (sorted ? b.sort : 0.0) + b.shade)
+        + alive * b.compactAlive + dead * (b.compactDead + b.gather);
+}
+
+/**
+ * Render a few iterations with the wavefront pipeline and, from the number
+ * of paths active at every depth, count the bytes of path state each layout
+ * reads and writes per bounce.
+ */
+static void benchLayout(Scene* scene, int numThreads)
+{
+    pathtraceCpuInit(scene, numThreads, CPU_PIPELINE_WAVEFRONT);
+    for (int iter = 1; iter <= BENCH_ITERATIONS; iter++)
+    {
+        pathtraceCpu(iter);
+    }
+    const std::vector<int> active = pathtraceCpuStats().activePaths;
+    pathtraceCpuFree();
+
+    const bool sorted = scene->state.materialSort == SORT_ON;
+    const StageBytes aos = aosBytes();
+    const StageBytes soa = soaBytes();
+    const Camera& cam = scene->state.camera;
+    const int pixelcount = cam.resolution.x * cam.resolution.y;
+
+    printf("Path state: AoS %d + %d bytes, SoA %d + %d bytes per path (PathSegment + intersection)\n",
+        (int)sizeof(PathSegment), (int)sizeof(ShadeableIntersection),
+        (int)(PathView::bytes(pixelcount) / pixelcount), (int)(HitView::bytes(pixelcount) / pixelcount));
+    printf("Generate: AoS %.2f MB, SoA %.2f MB\n", pixelcount * aos.generate * 1e-6, pixelcount * soa.generate * 1e-6);
+    printf("%5s %10s %12s %12s %7s\n", "depth", "active", "AoS MB", "SoA MB", "SoA/AoS");
+
+    double aosTotal = 0.0;
+    double soaTotal = 0.0;
+    for (size_t depth = 0; depth < active.size(); depth++)
+    {
+        int alive = depth + 1 < active.size() ? active[depth + 1] : 0;
+        double a = bounceBytes(aos, active[depth], alive, sorted);
+        double s = bounceBytes(soa, active[depth], alive, sorted);
+        aosTotal += a;
+        soaTotal += s;
+        printf("%5d %10d %12.2f %12.2f %7.2f\n", (int)depth, active[depth], a * 1e-6, s * 1e-6, s / a);
+    }
+    if (!active.empty())
+    {
+        printf("Average per bounce: AoS %.2f MB, SoA %.2f MB (%.0f%% less)\n",
+            aosTotal / active.size() * 1e-6, soaTotal / active.size() * 1e-6,
+            100.0 * (1.0 - soaTotal / aosTotal));
+    }
+}
+
+/**
+ * Render the scene at its DEPTH and at two and four times that, with and
+ * without Russian roulette, and compare the path length and time per
+ * iteration. The mean image brightness should match between the two modes
+ * at any depth, since roulette is unbiased.
+ */
+static void benchRoulette(Scene* scene, int numThreads)
+{
+    RenderState& state = scene->state;
+    const int sceneDepth = state.traceDepth;
+    const int sceneRoulette = state.rouletteDepth;
+    const int rouletteDepth = sceneRoulette >= 0 ? sceneRoulette : 3;
+    const size_t pixelcount = state.image.size();
+
+    printf("%5s %9s %12s %12s %12s %10s\n", "DEPTH", "roulette", "path length", "rays/iter", "ms/iter", "mean");
+    for (int scale = 1; scale <= 4; scale *= 2)
+    {
+        for (int roulette = 0; roulette < 2; roulette++)
+        {
+            state.traceDepth = sceneDepth * scale;
+            state.rouletteDepth = roulette ? rouletteDepth : -1;
+            pathtraceCpuInit(scene, numThreads, CPU_PIPELINE_WAVEFRONT);
+            for (int iter = 1; iter <= BENCH_ITERATIONS; iter++)
+            {
+                pathtraceCpu(iter);
+            }
+            const CpuRenderStats stats = pathtraceCpuStats();
+            pathtraceCpuFree();
+
+            double mean = 0.0;
+            for (size_t i = 0; i < pixelcount; i++)
+            {
+                const glm::vec3& c = state.image[i];
+                mean += (c.x + c.y + c.z) / 3.0;
+            }
+            mean /= (double)pixelcount * BENCH_ITERATIONS;
+
+            char label[16];
+            snprintf(label, sizeof(label), roulette ? "from %d" : "off", rouletteDepth);
+            printf("%5d %9s %12.2f %12lld %12.3f %10.4f\n", state.traceDepth, label,
+                utilityCore::averagePathLength(stats.activePaths), stats.rays / BENCH_ITERATIONS,
+                stats.seconds * 1000.0 / BENCH_ITERATIONS, mean);
+        }
+    }
+    state.traceDepth = sceneDepth;
+    state.rouletteDepth = sceneRoulette;
+}
+
+/**
+ * `count` random spheres and cubes in a 20-unit cube, sized so they fill
+ * roughly the same fraction of it at any count.
+ */
+static std::vector<Geom> randomGeoms(int count, std::mt19937& rng)
+{
+    std::uniform_real_distribution<float> position(-10.0f, 10.0f);
+    std::uniform_real_distribution<float> angle(0.0f, 360.0f);
+    std::uniform_real_distribution<float> size(0.5f, 1.5f);
+    const float scale = 20.0f / std::cbrt((float)count);
+
+    std::vector<Geom> geoms(count);
+    for (int i = 0; i < count; i++)
+    {
+        Geom& g = geoms[i];
+        g.type = i % 2 ? CUBE : SPHERE;
+        g.materialid = 0;
+        g.meshId = -1;
+        g.translation = glm::vec3(position(rng), position(rng), position(rng));
+        g.rotation = glm::vec3(angle(rng), angle(rng), angle(rng));
+        g.scale = scale * glm::vec3(size(rng), size(rng), size(rng));
+        g.transform = utilityCore::buildTransformationMatrix(g.translation, g.rotation, g.scale);
+        g.inverseTransform = glm::inverse(g.transform);
+        g.invTranspose = glm::inverseTranspose(g.transform);
+    }
+    return geoms;
+}
+
+/**
+ * Segments between two random points in `bounds`, as shadow rays: origin at
+ * one end, `tMax` the distance to the other.
+ */
+static void shadowRaysIn(const AABB& bounds, int count, std::mt19937& rng, std::vector<Ray>& rays,
+    std::vector<float>& tMax)
+{
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    const glm::vec3 size = bounds.max - bounds.min;
+    rays.resize(count);
+    tMax.resize(count);
+    for (int i = 0; i < count; i++)
+    {
+        const glm::vec3 from = bounds.min + glm::vec3(unit(rng), unit(rng), unit(rng)) * size;
+        const glm::vec3 to = bounds.min + glm::vec3(unit(rng), unit(rng), unit(rng)) * size;
+        rays[i].origin = from;
+        rays[i].direction = glm::normalize(to - from);
+        tMax[i] = glm::length(to - from);
+    }
+}
+
+static bool sameNodes(const Bvh& a, const Bvh& b)
+{
+    return a.primIndices == b.primIndices && a.nodes.size() == b.nodes.size()
+        && memcmp(a.nodes.data(), b.nodes.data(), a.nodes.size() * sizeof(BvhNode)) == 0;
+}
+
+/**
+ * Build the BVH over random scenes of 10 to 1M primitives, serially and on
+ * `numThreads` threads, and time closest hit queries for random rays through
+ * them against the linear search where that finishes in reasonable time.
+ * Traversal is single threaded. Independent of the scene file.
+ */
+static void benchBvh(int numThreads)
+{
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+    ThreadPool pool(numThreads);
+
+    printf("Parallel builds on %d threads\n", pool.size());
+    printf("%8s %10s %12s %9s %6s %8s %14s %14s %9s %10s\n", "prims", "build ms", "parallel ms",
+        "nodes", "depth", "SAH", "BVH Mrays/s", "linear Mrays/s", "speedup", "mismatches");
+    for (int count = 10; count <= 1000000; count *= 10)
+    {
+        std::vector<Geom> geoms = randomGeoms(count, rng);
+        const std::vector<CompactGeom> records = compactGeoms(geoms);
+        Bvh bvh;
+        bvh.build(geoms);
+        Bvh parallel;
+        parallel.build(geoms, &pool);
+        if (!sameNodes(bvh, parallel))
+        {
+            printf("Parallel build over %d prims differs from the serial one\n", count);
+        }
+
+        // Rays from outside the scene towards random points inside it
+        std::vector<Ray> rays(BENCH_RAYS);
+        for (int i = 0; i < BENCH_RAYS; i++)
+        {
+            glm::vec3 from = 30.0f * glm::normalize(glm::vec3(unit(rng), unit(rng), unit(rng)));
+            glm::vec3 to = 10.0f * glm::vec3(unit(rng), unit(rng), unit(rng));
+            rays[i].origin = from;
+            rays[i].direction = glm::normalize(to - from);
+        }
+
+        std::vector<int> hits(BENCH_RAYS);
+        Clock::time_point start = Clock::now();
+        for (int i = 0; i < BENCH_RAYS; i++)
+        {
+            ShadeableIntersection isect;
+            hits[i] = intersectBvh(rays[i], records.data(), bvh.view(), MeshView(), isect);
+        }
+        std::chrono::duration<double> bvhSeconds = Clock::now() - start;
+        const double bvhRate = BENCH_RAYS / bvhSeconds.count() * 1e-6;
+
+        if (count <= BENCH_LINEAR_MAX_PRIMS)
+        {
+            int mismatches = 0;
+            start = Clock::now();
+            for (int i = 0; i < BENCH_LINEAR_RAYS; i++)
+            {
+                ShadeableIntersection isect;
+                mismatches += intersectGeoms(rays[i], records.data(), count, MeshView(), isect) != hits[i];
+            }
+            std::chrono::duration<double> linearSeconds = Clock::now() - start;
+            const double linearRate = BENCH_LINEAR_RAYS / linearSeconds.count() * 1e-6;
+            printf("%8d %10.2f %12.2f %9d %6d %8.2f %14.3f %14.3f %8.1fx %10d\n", count, bvh.buildMs, parallel.buildMs,
+                (int)bvh.nodes.size(), bvh.depth, bvh.sahCost(), bvhRate, linearRate, bvhRate / linearRate, mismatches);
+        }
+        else
+        {
+            printf("%8d %10.2f %12.2f %9d %6d %8.2f %14.3f %14s %9s %10s\n", count, bvh.buildMs, parallel.buildMs,
+                (int)bvh.nodes.size(), bvh.depth, bvh.sahCost(), bvhRate, "-", "-", "-");
+        }
+    }
+}
+
+// Closest hit queries per second through `bvh`, in millions
+static double traceRate(const std::vector<CompactGeom>& geoms, const Bvh& bvh, MeshView meshes,
+    const std::vector<Ray>& rays)
+{
+    Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < rays.size(); i++)
+    {
+        ShadeableIntersection isect;
+        intersectBvh(rays[i], geoms.data(), bvh.view(), meshes, isect);
+    }
+    std::chrono::duration<double> seconds = Clock::now() - start;
+    return rays.size() / seconds.count() * 1e-6;
+}
+
+/**
+ * Build the LBVH on the device `BENCH_GPU_BUILDS` times and return the mean
+ * build time in ms, or a negative value without a device. Sets `mismatches`
+ * to the nodes whose children or primitives differ from `host`; bounds are
+ * left out as FMA contraction on the device may move them by an ulp.
+ */
+static double gpuBuildMs(const std::vector<Geom>& geoms, const Bvh& host, int& mismatches)
+{
+    int devices = 0;
+    mismatches = 0;
+    if (cudaGetDeviceCount(&devices) != cudaSuccess || devices == 0 || geoms.empty())
+    {
+        return -1.0;
+    }
+    const int n = (int)geoms.size();
+    Geom* dev_geoms;
+    BvhNode* dev_nodes;
+    int* dev_primIndices;
+    cudaMalloc(&dev_geoms, n * sizeof(Geom));
+    cudaMalloc(&dev_nodes, (2 * n - 1) * sizeof(BvhNode));
+    cudaMalloc(&dev_primIndices, n * sizeof(int));
+    cudaMemcpy(dev_geoms, geoms.data(), n * sizeof(Geom), cudaMemcpyHostToDevice);
+
+    // The first build allocates the scratch buffers
+    Lbvh::buildDevice(n, dev_geoms, dev_nodes, dev_primIndices);
+    cudaDeviceSynchronize();
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < BENCH_GPU_BUILDS; i++)
+    {
+        Lbvh::buildDevice(n, dev_geoms, dev_nodes, dev_primIndices);
+    }
+    cudaDeviceSynchronize();
+    std::chrono::duration<double, std::milli> elapsed = Clock::now() - start;
+
+    std::vector<BvhNode> nodes(2 * n - 1);
+    std::vector<int> primIndices(n);
+    cudaMemcpy(nodes.data(), dev_nodes, nodes.size() * sizeof(BvhNode), cudaMemcpyDeviceToHost);
+    cudaMemcpy(primIndices.data(), dev_primIndices, n * sizeof(int), cudaMemcpyDeviceToHost);
+    for (size_t i = 0; i < nodes.size(); i++)
+    {
+        const BvhNode& a = nodes[i];
+        const BvhNode& b = host.nodes[i];
+        bool leaf = a.primCount > 0;
+        mismatches += a.rightOrFirst != b.rightOrFirst || a.primCount != b.primCount
+            || (leaf && primIndices[a.rightOrFirst] != host.primIndices[b.rightOrFirst]);
+    }
+
+    cudaFree(dev_geoms);
+    cudaFree(dev_nodes);
+    cudaFree(dev_primIndices);
+    Lbvh::freeScratch();
+    return elapsed.count() / BENCH_GPU_BUILDS;
+}
+
+/**
+ * Build time against trace time of the SAH builder and the linear BVH, on
+ * the loaded scene and on random scenes of 1k to 1M primitives. Both host
+ * builds run on `numThreads` threads, and the device build runs when there is
+ * a GPU. Rays go from a sphere around the scene towards random points in its
+ * bounds, traced on one thread.
+ */
+static void benchLbvh(Scene* scene, int numThreads)
+{
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    ThreadPool pool(numThreads);
+
+    printf("Host builds on %d threads\n", pool.size());
+    printf("%-10s %8s %9s %9s %9s %8s %8s %9s %9s %11s %11s\n", "scene", "prims", "SAH ms", "LBVH ms",
+        "GPU ms", "SAH", "LBVH", "SAH dpt", "LBVH dpt", "SAH Mray/s", "LBVH Mray/s");
+    for (int count = 0; count <= 1000000; count = count ? count * 10 : 1000)
+    {
+        std::vector<Geom> generated;
+        if (count > 0)
+        {
+            generated = randomGeoms(count, rng);
+        }
+        const std::vector<Geom>& geoms = count > 0 ? generated : scene->geoms;
+        const MeshView meshes = count > 0 ? MeshView() : scene->meshes.view();
+        if (geoms.empty())
+        {
+            continue;
+        }
+
+        Bvh sah;
+        sah.build(geoms, &pool, BVH_BUILDER_SAH);
+        Bvh lbvh;
+        lbvh.build(geoms, &pool, BVH_BUILDER_LBVH);
+        int mismatches;
+        double gpuMs = gpuBuildMs(geoms, lbvh, mismatches);
+        if (mismatches > 0)
+        {
+            printf("GPU build over %d prims differs from the host one in %d nodes\n", (int)geoms.size(), mismatches);
+        }
+
+        AABB bounds;
+        bounds.min = sah.nodes[0].boundsMin;
+        bounds.max = sah.nodes[0].boundsMax;
+        const glm::vec3 center = bounds.center();
+        const float radius = glm::length(bounds.max - bounds.min);
+        std::vector<Ray> rays(BENCH_RAYS);
+        for (int i = 0; i < BENCH_RAYS; i++)
+        {
+            glm::vec3 dir = glm::vec3(unit(rng), unit(rng), unit(rng)) * 2.0f - 1.0f;
+            glm::vec3 from = center + radius * glm::normalize(dir + glm::vec3(1e-6f));
+            glm::vec3 to = bounds.min + glm::vec3(unit(rng), unit(rng), unit(rng)) * (bounds.max - bounds.min);
+            rays[i].origin = from;
+            rays[i].direction = glm::normalize(to - from);
+        }
+
+        char gpuColumn[16] = "-";
+        if (gpuMs >= 0.0)
+        {
+            snprintf(gpuColumn, sizeof(gpuColumn), "%.2f", gpuMs);
+        }
+        printf("%-10s %8d %9.2f %9.2f %9s %8.2f %8.2f %9d %9d %11.3f %11.3f\n", count > 0 ? "random" : "loaded",
+            (int)geoms.size(), sah.buildMs, lbvh.buildMs, gpuColumn, sah.sahCost(), lbvh.sahCost(),
+            sah.depth, lbvh.depth, traceRate(compactGeoms(geoms), sah, meshes, rays),
+            traceRate(compactGeoms(geoms), lbvh, meshes, rays));
+    }
+}
+
+/**
+ * Animate a fixed 1% of the geoms of random scenes of 10k to 1M primitives,
+ * each drifting at its own velocity, and time Scene::updateGeoms() per frame
+ * against a full rebuild. Reports the SAH cost ratio the refits reached, how
+ * often they fell back to a rebuild, and the bytes uploaded per frame against
+ * the whole scene: the geoms the CPU backend compacts again in
+ * pathtraceCpuUpdateScene(), plus the BVH nodes a device copy of the tree
+ * takes. Stale counts the shadow rays the backend then answers differently
+ * from a fresh copy of the geoms. Uses `scene` with its geoms swapped out.
+ */
+static void benchRefit(Scene* scene, int numThreads)
+{
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+    std::vector<Geom> sceneGeoms;
+    sceneGeoms.swap(scene->geoms);
+
+    printf("%d frames, %.0f%% of geoms moving, rebuild past %.2fx the built SAH cost\n", BENCH_REFIT_FRAMES,
+        BENCH_REFIT_MOVING * 100.0f, BVH_REFIT_MAX_COST_RATIO);
+    printf("%8s %10s %10s %9s %9s %12s %12s %8s\n", "prims", "build ms", "update ms", "rebuilds", "max cost",
+        "upload KB", "full KB", "stale");
+    for (int count = 10000; count <= 1000000; count *= 10)
+    {
+        scene->geoms = randomGeoms(count, rng);
+        scene->buildBvh();
+        pathtraceCpuInit(scene, numThreads, CPU_PIPELINE_TILES);
+        const double buildMs = scene->bvh.buildMs;
+        const double fullKB = (count * sizeof(CompactGeom) + scene->bvh.nodes.size() * sizeof(BvhNode)) / 1024.0;
+
+        const int moving = std::max(1, (int)(count * BENCH_REFIT_MOVING));
+        const float speed = 0.5f * 20.0f / std::cbrt((float)count);
+        std::vector<int> movers(moving);
+        std::vector<glm::vec3> velocity(moving);
+        for (int i = 0; i < moving; i++)
+        {
+            movers[i] = std::uniform_int_distribution<int>(0, count - 1)(rng);
+            velocity[i] = speed * glm::vec3(unit(rng), unit(rng), unit(rng));
+        }
+
+        double updateMs = 0.0;
+        double uploadBytes = 0.0;
+        float maxCost = 1.0f;
+        int rebuilds = 0;
+        for (int frame = 0; frame < BENCH_REFIT_FRAMES; frame++)
+        {
+            for (int i = 0; i < moving; i++)
+            {
+                const Geom& g = scene->geoms[movers[i]];
+                scene->setGeomTransform(movers[i], g.translation + velocity[i], g.rotation, g.scale);
+            }
+            Clock::time_point start = Clock::now();
+            bool rebuilt = scene->updateGeoms();
+            std::chrono::duration<double, std::milli> elapsed = Clock::now() - start;
+            updateMs += elapsed.count();
+
+            if (rebuilt)
+            {
+                rebuilds++;
+                uploadBytes += scene->bvh.nodes.size() * sizeof(BvhNode);
+            }
+            else
+            {
+                maxCost = std::max(maxCost, scene->bvh.refitCostRatio());
+                for (size_t r = 0; r < scene->dirtyNodeRanges.size(); r++)
+                {
+                    uploadBytes += (scene->dirtyNodeRanges[r].end - scene->dirtyNodeRanges[r].begin) * sizeof(BvhNode);
+                }
+            }
+            uploadBytes += pathtraceCpuUpdateScene();
+        }
+
+        AABB bounds;
+        bounds.min = scene->bvh.nodes[0].boundsMin;
+        bounds.max = scene->bvh.nodes[0].boundsMax;
+        std::vector<Ray> rays;
+        std::vector<float> tMax;
+        shadowRaysIn(bounds, BENCH_REFIT_CHECK_RAYS, rng, rays, tMax);
+        std::vector<int> occluded(BENCH_REFIT_CHECK_RAYS);
+        pathtraceCpuOccluded(rays.data(), tMax.data(), BENCH_REFIT_CHECK_RAYS, occluded.data());
+        pathtraceCpuFree();
+        const std::vector<CompactGeom> records = compactGeoms(scene->geoms);
+        int stale = 0;
+        for (int i = 0; i < BENCH_REFIT_CHECK_RAYS; i++)
+        {
+            stale += occludedBvh(rays[i], tMax[i], records.data(), scene->bvh.view(), MeshView()) != (occluded[i] != 0);
+        }
+
+        printf("%8d %10.2f %10.3f %9d %8.2fx %12.1f %12.1f %8d\n", count, buildMs, updateMs / BENCH_REFIT_FRAMES,
+            rebuilds, maxCost, uploadBytes / 1024.0 / BENCH_REFIT_FRAMES, fullKB, stale);
+    }
+
+    scene->geoms.swap(sceneGeoms);
+    scene->buildBvh();
+}
+
+/**
+ * Add a torus of BENCH_TORUS_RINGS * BENCH_TORUS_SEGMENTS quads, with vertex
+ * normals, to `meshes`, fitting in the unit cube like the other primitives.
+ */
+static int addTorus(MeshSet& meshes, ThreadPool* pool)
+{
+    const float major = 0.35f;
+    const float minor = 0.15f;
+    std::vector<glm::vec3> positions;
+    std::vector<glm::vec3> normals;
+    std::vector<glm::ivec3> triangles;
+    for (int i = 0; i < BENCH_TORUS_RINGS; i++)
+    {
+        const float u = TWO_PI * i / BENCH_TORUS_RINGS;
+        const glm::vec3 ring(cosf(u), 0.0f, sinf(u));
+        for (int j = 0; j < BENCH_TORUS_SEGMENTS; j++)
+        {
+            const float v = TWO_PI * j / BENCH_TORUS_SEGMENTS;
+            const glm::vec3 n = cosf(v) * ring + glm::vec3(0.0f, sinf(v), 0.0f);
+            positions.push_back(major * ring + minor * n);
+            normals.push_back(n);
+
+            const int i1 = (i + 1) % BENCH_TORUS_RINGS;
+            const int j1 = (j + 1) % BENCH_TORUS_SEGMENTS;
+            const int a = i * BENCH_TORUS_SEGMENTS + j;
+            const int b = i1 * BENCH_TORUS_SEGMENTS + j;
+            const int c = i1 * BENCH_TORUS_SEGMENTS + j1;
+            const int d = i * BENCH_TORUS_SEGMENTS + j1;
+            triangles.push_back(glm::ivec3(a, b, c));
+            triangles.push_back(glm::ivec3(a, c, d));
+        }
+    }
+    return meshes.add("torus", positions, normals, triangles, pool);
+}
+
+/**
+ * Place 1 to BENCH_MAX_INSTANCES instances of one 100k-triangle mesh at
+ * random and report what the two-level hierarchy costs: the mesh's bytes
+ * are held once, and each instance adds a Geom and its share of the scene
+ * BVH. Compares the total against flattening every instance into world
+ * space, and traces random rays through the scene on one thread.
+ */
+static void benchInstances(int numThreads)
+{
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    ThreadPool pool(numThreads);
+    MeshSet meshes;
+    const int meshId = addTorus(meshes, &pool);
+    const Mesh& mesh = meshes.meshes[meshId];
+    const double meshMB = meshes.meshBytes(meshId) / (1024.0 * 1024.0);
+    printf("Mesh: %d triangles, %d vertices, %.1f MB with its BVH, built in %.1f ms\n", mesh.numTriangles,
+        mesh.numVertices, meshMB, meshes.lastBuildMs);
+
+    printf("%9s %12s %10s %10s %12s %12s %11s\n", "instances", "scene tris", "bytes/inst", "total MB",
+        "flat MB", "build ms", "Mrays/s");
+    for (int count = 1; count <= BENCH_MAX_INSTANCES; count *= 10)
+    {
+        std::vector<Geom> geoms = randomGeoms(count, rng);
+        for (int i = 0; i < count; i++)
+        {
+            geoms[i].type = MESH;
+            geoms[i].meshId = meshId;
+            geoms[i].meshMin = mesh.boundsMin;
+            geoms[i].meshMax = mesh.boundsMax;
+        }
+        Bvh bvh;
+        bvh.build(geoms, &pool);
+        const double instanceBytes = count * (sizeof(CompactGeom) + sizeof(int)) + bvh.nodes.size() * sizeof(BvhNode);
+        const double totalMB = meshMB + instanceBytes / (1024.0 * 1024.0);
+
+        AABB bounds;
+        bounds.min = bvh.nodes[0].boundsMin;
+        bounds.max = bvh.nodes[0].boundsMax;
+        const glm::vec3 center = bounds.center();
+        const float radius = glm::length(bounds.max - bounds.min);
+        std::vector<Ray> rays(BENCH_RAYS);
+        for (int i = 0; i < BENCH_RAYS; i++)
+        {
+            glm::vec3 dir = glm::vec3(unit(rng), unit(rng), unit(rng)) * 2.0f - 1.0f;
+            glm::vec3 from = center + radius * glm::normalize(dir + glm::vec3(1e-6f));
+            glm::vec3 to = bounds.min + glm::vec3(unit(rng), unit(rng), unit(rng)) * (bounds.max - bounds.min);
+            rays[i].origin = from;
+            rays[i].direction = glm::normalize(to - from);
+        }
+
+        printf("%9d %12lld %10.0f %10.1f %12.1f %12.2f %11.3f\n", count, (long long)count * mesh.numTriangles,
+            instanceBytes / count, totalMB, meshMB * count, bvh.buildMs,
+            traceRate(compactGeoms(geoms), bvh, meshes.view(), rays));
+    }
+}
+
+/**
+ * Bytes per primitive and work per ray of the binary BVH against its
+ * compressed wide conversion, on the loaded scene and on random scenes of
+ * 1k to 1M primitives. Steps are nodes visited; node bytes count every node
+ * record read, including the children a binary node tests. Traced on one
+ * thread; mismatches are rays whose hit differs between the two.
+ */
+static void benchWide(Scene* scene, int numThreads)
+{
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    ThreadPool pool(numThreads);
+
+    printf("%d-wide nodes of %d bytes, binary nodes of %d bytes\n", WIDE_BVH_WIDTH, (int)sizeof(WideBvhNode),
+        (int)sizeof(BvhNode));
+    printf("%-7s %8s %7s %7s %8s %8s %9s %9s %8s %8s %9s %9s %10s\n", "scene", "prims", "B/prim", "wide",
+        "steps", "wide", "node B", "wide", "prims", "wide", "Mrays/s", "wide", "mismatches");
+    for (int count = 0; count <= 1000000; count = count ? count * 10 : 1000)
+    {
+        std::vector<Geom> generated;
+        if (count > 0)
+        {
+            generated = randomGeoms(count, rng);
+        }
+        const std::vector<Geom>& geoms = count > 0 ? generated : scene->geoms;
+        const MeshView meshes = count > 0 ? MeshView() : scene->meshes.view();
+        if (geoms.empty())
+        {
+            continue;
+        }
+
+        const std::vector<CompactGeom> records = compactGeoms(geoms);
+        Bvh bvh;
+        bvh.build(geoms, &pool);
+        WideBvh wide;
+        wide.build(bvh);
+        const double prims = (double)geoms.size();
+        const double binaryBytes = bvh.nodes.size() * sizeof(BvhNode) + bvh.primIndices.size() * sizeof(int);
+
+        AABB bounds;
+        bounds.min = bvh.nodes[0].boundsMin;
+        bounds.max = bvh.nodes[0].boundsMax;
+        const glm::vec3 center = bounds.center();
+        const float radius = glm::length(bounds.max - bounds.min);
+        std::vector<Ray> rays(BENCH_RAYS);
+        for (int i = 0; i < BENCH_RAYS; i++)
+        {
+            glm::vec3 dir = glm::vec3(unit(rng), unit(rng), unit(rng)) * 2.0f - 1.0f;
+            glm::vec3 from = center + radius * glm::normalize(dir + glm::vec3(1e-6f));
+            glm::vec3 to = bounds.min + glm::vec3(unit(rng), unit(rng), unit(rng)) * (bounds.max - bounds.min);
+            rays[i].origin = from;
+            rays[i].direction = glm::normalize(to - from);
+        }
+
+        // Counted in a pass of their own, so the timed passes run as the
+        // renderers do
+        double binary[3] = { 0.0, 0.0, 0.0 };
+        double compressed[3] = { 0.0, 0.0, 0.0 };
+        int mismatches = 0;
+        for (int i = 0; i < BENCH_RAYS; i++)
+        {
+            ShadeableIntersection isect;
+            TraversalStats b = { 0, 0, 0 };
+            TraversalStats w = { 0, 0, 0 };
+            int hit = intersectBvh(rays[i], records.data(), bvh.view(), meshes, isect, &b);
+            mismatches += intersectWideBvh(rays[i], records.data(), wide.view(), meshes, isect, &w) != hit;
+            binary[0] += b.steps;
+            binary[1] += b.nodeBytes;
+            binary[2] += b.primTests;
+            compressed[0] += w.steps;
+            compressed[1] += w.nodeBytes;
+            compressed[2] += w.primTests;
+        }
+
+        Clock::time_point start = Clock::now();
+        for (int i = 0; i < BENCH_RAYS; i++)
+        {
+            ShadeableIntersection isect;
+            intersectWideBvh(rays[i], records.data(), wide.view(), meshes, isect);
+        }
+        std::chrono::duration<double> wideSeconds = Clock::now() - start;
+
+        printf("%-7s %8d %7.1f %7.1f %8.1f %8.1f %9.0f %9.0f %8.1f %8.1f %9.3f %9.3f %10d\n",
+            count > 0 ? "random" : "loaded", (int)geoms.size(), binaryBytes / prims, wide.bytes() / prims,
+            binary[0] / BENCH_RAYS, compressed[0] / BENCH_RAYS, binary[1] / BENCH_RAYS,
+            compressed[1] / BENCH_RAYS, binary[2] / BENCH_RAYS, compressed[2] / BENCH_RAYS,
+            traceRate(records, bvh, meshes, rays), BENCH_RAYS / wideSeconds.count() * 1e-6, mismatches);
+    }
+}
+
+// Rays from a sphere around `bounds` towards random points inside it
+static std::vector<Ray> raysInto(const AABB& bounds, int count, std::mt19937& rng)
+{
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    const glm::vec3 center = bounds.center();
+    const float radius = glm::length(bounds.max - bounds.min);
+    std::vector<Ray> rays(count);
+    for (int i = 0; i < count; i++)
+    {
+        glm::vec3 dir = glm::vec3(unit(rng), unit(rng), unit(rng)) * 2.0f - 1.0f;
+        glm::vec3 from = center + radius * glm::normalize(dir + glm::vec3(1e-6f));
+        glm::vec3 to = bounds.min + glm::vec3(unit(rng), unit(rng), unit(rng)) * (bounds.max - bounds.min);
+        rays[i].origin = from;
+        rays[i].direction = glm::normalize(to - from);
+    }
+    return rays;
+}
+
+/**
+ * Packed ray tests on every instruction set this CPU has, against the scalar
+ * sphereIntersectionTest and boxIntersectionTest: tests per second with one
+ * ray against BENCH_SIMD_GEOMS packed geoms, the rays whose hit or miss
+ * differs, and the largest relative difference in `t`. Then closest-hit
+ * throughput over a random BVH with packed leaf tests. One thread.
+ */
+static void benchSimd()
+{
+    std::mt19937 rng(1234);
+    const SimdIsa best = bestSimdIsa();
+    printf("Widest instruction set: %s\n", simdIsaName(best));
+
+    std::vector<Geom> geoms = randomGeoms(BENCH_SIMD_GEOMS, rng);
+    AABB bounds = AABB::empty();
+    for (size_t i = 0; i < geoms.size(); i++)
+    {
+        bounds.grow(geomBounds(geoms[i]));
+    }
+    std::vector<CompactGeom> records = compactGeoms(geoms);
+    const std::vector<Ray> rays = raysInto(bounds, BENCH_SIMD_RAYS, rng);
+    const double tests = (double)BENCH_SIMD_RAYS * BENCH_SIMD_GEOMS;
+
+    // Reference: the scalar tests, one geom at a time
+    std::vector<float> reference((size_t)BENCH_SIMD_RAYS * BENCH_SIMD_GEOMS);
+    Clock::time_point start = Clock::now();
+    for (int r = 0; r < BENCH_SIMD_RAYS; r++)
+    {
+        for (int g = 0; g < BENCH_SIMD_GEOMS; g++)
+        {
+            glm::vec3 point;
+            glm::vec3 normal;
+            bool outside;
+            reference[(size_t)r * BENCH_SIMD_GEOMS + g] = records[g].type() == CUBE
+                ? boxIntersectionTest(records[g], rays[r], point, normal, outside)
+                : sphereIntersectionTest(records[g], rays[r], point, normal, outside);
+        }
+    }
+    std::chrono::duration<double> scalarSeconds = Clock::now() - start;
+    const double scalarRate = tests / scalarSeconds.count() * 1e-6;
+
+    PackedGeoms packed;
+    packed.pack(records.data(), BENCH_SIMD_GEOMS);
+    std::vector<float> t(BENCH_SIMD_GEOMS + SIMD_MAX_WIDTH);
+    printf("%-8s %6s %12s %9s %11s %12s\n", "ISA", "lanes", "Mtests/s", "speedup", "mismatches", "max rel err");
+    printf("%-8s %6d %12.1f %8.2fx %11s %12s\n", "glm", 1, scalarRate, 1.0, "-", "-");
+    for (int isa = SIMD_ISA_SCALAR; isa <= best; isa++)
+    {
+        int mismatches = 0;
+        double maxError = 0.0;
+        double seconds = 0.0;
+        for (int r = 0; r < BENCH_SIMD_RAYS; r++)
+        {
+            start = Clock::now();
+            intersectPacked(packed.view(), 0, BENCH_SIMD_GEOMS, rays[r], t.data(), (SimdIsa)isa);
+            std::chrono::duration<double> elapsed = Clock::now() - start;
+            seconds += elapsed.count();
+            for (int g = 0; g < BENCH_SIMD_GEOMS; g++)
+            {
+                const float expected = reference[(size_t)r * BENCH_SIMD_GEOMS + g];
+                if ((expected > 0.0f) != (t[g] > 0.0f))
+                {
+                    mismatches++;
+                }
+                else if (expected > 0.0f)
+                {
+                    maxError = std::max(maxError, (double)std::abs(t[g] - expected) / expected);
+                }
+            }
+        }
+        const double rate = tests / seconds * 1e-6;
+        printf("%-8s %6d %12.1f %8.2fx %11d %12.2e\n", simdIsaName((SimdIsa)isa), simdIsaWidth((SimdIsa)isa),
+            rate, rate / scalarRate, mismatches, maxError);
+    }
+
+    geoms = randomGeoms(BENCH_SIMD_BVH_PRIMS, rng);
+    records = compactGeoms(geoms);
+    Bvh bvh;
+    bvh.build(geoms);
+    bounds.min = bvh.nodes[0].boundsMin;
+    bounds.max = bvh.nodes[0].boundsMax;
+    const std::vector<Ray> bvhRays = raysInto(bounds, BENCH_RAYS, rng);
+    packed.pack(records.data(), BENCH_SIMD_BVH_PRIMS, bvh.primIndices.data());
+    std::vector<int> hits(BENCH_RAYS);
+    for (int i = 0; i < BENCH_RAYS; i++)
+    {
+        ShadeableIntersection isect;
+        hits[i] = intersectBvh(bvhRays[i], records.data(), bvh.view(), MeshView(), isect);
+    }
+
+    printf("BVH over %d prims, leaves of up to %d\n", BENCH_SIMD_BVH_PRIMS, BVH_MAX_LEAF_SIZE);
+    printf("%-8s %11s %11s\n", "leaves", "Mrays/s", "mismatches");
+    printf("%-8s %11.3f %11s\n", "glm", traceRate(records, bvh, MeshView(), bvhRays), "-");
+    for (int isa = SIMD_ISA_SCALAR; isa <= best; isa++)
+    {
+        int mismatches = 0;
+        start = Clock::now();
+        for (int i = 0; i < BENCH_RAYS; i++)
+        {
+            ShadeableIntersection isect;
+            mismatches += intersectBvhPacked(bvhRays[i], records.data(), bvh.view(), packed.view(), MeshView(),
+                isect, (SimdIsa)isa) != hits[i];
+        }
+        std::chrono::duration<double> seconds = Clock::now() - start;
+        printf("%-8s %11.3f %11d\n", simdIsaName((SimdIsa)isa), BENCH_RAYS / seconds.count() * 1e-6, mismatches);
+    }
+}
+
+/**
+ * Closest-hit queries through a BVH over BENCH_GEOM_RECORDS random geoms:
+ * size of the record the intersection tests read, geom and node bytes read
+ * per ray, and rays per second on one thread and on `numThreads`.
+ */
+static void benchGeoms(int numThreads)
+{
+    std::mt19937 rng(1234);
+    ThreadPool pool(numThreads);
+    const std::vector<Geom> geoms = randomGeoms(BENCH_GEOM_RECORDS, rng);
+    Bvh bvh;
+    bvh.build(geoms);
+    AABB bounds;
+    bounds.min = bvh.nodes[0].boundsMin;
+    bounds.max = bvh.nodes[0].boundsMax;
+    const std::vector<Ray> rays = raysInto(bounds, BENCH_RAYS, rng);
+    const std::vector<CompactGeom> compact = compactGeoms(geoms);
+    const CompactGeom* records = compact.data();
+    const size_t recordBytes = sizeof(CompactGeom);
+
+    TraversalStats stats = { 0, 0, 0 };
+    std::vector<int> hits(BENCH_RAYS);
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < BENCH_RAYS; i++)
+    {
+        ShadeableIntersection isect;
+        hits[i] = intersectBvh(rays[i], records, bvh.view(), MeshView(), isect, &stats);
+    }
+    std::chrono::duration<double> seconds = Clock::now() - start;
+
+    const int chunks = (BENCH_RAYS + BENCH_GEOM_CHUNK - 1) / BENCH_GEOM_CHUNK;
+    start = Clock::now();
+    pool.run(chunks, [&](int chunk, int thread)
+    {
+        const int end = std::min((chunk + 1) * BENCH_GEOM_CHUNK, BENCH_RAYS);
+        for (int i = chunk * BENCH_GEOM_CHUNK; i < end; i++)
+        {
+            ShadeableIntersection isect;
+            intersectBvh(rays[i], records, bvh.view(), MeshView(), isect);
+        }
+    });
+    std::chrono::duration<double> parallelSeconds = Clock::now() - start;
+
+    int mismatches = 0;
+    for (int i = 0; i < BENCH_LINEAR_RAYS; i++)
+    {
+        ShadeableIntersection isect;
+        mismatches += intersectGeoms(rays[i], records, BENCH_GEOM_RECORDS, MeshView(), isect) != hits[i];
+    }
+
+    printf("%d geoms, %d rays\n", BENCH_GEOM_RECORDS, BENCH_RAYS);
+    printf("Record: %d bytes, %.1f KB for the scene\n", (int)recordBytes, recordBytes * BENCH_GEOM_RECORDS / 1024.0);
+    printf("Per ray: %.1f geom tests, %.0f geom bytes, %.0f node bytes\n", (double)stats.primTests / BENCH_RAYS,
+        (double)stats.primTests * recordBytes / BENCH_RAYS, (double)stats.nodeBytes / BENCH_RAYS);
+    printf("Mrays/s: %.3f on one thread, %.3f on %d\n", BENCH_RAYS / seconds.count() * 1e-6,
+        BENCH_RAYS / parallelSeconds.count() * 1e-6, pool.size());
+    printf("Mismatches against the linear search: %d of %d\n", mismatches, BENCH_LINEAR_RAYS);
+}
+
+/**
+ * Any-hit queries against closest-hit ones on the same shadow rays, through
+ * the binary and wide BVHs of random scenes and the flat loop where it
+ * finishes in reasonable time, one thread. A closest hit occludes if it is
+ * nearer than tMax; mismatches count the rays where the two queries
+ * disagree. Then batched queries on the loaded scene on all threads.
+ */
+static void benchOcclusion(Scene* scene, int numThreads)
+{
+    std::mt19937 rng(1234);
+    printf("Shadow rays between random points, Mrays/s on one thread\n");
+    printf("%8s %10s %10s %8s %10s %10s %10s %10s %9s %10s\n", "prims", "closest", "any-hit", "speedup",
+        "wide cl.", "wide any", "linear cl.", "linear any", "occluded", "mismatches");
+    for (int count = 100; count <= 1000000; count *= 10)
+    {
+        const std::vector<Geom> geoms = randomGeoms(count, rng);
+        const std::vector<CompactGeom> records = compactGeoms(geoms);
+        Bvh bvh;
+        bvh.build(geoms);
+        WideBvh wide;
+        wide.build(bvh);
+        AABB bounds;
+        bounds.min = bvh.nodes[0].boundsMin;
+        bounds.max = bvh.nodes[0].boundsMax;
+        std::vector<Ray> rays;
+        std::vector<float> tMax;
+        shadowRaysIn(bounds, BENCH_SHADOW_RAYS, rng, rays, tMax);
+
+        std::vector<char> blocked(BENCH_SHADOW_RAYS);
+        Clock::time_point start = Clock::now();
+        for (int i = 0; i < BENCH_SHADOW_RAYS; i++)
+        {
+            ShadeableIntersection isect;
+            intersectBvh(rays[i], records.data(), bvh.view(), MeshView(), isect);
+            blocked[i] = isect.t > 0.0f && isect.t < tMax[i];
+        }
+        std::chrono::duration<double> closestSeconds = Clock::now() - start;
+
+        int mismatches = 0;
+        int occluded = 0;
+        start = Clock::now();
+        for (int i = 0; i < BENCH_SHADOW_RAYS; i++)
+        {
+            const bool hit = occludedBvh(rays[i], tMax[i], records.data(), bvh.view(), MeshView());
+            mismatches += hit != (blocked[i] != 0);
+            occluded += hit;
+        }
+        std::chrono::duration<double> anySeconds = Clock::now() - start;
+
+        start = Clock::now();
+        for (int i = 0; i < BENCH_SHADOW_RAYS; i++)
+        {
+            ShadeableIntersection isect;
+            intersectWideBvh(rays[i], records.data(), wide.view(), MeshView(), isect);
+        }
+        std::chrono::duration<double> wideClosestSeconds = Clock::now() - start;
+        start = Clock::now();
+        for (int i = 0; i < BENCH_SHADOW_RAYS; i++)
+        {
+            mismatches += occludedWideBvh(rays[i], tMax[i], records.data(), wide.view(), MeshView())
+                != (blocked[i] != 0);
+        }
+        std::chrono::duration<double> wideAnySeconds = Clock::now() - start;
+
+        const double closestRate = BENCH_SHADOW_RAYS / closestSeconds.count() * 1e-6;
+        const double anyRate = BENCH_SHADOW_RAYS / anySeconds.count() * 1e-6;
+        printf("%8d %10.3f %10.3f %7.2fx %10.3f %10.3f ", count, closestRate, anyRate, anyRate / closestRate,
+            BENCH_SHADOW_RAYS / wideClosestSeconds.count() * 1e-6, BENCH_SHADOW_RAYS / wideAnySeconds.count() * 1e-6);
+        if (count <= BENCH_LINEAR_MAX_PRIMS)
+        {
+            start = Clock::now();
+            for (int i = 0; i < BENCH_LINEAR_RAYS; i++)
+            {
+                ShadeableIntersection isect;
+                intersectGeoms(rays[i], records.data(), count, MeshView(), isect);
+            }
+            std::chrono::duration<double> linearClosestSeconds = Clock::now() - start;
+            start = Clock::now();
+            for (int i = 0; i < BENCH_LINEAR_RAYS; i++)
+            {
+                mismatches += occludedGeoms(rays[i], tMax[i], records.data(), count, MeshView()) != (blocked[i] != 0);
+            }
+            std::chrono::duration<double> linearAnySeconds = Clock::now() - start;
+            printf("%10.3f %10.3f ", BENCH_LINEAR_RAYS / linearClosestSeconds.count() * 1e-6,
+                BENCH_LINEAR_RAYS / linearAnySeconds.count() * 1e-6);
+        }
+        else
+        {
+            printf("%10s %10s ", "-", "-");
+        }
+        printf("%8.1f%% %10d\n", 100.0 * occluded / BENCH_SHADOW_RAYS, mismatches);
+    }
+
+    // The batched entry point, on the loaded scene
+    AABB bounds = AABB::empty();
+    for (size_t i = 0; i < scene->geoms.size(); i++)
+    {
+        bounds.grow(geomBounds(scene->geoms[i]));
+    }
+    std::vector<Ray> rays;
+    std::vector<float> tMax;
+    shadowRaysIn(bounds, BENCH_SHADOW_RAYS, rng, rays, tMax);
+    std::vector<int> occluded(BENCH_SHADOW_RAYS);
+    pathtraceCpuInit(scene, numThreads, CPU_PIPELINE_TILES);
+    const CpuRenderStats stats = pathtraceCpuStats();
+    Clock::time_point start = Clock::now();
+    pathtraceCpuOccluded(rays.data(), tMax.data(), BENCH_SHADOW_RAYS, occluded.data());
+    std::chrono::duration<double> seconds = Clock::now() - start;
+    pathtraceCpuFree();
+    int blocked = 0;
+    for (int i = 0; i < BENCH_SHADOW_RAYS; i++)
+    {
+        blocked += occluded[i];
+    }
+    printf("Loaded scene, pathtraceCpuOccluded on %d threads: %.3f Mrays/s, %.1f%% occluded\n", stats.threads,
+        BENCH_SHADOW_RAYS / seconds.count() * 1e-6, 100.0 * blocked / BENCH_SHADOW_RAYS);
+}
+
+/**
+ * Trace every camera ray of `cam` through `bvh` once as single rays and once
+ * as PACKET_SIZE x PACKET_SIZE packets, on one thread, and print a row of
+ * rays per second, work per ray and rays whose hit differs.
+ */
+static void primaryPacketRow(const char* label, const Camera& cam, const CompactGeom* geoms, const Bvh& bvh,
+    MeshView meshes)
+{
+    const int pixels = cam.resolution.x * cam.resolution.y;
+    std::vector<PathSegment> segments(pixels);
+    for (int y = 0; y < cam.resolution.y; y++)
+    {
+        for (int x = 0; x < cam.resolution.x; x++)
+        {
+            generateCameraPath(cam, 1, x, y, 1, false, SAMPLER_PCG, segments[x + y * cam.resolution.x]);
+        }
+    }
+
+    std::vector<ShadeableIntersection> single(pixels);
+    TraversalStats singleStats = { 0, 0, 0 };
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < pixels; i++)
+    {
+        intersectBvh(segments[i].ray, geoms, bvh.view(), meshes, single[i], &singleStats);
+    }
+    std::chrono::duration<double> singleSeconds = Clock::now() - start;
+
+    std::vector<ShadeableIntersection> packed(pixels);
+    PacketStats packetStats = { 0, 0, 0 };
+    int mismatches = 0;
+    double seconds = 0.0;
+    for (int by = 0; by < cam.resolution.y; by += PACKET_SIZE)
+    {
+        for (int bx = 0; bx < cam.resolution.x; bx += PACKET_SIZE)
+        {
+            start = Clock::now();
+            RayPacket packet;
+            packet.count = 0;
+            int pixel[PACKET_RAYS];
+            for (int y = by; y < std::min(by + PACKET_SIZE, cam.resolution.y); y++)
+            {
+                for (int x = bx; x < std::min(bx + PACKET_SIZE, cam.resolution.x); x++)
+                {
+                    pixel[packet.count] = x + y * cam.resolution.x;
+                    packet.rays[packet.count++] = segments[x + y * cam.resolution.x].ray;
+                }
+            }
+            packet.prepare();
+            ShadeableIntersection hits[PACKET_RAYS];
+            intersectPacket(packet, geoms, bvh.view(), meshes, hits, &packetStats);
+            std::chrono::duration<double> elapsed = Clock::now() - start;
+            seconds += elapsed.count();
+            for (int i = 0; i < packet.count; i++)
+            {
+                const ShadeableIntersection& a = single[pixel[i]];
+                mismatches += a.t != hits[i].t || (a.t > 0.0f && a.materialId != hits[i].materialId);
+            }
+        }
+    }
+
+    const double singleRate = pixels / singleSeconds.count() * 1e-6;
+    const double packetRate = pixels / seconds * 1e-6;
+    printf("%-12s %9d %14.3f %14.3f %8.2fx %13.2f %13.2f %8.1f%% %10d\n", label, (int)bvh.primIndices.size(), singleRate,
+        packetRate, packetRate / singleRate, (double)singleStats.steps / pixels,
+        (double)packetStats.rayBoxTests / pixels, 100.0 * packetStats.culled / std::max(1, packetStats.nodes),
+        mismatches);
+}
+
+/**
+ * Camera rays traced as packets against single rays: primary-only speed on
+ * the loaded scene and on random scenes seen from outside, then whole paths
+ * on the CPU tiles pipeline, where only depth 0 is traced as packets.
+ */
+static void benchPackets(Scene* scene, int numThreads)
+{
+    RenderState& state = scene->state;
+    printf("Primary rays, %dx%d packets, one thread\n", PACKET_SIZE, PACKET_SIZE);
+    printf("%-12s %9s %14s %14s %9s %13s %13s %9s %10s\n", "scene", "prims", "single Mrays/s",
+        "packet Mrays/s", "speedup", "nodes/ray", "box tests/ray", "culled", "mismatches");
+    primaryPacketRow("loaded", state.camera, compactGeoms(scene->geoms).data(), scene->bvh, scene->meshes.view());
+
+    // The random scenes fill a 20-unit cube around the origin
+    Camera cam = state.camera;
+    cam.position = glm::vec3(0.0f, 0.0f, 35.0f);
+    cam.view = glm::vec3(0.0f, 0.0f, -1.0f);
+    cam.up = glm::vec3(0.0f, 1.0f, 0.0f);
+    cam.right = glm::normalize(glm::cross(cam.view, cam.up));
+    std::mt19937 rng(1234);
+    for (int count = 100; count <= BENCH_PACKET_MAX_PRIMS; count *= 10)
+    {
+        const std::vector<Geom> geoms = randomGeoms(count, rng);
+        Bvh bvh;
+        bvh.build(geoms);
+        primaryPacketRow("random", cam, compactGeoms(geoms).data(), bvh, MeshView());
+    }
+
+    // Without the first-hit cache every iteration traces its camera rays
+    const bool sceneCache = state.cacheFirstHits;
+    const bool scenePackets = state.packetRays;
+    state.cacheFirstHits = false;
+    printf("Whole paths on the loaded scene, CPU tiles\n");
+    printf("%-8s %12s %12s %12s %10s\n", "primary", "Mrays/s", "rays/iter", "ms/iter", "mean");
+    for (int packets = 0; packets < 2; packets++)
+    {
+        state.packetRays = packets != 0;
+        pathtraceCpuInit(scene, numThreads, CPU_PIPELINE_TILES);
+        for (int iter = 1; iter <= BENCH_ITERATIONS; iter++)
+        {
+            pathtraceCpu(iter);
+        }
+        const CpuRenderStats stats = pathtraceCpuStats();
+        pathtraceCpuFree();
+
+        double mean = 0.0;
+        for (size_t i = 0; i < state.image.size(); i++)
+        {
+            const glm::vec3& c = state.image[i];
+            mean += (c.x + c.y + c.z) / 3.0;
+        }
+        mean /= (double)state.image.size() * BENCH_ITERATIONS;
+        printf("%-8s %12.3f %12lld %12.3f %10.4f\n", packets ? "packets" : "single", stats.rays / stats.seconds * 1e-6,
+            stats.rays / BENCH_ITERATIONS, stats.seconds * 1000.0 / BENCH_ITERATIONS, mean);
+    }
+    state.cacheFirstHits = sceneCache;
+    state.packetRays = scenePackets;
+}
+
+/**
+ * Render the loaded scene with the wavefront pipeline without ray ordering
+ * and with it before every depth but the first, and compare the extend time
+ * per depth against what the sort costs there. Depths where the saving
+ * beats the cost are the ones to list in RAY_ORDER_DEPTHS. The mean should
+ * match, since the order of the paths does not change their result.
+ */
+static void benchReorder(Scene* scene, int numThreads)
+{
+    RenderState& state = scene->state;
+    const unsigned int sceneDepths = state.rayOrderDepths;
+    CpuRenderStats stats[2];
+    double mean[2];
+    for (int ordered = 0; ordered < 2; ordered++)
+    {
+        state.rayOrderDepths = ordered ? 0xFFFFFFFEu : 0u;
+        pathtraceCpuInit(scene, numThreads, CPU_PIPELINE_WAVEFRONT);
+        for (int iter = 1; iter <= BENCH_ITERATIONS; iter++)
+        {
+            pathtraceCpu(iter);
+        }
+        stats[ordered] = pathtraceCpuStats();
+        pathtraceCpuFree();
+
+        mean[ordered] = 0.0;
+        for (size_t i = 0; i < state.image.size(); i++)
+        {
+            const glm::vec3& c = state.image[i];
+            mean[ordered] += (c.x + c.y + c.z) / 3.0;
+        }
+        mean[ordered] /= (double)state.image.size() * BENCH_ITERATIONS;
+    }
+    state.rayOrderDepths = sceneDepths;
+
+    printf("Average ms per iteration and depth, %d-bit keys\n", RAY_ORDER_KEY_BITS);
+    printf("%5s %10s %12s %12s %12s %12s\n", "depth", "active", "extend", "ordered", "order cost", "net saving");
+    const std::vector<double>& plain = stats[0].extendMs;
+    const std::vector<double>& extend = stats[1].extendMs;
+    const std::vector<double>& cost = stats[1].rayOrderMs;
+    for (size_t depth = 0; depth < plain.size() && depth < extend.size(); depth++)
+    {
+        const double order = depth < cost.size() ? cost[depth] : 0.0;
+        printf("%5d %10d %12.3f %12.3f %12.3f %12.3f\n", (int)depth, stats[0].activePaths[depth],
+            plain[depth] / BENCH_ITERATIONS, extend[depth] / BENCH_ITERATIONS, order / BENCH_ITERATIONS,
+            (plain[depth] - extend[depth] - order) / BENCH_ITERATIONS);
+    }
+    for (int ordered = 0; ordered < 2; ordered++)
+    {
+        printf("%-10s %8.3f ms per iteration, mean %.4f\n", ordered ? "ordered" : "unordered",
+            stats[ordered].seconds * 1000.0 / BENCH_ITERATIONS, mean[ordered]);
+    }
+}
+
+// Root mean square difference of the per-pixel means of `image` after
+// `iterations` and of `reference` after `referenceIterations`
+static double rmse(const std::vector<glm::vec3>& image, int iterations,
+    const std::vector<glm::vec3>& reference, int referenceIterations)
+{
+    double sum = 0.0;
+    for (size_t i = 0; i < image.size(); i++)
+    {
+        const glm::vec3 d = image[i] / (float)iterations - reference[i] / (float)referenceIterations;
+        sum += glm::dot(d, d) / 3.0;
+    }
+    return std::sqrt(sum / image.size());
+}
+
+/**
+ * Render the loaded scene at a lower resolution with and without next-event
+ * estimation and follow the error of each against a long reference render,
+ * at every power of two iterations. Then compare how many iterations, and
+ * how much time, light sampling needs to get as close as the render without
+ * it does at the end. The reference has noise of its own, which puts a floor
+ * under the error of both.
+ */
+static void benchNextEvent(Scene* scene, int numThreads)
+{
+    RenderState& state = scene->state;
+    if (scene->emitters.view().count == 0)
+    {
+        printf("The scene has no lights to sample\n");
+        return;
+    }
+    const Camera sceneCamera = state.camera;
+    const bool sceneNextEvent = state.nextEvent;
+    const int divisor = (std::max(sceneCamera.resolution.x, sceneCamera.resolution.y) + BENCH_NEE_MAX_RES - 1)
+        / BENCH_NEE_MAX_RES;
+    state.camera.resolution = sceneCamera.resolution / divisor;
+    state.camera.pixelLength = sceneCamera.pixelLength * (float)divisor;
+    state.image.assign(state.camera.resolution.x * state.camera.resolution.y, glm::vec3(0.0f));
+
+    state.nextEvent = true;
+    pathtraceCpuInit(scene, numThreads, CPU_PIPELINE_TILES);
+    for (int iter = 1; iter <= BENCH_NEE_REFERENCE; iter++)
+    {
+        pathtraceCpu(BENCH_NEE_REFERENCE_SEED + iter);
+    }
+    pathtraceCpuFree();
+    const std::vector<glm::vec3> reference = state.image;
+
+    // Error at 1, 2, 4, ... iterations
+    std::vector<double> error[2];
+    double msPerIteration[2];
+    double mean[2];
+    for (int nee = 0; nee < 2; nee++)
+    {
+        state.nextEvent = nee != 0;
+        pathtraceCpuInit(scene, numThreads, CPU_PIPELINE_TILES);
+        for (int iter = 1; iter <= BENCH_NEE_MAX_ITERATIONS; iter++)
+        {
+            pathtraceCpu(iter);
+            if ((iter & (iter - 1)) == 0)
+            {
+                error[nee].push_back(rmse(state.image, iter, reference, BENCH_NEE_REFERENCE));
+            }
+        }
+        msPerIteration[nee] = pathtraceCpuStats().seconds * 1000.0 / BENCH_NEE_MAX_ITERATIONS;
+        pathtraceCpuFree();
+
+        mean[nee] = 0.0;
+        for (size_t i = 0; i < state.image.size(); i++)
+        {
+            const glm::vec3& c = state.image[i];
+            mean[nee] += (c.x + c.y + c.z) / 3.0;
+        }
+        mean[nee] /= (double)state.image.size() * BENCH_NEE_MAX_ITERATIONS;
+    }
+
+    printf("%dx%d pixels, %d emitters, RMSE against %d iterations with light sampling\n",
+        state.camera.resolution.x, state.camera.resolution.y, scene->emitters.view().count, BENCH_NEE_REFERENCE);
+    printf("%10s %14s %14s\n", "iterations", "bounces only", "light sampling");
+    for (size_t i = 0; i < error[0].size(); i++)
+    {
+        printf("%10d %14.5f %14.5f\n", 1 << i, error[0][i], error[1][i]);
+    }
+    for (int nee = 0; nee < 2; nee++)
+    {
+        printf("%-15s %8.3f ms per iteration, mean %.4f\n", nee ? "light sampling" : "bounces only",
+            msPerIteration[nee], mean[nee]);
+    }
+
+    // Fewest iterations at which light sampling is as close as the bounces
+    // alone get at the end
+    const double target = error[0].back();
+    size_t reached = 0;
+    while (reached + 1 < error[1].size() && error[1][reached] > target)
+    {
+        reached++;
+    }
+    const int iterations = 1 << reached;
+    printf("RMSE %.5f: %d iterations with light sampling against %d without, %.1fx less time\n", target,
+        iterations, BENCH_NEE_MAX_ITERATIONS,
+        (BENCH_NEE_MAX_ITERATIONS * msPerIteration[0]) / (iterations * msPerIteration[1]));
+
+    state.camera = sceneCamera;
+    state.nextEvent = sceneNextEvent;
+    state.image.assign(sceneCamera.resolution.x * sceneCamera.resolution.y, glm::vec3(0.0f));
+}
+
+/**
+ * A lighting rig of `count` small emissive spheres and cubes hung 1 to 4
+ * units over a 40x40 floor at y = 0, with one material each whose
+ * emittance spreads over two orders of magnitude.
+ */
+static void lightRig(int count, std::mt19937& rng, std::vector<Geom>& geoms, std::vector<Material>& materials)
+{
+    std::uniform_real_distribution<float> across(-20.0f, 20.0f);
+    std::uniform_real_distribution<float> height(1.0f, 4.0f);
+    std::uniform_real_distribution<float> angle(0.0f, 360.0f);
+    std::uniform_real_distribution<float> size(0.05f, 0.3f);
+    std::uniform_real_distribution<float> tint(0.5f, 1.0f);
+    std::uniform_real_distribution<float> decades(0.0f, 2.0f);
+    geoms.resize(count);
+    materials.assign(count, Material());
+    for (int i = 0; i < count; i++)
+    {
+        Material& m = materials[i];
+        m.color = glm::vec3(tint(rng), tint(rng), tint(rng));
+        m.emittance = std::pow(10.0f, decades(rng));
+
+        Geom& g = geoms[i];
+        g.type = i % 2 ? CUBE : SPHERE;
+        g.materialid = i;
+        g.meshId = -1;
+        g.translation = glm::vec3(across(rng), height(rng), across(rng));
+        g.rotation = glm::vec3(angle(rng), angle(rng), angle(rng));
+        g.scale = glm::vec3(size(rng), size(rng), size(rng));
+        g.transform = utilityCore::buildTransformationMatrix(g.translation, g.rotation, g.scale);
+        g.inverseTransform = glm::inverse(g.transform);
+        g.invTranspose = glm::inverseTranspose(g.transform);
+    }
+}
+
+/**
+ * Direct light on a floor under rigs of 16 to BENCH_LIGHT_MAX_EMITTERS
+ * lights, picked from the flat power CDF and with the light tree. Every
+ * shading point takes the same number of light samples either way; the
+ * estimate of each is the luminance it receives, without occlusion, so the
+ * variance only reflects how well the samples go where the light comes
+ * from. Prints the time to build the tree, the variance of one sample
+ * averaged over the points, the mean, which both must agree on, and the
+ * time per sample on one thread.
+ */
+static void benchLightTree()
+{
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<float> across(-20.0f, 20.0f);
+    printf("%d shading points on the floor, %d light samples each\n", BENCH_LIGHT_POINTS, BENCH_LIGHT_SAMPLES);
+    printf("%8s %9s %8s %12s %12s %8s %10s %10s %8s %8s\n", "emitters", "tree ms", "nodes", "power var",
+        "tree var", "ratio", "power mean", "tree mean", "power ns", "tree ns");
+    for (int count = 16; count <= BENCH_LIGHT_MAX_EMITTERS; count *= 4)
+    {
+        std::vector<Geom> geoms;
+        std::vector<Material> materials;
+        lightRig(count, rng, geoms, materials);
+        EmitterTable table;
+        table.build(geoms, materials);
+        Clock::time_point start = Clock::now();
+        table.buildTree(geoms);
+        std::chrono::duration<double, std::milli> buildMs = Clock::now() - start;
+
+        std::vector<glm::vec3> points(BENCH_LIGHT_POINTS);
+        for (int i = 0; i < BENCH_LIGHT_POINTS; i++)
+        {
+            points[i] = glm::vec3(across(rng), 0.0f, across(rng));
+        }
+
+        double variance[2];
+        double mean[2];
+        double ns[2];
+        for (int tree = 0; tree < 2; tree++)
+        {
+            const EmitterView lights = table.view(tree != 0);
+            variance[tree] = 0.0;
+            mean[tree] = 0.0;
+            start = Clock::now();
+            for (int i = 0; i < BENCH_LIGHT_POINTS; i++)
+            {
+                double sum = 0.0;
+                double sumSquares = 0.0;
+                for (int s = 0; s < BENCH_LIGHT_SAMPLES; s++)
+                {
+                    Sampler sampleRng(SAMPLER_PCG, s, i, 0);
+                    LightSample light;
+                    double estimate = 0.0;
+                    if (sampleEmitter(lights, points[i], sampleRng, light))
+                    {
+                        const glm::vec3 toLight = light.point - points[i];
+                        const float d2 = glm::dot(toLight, toLight);
+                        const float cosSurface = toLight.y / std::sqrt(d2);
+                        const float cosLight = -glm::dot(light.normal, toLight) / std::sqrt(d2);
+                        if (cosSurface > 0.0f && cosLight > 0.0f)
+                        {
+                            const float luminance = 0.2126f * light.emission.r + 0.7152f * light.emission.g
+                                + 0.0722f * light.emission.b;
+                            estimate = luminance * cosSurface * cosLight / (d2 * light.pdf);
+                        }
+                    }
+                    sum += estimate;
+                    sumSquares += estimate * estimate;
+                }
+                const double pointMean = sum / BENCH_LIGHT_SAMPLES;
+                variance[tree] += (sumSquares - sum * pointMean) / (BENCH_LIGHT_SAMPLES - 1);
+                mean[tree] += pointMean;
+            }
+            std::chrono::duration<double, std::nano> elapsed = Clock::now() - start;
+            ns[tree] = elapsed.count() / ((double)BENCH_LIGHT_POINTS * BENCH_LIGHT_SAMPLES);
+            variance[tree] /= BENCH_LIGHT_POINTS;
+            mean[tree] /= BENCH_LIGHT_POINTS;
+        }
+        printf("%8d %9.3f %8d %12.5g %12.5g %7.1fx %10.4f %10.4f %8.1f %8.1f\n", count, buildMs.count(),
+            (int)table.nodes.size(), variance[0], variance[1], variance[0] / variance[1], mean[0], mean[1], ns[0],
+            ns[1]);
+    }
+}
+
+// Chi-square statistic of `counts` against an even spread, normalized to
+// about a standard normal: beyond 3 or 4 the numbers are not uniform
+static double chiSquareZ(const std::vector<long long>& counts, long long total)
+{
+    const double expected = (double)total / counts.size();
+    double chi2 = 0.0;
+    for (size_t i = 0; i < counts.size(); i++)
+    {
+        const double d = counts[i] - expected;
+        chi2 += d * d / expected;
+    }
+    const double dof = counts.size() - 1.0;
+    return (chi2 - dof) / std::sqrt(2.0 * dof);
+}
+
+static int samplerBin(float u, int bins)
+{
+    return std::min(bins - 1, (int)(u * bins));
+}
+
+/**
+ * Both random number generators, one thread. Cost per bounce sets up a
+ * sampler for every path and draws BENCH_SAMPLER_DRAWS numbers from it; cost
+ * per number draws many from one. Quality is tested on the first two
+ * numbers of every path, where hash-seeded generators are weakest:
+ * chi-square of single numbers, of the pair within a path, and of the first
+ * numbers of neighbouring pixels and of consecutive samples of a pixel. The
+ * last column counts paths whose first two numbers repeat another path's;
+ * a minstd stream is fixed by its 31-bit seed, so those share everything.
+ */
+static void benchSampler()
+{
+    const int pixels = BENCH_SAMPLER_PIXELS;
+    const int paths = pixels * BENCH_SAMPLER_SAMPLES;
+    const int bins2 = BENCH_SAMPLER_BINS_2D * BENCH_SAMPLER_BINS_2D;
+    printf("%d paths: %d pixels times %d samples\n", paths, pixels, BENCH_SAMPLER_SAMPLES);
+    printf("%-8s %10s %10s %8s %8s %8s %8s %8s %8s\n", "sampler", "ns/bounce", "ns/number", "mean", "z 1D",
+        "z pair", "z pixel", "z sample", "repeats");
+    static const char* names[] = { "pcg", "minstd" };
+    for (int k = 0; k < 2; k++)
+    {
+        const SamplerKind kind = (SamplerKind)k;
+        double sum = 0.0;
+        Clock::time_point start = Clock::now();
+        for (int path = 0; path < paths; path++)
+        {
+            Sampler rng(kind, path / pixels, path % pixels, 0);
+            for (int d = 0; d < BENCH_SAMPLER_DRAWS; d++)
+            {
+                sum += rng.next();
+            }
+        }
+        std::chrono::duration<double, std::nano> bounceNs = Clock::now() - start;
+        start = Clock::now();
+        for (int pixel = 0; pixel < pixels; pixel++)
+        {
+            Sampler rng(kind, 0, pixel, 1);
+            for (int d = 0; d < BENCH_SAMPLER_SAMPLES * BENCH_SAMPLER_DRAWS; d++)
+            {
+                sum += rng.next();
+            }
+        }
+        std::chrono::duration<double, std::nano> numberNs = Clock::now() - start;
+
+        // First two numbers of each path, 24 bits each, by sample then pixel
+        std::vector<unsigned long long> firstTwo(paths);
+        std::vector<long long> single(BENCH_SAMPLER_BINS_1D);
+        std::vector<long long> pair(bins2);
+        for (int path = 0; path < paths; path++)
+        {
+            Sampler rng(kind, path / pixels, path % pixels, 0);
+            const float u0 = rng.next();
+            const float u1 = rng.next();
+            single[samplerBin(u0, BENCH_SAMPLER_BINS_1D)]++;
+            single[samplerBin(u1, BENCH_SAMPLER_BINS_1D)]++;
+            pair[samplerBin(u0, BENCH_SAMPLER_BINS_2D) * BENCH_SAMPLER_BINS_2D + samplerBin(u1, BENCH_SAMPLER_BINS_2D)]++;
+            firstTwo[path] = ((unsigned long long)(u0 * 16777216.0f) << 24) | (unsigned long long)(u1 * 16777216.0f);
+        }
+
+        // Disjoint neighbours: pixels 2i and 2i + 1, samples 2j and 2j + 1
+        std::vector<long long> pixelPair(bins2);
+        std::vector<long long> samplePair(bins2);
+        for (int path = 0; path < paths; path += 2)
+        {
+            const float a = (firstTwo[path] >> 24) / 16777216.0f;
+            const float b = (firstTwo[path + 1] >> 24) / 16777216.0f;
+            pixelPair[samplerBin(a, BENCH_SAMPLER_BINS_2D) * BENCH_SAMPLER_BINS_2D + samplerBin(b, BENCH_SAMPLER_BINS_2D)]++;
+        }
+        for (int sample = 0; sample < BENCH_SAMPLER_SAMPLES; sample += 2)
+        {
+            for (int pixel = 0; pixel < pixels; pixel++)
+            {
+                const float a = (firstTwo[sample * pixels + pixel] >> 24) / 16777216.0f;
+                const float b = (firstTwo[(sample + 1) * pixels + pixel] >> 24) / 16777216.0f;
+                samplePair[samplerBin(a, BENCH_SAMPLER_BINS_2D) * BENCH_SAMPLER_BINS_2D
+                    + samplerBin(b, BENCH_SAMPLER_BINS_2D)]++;
+            }
+        }
+
+        std::sort(firstTwo.begin(), firstTwo.end());
+        int repeats = 0;
+        for (int i = 0; i < paths; i++)
+        {
+            repeats += (i > 0 && firstTwo[i] == firstTwo[i - 1]) || (i + 1 < paths && firstTwo[i] == firstTwo[i + 1]);
+        }
+
+        printf("%-8s %10.2f %10.2f %8.4f %8.2f %8.2f %8.2f %8.2f %8d\n", names[k], bounceNs.count() / paths,
+            numberNs.count() / ((double)paths * BENCH_SAMPLER_DRAWS), sum / (2.0 * paths * BENCH_SAMPLER_DRAWS),
+            chiSquareZ(single, 2LL * paths), chiSquareZ(pair, paths), chiSquareZ(pixelPair, paths / 2),
+            chiSquareZ(samplePair, paths / 2), repeats);
+    }
+}
+
+bool runBenchmark(const std::string& name, Scene* scene, int numThreads)
+{
+    if (name == "firsthits")
+    {
+        benchFirstHits(scene, numThreads);
+        return true;
+    }
+    if (name == "layout")
+    {
+        benchLayout(scene, numThreads);
+        return true;
+    }
+    if (name == "roulette")
+    {
+        benchRoulette(scene, numThreads);
+        return true;
+    }
+    if (name == "bvh")
+    {
+        benchBvh(numThreads);
+        return true;
+    }
+    if (name == "lbvh")
+    {
+        benchLbvh(scene, numThreads);
+        return true;
+    }
+    if (name == "refit")
+    {
+        benchRefit(scene, numThreads);
+        return true;
+    }
+    if (name == "wide")
+    {
+        benchWide(scene, numThreads);
+        return true;
+    }
+    if (name == "simd")
+    {
+        benchSimd();
+        return true;
+    }
+    if (name == "geoms")
+    {
+        benchGeoms(numThreads);
+        return true;
+    }
+    if (name == "occlusion")
+    {
+        benchOcclusion(scene, numThreads);
+        return true;
+    }
+    if (name == "packets")
+    {
+        benchPackets(scene, numThreads);
+        return true;
+    }
+    if (name == "reorder")
+    {
+        benchReorder(scene, numThreads);
+        return true;
+    }
+    if (name == "nee")
+    {
+        benchNextEvent(scene, numThreads);
+        return true;
+    }
+    if (name == "lighttree")
+    {
+        benchLightTree();
+        return true;
+    }
+    if (name == "sampler")
+    {
+        benchSampler();
+        return true;
+    }
+    if (name == "instances")
+    {
+        benchInstances(numThreads);
+        return true;
+    }
+    return false;
+}
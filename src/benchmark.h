@@ -0,0 +1,51 @@
+#pragma once
+
+#include <string>
+#include "scene.h"
+
+/**
+ * Headless benchmarks, selected with `--bench NAME` on the command line. Each
+ * one renders `scene` on the CPU backend where it needs path statistics, so
+ * they run without a GPU or display.
+ *
+ *   firsthits whether the first-hit cache changes the image after camera
+ *            moves, scene rebuilds, moved geoms and ANTIALIAS toggles
+ *   layout   bytes of path state moved per bounce, AoS vs. SoA
+ *   roulette path length and time per iteration at growing DEPTH, with and
+ *            without Russian roulette
+ *   bvh      BVH build time, serial and parallel, and closest-hit
+ *            throughput on random scenes of 10 to 1M primitives, against the
+ *            linear search
+ *   lbvh     build and trace time of SAH trees against linear BVHs built on
+ *            the host and the GPU, on the loaded scene and random scenes
+ *   refit    per-frame cost of moving a few geoms: BVH refit, SAH cost
+ *            growth, fallback rebuilds and upload size, against a rebuild,
+ *            and whether the CPU backend traced the moved geoms
+ *   instances memory and trace speed of up to 10k instances of one
+ *            100k-triangle mesh, against flattening them
+ *   wide     bytes per primitive, nodes visited, node bytes read and trace
+ *            speed of the binary BVH against compressed wide nodes
+ *   simd     packed SSE2/AVX2 sphere and cube tests against the scalar
+ *            ones: speed, agreement, and BVH traversal with packed leaves
+ *   geoms    size of the geom record the intersection tests read, bytes
+ *            read and closest-hit speed on a 10k-object scene
+ *   occlusion any-hit shadow ray queries against closest-hit ones, per
+ *            traversal, and the batched host entry point
+ *   packets  camera rays traced as 8x8 packets against single rays, primary
+ *            rays alone and whole paths on the CPU
+ *   reorder  extend time per depth with and without sorting the paths by
+ *            ray first, against the cost of the sort
+ *   nee      convergence with and without next-event estimation: error
+ *            against a reference render by iterations, and the time light
+ *            sampling takes to reach the same error
+ *   lighttree direct light variance at equal sample count with lights
+ *            picked by the light tree against the flat power CDF, on rigs
+ *            of 16 to 16k small emitters
+ *   sampler  cost per bounce and per number of the counter-based and thrust
+ *            random number generators, chi-square tests of their numbers
+ *            within a path and across neighbouring pixels and samples, and
+ *            paths that repeat another's numbers
+ *
+ * @return  false if there is no benchmark called `name`.
+ */
+bool runBenchmark(const std::string& name, Scene* scene, int numThreads);
@@ -0,0 +1,72 @@
+#include "bufferPool.h"
+
+#include <cuda_runtime.h>
+
+BufferPool::BufferPool(BufferMemory memory) : memory(memory) {}
+
+void BufferPool::allocateBuffer(Buffer& buffer, size_t bytes)
+{
+    if (memory == BUFFER_PINNED_HOST)
+    {
+        cudaMallocHost(&buffer.data, bytes);
+    }
+    else
+    {
+        cudaMalloc(&buffer.data, bytes);
+    }
+    buffer.bytes = bytes;
+}
+
+void BufferPool::freeBuffer(Buffer& buffer)
+{
+    if (memory == BUFFER_PINNED_HOST)
+    {
+        cudaFreeHost(buffer.data);
+    }
+    else
+    {
+        cudaFree(buffer.data);
+    }
+    buffer.data = NULL;
+}
+
+void* BufferPool::reserve(const std::string& name, size_t bytes)
+{
+    Buffer& buffer = buffers[name];
+    // Empty requests are never allocated (CUDA returns NULL for them anyway),
+    // so they must not count as allocations or live buffers either
+    if (bytes == 0 || (buffer.data != NULL && buffer.bytes >= bytes))
+    {
+        return buffer.data;
+    }
+
+    if (buffer.data != NULL)
+    {
+        freeBuffer(buffer);
+        counters.liveBytes -= buffer.bytes;
+        counters.liveBuffers--;
+    }
+    allocateBuffer(buffer, bytes);
+
+    counters.allocations++;
+    counters.bytesAllocated += bytes;
+    counters.liveBuffers++;
+    counters.liveBytes += bytes;
+    return buffer.data;
+}
+
+void BufferPool::release()
+{
+    for (std::map<std::string, Buffer>::iterator it = buffers.begin(); it != buffers.end(); ++it)
+    {
+        freeBuffer(it->second);
+    }
+    buffers.clear();
+    counters.liveBuffers = 0;
+    counters.liveBytes = 0;
+}
+
+BufferPoolStats BufferPool::stats() const
+{
+    return counters;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstddef>
+#include <map>
+#include <string>
+
+enum BufferMemory
+{
+    BUFFER_DEVICE,          // cudaMalloc
+    BUFFER_PINNED_HOST      // cudaMallocHost, for asynchronous copies
+};
+
+struct BufferPoolStats
+{
+    BufferPoolStats() : allocations(0), bytesAllocated(0), liveBuffers(0), liveBytes(0) {}
+    int allocations;            // allocation calls since the pool was created
+    size_t bytesAllocated;      // bytes requested by those calls
+    int liveBuffers;
+    size_t liveBytes;
+};
+
+/**
+ * Named device (or pinned host) allocations that persist across renders.
+ *
+ * reserve() hands back the same buffer for a name as long as it is big
+ * enough, and only reallocates when a buffer has to grow. Resetting the
+ * camera therefore costs no allocations at all, which the counters in
+ * stats() make easy to check.
+ */
+class BufferPool
+{
+public:
+    explicit BufferPool(BufferMemory memory = BUFFER_DEVICE);
+
+    // Buffer of at least `bytes` for `name`. Contents are undefined after it
+    // grows. A zero-byte request allocates nothing and may return NULL.
+    void* reserve(const std::string& name, size_t bytes);
+
+    template <typename T>
+    T* reserve(const std::string& name, size_t count)
+    {
+        return static_cast<T*>(reserve(name, count * sizeof(T)));
+    }
+
+    // Free every buffer. The counters are kept.
+    void release();
+
+    BufferPoolStats stats() const;
+
+private:
+    struct Buffer
+    {
+        void* data;
+        size_t bytes;
+    };
+
+    void allocateBuffer(Buffer& buffer, size_t bytes);
+    void freeBuffer(Buffer& buffer);
+
+    BufferMemory memory;
+    std::map<std::string, Buffer> buffers;
+    BufferPoolStats counters;
+};
@@ -0,0 +1,582 @@
+#include "bvh.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+
+#include "lbvh.h"
+#include "threadPool.h"
+
+// Cost of visiting an inner node relative to testing one primitive. Sphere
+// and box tests transform the ray first, so they cost a few box tests each.
+#define BVH_TRAVERSAL_COST 0.5f
+// Parallel builds split nodes of at least this many primitives with parallel
+// binning and build anything smaller as one serial task
+#define BVH_PARALLEL_MIN_PRIMS 16384
+// Primitives per task when binning in parallel
+#define BVH_BIN_CHUNK 16384
+
+namespace
+{
+    // Per-primitive inputs of a build, and the index array it reorders
+    struct BuildInput
+    {
+        const AABB* primBounds;
+        const glm::vec3* centroids;
+        int* primIndices;
+    };
+
+    // Primitive counts and bounds per bin, for each axis
+    struct Bins
+    {
+        int counts[3][BVH_NUM_BINS];
+        AABB bounds[3][BVH_NUM_BINS];
+
+        void clear()
+        {
+            for (int axis = 0; axis < 3; axis++)
+            {
+                for (int b = 0; b < BVH_NUM_BINS; b++)
+                {
+                    counts[axis][b] = 0;
+                    bounds[axis][b] = AABB::empty();
+                }
+            }
+        }
+
+        void merge(const Bins& other)
+        {
+            for (int axis = 0; axis < 3; axis++)
+            {
+                for (int b = 0; b < BVH_NUM_BINS; b++)
+                {
+                    counts[axis][b] += other.counts[axis][b];
+                    bounds[axis][b].grow(other.bounds[axis][b]);
+                }
+            }
+        }
+    };
+
+    // How to split a node: make it a leaf, split at a bin boundary, or split
+    // at the median centroid
+    struct Split
+    {
+        bool leaf;
+        int axis;           // -1 for a median split
+        int bin;
+    };
+
+    // Bin scale along each axis: bins per unit, or 0 if every centroid is
+    // in the same plane
+    glm::vec3 binScale(const AABB& centroidBounds)
+    {
+        glm::vec3 scale;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            float extent = centroidBounds.max[axis] - centroidBounds.min[axis];
+            scale[axis] = extent > 0.0f ? BVH_NUM_BINS / extent : 0.0f;
+        }
+        return scale;
+    }
+
+    int binIndex(float centroid, float lo, float scale)
+    {
+        return std::min(BVH_NUM_BINS - 1, (int)((centroid - lo) * scale));
+    }
+
+    void rangeBounds(const BuildInput& in, int first, int count, AABB& bounds, AABB& centroidBounds)
+    {
+        bounds = AABB::empty();
+        centroidBounds = AABB::empty();
+        for (int i = first; i < first + count; i++)
+        {
+            bounds.grow(in.primBounds[in.primIndices[i]]);
+            centroidBounds.grow(in.centroids[in.primIndices[i]]);
+        }
+    }
+
+    void binRange(const BuildInput& in, int first, int count, const AABB& centroidBounds, Bins& bins)
+    {
+        const glm::vec3 scale = binScale(centroidBounds);
+        bins.clear();
+        for (int axis = 0; axis < 3; axis++)
+        {
+            if (scale[axis] == 0.0f)
+            {
+                continue;
+            }
+            const float lo = centroidBounds.min[axis];
+            for (int i = first; i < first + count; i++)
+            {
+                int prim = in.primIndices[i];
+                int b = binIndex(in.centroids[prim][axis], lo, scale[axis]);
+                bins.counts[axis][b]++;
+                bins.bounds[axis][b].grow(in.primBounds[prim]);
+            }
+        }
+    }
+
+    // Pick the cheapest split among the bin boundaries of every axis, or a
+    // leaf if that is cheaper still
+    Split chooseSplit(const Bins& bins, const AABB& bounds, const AABB& centroidBounds, int count, int level)
+    {
+        const glm::vec3 scale = binScale(centroidBounds);
+        int bestAxis = -1;
+        int bestBin = 0;
+        float bestCost = FLT_MAX;
+        for (int axis = 0; axis < 3 && count > 1; axis++)
+        {
+            if (scale[axis] == 0.0f)
+            {
+                continue;
+            }
+
+            // Sweep from the right for the area and count of every right
+            // side, then from the left to evaluate each boundary.
+            float rightArea[BVH_NUM_BINS];
+            int rightCount[BVH_NUM_BINS];
+            AABB right = AABB::empty();
+            int n = 0;
+            for (int b = BVH_NUM_BINS - 1; b > 0; b--)
+            {
+                right.grow(bins.bounds[axis][b]);
+                n += bins.counts[axis][b];
+                rightArea[b] = right.surfaceArea();
+                rightCount[b] = n;
+            }
+            AABB left = AABB::empty();
+            n = 0;
+            for (int b = 1; b < BVH_NUM_BINS; b++)
+            {
+                left.grow(bins.bounds[axis][b - 1]);
+                n += bins.counts[axis][b - 1];
+                if (n == 0 || rightCount[b] == 0)
+                {
+                    continue;
+                }
+                float cost = left.surfaceArea() * n + rightArea[b] * rightCount[b];
+                if (cost < bestCost)
+                {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestBin = b;
+                }
+            }
+        }
+
+        Split split;
+        const float area = bounds.surfaceArea();
+        const float splitCost = area > 0.0f ? BVH_TRAVERSAL_COST + bestCost / area : FLT_MAX;
+        const bool canSplit = bestAxis >= 0 || count > BVH_MAX_LEAF_SIZE;
+        split.leaf = !canSplit || (count <= BVH_MAX_LEAF_SIZE && splitCost >= count);
+
+        // Near the depth the traversal stack allows, halve the primitives
+        // instead, which is guaranteed to reach the leaves in time
+        int halvings = 0;
+        while ((BVH_MAX_LEAF_SIZE << halvings) < count)
+        {
+            halvings++;
+        }
+        const bool balanced = level + halvings >= BVH_STACK_SIZE;
+        split.axis = balanced ? -1 : bestAxis;
+        split.bin = bestBin;
+        return split;
+    }
+
+    // Reorder primIndices[first, first + count) by `split` and return where
+    // the right side starts
+    int partitionRange(const BuildInput& in, int first, int count, const Split& split, const AABB& centroidBounds)
+    {
+        int* begin = in.primIndices + first;
+        int* end = begin + count;
+        if (split.axis >= 0)
+        {
+            const int axis = split.axis;
+            const float lo = centroidBounds.min[axis];
+            const float scale = binScale(centroidBounds)[axis];
+            return (int)(std::partition(begin, end,
+                [&](int prim)
+                {
+                    return binIndex(in.centroids[prim][axis], lo, scale) < split.bin;
+                }) - in.primIndices);
+        }
+
+        // Split at the median centroid along the widest axis; if every
+        // centroid is the same point, any split is as good as another
+        glm::vec3 extent = centroidBounds.max - centroidBounds.min;
+        int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+        int* middle = begin + count / 2;
+        std::nth_element(begin, middle, end,
+            [&](int a, int b)
+            {
+                return in.centroids[a][axis] < in.centroids[b][axis];
+            });
+        return (int)(middle - in.primIndices);
+    }
+
+    void setBounds(BvhNode& node, const AABB& bounds)
+    {
+        node.boundsMin = bounds.min;
+        node.boundsMax = bounds.max;
+    }
+
+    AABB nodeBounds(const BvhNode& node)
+    {
+        AABB b;
+        b.min = node.boundsMin;
+        b.max = node.boundsMax;
+        return b;
+    }
+
+    /**
+     * Build the subtree over primIndices[first, first + count), appending its
+     * nodes to `nodes` in depth-first order, and return the index of its
+     * root. Child indices are relative to the start of `nodes`.
+     */
+    int buildSubtree(const BuildInput& in, std::vector<BvhNode>& nodes, int first, int count, int level, int& depth)
+    {
+        const int index = (int)nodes.size();
+        nodes.push_back(BvhNode());
+        depth = std::max(depth, level);
+
+        AABB bounds;
+        AABB centroidBounds;
+        rangeBounds(in, first, count, bounds, centroidBounds);
+        setBounds(nodes[index], bounds);
+
+        Bins bins;
+        binRange(in, first, count, centroidBounds, bins);
+        Split split = chooseSplit(bins, bounds, centroidBounds, count, level);
+        if (split.leaf)
+        {
+            nodes[index].rightOrFirst = first;
+            nodes[index].primCount = count;
+            return index;
+        }
+
+        int mid = partitionRange(in, first, count, split, centroidBounds);
+        buildSubtree(in, nodes, first, mid - first, level + 1, depth);
+        nodes[index].rightOrFirst = buildSubtree(in, nodes, mid, first + count - mid, level + 1, depth);
+        nodes[index].primCount = 0;
+        return index;
+    }
+
+    // A node of the top levels of a parallel build: either split right away,
+    // with child jobs, or built as one serial subtree task
+    struct BuildJob
+    {
+        int first;
+        int count;
+        int level;
+        BvhNode node;
+        int left;           // job indices, -1 for a subtree task or leaf
+        int right;
+        bool subtree;
+        std::vector<BvhNode> nodes;
+        int depth;
+    };
+
+    // Append the nodes of `job` to `out` in depth-first order and return
+    // the index of its root
+    int emitJob(std::vector<BuildJob>& jobs, int job, std::vector<BvhNode>& out)
+    {
+        const int base = (int)out.size();
+        if (jobs[job].subtree)
+        {
+            for (size_t i = 0; i < jobs[job].nodes.size(); i++)
+            {
+                BvhNode node = jobs[job].nodes[i];
+                if (node.primCount == 0)
+                {
+                    node.rightOrFirst += base;
+                }
+                out.push_back(node);
+            }
+            return base;
+        }
+        out.push_back(jobs[job].node);
+        if (jobs[job].left >= 0)
+        {
+            emitJob(jobs, jobs[job].left, out);
+            out[base].rightOrFirst = emitJob(jobs, jobs[job].right, out);
+        }
+        return base;
+    }
+}
+
+Bvh::Bvh() : depth(0), buildMs(0.0), buildThreads(1), builder(BVH_BUILDER_SAH), refits(0),
+    totalWeightedArea(0.0), builtWeightedArea(0.0)
+{
+}
+
+void Bvh::build(const std::vector<Geom>& geoms, ThreadPool* pool, BvhBuilder builder)
+{
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+    const int count = (int)geoms.size();
+    const int threads = pool ? pool->size() : 1;
+    this->builder = builder;
+    if (builder != BVH_BUILDER_SAH)
+    {
+        // Without a device, LBVH_GPU builds the same tree on the host
+        if (builder == BVH_BUILDER_LBVH_GPU && Lbvh::buildOnDevice(geoms, nodes, primIndices, depth))
+        {
+            buildThreads = 1;
+        }
+        else
+        {
+            Lbvh::build(geoms, pool, nodes, primIndices, depth);
+            buildThreads = threads;
+        }
+        prepareRefit();
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+        buildMs = elapsed.count();
+        return;
+    }
+
+    std::vector<AABB> primBounds(count);
+    for (int i = 0; i < count; i++)
+    {
+        primBounds[i] = geomBounds(geoms[i]);
+    }
+    build(primBounds, pool);
+}
+
+void Bvh::build(const std::vector<AABB>& primBounds, ThreadPool* pool)
+{
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+    const int count = (int)primBounds.size();
+    const int threads = pool ? pool->size() : 1;
+    builder = BVH_BUILDER_SAH;
+    std::vector<glm::vec3> centroids(count);
+    primIndices.resize(count);
+    for (int i = 0; i < count; i++)
+    {
+        centroids[i] = primBounds[i].center();
+        primIndices[i] = i;
+    }
+    BuildInput in;
+    in.primBounds = primBounds.data();
+    in.centroids = centroids.data();
+    in.primIndices = primIndices.data();
+
+    nodes.clear();
+    nodes.reserve(2 * count);
+    depth = 0;
+    buildThreads = 1;
+    if (count > 0 && (threads == 1 || count < BVH_PARALLEL_MIN_PRIMS))
+    {
+        buildSubtree(in, nodes, 0, count, 1, depth);
+    }
+    else if (count > 0)
+    {
+        buildThreads = threads;
+
+        // Split the top levels one node at a time, each with its bounds and
+        // bins computed in parallel, until the nodes are small enough to
+        // give every thread a few subtrees.
+        const int subtreeSize = std::max(BVH_PARALLEL_MIN_PRIMS, count / (4 * threads));
+        std::vector<BuildJob> jobs(1);
+        jobs[0].first = 0;
+        jobs[0].count = count;
+        jobs[0].level = 1;
+        std::vector<int> subtrees;
+        for (size_t j = 0; j < jobs.size(); j++)
+        {
+            const int first = jobs[j].first;
+            const int n = jobs[j].count;
+            const int level = jobs[j].level;
+            jobs[j].left = jobs[j].right = -1;
+            jobs[j].subtree = n <= subtreeSize;
+            jobs[j].depth = level;
+            if (jobs[j].subtree)
+            {
+                subtrees.push_back((int)j);
+                continue;
+            }
+
+            const int chunks = (n + BVH_BIN_CHUNK - 1) / BVH_BIN_CHUNK;
+            std::vector<AABB> chunkBounds(chunks);
+            std::vector<AABB> chunkCentroids(chunks);
+            pool->run(chunks, [&](int chunk, int thread)
+            {
+                int begin = first + chunk * BVH_BIN_CHUNK;
+                rangeBounds(in, begin, std::min(BVH_BIN_CHUNK, first + n - begin), chunkBounds[chunk], chunkCentroids[chunk]);
+            });
+            AABB bounds = AABB::empty();
+            AABB centroidBounds = AABB::empty();
+            for (int c = 0; c < chunks; c++)
+            {
+                bounds.grow(chunkBounds[c]);
+                centroidBounds.grow(chunkCentroids[c]);
+            }
+
+            std::vector<Bins> chunkBins(chunks);
+            pool->run(chunks, [&](int chunk, int thread)
+            {
+                int begin = first + chunk * BVH_BIN_CHUNK;
+                binRange(in, begin, std::min(BVH_BIN_CHUNK, first + n - begin), centroidBounds, chunkBins[chunk]);
+            });
+            Bins bins;
+            bins.clear();
+            for (int c = 0; c < chunks; c++)
+            {
+                bins.merge(chunkBins[c]);
+            }
+
+            setBounds(jobs[j].node, bounds);
+            Split split = chooseSplit(bins, bounds, centroidBounds, n, level);
+            if (split.leaf)
+            {
+                jobs[j].node.rightOrFirst = first;
+                jobs[j].node.primCount = n;
+                continue;
+            }
+            jobs[j].node.primCount = 0;
+
+            int mid = partitionRange(in, first, n, split, centroidBounds);
+            BuildJob child;
+            child.level = level + 1;
+            child.first = first;
+            child.count = mid - first;
+            jobs[j].left = (int)jobs.size();
+            jobs.push_back(child);
+            child.first = mid;
+            child.count = first + n - mid;
+            jobs[j].right = (int)jobs.size();
+            jobs.push_back(child);
+        }
+
+        // Every subtree reorders its own range of primIndices and writes its
+        // own nodes, so they need no synchronization
+        pool->run((int)subtrees.size(), [&](int task, int thread)
+        {
+            BuildJob& job = jobs[subtrees[task]];
+            job.nodes.reserve(2 * job.count);
+            buildSubtree(in, job.nodes, job.first, job.count, job.level, job.depth);
+        });
+        for (size_t j = 0; j < jobs.size(); j++)
+        {
+            depth = std::max(depth, jobs[j].depth);
+        }
+        emitJob(jobs, 0, nodes);
+    }
+    prepareRefit();
+
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+    buildMs = elapsed.count();
+}
+
+void Bvh::prepareRefit()
+{
+    parents.assign(nodes.size(), -1);
+    geomLeaves.assign(primIndices.size(), -1);
+    totalWeightedArea = 0.0;
+    for (int i = 0; i < (int)nodes.size(); i++)
+    {
+        const BvhNode& n = nodes[i];
+        if (n.primCount > 0)
+        {
+            for (int k = 0; k < n.primCount; k++)
+            {
+                geomLeaves[primIndices[n.rightOrFirst + k]] = i;
+            }
+        }
+        else
+        {
+            parents[i + 1] = i;
+            parents[n.rightOrFirst] = i;
+        }
+        totalWeightedArea += weightedArea(i);
+    }
+    builtWeightedArea = totalWeightedArea;
+    refits = 0;
+}
+
+double Bvh::weightedArea(int i) const
+{
+    const BvhNode& n = nodes[i];
+    return nodeBounds(n).surfaceArea() * (n.primCount > 0 ? (double)n.primCount : BVH_TRAVERSAL_COST);
+}
+
+void Bvh::refit(const std::vector<Geom>& geoms, const std::vector<int>& dirtyGeoms,
+    std::vector<int>& changedNodes)
+{
+    changedNodes.clear();
+    for (size_t i = 0; i < dirtyGeoms.size(); i++)
+    {
+        for (int node = geomLeaves[dirtyGeoms[i]]; node >= 0; node = parents[node])
+        {
+            changedNodes.push_back(node);
+        }
+    }
+    std::sort(changedNodes.begin(), changedNodes.end());
+    changedNodes.erase(std::unique(changedNodes.begin(), changedNodes.end()), changedNodes.end());
+
+    for (int i = (int)changedNodes.size() - 1; i >= 0; i--)
+    {
+        const int index = changedNodes[i];
+        BvhNode& n = nodes[index];
+        AABB bounds = AABB::empty();
+        if (n.primCount > 0)
+        {
+            for (int k = 0; k < n.primCount; k++)
+            {
+                bounds.grow(geomBounds(geoms[primIndices[n.rightOrFirst + k]]));
+            }
+        }
+        else
+        {
+            bounds = nodeBounds(nodes[index + 1]);
+            bounds.grow(nodeBounds(nodes[n.rightOrFirst]));
+        }
+        totalWeightedArea -= weightedArea(index);
+        setBounds(n, bounds);
+        totalWeightedArea += weightedArea(index);
+    }
+    refits++;
+}
+
+BvhView Bvh::view() const
+{
+    BvhView v;
+    v.nodes = nodes.data();
+    v.primIndices = primIndices.data();
+    v.numNodes = (int)nodes.size();
+    return v;
+}
+
+AABB Bvh::bounds() const
+{
+    AABB b = AABB::empty();
+    if (!nodes.empty())
+    {
+        b.min = nodes[0].boundsMin;
+        b.max = nodes[0].boundsMax;
+    }
+    return b;
+}
+
+float Bvh::sahCost() const
+{
+    if (nodes.empty())
+    {
+        return 0.0f;
+    }
+    const float rootArea = nodeBounds(nodes[0]).surfaceArea();
+    if (rootArea <= 0.0f)
+    {
+        return (float)primIndices.size();
+    }
+
+    // Each node is visited with the probability that a ray through the root
+    // also passes through its box, which is proportional to its area. The
+    // weighted areas are summed at build time and kept up to date by refit().
+    return (float)(totalWeightedArea / rootArea);
+}
+
+float Bvh::refitCostRatio() const
+{
+    return builtWeightedArea > 0.0 ? (float)(totalWeightedArea / builtWeightedArea) : 1.0f;
+}
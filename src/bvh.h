@@ -0,0 +1,190 @@
+#pragma once
+
+#include <cfloat>
+#include <vector>
+#include "glm/glm.hpp"
+#include "sceneStructs.h"
+
+// Leaves hold at most this many primitives, whatever the SAH prefers
+#define BVH_MAX_LEAF_SIZE 8
+// Number of bins the SAH split is evaluated on, per axis
+#define BVH_NUM_BINS 16
+// Entries in the traversal stack; the builder keeps the tree shallower
+#define BVH_STACK_SIZE 64
+// A refitted tree is rebuilt once its SAH cost grows past this many times
+// the cost it was built with
+#define BVH_REFIT_MAX_COST_RATIO 1.3f
+
+struct AABB
+{
+    glm::vec3 min;
+    glm::vec3 max;
+
+    // An empty box that any grow() replaces
+    __host__ __device__ static AABB empty()
+    {
+        AABB b;
+        b.min = glm::vec3(FLT_MAX);
+        b.max = glm::vec3(-FLT_MAX);
+        return b;
+    }
+
+    __host__ __device__ void grow(const glm::vec3& p)
+    {
+        min = glm::min(min, p);
+        max = glm::max(max, p);
+    }
+
+    __host__ __device__ void grow(const AABB& b)
+    {
+        min = glm::min(min, b.min);
+        max = glm::max(max, b.max);
+    }
+
+    __host__ __device__ float surfaceArea() const
+    {
+        glm::vec3 d = max - min;
+        if (d.x < 0.0f || d.y < 0.0f || d.z < 0.0f)
+        {
+            return 0.0f;
+        }
+        return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+
+    __host__ __device__ glm::vec3 center() const
+    {
+        return 0.5f * (min + max);
+    }
+};
+
+/**
+ * World-space bounds of a geom: the transformed unit cube or sphere, or the
+ * transformed object-space box of a mesh. The cube and sphere fit the unit
+ * cube centered at the origin in object space. Column j of the transform is
+ * where object axis j goes, so the extent along world axis i sums row i
+ * weighted by the box's half extents: absolute values for the box's corners,
+ * and the length of the row for the sphere, which is exact for the ellipsoid
+ * it becomes.
+ */
+__host__ __device__ inline AABB geomBounds(const Geom& geom)
+{
+    glm::vec3 objectCenter(0.0f);
+    glm::vec3 objectHalfExtent(0.5f);
+    if (geom.type == MESH)
+    {
+        objectCenter = 0.5f * (geom.meshMin + geom.meshMax);
+        objectHalfExtent = 0.5f * (geom.meshMax - geom.meshMin);
+    }
+
+    glm::vec3 halfExtent;
+    for (int i = 0; i < 3; i++)
+    {
+        glm::vec3 row(geom.transform[0][i], geom.transform[1][i], geom.transform[2][i]);
+        halfExtent[i] = geom.type == SPHERE
+            ? 0.5f * glm::length(row)
+            : glm::dot(glm::abs(row), objectHalfExtent);
+    }
+    glm::vec3 center(geom.transform * glm::vec4(objectCenter, 1.0f));
+
+    AABB b;
+    b.min = center - halfExtent;
+    b.max = center + halfExtent;
+    return b;
+}
+
+/**
+ * One node of a flattened BVH, 32 bytes. Nodes are stored in depth-first
+ * order, so the left child of an inner node is the next node and only the
+ * right child needs an index.
+ */
+struct BvhNode
+{
+    glm::vec3 boundsMin;
+    int rightOrFirst;       // inner: index of the right child; leaf: first entry in primIndices
+    glm::vec3 boundsMax;
+    int primCount;          // 0 for inner nodes
+};
+
+/**
+ * Plain pointers to a BVH and its primitive indices, in host or device memory,
+ * passed to the traversal by value.
+ */
+struct BvhView
+{
+    const BvhNode* nodes;
+    const int* primIndices;
+    int numNodes;
+};
+
+class ThreadPool;
+
+/**
+ * Bounding volume hierarchy over the geoms of a scene, built on the host with
+ * a binned surface area heuristic, or as a linear BVH (see lbvh.h). The geoms
+ * keep their order; leaves refer to them through primIndices.
+ *
+ * With a thread pool, the top levels are split one at a time with the
+ * binning spread over the threads, and the subtrees below them are built as
+ * parallel tasks. The splits are the same either way, so a parallel build
+ * gives exactly the nodes and primIndices of a serial one.
+ */
+class Bvh
+{
+public:
+    Bvh();
+
+    // Rebuild over `geoms`. Call again after geoms are added or moved.
+    // BVH_BUILDER_LBVH_GPU builds on the device and reads the tree back, or
+    // builds it on the host without a device; buildMs includes the copies.
+    void build(const std::vector<Geom>& geoms, ThreadPool* pool = NULL,
+        BvhBuilder builder = BVH_BUILDER_SAH);
+
+    // Build with the SAH over any primitives, given their bounds
+    void build(const std::vector<AABB>& primBounds, ThreadPool* pool = NULL);
+
+    /**
+     * Update the bounds of the leaves holding `dirtyGeoms` and of every node
+     * above them for the geoms' new transforms, keeping the tree as it is.
+     * Children always come after their parent, so the dirty nodes are fitted
+     * in reverse order.
+     *
+     * @param changedNodes  Output parameter for the indices of the refitted
+     *                      nodes, ascending.
+     */
+    void refit(const std::vector<Geom>& geoms, const std::vector<int>& dirtyGeoms,
+        std::vector<int>& changedNodes);
+
+    // Host view, valid until the next build
+    BvhView view() const;
+
+    // Box of the root, empty if there are no nodes
+    AABB bounds() const;
+
+    // Expected cost of a random ray under the SAH, in primitive tests
+    float sahCost() const;
+
+    // SAH cost now over the cost after the last build, tracked through
+    // refits. Both are taken over the root box of the build, since geoms
+    // moving apart grow the root and would otherwise hide the loss.
+    float refitCostRatio() const;
+
+    std::vector<BvhNode> nodes;
+    std::vector<int> primIndices;
+    int depth;              // levels in the deepest leaf, 1 for a single leaf
+    double buildMs;         // duration of the last build
+    int buildThreads;       // threads the last build ran on
+    BvhBuilder builder;     // builder of the last build
+    int refits;             // refits since the last build
+
+private:
+    // Index the parents and leaves that refit() walks, and reset the cost
+    void prepareRefit();
+
+    // Surface area of node i times its SAH cost weight
+    double weightedArea(int i) const;
+
+    std::vector<int> parents;       // -1 for the root
+    std::vector<int> geomLeaves;    // leaf holding each geom
+    double totalWeightedArea;       // sum of weightedArea() over the nodes
+    double builtWeightedArea;       // totalWeightedArea after the last build
+};
@@ -0,0 +1,34 @@
+#include "firstHitCache.h"
+
+static bool sameCamera(const Camera& a, const Camera& b)
+{
+    return a.resolution == b.resolution
+        && a.position == b.position
+        && a.view == b.view
+        && a.up == b.up
+        && a.right == b.right
+        && a.pixelLength == b.pixelLength;
+}
+
+FirstHitCache::FirstHitCache() : stored(false), camera() {}
+
+bool FirstHitCache::enabled(const RenderState& state)
+{
+    return state.cacheFirstHits && !state.antialias;
+}
+
+bool FirstHitCache::valid(const RenderState& state) const
+{
+    return stored && enabled(state) && sameCamera(camera, state.camera);
+}
+
+void FirstHitCache::store(const RenderState& state)
+{
+    stored = true;
+    camera = state.camera;
+}
+
+void FirstHitCache::invalidate()
+{
+    stored = false;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "sceneStructs.h"
+
+/**
+ * Bookkeeping for reusing depth-0 intersections across iterations.
+ *
+ * Without sub-pixel jitter every iteration shoots exactly the same camera
+ * rays, so their first hits only have to be traced once per camera and
+ * scene. Each backend keeps the cached intersections in its own buffer, one
+ * per pixel in pixel order; this class decides whether that buffer may be
+ * used. The cache is keyed on the camera it was filled for, so a camera that
+ * moves without a reinit still misses, and scene edits must call
+ * invalidate().
+ */
+class FirstHitCache
+{
+public:
+    FirstHitCache();
+
+    // Whether caching applies at all: it is switched on and rays are not jittered.
+    static bool enabled(const RenderState& state);
+
+    // Whether the cached hits match `state` and can replace tracing depth 0.
+    bool valid(const RenderState& state) const;
+
+    // Record that the buffer now holds the depth-0 hits for `state`.
+    void store(const RenderState& state);
+
+    void invalidate();
+
+private:
+    bool stored;
+    Camera camera;
+};
@@ -1,14 +1,48 @@
 #include "interactions.h"
 
+__host__ __device__ void generateCameraPath(
+    const Camera& cam,
+    int iter,
+    int x,
+    int y,
+    int traceDepth,
+    bool jitter,
+    SamplerKind sampler,
+    PathSegment& segment)
+{
+    segment.ray.origin = cam.position;
+    segment.color = glm::vec3(1.0f, 1.0f, 1.0f);
+    segment.radiance = glm::vec3(0.0f);
+    segment.bsdfPdf = 0.0f;
+    segment.pixelIndex = x + (y * cam.resolution.x);
+    segment.iteration = iter;
+
+    float px = (float)x;
+    float py = (float)y;
+    if (jitter)
+    {
+        // Shading at depth d seeds with d < traceDepth, so depth traceDepth
+        // gives the camera its own random sequence.
+        Sampler rng(sampler, iter, segment.pixelIndex, traceDepth);
+        px += rng.next() - 0.5f;
+        py += rng.next() - 0.5f;
+    }
+
+    segment.ray.direction = glm::normalize(cam.view
+        - cam.right * cam.pixelLength.x * (px - (float)cam.resolution.x * 0.5f)
+        - cam.up * cam.pixelLength.y * (py - (float)cam.resolution.y * 0.5f)
+    );
+
+    segment.remainingBounces = traceDepth;
+}
+
 __host__ __device__ glm::vec3 calculateRandomDirectionInHemisphere(
     glm::vec3 normal,
-    thrust::default_random_engine &rng)
+    Sampler& rng)
 {
-    thrust::uniform_real_distribution<float> u01(0, 1);
-
-    float up = sqrt(u01(rng)); // cos(theta)
+    float up = sqrt(rng.next()); // cos(theta)
     float over = sqrt(1 - up * up); // sin(theta)
-    float around = u01(rng) * TWO_PI;
+    float around = rng.next() * TWO_PI;
 
     // Find a direction that is not the normal based off of whether or not the
     // normal's components are all equal to sqrt(1/3) or whether or not at
@@ -45,9 +79,85 @@ __host__ __device__ void scatterRay(
     glm::vec3 intersect,
     glm::vec3 normal,
     const Material &m,
-    thrust::default_random_engine &rng)
+    Sampler& rng)
+{
+    if (m.hasReflective > 0.0f)
+    {
+        scatterSpecular(pathSegment, intersect, normal, m);
+    }
+    else
+    {
+        scatterDiffuse(pathSegment, intersect, normal, m, rng);
+    }
+}
+
+__host__ __device__ void scatterDiffuse(
+    PathSegment& pathSegment,
+    glm::vec3 intersect,
+    glm::vec3 normal,
+    const Material& m,
+    Sampler& rng)
+{
+    // Cosine-weighted sampling cancels the Lambertian cos/pdf term, so the
+    // throughput is simply scaled by the albedo.
+    pathSegment.ray.origin = intersect + normal * EPSILON;
+    pathSegment.ray.direction = glm::normalize(calculateRandomDirectionInHemisphere(normal, rng));
+    pathSegment.color *= m.color;
+    pathSegment.bsdfPdf = glm::max(glm::dot(normal, pathSegment.ray.direction), 0.0f) / PI;
+    pathSegment.remainingBounces--;
+}
+
+__host__ __device__ void scatterSpecular(
+    PathSegment& pathSegment,
+    glm::vec3 intersect,
+    glm::vec3 normal,
+    const Material& m)
+{
+    pathSegment.ray.origin = intersect + normal * EPSILON;
+    pathSegment.ray.direction = glm::normalize(glm::reflect(pathSegment.ray.direction, normal));
+    pathSegment.color *= m.specular.color;
+    pathSegment.bsdfPdf = 0.0f;
+    pathSegment.remainingBounces--;
+}
+
+__host__ __device__ void sampleDirectLight(
+    const glm::vec3& throughput,
+    glm::vec3 intersect,
+    glm::vec3 normal,
+    const Material& m,
+    const EmitterView& lights,
+    Sampler& rng,
+    ShadowRay& shadow)
 {
-    // TODO: implement this.
-    // A basic implementation of pure-diffuse shading will just call the
-    // calculateRandomDirectionInHemisphere defined above.
+    shadow.tMax = 0.0f;
+    // The point a bounce from here starts at, which emissionWeight() sees
+    // as the ray origin
+    const glm::vec3 origin = intersect + normal * EPSILON;
+    LightSample light;
+    if (!sampleEmitter(lights, origin, rng, light))
+    {
+        return;
+    }
+    const glm::vec3 toLight = light.point - origin;
+    const float distance = glm::length(toLight);
+    if (distance <= 0.0f)
+    {
+        return;
+    }
+    const glm::vec3 direction = toLight / distance;
+    const float cosSurface = glm::dot(normal, direction);
+    const float lightPdf = emitterPdf(light.pdf, distance, -glm::dot(light.normal, direction));
+    if (cosSurface <= 0.0f || lightPdf <= 0.0f)
+    {
+        return;
+    }
+
+    // Lambertian BRDF m.color / PI, and the density the bounce would have
+    // picked this direction with
+    const float bsdfPdf = cosSurface / PI;
+    shadow.ray.origin = origin;
+    shadow.ray.direction = direction;
+    shadow.tMax = distance * (1.0f - SHADOW_RAY_SHORTEN);
+    shadow.radiance = throughput * (m.color / PI) * light.emission * (cosSurface / lightPdf)
+        * powerHeuristic(lightPdf, bsdfPdf);
 }
@@ -1,8 +1,27 @@
 #pragma once
 
 #include "intersections.h"
+#include "lights.h"
+#include "sampler.h"
 #include <glm/glm.hpp>
-#include <thrust/random.h>
+
+/**
+ * Initialize `segment` as sample `iter` of pixel (x, y): a ray from the camera
+ * through the pixel, white throughput, no radiance and `traceDepth`
+ * remaining bounces. The
+ * ray goes through the pixel center, or through a random point in the pixel
+ * drawn from `sampler` if `jitter` is set.
+ */
+__host__ __device__ void generateCameraPath(
+    const Camera& cam,
+    int iter,
+    int x,
+    int y,
+    int traceDepth,
+    bool jitter,
+    SamplerKind sampler,
+    PathSegment& segment);
+
 // CHECKITOUT
 /**
  * Computes a cosine-weighted random direction in a hemisphere.
@@ -10,7 +29,7 @@
  */
 __host__ __device__ glm::vec3 calculateRandomDirectionInHemisphere(
     glm::vec3 normal, 
-    thrust::default_random_engine& rng);
+    Sampler& rng);
 
 /**
  * Scatter a ray with some probabilities according to the material properties.
@@ -42,4 +61,238 @@ __host__ __device__ void scatterRay(
     glm::vec3 intersect,
     glm::vec3 normal,
     const Material& m,
-    thrust::default_random_engine& rng);
+    Sampler& rng);
+
+/**
+ * Lambertian bounce: cosine-weighted direction, throughput scaled by albedo.
+ * The direction's density is kept in bsdfPdf for weighing the light the
+ * path may hit next.
+ */
+__host__ __device__ void scatterDiffuse(
+    PathSegment& pathSegment,
+    glm::vec3 intersect,
+    glm::vec3 normal,
+    const Material& m,
+    Sampler& rng);
+
+/**
+ * Perfect mirror bounce: reflected direction, throughput scaled by the
+ * specular color. Light sampling cannot find this direction, so bsdfPdf is
+ * cleared.
+ */
+__host__ __device__ void scatterSpecular(
+    PathSegment& pathSegment,
+    glm::vec3 intersect,
+    glm::vec3 normal,
+    const Material& m);
+
+/**
+ * Next-event estimation at a diffuse hit: pick a point on a light and set
+ * `shadow` to the ray towards it and the light it carries, weighted against
+ * finding the same light with a cosine-weighted bounce by the power
+ * heuristic. `throughput` is the path's before the bounce. The shadow ray is
+ * left out (tMax 0) when there are no lights or the point faces away.
+ */
+__host__ __device__ void sampleDirectLight(
+    const glm::vec3& throughput,
+    glm::vec3 intersect,
+    glm::vec3 normal,
+    const Material& m,
+    const EmitterView& lights,
+    Sampler& rng,
+    ShadowRay& shadow);
+
+/**
+ * MIS weight of the emission a path picks up by hitting a light after a
+ * bounce with density `bsdfPdf`, the counterpart of the weight in
+ * sampleDirectLight. Camera rays and mirror bounces, which light sampling
+ * cannot produce, and scenes without light sampling keep all of it.
+ */
+__host__ __device__ inline float emissionWeight(
+    float bsdfPdf,
+    const Ray& ray,
+    const ShadeableIntersection& intersection,
+    const EmitterView& lights)
+{
+    if (lights.count == 0 || bsdfPdf <= 0.0f)
+    {
+        return 1.0f;
+    }
+    const float distance = intersection.t * glm::length(ray.direction);
+    const float cosLight = glm::abs(glm::dot(intersection.surfaceNormal, glm::normalize(ray.direction)));
+    const float areaPdf = emitterAreaPdf(lights, intersection.geomId, ray.origin);
+    return powerHeuristic(bsdfPdf, emitterPdf(areaPdf, distance, cosLight));
+}
+
+/**
+ * Pick the shading queue for a path from its closest hit.
+ */
+__host__ __device__ inline ShadeQueue classifyIntersection(
+    const ShadeableIntersection& intersection,
+    const Material* materials)
+{
+    if (intersection.t <= 0.0f)
+    {
+        return QUEUE_TERMINATED;
+    }
+    const Material& material = materials[intersection.materialId];
+    if (material.emittance > 0.0f)
+    {
+        return QUEUE_TERMINATED;
+    }
+    return material.hasReflective > 0.0f ? QUEUE_SPECULAR : QUEUE_DIFFUSE;
+}
+
+/**
+ * Key for sorting paths by material before shading. Keys are ordered by shade
+ * queue first, so after sorting every queue is one contiguous range of paths,
+ * and by material within a queue. Misses sort after every material.
+ */
+__host__ __device__ inline int materialSortKey(
+    const ShadeableIntersection& intersection,
+    const Material* materials,
+    int numMaterials)
+{
+    int queue = classifyIntersection(intersection, materials);
+    int material = intersection.t > 0.0f ? intersection.materialId : numMaterials;
+    return queue * (numMaterials + 1) + material;
+}
+
+// Number of key bits the radix sort needs for materialSortKey.
+inline int materialSortKeyBits(int numMaterials)
+{
+    int keys = NUM_SHADE_QUEUES * (numMaterials + 1);
+    int bits = 0;
+    while ((1 << bits) < keys)
+    {
+        bits++;
+    }
+    return bits;
+}
+
+/**
+ * Russian roulette for a path that has made `bounces` bounces: from
+ * `rouletteDepth` bounces on (never if it is negative), the path continues
+ * with a probability equal to its largest throughput component and its
+ * throughput is divided by that probability, so the expected contribution is
+ * unchanged while dim paths stop early.
+ *
+ * @return  false if the path was terminated, with its color cleared.
+ */
+__host__ __device__ inline bool survivesRoulette(
+    PathSegment& pathSegment,
+    int bounces,
+    int rouletteDepth,
+    Sampler& rng)
+{
+    if (rouletteDepth < 0 || bounces < rouletteDepth)
+    {
+        return true;
+    }
+    const glm::vec3& c = pathSegment.color;
+    float survival = glm::min(glm::max(c.x, glm::max(c.y, c.z)), 1.0f);
+    if (survival <= 0.0f || rng.next() >= survival)
+    {
+        pathSegment.color = glm::vec3(0.0f);
+        pathSegment.remainingBounces = 0;
+        return false;
+    }
+    pathSegment.color /= survival;
+    return true;
+}
+
+/**
+ * Shade a path that was sorted into `queue` and, unless it terminates here,
+ * replace its ray with the next bounce. Each wavefront shading stage
+ * instantiates this for one queue, so no stage branches on material type.
+ * Paths past `rouletteDepth` bounces are also subject to Russian roulette.
+ * Light found along the way is added to the path's radiance. Random numbers
+ * come from a `sampler` keyed on the path's pixel, iteration and `depth`.
+ *
+ * Diffuse hits also sample `lights`, and leave the shadow ray for the caller
+ * to trace: its radiance is added to the path's if nothing blocks it.
+ * `shadow` gets tMax 0 otherwise.
+ *
+ * @return  true if the path needs to be extended by another bounce.
+ */
+template <ShadeQueue queue>
+__host__ __device__ inline bool shadePath(
+    int depth,
+    int rouletteDepth,
+    SamplerKind sampler,
+    PathSegment& pathSegment,
+    const ShadeableIntersection& intersection,
+    const Material* materials,
+    const EmitterView& lights,
+    ShadowRay& shadow)
+{
+    shadow.tMax = 0.0f;
+    if (queue == QUEUE_TERMINATED)
+    {
+        if (intersection.t > 0.0f)
+        {
+            const Material& light = materials[intersection.materialId];
+            pathSegment.radiance += pathSegment.color * (light.color * light.emittance)
+                * emissionWeight(pathSegment.bsdfPdf, pathSegment.ray, intersection, lights);
+        }
+        else
+        {
+            pathSegment.radiance += pathSegment.color * BACKGROUND_COLOR;
+        }
+        pathSegment.remainingBounces = 0;
+        return false;
+    }
+
+    const Material& material = materials[intersection.materialId];
+    glm::vec3 intersect = getPointOnRay(pathSegment.ray, intersection.t);
+    Sampler rng(sampler, pathSegment.iteration, pathSegment.pixelIndex, depth);
+    if (queue == QUEUE_DIFFUSE)
+    {
+        const glm::vec3 throughput = pathSegment.color;
+        scatterDiffuse(pathSegment, intersect, intersection.surfaceNormal, material, rng);
+
+        // A light the bounce finds would only count if the path had a bounce
+        // left, so the same goes for sampling it
+        if (pathSegment.remainingBounces > 0)
+        {
+            sampleDirectLight(throughput, intersect, intersection.surfaceNormal, material, lights, rng, shadow);
+        }
+    }
+    else
+    {
+        scatterSpecular(pathSegment, intersect, intersection.surfaceNormal, material);
+    }
+
+    // Out of bounces; the radiance gathered so far is the result
+    if (pathSegment.remainingBounces <= 0)
+    {
+        return false;
+    }
+    return survivesRoulette(pathSegment, depth + 1, rouletteDepth, rng);
+}
+
+/**
+ * Runtime-dispatched shadePath for callers that handle every queue in one
+ * place, such as the CPU tile renderer.
+ */
+__host__ __device__ inline bool shadePath(
+    ShadeQueue queue,
+    int depth,
+    int rouletteDepth,
+    SamplerKind sampler,
+    PathSegment& pathSegment,
+    const ShadeableIntersection& intersection,
+    const Material* materials,
+    const EmitterView& lights,
+    ShadowRay& shadow)
+{
+    switch (queue)
+    {
+    case QUEUE_DIFFUSE:
+        return shadePath<QUEUE_DIFFUSE>(depth, rouletteDepth, sampler, pathSegment, intersection, materials, lights, shadow);
+    case QUEUE_SPECULAR:
+        return shadePath<QUEUE_SPECULAR>(depth, rouletteDepth, sampler, pathSegment, intersection, materials, lights, shadow);
+    default:
+        return shadePath<QUEUE_TERMINATED>(depth, rouletteDepth, sampler, pathSegment, intersection, materials, lights, shadow);
+    }
+}
@@ -1,15 +1,41 @@
 #include "intersections.h"
 
+/**
+ * World-space result of a hit at distance `t` along the normalized
+ * object-space direction, `rd` being the unnormalized one. Object space
+ * stretches the ray by |rd| / |r.direction|, so the distance to the point
+ * getPointOnRay gives, just short of the surface, follows without going
+ * back through the object-to-world transform.
+ *
+ * @param objectNormal  Normal at the hit in object space.
+ * @return              The distance along `r`, as the hit's `t`.
+ */
+__host__ __device__ static float worldDistance(
+    const Ray& r,
+    const glm::vec3& rd,
+    float t,
+    const glm::vec4* inverse,
+    const glm::vec3& objectNormal,
+    glm::vec3& intersectionPoint,
+    glm::vec3& normal)
+{
+    const float u = (t - .0001f) / glm::length(rd);
+    intersectionPoint = r.origin + u * r.direction;
+    normal = glm::normalize(transformNormal(inverse, objectNormal));
+    return glm::abs(u) * glm::length(r.direction);
+}
+
 __host__ __device__ float boxIntersectionTest(
-    Geom box,
-    Ray r,
+    const CompactGeom& box,
+    const Ray& r,
     glm::vec3 &intersectionPoint,
     glm::vec3 &normal,
     bool &outside)
 {
+    const glm::vec3 rd = transformDirection(box.inverse, r.direction);
     Ray q;
-    q.origin    =                multiplyMV(box.inverseTransform, glm::vec4(r.origin   , 1.0f));
-    q.direction = glm::normalize(multiplyMV(box.inverseTransform, glm::vec4(r.direction, 0.0f)));
+    q.origin    = transformPoint(box.inverse, r.origin);
+    q.direction = glm::normalize(rd);
 
     float tmin = -1e38f;
     float tmax = 1e38f;
@@ -48,29 +74,25 @@ __host__ __device__ float boxIntersectionTest(
             tmin_n = tmax_n;
             outside = false;
         }
-        intersectionPoint = multiplyMV(box.transform, glm::vec4(getPointOnRay(q, tmin), 1.0f));
-        normal = glm::normalize(multiplyMV(box.invTranspose, glm::vec4(tmin_n, 0.0f)));
-        return glm::length(r.origin - intersectionPoint);
+        return worldDistance(r, rd, tmin, box.inverse, tmin_n, intersectionPoint, normal);
     }
 
     return -1;
 }
 
 __host__ __device__ float sphereIntersectionTest(
-    Geom sphere,
-    Ray r,
+    const CompactGeom& sphere,
+    const Ray& r,
     glm::vec3 &intersectionPoint,
     glm::vec3 &normal,
     bool &outside)
 {
     float radius = .5;
 
-    glm::vec3 ro = multiplyMV(sphere.inverseTransform, glm::vec4(r.origin, 1.0f));
-    glm::vec3 rd = glm::normalize(multiplyMV(sphere.inverseTransform, glm::vec4(r.direction, 0.0f)));
-
+    const glm::vec3 rd = transformDirection(sphere.inverse, r.direction);
     Ray rt;
-    rt.origin = ro;
-    rt.direction = rd;
+    rt.origin = transformPoint(sphere.inverse, r.origin);
+    rt.direction = glm::normalize(rd);
 
     float vDotDirection = glm::dot(rt.origin, rt.direction);
     float radicand = vDotDirection * vDotDirection - (glm::dot(rt.origin, rt.origin) - powf(radius, 2));
@@ -101,13 +123,735 @@ __host__ __device__ float sphereIntersectionTest(
     }
 
     glm::vec3 objspaceIntersection = getPointOnRay(rt, t);
+    t = worldDistance(r, rd, t, sphere.inverse, objspaceIntersection, intersectionPoint, normal);
+    if (!outside)
+    {
+        normal = -normal;
+    }
+    return t;
+}
+
+/**
+ * Ray in the form the watertight triangle test wants: the axis where the
+ * direction is largest becomes z, and the shear that maps the direction onto
+ * it is applied to each triangle's vertices instead of the ray.
+ */
+struct WatertightRay
+{
+    glm::vec3 origin;
+    int kx;
+    int ky;
+    int kz;
+    float sx;
+    float sy;
+    float sz;
+};
+
+__host__ __device__ static WatertightRay watertightRay(const glm::vec3& origin, const glm::vec3& dir)
+{
+    WatertightRay w;
+    w.origin = origin;
+    glm::vec3 a = glm::abs(dir);
+    w.kz = a.x > a.y ? (a.x > a.z ? 0 : 2) : (a.y > a.z ? 1 : 2);
+    w.kx = w.kz == 2 ? 0 : w.kz + 1;
+    w.ky = w.kx == 2 ? 0 : w.kx + 1;
+    // Keep the winding, so the sign of the determinant tells the side
+    if (dir[w.kz] < 0.0f)
+    {
+        int swap = w.kx;
+        w.kx = w.ky;
+        w.ky = swap;
+    }
+    w.sx = dir[w.kx] / dir[w.kz];
+    w.sy = dir[w.ky] / dir[w.kz];
+    w.sz = 1.0f / dir[w.kz];
+    return w;
+}
+
+/**
+ * Watertight ray/triangle test. Edge functions that come out exactly zero
+ * are recomputed in double precision, so an edge shared by two triangles
+ * always belongs to at least one of them.
+ *
+ * @param bary  Output parameter for the weights of a, b and c at the hit.
+ * @return      true on a hit with 0 < t <= tMax.
+ */
+__host__ __device__ static bool triangleIntersectionTest(
+    const WatertightRay& w,
+    const glm::vec3& a,
+    const glm::vec3& b,
+    const glm::vec3& c,
+    float tMax,
+    float& t,
+    glm::vec3& bary)
+{
+    const glm::vec3 A = a - w.origin;
+    const glm::vec3 B = b - w.origin;
+    const glm::vec3 C = c - w.origin;
+    const float ax = A[w.kx] - w.sx * A[w.kz];
+    const float ay = A[w.ky] - w.sy * A[w.kz];
+    const float bx = B[w.kx] - w.sx * B[w.kz];
+    const float by = B[w.ky] - w.sy * B[w.kz];
+    const float cx = C[w.kx] - w.sx * C[w.kz];
+    const float cy = C[w.ky] - w.sy * C[w.kz];
+
+    float u = cx * by - cy * bx;
+    float v = ax * cy - ay * cx;
+    float e = bx * ay - by * ax;
+    if (u == 0.0f || v == 0.0f || e == 0.0f)
+    {
+        u = (float)((double)cx * (double)by - (double)cy * (double)bx);
+        v = (float)((double)ax * (double)cy - (double)ay * (double)cx);
+        e = (float)((double)bx * (double)ay - (double)by * (double)ax);
+    }
+    if ((u < 0.0f || v < 0.0f || e < 0.0f) && (u > 0.0f || v > 0.0f || e > 0.0f))
+    {
+        return false;
+    }
+    const float det = u + v + e;
+    if (det == 0.0f)
+    {
+        return false;
+    }
+
+    // Scaled distance, compared against tMax before the division
+    const float T = u * w.sz * A[w.kz] + v * w.sz * B[w.kz] + e * w.sz * C[w.kz];
+    if (det < 0.0f ? (T >= 0.0f || T < tMax * det) : (T <= 0.0f || T > tMax * det))
+    {
+        return false;
+    }
+    const float invDet = 1.0f / det;
+    t = T * invDet;
+    bary = glm::vec3(u, v, e) * invDet;
+    return true;
+}
 
-    intersectionPoint = multiplyMV(sphere.transform, glm::vec4(objspaceIntersection, 1.f));
-    normal = glm::normalize(multiplyMV(sphere.invTranspose, glm::vec4(objspaceIntersection, 0.f)));
+__host__ __device__ float meshIntersectionTest(
+    const CompactGeom& geom,
+    const Ray& r,
+    MeshView meshes,
+    glm::vec3& intersectionPoint,
+    glm::vec3& normal,
+    bool& outside)
+{
+    const Mesh& mesh = meshes.meshes[geom.meshId];
+    const glm::vec3 dir = glm::normalize(r.direction);
+    const glm::vec3 ro = transformPoint(geom.inverse, r.origin);
+    const glm::vec3 rd = transformDirection(geom.inverse, dir);
+    const glm::vec3 invDir = 1.0f / rd;
+    const WatertightRay w = watertightRay(ro, rd);
+
+    float tHit = FLT_MAX;
+    int hitTriangle = -1;
+    glm::vec3 hitBary;
+
+    // Same nearest-first walk as intersectBvh, over the mesh's own nodes
+    int stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    float tEntry;
+    const BvhNode* nodes = meshes.nodes;
+    int node = rayIntersectsBox(nodes[mesh.rootNode].boundsMin, nodes[mesh.rootNode].boundsMax,
+        ro, invDir, tHit, tEntry) ? mesh.rootNode : -1;
+    while (node >= 0)
+    {
+        const BvhNode& n = nodes[node];
+        if (n.primCount > 0)
+        {
+            for (int i = 0; i < n.primCount; i++)
+            {
+                const int tri = meshes.primIndices[n.rightOrFirst + i];
+                const glm::ivec3 v = meshes.triangles[tri];
+                float t;
+                glm::vec3 bary;
+                if (triangleIntersectionTest(w, meshes.positions[v.x], meshes.positions[v.y],
+                    meshes.positions[v.z], tHit, t, bary) && (t < tHit || (t == tHit && tri < hitTriangle)))
+                {
+                    tHit = t;
+                    hitTriangle = tri;
+                    hitBary = bary;
+                }
+            }
+            node = stackSize > 0 ? stack[--stackSize] : -1;
+            continue;
+        }
+
+        int near = node + 1;
+        int far = n.rightOrFirst;
+        float tNear;
+        float tFar;
+        bool hitNear = rayIntersectsBox(nodes[near].boundsMin, nodes[near].boundsMax, ro, invDir, tHit, tNear);
+        bool hitFar = rayIntersectsBox(nodes[far].boundsMin, nodes[far].boundsMax, ro, invDir, tHit, tFar);
+        if (hitNear && hitFar)
+        {
+            if (tFar < tNear)
+            {
+                int swap = near;
+                near = far;
+                far = swap;
+            }
+            stack[stackSize++] = far;
+            node = near;
+        }
+        else if (hitNear || hitFar)
+        {
+            node = hitNear ? near : far;
+        }
+        else
+        {
+            node = stackSize > 0 ? stack[--stackSize] : -1;
+        }
+    }
+
+    if (hitTriangle < 0)
+    {
+        return -1.0f;
+    }
+
+    const glm::ivec3 v = meshes.triangles[hitTriangle];
+    const glm::vec3 p0 = meshes.positions[v.x];
+    const glm::vec3 faceNormal = glm::normalize(transformNormal(geom.inverse,
+        glm::cross(meshes.positions[v.y] - p0, meshes.positions[v.z] - p0)));
+    normal = faceNormal;
+    if (mesh.firstNormal >= 0)
+    {
+        const glm::vec3* n = meshes.normals + mesh.firstNormal - mesh.firstVertex;
+        glm::vec3 shading = hitBary.x * n[v.x] + hitBary.y * n[v.y] + hitBary.z * n[v.z];
+        normal = glm::normalize(transformNormal(geom.inverse, shading));
+    }
+
+    outside = glm::dot(faceNormal, dir) < 0.0f;
     if (!outside)
     {
         normal = -normal;
     }
+    intersectionPoint = r.origin + tHit * dir;
+    return tHit;
+}
+
+__host__ __device__ float geomIntersectionTest(
+    const CompactGeom& geom,
+    const Ray& r,
+    MeshView meshes,
+    glm::vec3& intersectionPoint,
+    glm::vec3& normal,
+    bool& outside)
+{
+    if (geom.type() == CUBE)
+    {
+        return boxIntersectionTest(geom, r, intersectionPoint, normal, outside);
+    }
+    else if (geom.type() == SPHERE)
+    {
+        return sphereIntersectionTest(geom, r, intersectionPoint, normal, outside);
+    }
+    else if (geom.type() == MESH)
+    {
+        return meshIntersectionTest(geom, r, meshes, intersectionPoint, normal, outside);
+    }
+    return -1.0f;
+}
+
+/**
+ * Any hit of a triangle mesh before `tMax`, along the same object-space ray
+ * as meshIntersectionTest. Both hit children are stacked, in node order.
+ */
+__host__ __device__ static bool meshOccludes(const CompactGeom& geom, const Ray& r, MeshView meshes, float tMax)
+{
+    const Mesh& mesh = meshes.meshes[geom.meshId];
+    const glm::vec3 ro = transformPoint(geom.inverse, r.origin);
+    const glm::vec3 rd = transformDirection(geom.inverse, glm::normalize(r.direction));
+    const glm::vec3 invDir = 1.0f / rd;
+    const WatertightRay w = watertightRay(ro, rd);
+
+    int stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    float tEntry;
+    const BvhNode* nodes = meshes.nodes;
+    if (rayIntersectsBox(nodes[mesh.rootNode].boundsMin, nodes[mesh.rootNode].boundsMax, ro, invDir, tMax, tEntry))
+    {
+        stack[stackSize++] = mesh.rootNode;
+    }
+    while (stackSize > 0)
+    {
+        const BvhNode& n = nodes[stack[--stackSize]];
+        if (n.primCount > 0)
+        {
+            for (int i = 0; i < n.primCount; i++)
+            {
+                const glm::ivec3 v = meshes.triangles[meshes.primIndices[n.rightOrFirst + i]];
+                float t;
+                glm::vec3 bary;
+                if (triangleIntersectionTest(w, meshes.positions[v.x], meshes.positions[v.y],
+                    meshes.positions[v.z], tMax, t, bary) && t < tMax)
+                {
+                    return true;
+                }
+            }
+            continue;
+        }
+
+        const int far = n.rightOrFirst;
+        if (rayIntersectsBox(nodes[far].boundsMin, nodes[far].boundsMax, ro, invDir, tMax, tEntry))
+        {
+            stack[stackSize++] = far;
+        }
+        const int near = &n - nodes + 1;
+        if (rayIntersectsBox(nodes[near].boundsMin, nodes[near].boundsMax, ro, invDir, tMax, tEntry))
+        {
+            stack[stackSize++] = near;
+        }
+    }
+    return false;
+}
+
+__host__ __device__ bool geomOccludes(
+    const CompactGeom& geom,
+    const Ray& r,
+    MeshView meshes,
+    float tMax)
+{
+    if (geom.type() == MESH)
+    {
+        return meshOccludes(geom, r, meshes, tMax);
+    }
+    if (geom.type() != CUBE && geom.type() != SPHERE)
+    {
+        return false;
+    }
+
+    // Not renormalized, so distances along rd are world distances
+    const glm::vec3 ro = transformPoint(geom.inverse, r.origin);
+    const glm::vec3 rd = transformDirection(geom.inverse, glm::normalize(r.direction));
+    float tNear;
+    float tFar;
+    if (geom.type() == CUBE)
+    {
+        const glm::vec3 t1 = (glm::vec3(-0.5f) - ro) / rd;
+        const glm::vec3 t2 = (glm::vec3(0.5f) - ro) / rd;
+        const glm::vec3 ta = glm::min(t1, t2);
+        const glm::vec3 tb = glm::max(t1, t2);
+        tNear = glm::max(glm::max(ta.x, ta.y), ta.z);
+        tFar = glm::min(glm::min(tb.x, tb.y), tb.z);
+        if (tFar < tNear)
+        {
+            return false;
+        }
+    }
+    else
+    {
+        // |ro + t rd|^2 = 0.25
+        const float a = glm::dot(rd, rd);
+        const float b = glm::dot(ro, rd);
+        const float radicand = b * b - a * (glm::dot(ro, ro) - 0.25f);
+        if (radicand < 0.0f)
+        {
+            return false;
+        }
+        const float squareRoot = sqrt(radicand);
+        tNear = (-b - squareRoot) / a;
+        tFar = (-b + squareRoot) / a;
+    }
+    return (tNear > 0.0f && tNear < tMax) || (tFar > 0.0f && tFar < tMax);
+}
+
+__host__ __device__ int intersectGeoms(
+    const Ray& r,
+    const CompactGeom* geoms,
+    int geoms_size,
+    MeshView meshes,
+    ShadeableIntersection& intersection)
+{
+    float t;
+    glm::vec3 intersect_point;
+    glm::vec3 normal;
+    float t_min = FLT_MAX;
+    int hit_geom_index = -1;
+    bool outside = true;
+
+    glm::vec3 tmp_intersect;
+    glm::vec3 tmp_normal;
+
+    // naive parse through global geoms
+
+    for (int i = 0; i < geoms_size; i++)
+    {
+        t = geomIntersectionTest(geoms[i], r, meshes, tmp_intersect, tmp_normal, outside);
+
+        // Compute the minimum t from the intersection tests to determine what
+        // scene geometry object was hit first.
+        if (t > 0.0f && t_min > t)
+        {
+            t_min = t;
+            hit_geom_index = i;
+            intersect_point = tmp_intersect;
+            normal = tmp_normal;
+        }
+    }
+
+    if (hit_geom_index == -1)
+    {
+        intersection.t = -1.0f;
+    }
+    else
+    {
+        // The ray hits something
+        intersection.t = t_min;
+        intersection.materialId = geoms[hit_geom_index].materialId();
+        intersection.geomId = hit_geom_index;
+        intersection.surfaceNormal = normal;
+    }
+
+    return hit_geom_index;
+}
 
-    return glm::length(r.origin - intersectionPoint);
+__host__ __device__ int intersectBvh(
+    const Ray& r,
+    const CompactGeom* geoms,
+    BvhView bvh,
+    MeshView meshes,
+    ShadeableIntersection& intersection,
+    TraversalStats* stats)
+{
+    glm::vec3 invDir = 1.0f / glm::normalize(r.direction);
+    glm::vec3 normal;
+    float t_min = FLT_MAX;
+    int hit_geom_index = -1;
+    bool outside = true;
+
+    glm::vec3 tmp_intersect;
+    glm::vec3 tmp_normal;
+
+    // Depth-first walk that enters the nearer child of an inner node first
+    // and stacks the other one, so the closest hit tends to be found early
+    // and prunes every box behind it.
+    int stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    float tEntry;
+    int node = bvh.numNodes > 0 && rayIntersectsBox(bvh.nodes[0].boundsMin, bvh.nodes[0].boundsMax,
+        r.origin, invDir, t_min, tEntry) ? 0 : -1;
+    if (stats && bvh.numNodes > 0)
+    {
+        stats->nodeBytes += sizeof(BvhNode);
+    }
+    while (node >= 0)
+    {
+        const BvhNode& n = bvh.nodes[node];
+        if (stats)
+        {
+            stats->steps++;
+            stats->nodeBytes += n.primCount > 0 ? 0 : 2 * sizeof(BvhNode);
+            stats->primTests += n.primCount;
+        }
+        if (n.primCount > 0)
+        {
+            for (int i = 0; i < n.primCount; i++)
+            {
+                int g = bvh.primIndices[n.rightOrFirst + i];
+                float t = geomIntersectionTest(geoms[g], r, meshes, tmp_intersect, tmp_normal, outside);
+
+                // On a tie the lowest index wins, as in the linear search
+                if (t > 0.0f && (t < t_min || (t == t_min && g < hit_geom_index)))
+                {
+                    t_min = t;
+                    hit_geom_index = g;
+                    normal = tmp_normal;
+                }
+            }
+            node = stackSize > 0 ? stack[--stackSize] : -1;
+            continue;
+        }
+
+        int near = node + 1;
+        int far = n.rightOrFirst;
+        float tNear;
+        float tFar;
+        bool hitNear = rayIntersectsBox(bvh.nodes[near].boundsMin, bvh.nodes[near].boundsMax,
+            r.origin, invDir, t_min, tNear);
+        bool hitFar = rayIntersectsBox(bvh.nodes[far].boundsMin, bvh.nodes[far].boundsMax,
+            r.origin, invDir, t_min, tFar);
+        if (hitNear && hitFar)
+        {
+            if (tFar < tNear)
+            {
+                int swap = near;
+                near = far;
+                far = swap;
+            }
+            stack[stackSize++] = far;
+            node = near;
+        }
+        else if (hitNear || hitFar)
+        {
+            node = hitNear ? near : far;
+        }
+        else
+        {
+            node = stackSize > 0 ? stack[--stackSize] : -1;
+        }
+    }
+
+    if (hit_geom_index == -1)
+    {
+        intersection.t = -1.0f;
+    }
+    else
+    {
+        intersection.t = t_min;
+        intersection.materialId = geoms[hit_geom_index].materialId();
+        intersection.geomId = hit_geom_index;
+        intersection.surfaceNormal = normal;
+    }
+
+    return hit_geom_index;
+}
+
+__host__ __device__ int intersectWideBvh(
+    const Ray& r,
+    const CompactGeom* geoms,
+    WideBvhView bvh,
+    MeshView meshes,
+    ShadeableIntersection& intersection,
+    TraversalStats* stats)
+{
+    glm::vec3 invDir = 1.0f / glm::normalize(r.direction);
+    glm::vec3 normal;
+    float t_min = FLT_MAX;
+    int hit_geom_index = -1;
+    bool outside = true;
+
+    glm::vec3 tmp_intersect;
+    glm::vec3 tmp_normal;
+
+    // Child entries with the distance at which the ray enters their box
+    int stack[WIDE_BVH_STACK_SIZE];
+    float stackEntry[WIDE_BVH_STACK_SIZE];
+    int stackSize = 0;
+    if (bvh.numNodes > 0)
+    {
+        stack[0] = 0;
+        stackEntry[0] = -FLT_MAX;
+        stackSize = 1;
+    }
+    while (stackSize > 0)
+    {
+        stackSize--;
+        const int entry = stack[stackSize];
+        if (stackEntry[stackSize] > t_min * BOX_TEST_SLACK)
+        {
+            continue;
+        }
+
+        if (wideBvhIsLeaf(entry))
+        {
+            const int first = wideBvhLeafFirst(entry);
+            const int count = wideBvhLeafCount(entry);
+            if (stats)
+            {
+                stats->primTests += count;
+            }
+            for (int i = 0; i < count; i++)
+            {
+                int g = bvh.primIndices[first + i];
+                float t = geomIntersectionTest(geoms[g], r, meshes, tmp_intersect, tmp_normal, outside);
+
+                // On a tie the lowest index wins, as in the linear search
+                if (t > 0.0f && (t < t_min || (t == t_min && g < hit_geom_index)))
+                {
+                    t_min = t;
+                    hit_geom_index = g;
+                    normal = tmp_normal;
+                }
+            }
+            continue;
+        }
+
+        const WideBvhNode& n = bvh.nodes[entry];
+        if (stats)
+        {
+            stats->steps++;
+            stats->nodeBytes += sizeof(WideBvhNode);
+        }
+        const glm::vec3 step = n.scale();
+
+        // Hit children, sorted nearest first
+        int hits[WIDE_BVH_WIDTH];
+        float hitEntry[WIDE_BVH_WIDTH];
+        int numHits = 0;
+        for (int c = 0; c < n.numChildren; c++)
+        {
+            glm::vec3 boxMin;
+            glm::vec3 boxMax;
+            float tEntry;
+            n.childBounds(c, step, boxMin, boxMax);
+            if (!rayIntersectsBox(boxMin, boxMax, r.origin, invDir, t_min, tEntry))
+            {
+                continue;
+            }
+            int k = numHits++;
+            while (k > 0 && hitEntry[k - 1] > tEntry)
+            {
+                hits[k] = hits[k - 1];
+                hitEntry[k] = hitEntry[k - 1];
+                k--;
+            }
+            hits[k] = n.child[c];
+            hitEntry[k] = tEntry;
+        }
+        for (int k = numHits - 1; k >= 0; k--)
+        {
+            stack[stackSize] = hits[k];
+            stackEntry[stackSize] = hitEntry[k];
+            stackSize++;
+        }
+    }
+
+    if (hit_geom_index == -1)
+    {
+        intersection.t = -1.0f;
+    }
+    else
+    {
+        intersection.t = t_min;
+        intersection.materialId = geoms[hit_geom_index].materialId();
+        intersection.geomId = hit_geom_index;
+        intersection.surfaceNormal = normal;
+    }
+
+    return hit_geom_index;
+}
+
+__host__ __device__ bool occludedGeoms(
+    const Ray& r,
+    float tMax,
+    const CompactGeom* geoms,
+    int geoms_size,
+    MeshView meshes)
+{
+    for (int i = 0; i < geoms_size; i++)
+    {
+        if (geomOccludes(geoms[i], r, meshes, tMax))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+__host__ __device__ bool occludedBvh(
+    const Ray& r,
+    float tMax,
+    const CompactGeom* geoms,
+    BvhView bvh,
+    MeshView meshes,
+    TraversalStats* stats)
+{
+    const glm::vec3 invDir = 1.0f / glm::normalize(r.direction);
+    int stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    float tEntry;
+    if (bvh.numNodes > 0 && rayIntersectsBox(bvh.nodes[0].boundsMin, bvh.nodes[0].boundsMax,
+        r.origin, invDir, tMax, tEntry))
+    {
+        stack[stackSize++] = 0;
+    }
+    if (stats && bvh.numNodes > 0)
+    {
+        stats->nodeBytes += sizeof(BvhNode);
+    }
+    while (stackSize > 0)
+    {
+        const int node = stack[--stackSize];
+        const BvhNode& n = bvh.nodes[node];
+        if (stats)
+        {
+            stats->steps++;
+            stats->nodeBytes += n.primCount > 0 ? 0 : 2 * sizeof(BvhNode);
+        }
+        if (n.primCount > 0)
+        {
+            for (int i = 0; i < n.primCount; i++)
+            {
+                if (stats)
+                {
+                    stats->primTests++;
+                }
+                if (geomOccludes(geoms[bvh.primIndices[n.rightOrFirst + i]], r, meshes, tMax))
+                {
+                    return true;
+                }
+            }
+            continue;
+        }
+
+        // Any hit ends the walk, so the order of the children does not matter
+        const int far = n.rightOrFirst;
+        if (rayIntersectsBox(bvh.nodes[far].boundsMin, bvh.nodes[far].boundsMax, r.origin, invDir, tMax, tEntry))
+        {
+            stack[stackSize++] = far;
+        }
+        if (rayIntersectsBox(bvh.nodes[node + 1].boundsMin, bvh.nodes[node + 1].boundsMax, r.origin, invDir,
+            tMax, tEntry))
+        {
+            stack[stackSize++] = node + 1;
+        }
+    }
+    return false;
+}
+
+__host__ __device__ bool occludedWideBvh(
+    const Ray& r,
+    float tMax,
+    const CompactGeom* geoms,
+    WideBvhView bvh,
+    MeshView meshes,
+    TraversalStats* stats)
+{
+    const glm::vec3 invDir = 1.0f / glm::normalize(r.direction);
+    int stack[WIDE_BVH_STACK_SIZE];
+    int stackSize = 0;
+    if (bvh.numNodes > 0)
+    {
+        stack[stackSize++] = 0;
+    }
+    while (stackSize > 0)
+    {
+        const int entry = stack[--stackSize];
+        if (wideBvhIsLeaf(entry))
+        {
+            const int first = wideBvhLeafFirst(entry);
+            const int count = wideBvhLeafCount(entry);
+            if (stats)
+            {
+                stats->primTests += count;
+            }
+            for (int i = 0; i < count; i++)
+            {
+                if (geomOccludes(geoms[bvh.primIndices[first + i]], r, meshes, tMax))
+                {
+                    return true;
+                }
+            }
+            continue;
+        }
+
+        const WideBvhNode& n = bvh.nodes[entry];
+        if (stats)
+        {
+            stats->steps++;
+            stats->nodeBytes += sizeof(WideBvhNode);
+        }
+        const glm::vec3 step = n.scale();
+        for (int c = n.numChildren - 1; c >= 0; c--)
+        {
+            glm::vec3 boxMin;
+            glm::vec3 boxMax;
+            float tEntry;
+            n.childBounds(c, step, boxMin, boxMax);
+            if (rayIntersectsBox(boxMin, boxMax, r.origin, invDir, tMax, tEntry))
+            {
+                stack[stackSize++] = n.child[c];
+            }
+        }
+    }
+    return false;
 }
@@ -3,8 +3,14 @@
 #include <glm/glm.hpp>
 #include <glm/gtx/intersect.hpp>
 
+#include "bvh.h"
+#include "mesh.h"
 #include "sceneStructs.h"
 #include "utilities.h"
+#include "wideBvh.h"
+
+// Relative widening of the slab test against rounding, see rayIntersectsBox
+#define BOX_TEST_SLACK 1.00001f
 
 /**
  * Handy-dandy hash function that provides seeds for random number generation.
@@ -31,11 +37,32 @@ __host__ __device__ inline glm::vec3 getPointOnRay(Ray r, float t)
 }
 
 /**
- * Multiplies a mat4 and a vec4 and returns a vec3 clipped from the vec4.
+ * A 3x4 affine matrix, given as its rows, applied to a point.
+ */
+__host__ __device__ inline glm::vec3 transformPoint(const glm::vec4* rows, const glm::vec3& p)
+{
+    return glm::vec3(
+        rows[0].x * p.x + rows[0].y * p.y + rows[0].z * p.z + rows[0].w,
+        rows[1].x * p.x + rows[1].y * p.y + rows[1].z * p.z + rows[1].w,
+        rows[2].x * p.x + rows[2].y * p.y + rows[2].z * p.z + rows[2].w);
+}
+
+// The same matrix applied to a direction, ignoring the translation
+__host__ __device__ inline glm::vec3 transformDirection(const glm::vec4* rows, const glm::vec3& d)
+{
+    return glm::vec3(
+        rows[0].x * d.x + rows[0].y * d.y + rows[0].z * d.z,
+        rows[1].x * d.x + rows[1].y * d.y + rows[1].z * d.z,
+        rows[2].x * d.x + rows[2].y * d.y + rows[2].z * d.z);
+}
+
+/**
+ * An object-space normal into world space, given the rows of the
+ * world-to-object matrix: the normal matrix is their transpose.
  */
-__host__ __device__ inline glm::vec3 multiplyMV(glm::mat4 m, glm::vec4 v)
+__host__ __device__ inline glm::vec3 transformNormal(const glm::vec4* rows, const glm::vec3& n)
 {
-    return glm::vec3(m * v);
+    return n.x * glm::vec3(rows[0]) + n.y * glm::vec3(rows[1]) + n.z * glm::vec3(rows[2]);
 }
 
 // CHECKITOUT
@@ -49,8 +76,8 @@ __host__ __device__ inline glm::vec3 multiplyMV(glm::mat4 m, glm::vec4 v)
  * @return                   Ray parameter `t` value. -1 if no intersection.
  */
 __host__ __device__ float boxIntersectionTest(
-    Geom box,
-    Ray r,
+    const CompactGeom& box,
+    const Ray& r,
     glm::vec3& intersectionPoint,
     glm::vec3& normal,
     bool& outside);
@@ -66,8 +93,220 @@ __host__ __device__ float boxIntersectionTest(
  * @return                   Ray parameter `t` value. -1 if no intersection.
  */
 __host__ __device__ float sphereIntersectionTest(
-    Geom sphere,
-    Ray r,
+    const CompactGeom& sphere,
+    const Ray& r,
+    glm::vec3& intersectionPoint,
+    glm::vec3& normal,
+    bool& outside);
+
+/**
+ * Test intersection between a ray and a transformed triangle mesh. The ray
+ * goes into the mesh's object space without renormalizing, so `t` along it
+ * is still the world-space distance, and walks the mesh's BVH nearest node
+ * first. Triangles use the watertight test of Woop, Benthin and Wald
+ * (2013), so rays through a shared edge or vertex cannot slip between its
+ * triangles. The normal is interpolated from the vertex normals if the mesh
+ * has them; `outside` is decided by the face normal.
+ *
+ * @param intersectionPoint  Output parameter for point of intersection.
+ * @param normal             Output parameter for surface normal, facing the ray.
+ * @param outside            Output param for whether the ray came from outside.
+ * @return                   Ray parameter `t` value. -1 if no intersection.
+ */
+__host__ __device__ float meshIntersectionTest(
+    const CompactGeom& mesh,
+    const Ray& r,
+    MeshView meshes,
+    glm::vec3& intersectionPoint,
+    glm::vec3& normal,
+    bool& outside);
+
+/**
+ * Test intersection between a ray and a geom of any type.
+ *
+ * @return  Ray parameter `t` value. -1 if no intersection.
+ */
+__host__ __device__ float geomIntersectionTest(
+    const CompactGeom& geom,
+    const Ray& r,
+    MeshView meshes,
     glm::vec3& intersectionPoint,
     glm::vec3& normal,
     bool& outside);
+
+/**
+ * Whether ray `r` hits `geom` at a distance in (0, tMax). The any-hit
+ * counterpart of geomIntersectionTest for shadow rays: it stops at the
+ * first surface it finds and computes no point or normal. Spheres and cubes
+ * are solved along the object-space image of the normalized direction, so
+ * the roots are world distances without a transform back; they skip the
+ * 0.0001 pull-back of getPointOnRay and can differ from the closest-hit `t`
+ * by that much.
+ */
+__host__ __device__ bool geomOccludes(
+    const CompactGeom& geom,
+    const Ray& r,
+    MeshView meshes,
+    float tMax);
+
+/**
+ * Slab test of a ray against an axis-aligned box, with `invDir` the inverse
+ * of the normalized ray direction, or of its image in a mesh's object space,
+ * so distances compare with the `t` of the intersection tests.
+ *
+ * The primitive tests work in object space and round differently, so a hit
+ * at tMax can sit an ulp or two past the entry into its own box. Both ends
+ * are widened by BOX_TEST_SLACK so such a box is never culled, which would
+ * lose the lowest-index tie break on shared edges.
+ *
+ * @param tEntry  Output parameter for where the ray enters the box, negative
+ *                if the origin is inside.
+ * @return        true if the ray enters the box no farther than tMax.
+ */
+__host__ __device__ inline bool rayIntersectsBox(
+    const glm::vec3& boxMin,
+    const glm::vec3& boxMax,
+    const glm::vec3& origin,
+    const glm::vec3& invDir,
+    float tMax,
+    float& tEntry)
+{
+    glm::vec3 t0 = (boxMin - origin) * invDir;
+    glm::vec3 t1 = (boxMax - origin) * invDir;
+    tEntry = fmaxf(fmaxf(fminf(t0.x, t1.x), fminf(t0.y, t1.y)), fminf(t0.z, t1.z));
+    float tExit = fminf(fminf(fmaxf(t0.x, t1.x), fmaxf(t0.y, t1.y)), fmaxf(t0.z, t1.z));
+    tExit *= BOX_TEST_SLACK;
+    return tEntry <= tExit && tExit >= 0.0f && tEntry <= tMax * BOX_TEST_SLACK;
+}
+
+/**
+ * Work done by one BVH traversal, counted when the caller passes a place
+ * for it. Used to compare node layouts.
+ */
+struct TraversalStats
+{
+    int steps;          // nodes visited
+    int nodeBytes;      // node data read, box tests included
+    int primTests;      // geoms tested
+};
+
+/**
+ * Find the closest intersection of ray `r` with any of the `geoms_size`
+ * geoms by testing each one in turn. Kept as the reference for the BVH
+ * traversal and for scenes too small to need one.
+ *
+ * @param intersection  Output parameter. `t` is set to -1 if nothing was hit;
+ *                      the other fields are only written on a hit.
+ * @return              Index of the geom that was hit, or -1.
+ */
+__host__ __device__ int intersectGeoms(
+    const Ray& r,
+    const CompactGeom* geoms,
+    int geoms_size,
+    MeshView meshes,
+    ShadeableIntersection& intersection);
+
+/**
+ * Find the closest intersection of ray `r` with `geoms`, visiting the BVH
+ * nodes the ray enters nearest first and skipping those behind its closest
+ * hit so far. Gives the same
+ * result as intersectGeoms, ties included. Shared by the
+ * `computeIntersections` kernel and the CPU backend.
+ *
+ * @param intersection  Output parameter. `t` is set to -1 if nothing was hit;
+ *                      the other fields are only written on a hit.
+ * @return              Index of the geom that was hit, or -1.
+ */
+__host__ __device__ int intersectBvh(
+    const Ray& r,
+    const CompactGeom* geoms,
+    BvhView bvh,
+    MeshView meshes,
+    ShadeableIntersection& intersection,
+    TraversalStats* stats = NULL);
+
+/**
+ * intersectBvh over the compressed nodes of a WideBvh. Every child box of a
+ * visited node is decoded and tested, and the hit ones, leaves included, go
+ * on the stack farthest first with their entry distance, so entries behind
+ * the closest hit found since are dropped unvisited. Gives the same result
+ * as intersectBvh over the tree it was converted from.
+ */
+__host__ __device__ int intersectWideBvh(
+    const Ray& r,
+    const CompactGeom* geoms,
+    WideBvhView bvh,
+    MeshView meshes,
+    ShadeableIntersection& intersection,
+    TraversalStats* stats = NULL);
+
+/**
+ * Closest hit through `wideBvh` if it has nodes, and through `bvh`
+ * otherwise.
+ */
+__host__ __device__ inline int intersectScene(
+    const Ray& r,
+    const CompactGeom* geoms,
+    BvhView bvh,
+    WideBvhView wideBvh,
+    MeshView meshes,
+    ShadeableIntersection& intersection)
+{
+    if (wideBvh.numNodes > 0)
+    {
+        return intersectWideBvh(r, geoms, wideBvh, meshes, intersection);
+    }
+    return intersectBvh(r, geoms, bvh, meshes, intersection);
+}
+
+/**
+ * Whether anything in `geoms` blocks ray `r` before `tMax`, by testing each
+ * geom in turn until one does. The reference for the traversals below.
+ */
+__host__ __device__ bool occludedGeoms(
+    const Ray& r,
+    float tMax,
+    const CompactGeom* geoms,
+    int geoms_size,
+    MeshView meshes);
+
+/**
+ * Any-hit query through the BVH: whether anything blocks ray `r` before
+ * `tMax`. Nodes are culled against the fixed `tMax` and visited without
+ * sorting, and the walk ends at the first hit. Agrees with occludedGeoms.
+ */
+__host__ __device__ bool occludedBvh(
+    const Ray& r,
+    float tMax,
+    const CompactGeom* geoms,
+    BvhView bvh,
+    MeshView meshes,
+    TraversalStats* stats = NULL);
+
+// occludedBvh over the compressed nodes of a WideBvh
+__host__ __device__ bool occludedWideBvh(
+    const Ray& r,
+    float tMax,
+    const CompactGeom* geoms,
+    WideBvhView bvh,
+    MeshView meshes,
+    TraversalStats* stats = NULL);
+
+/**
+ * Any-hit query through `wideBvh` if it has nodes, and through `bvh`
+ * otherwise, like intersectScene.
+ */
+__host__ __device__ inline bool occludedScene(
+    const Ray& r,
+    float tMax,
+    const CompactGeom* geoms,
+    BvhView bvh,
+    WideBvhView wideBvh,
+    MeshView meshes)
+{
+    if (wideBvh.numNodes > 0)
+    {
+        return occludedWideBvh(r, tMax, geoms, wideBvh, meshes);
+    }
+    return occludedBvh(r, tMax, geoms, bvh, meshes);
+}
@@ -0,0 +1,575 @@
+#include "lbvh.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <cuda.h>
+#include <memory>
+
+#include "morton.h"
+#include "threadPool.h"
+#include "../stream_compaction/cpu.h"
+#include "../stream_compaction/radix.h"
+
+// Defined in pathtrace.cu
+void checkCUDAErrorFn(const char* msg, const char* file, int line, bool sync);
+#define FILENAME (strrchr(__FILE__, '/') ? strrchr(__FILE__, '/') + 1 : __FILE__)
+#define checkCUDAError(msg) checkCUDAErrorFn(msg, FILENAME, __LINE__, true)
+
+#define blockSize 128
+// Elements per task in the host build
+#define LBVH_CHUNK 16384
+
+// Node numbering during the build: inner nodes of the radix tree are
+// 0..n-2 with the root at 0, and the leaf for sorted primitive k is n-1+k.
+// Child, leaf count and arrival arrays only cover the inner nodes.
+
+__host__ __device__ static inline int countLeadingZeros(unsigned int x)
+{
+#ifdef __CUDA_ARCH__
+    return __clz((int)x);
+#else
+    if (x == 0)
+    {
+        return 32;
+    }
+    int n = 0;
+    while ((x & 0x80000000u) == 0)
+    {
+        x <<= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+/**
+ * Length of the common prefix of sorted keys i and j, or -1 if j is out of
+ * range. Equal codes are told apart by their index, so every key is unique.
+ */
+__host__ __device__ static inline int commonPrefix(const int* codes, int n, int i, int j)
+{
+    if (j < 0 || j >= n)
+    {
+        return -1;
+    }
+    unsigned int a = (unsigned int)codes[i];
+    unsigned int b = (unsigned int)codes[j];
+    if (a == b)
+    {
+        return 32 + countLeadingZeros((unsigned int)(i ^ j));
+    }
+    return countLeadingZeros(a ^ b);
+}
+
+/**
+ * Find the children of inner node i from the sorted codes alone: the range
+ * of keys it covers starts or ends at i, and its split is where the common
+ * prefix of the range gets one bit longer.
+ */
+__host__ __device__ static void buildInnerNode(
+    int i,
+    const int* codes,
+    int n,
+    int* leftChild,
+    int* rightChild,
+    int* parent,
+    int* leafCount)
+{
+    // Direction of the range from i and a bound on its length
+    int d = commonPrefix(codes, n, i, i + 1) - commonPrefix(codes, n, i, i - 1) >= 0 ? 1 : -1;
+    int minPrefix = commonPrefix(codes, n, i, i - d);
+    int maxLength = 2;
+    while (commonPrefix(codes, n, i, i + maxLength * d) > minPrefix)
+    {
+        maxLength *= 2;
+    }
+
+    // Exact other end by binary search
+    int length = 0;
+    for (int step = maxLength / 2; step >= 1; step /= 2)
+    {
+        if (commonPrefix(codes, n, i, i + (length + step) * d) > minPrefix)
+        {
+            length += step;
+        }
+    }
+    int j = i + length * d;
+
+    // Split: the last key sharing more than the range's common prefix with i
+    int nodePrefix = commonPrefix(codes, n, i, j);
+    int split = 0;
+    int divisor = 2;
+    int step;
+    do
+    {
+        step = (length + divisor - 1) / divisor;
+        if (commonPrefix(codes, n, i, i + (split + step) * d) > nodePrefix)
+        {
+            split += step;
+        }
+        divisor *= 2;
+    } while (step > 1);
+    int gamma = i + split * d + glm::min(d, 0);
+
+    int first = glm::min(i, j);
+    int last = glm::max(i, j);
+    int left = first == gamma ? n - 1 + gamma : gamma;
+    int right = last == gamma + 1 ? n - 1 + gamma + 1 : gamma + 1;
+    leftChild[i] = left;
+    rightChild[i] = right;
+    parent[left] = i;
+    parent[right] = i;
+    leafCount[i] = last - first + 1;
+}
+
+/**
+ * Position of `node` in depth-first order: one past its parent if it is the
+ * left child, and past the parent and the whole left subtree otherwise.
+ *
+ * @param depth  Output parameter for the number of levels down to the node.
+ */
+__host__ __device__ static int preorderIndex(
+    int node,
+    int n,
+    const int* leftChild,
+    const int* parent,
+    const int* leafCount,
+    int& depth)
+{
+    int index = 0;
+    depth = 1;
+    while (node != 0)
+    {
+        int p = parent[node];
+        int left = leftChild[p];
+        int leftLeaves = left >= n - 1 ? 1 : leafCount[left];
+        index += node == left ? 1 : 2 * leftLeaves;
+        node = p;
+        depth++;
+    }
+    return index;
+}
+
+// Write node `node` at its depth-first position
+__host__ __device__ static void emitNode(
+    int node,
+    int n,
+    const int* order,
+    const int* rightChild,
+    const int* preorder,
+    const AABB* bounds,
+    BvhNode* nodes,
+    int* primIndices)
+{
+    BvhNode out;
+    out.boundsMin = bounds[node].min;
+    out.boundsMax = bounds[node].max;
+    if (node < n - 1)
+    {
+        out.rightOrFirst = preorder[rightChild[node]];
+        out.primCount = 0;
+    }
+    else
+    {
+        int k = node - (n - 1);
+        out.rightOrFirst = k;
+        out.primCount = 1;
+        primIndices[k] = order[k];
+    }
+    nodes[preorder[node]] = out;
+}
+
+namespace Lbvh
+{
+    // Run fn(begin, end) over chunks of [0, n) on `pool`, or inline
+    template <typename Fn>
+    static void parallelFor(ThreadPool* pool, int n, const Fn& fn)
+    {
+        const int chunks = (n + LBVH_CHUNK - 1) / LBVH_CHUNK;
+        if (pool == NULL || chunks <= 1)
+        {
+            fn(0, n);
+            return;
+        }
+        pool->run(chunks, [&](int chunk, int thread)
+        {
+            int begin = chunk * LBVH_CHUNK;
+            fn(begin, std::min(begin + LBVH_CHUNK, n));
+        });
+    }
+
+    void build(const std::vector<Geom>& geoms, ThreadPool* pool,
+        std::vector<BvhNode>& nodes, std::vector<int>& primIndices, int& depth)
+    {
+        const int n = (int)geoms.size();
+        nodes.resize(n > 0 ? 2 * n - 1 : 0);
+        primIndices.resize(n);
+        depth = n > 0 ? 1 : 0;
+        if (n == 0)
+        {
+            return;
+        }
+
+        std::vector<AABB> primBounds(n);
+        const int chunks = (n + LBVH_CHUNK - 1) / LBVH_CHUNK;
+        std::vector<AABB> chunkCentroids(chunks, AABB::empty());
+        parallelFor(pool, n, [&](int begin, int end)
+        {
+            AABB& centroids = chunkCentroids[begin / LBVH_CHUNK];
+            for (int i = begin; i < end; i++)
+            {
+                primBounds[i] = geomBounds(geoms[i]);
+                centroids.grow(primBounds[i].center());
+            }
+        });
+        AABB sceneBounds = AABB::empty();
+        for (int c = 0; c < chunks; c++)
+        {
+            sceneBounds.grow(chunkCentroids[c]);
+        }
+
+        std::vector<int> codes(n);
+        std::vector<int> order(n);
+        parallelFor(pool, n, [&](int begin, int end)
+        {
+            for (int i = begin; i < end; i++)
+            {
+                codes[i] = mortonCode(primBounds[i].center(), sceneBounds);
+                order[i] = i;
+            }
+        });
+        StreamCompaction::CPU::sortByKey(n, MORTON_BITS, codes.data(), order.data(), pool);
+
+        const int numNodes = 2 * n - 1;
+        std::vector<int> leftChild(std::max(n - 1, 1));
+        std::vector<int> rightChild(std::max(n - 1, 1));
+        std::vector<int> parent(numNodes, -1);
+        std::vector<int> leafCount(std::max(n - 1, 1));
+        parallelFor(pool, n - 1, [&](int begin, int end)
+        {
+            for (int i = begin; i < end; i++)
+            {
+                buildInnerNode(i, codes.data(), n, leftChild.data(), rightChild.data(), parent.data(), leafCount.data());
+            }
+        });
+
+        // Fit bounds from the leaves up. Of the two children of a node, the
+        // one that finishes second goes on to fit the node.
+        std::vector<AABB> bounds(numNodes);
+        std::unique_ptr<std::atomic<int>[]> arrivals(new std::atomic<int>[n]);
+        for (int i = 0; i < n; i++)
+        {
+            arrivals[i] = 0;
+        }
+        parallelFor(pool, n, [&](int begin, int end)
+        {
+            for (int k = begin; k < end; k++)
+            {
+                int node = n - 1 + k;
+                bounds[node] = primBounds[order[k]];
+                node = parent[node];
+                while (node >= 0 && arrivals[node].fetch_add(1) == 1)
+                {
+                    bounds[node] = bounds[leftChild[node]];
+                    bounds[node].grow(bounds[rightChild[node]]);
+                    node = parent[node];
+                }
+            }
+        });
+
+        std::vector<int> preorder(numNodes);
+        std::vector<int> chunkDepth((numNodes + LBVH_CHUNK - 1) / LBVH_CHUNK, 1);
+        parallelFor(pool, numNodes, [&](int begin, int end)
+        {
+            int maxDepth = 1;
+            for (int node = begin; node < end; node++)
+            {
+                int d;
+                preorder[node] = preorderIndex(node, n, leftChild.data(), parent.data(), leafCount.data(), d);
+                maxDepth = std::max(maxDepth, d);
+            }
+            chunkDepth[begin / LBVH_CHUNK] = maxDepth;
+        });
+        depth = *std::max_element(chunkDepth.begin(), chunkDepth.end());
+
+        parallelFor(pool, numNodes, [&](int begin, int end)
+        {
+            for (int node = begin; node < end; node++)
+            {
+                emitNode(node, n, order.data(), rightChild.data(), preorder.data(), bounds.data(),
+                    nodes.data(), primIndices.data());
+            }
+        });
+    }
+
+    // Device scratch, grown as needed
+    static AABB* dev_primBounds = NULL;
+    static AABB* dev_sceneBounds = NULL;
+    static int* dev_codes = NULL;
+    static int* dev_order = NULL;
+    static int* dev_leftChild = NULL;
+    static int* dev_rightChild = NULL;
+    static int* dev_parent = NULL;
+    static int* dev_leafCount = NULL;
+    static AABB* dev_bounds = NULL;
+    static int* dev_arrivals = NULL;
+    static int* dev_preorder = NULL;
+    // buildOnDevice() input and output
+    static Geom* dev_geoms = NULL;
+    static BvhNode* dev_nodes = NULL;
+    static int* dev_primIndices = NULL;
+    static int capacity = 0;
+
+    static void reserve(int n)
+    {
+        if (capacity < n)
+        {
+            freeScratch();
+            const int numNodes = 2 * n - 1;
+            cudaMalloc(&dev_primBounds, n * sizeof(AABB));
+            cudaMalloc(&dev_sceneBounds, sizeof(AABB));
+            cudaMalloc(&dev_codes, n * sizeof(int));
+            cudaMalloc(&dev_order, n * sizeof(int));
+            cudaMalloc(&dev_leftChild, n * sizeof(int));
+            cudaMalloc(&dev_rightChild, n * sizeof(int));
+            cudaMalloc(&dev_parent, numNodes * sizeof(int));
+            cudaMalloc(&dev_leafCount, n * sizeof(int));
+            cudaMalloc(&dev_bounds, numNodes * sizeof(AABB));
+            cudaMalloc(&dev_arrivals, n * sizeof(int));
+            cudaMalloc(&dev_preorder, numNodes * sizeof(int));
+            cudaMalloc(&dev_geoms, n * sizeof(Geom));
+            cudaMalloc(&dev_nodes, numNodes * sizeof(BvhNode));
+            cudaMalloc(&dev_primIndices, n * sizeof(int));
+            capacity = n;
+        }
+    }
+
+    void freeScratch()
+    {
+        cudaFree(dev_primBounds);
+        cudaFree(dev_sceneBounds);
+        cudaFree(dev_codes);
+        cudaFree(dev_order);
+        cudaFree(dev_leftChild);
+        cudaFree(dev_rightChild);
+        cudaFree(dev_parent);
+        cudaFree(dev_leafCount);
+        cudaFree(dev_bounds);
+        cudaFree(dev_arrivals);
+        cudaFree(dev_preorder);
+        cudaFree(dev_geoms);
+        cudaFree(dev_nodes);
+        cudaFree(dev_primIndices);
+        dev_primBounds = dev_sceneBounds = dev_bounds = NULL;
+        dev_codes = dev_order = dev_leftChild = dev_rightChild = NULL;
+        dev_parent = dev_leafCount = dev_arrivals = dev_preorder = NULL;
+        dev_geoms = NULL;
+        dev_nodes = NULL;
+        dev_primIndices = NULL;
+        capacity = 0;
+    }
+
+    __global__ void kernPrimBounds(int n, const Geom* geoms, AABB* primBounds)
+    {
+        int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+        if (index < n)
+        {
+            primBounds[index] = geomBounds(geoms[index]);
+        }
+    }
+
+    // Bounds of every centroid, reduced by a single block
+    __global__ void kernCentroidBounds(int n, const AABB* primBounds, AABB* sceneBounds)
+    {
+        __shared__ AABB partial[blockSize];
+        AABB b = AABB::empty();
+        for (int i = threadIdx.x; i < n; i += blockDim.x)
+        {
+            b.grow(primBounds[i].center());
+        }
+        partial[threadIdx.x] = b;
+        __syncthreads();
+        for (int stride = blockDim.x / 2; stride > 0; stride /= 2)
+        {
+            if (threadIdx.x < stride)
+            {
+                partial[threadIdx.x].grow(partial[threadIdx.x + stride]);
+            }
+            __syncthreads();
+        }
+        if (threadIdx.x == 0)
+        {
+            *sceneBounds = partial[0];
+        }
+    }
+
+    __global__ void kernMortonCodes(int n, const AABB* primBounds, const AABB* sceneBounds, int* codes, int* order)
+    {
+        int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+        if (index < n)
+        {
+            codes[index] = mortonCode(primBounds[index].center(), *sceneBounds);
+            order[index] = index;
+        }
+    }
+
+    __global__ void kernInnerNodes(int n, const int* codes, int* leftChild, int* rightChild, int* parent, int* leafCount)
+    {
+        int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+        if (index < n - 1)
+        {
+            buildInnerNode(index, codes, n, leftChild, rightChild, parent, leafCount);
+        }
+    }
+
+    // Bypasses L1, which is not coherent with writes from other blocks
+    __device__ AABB loadBounds(const AABB* bounds)
+    {
+        const volatile float* f = (const volatile float*)bounds;
+        AABB b;
+        b.min = glm::vec3(f[0], f[1], f[2]);
+        b.max = glm::vec3(f[3], f[4], f[5]);
+        return b;
+    }
+
+    __global__ void kernFitBounds(
+        int n,
+        const int* order,
+        const AABB* primBounds,
+        const int* leftChild,
+        const int* rightChild,
+        const int* parent,
+        int* arrivals,
+        AABB* bounds)
+    {
+        int k = (blockIdx.x * blockDim.x) + threadIdx.x;
+        if (k >= n)
+        {
+            return;
+        }
+        int node = n - 1 + k;
+        bounds[node] = primBounds[order[k]];
+        node = parent[node];
+        while (node >= 0)
+        {
+            // Publish this child's bounds before the sibling can see the count
+            __threadfence();
+            if (atomicAdd(&arrivals[node], 1) == 0)
+            {
+                return;
+            }
+            AABB b = loadBounds(&bounds[leftChild[node]]);
+            b.grow(loadBounds(&bounds[rightChild[node]]));
+            bounds[node] = b;
+            node = parent[node];
+        }
+    }
+
+    __global__ void kernPreorder(int n, int numNodes, const int* leftChild, const int* parent, const int* leafCount, int* preorder)
+    {
+        int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+        if (index < numNodes)
+        {
+            int depth;
+            preorder[index] = preorderIndex(index, n, leftChild, parent, leafCount, depth);
+        }
+    }
+
+    __global__ void kernEmitNodes(
+        int n,
+        const int* order,
+        const int* rightChild,
+        const int* preorder,
+        const AABB* bounds,
+        BvhNode* nodes,
+        int* primIndices)
+    {
+        int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+        if (index < 2 * n - 1)
+        {
+            emitNode(index, n, order, rightChild, preorder, bounds, nodes, primIndices);
+        }
+    }
+
+    void buildDevice(int n, const Geom* geoms, BvhNode* nodes, int* primIndices)
+    {
+        if (n <= 0)
+        {
+            return;
+        }
+        reserve(n);
+        const int numNodes = 2 * n - 1;
+        dim3 primBlocks((n + blockSize - 1) / blockSize);
+        dim3 nodeBlocks((numNodes + blockSize - 1) / blockSize);
+
+        kernPrimBounds<<<primBlocks, blockSize>>>(n, geoms, dev_primBounds);
+        kernCentroidBounds<<<1, blockSize>>>(n, dev_primBounds, dev_sceneBounds);
+        kernMortonCodes<<<primBlocks, blockSize>>>(n, dev_primBounds, dev_sceneBounds, dev_codes, dev_order);
+        StreamCompaction::Radix::sortByKey(n, MORTON_BITS, dev_codes, dev_order);
+
+        cudaMemset(dev_parent, 0xff, numNodes * sizeof(int));
+        cudaMemset(dev_arrivals, 0, n * sizeof(int));
+        if (n > 1)
+        {
+            dim3 innerBlocks((n - 1 + blockSize - 1) / blockSize);
+            kernInnerNodes<<<innerBlocks, blockSize>>>(n, dev_codes, dev_leftChild, dev_rightChild, dev_parent, dev_leafCount);
+        }
+        kernFitBounds<<<primBlocks, blockSize>>>(n, dev_order, dev_primBounds,
+            dev_leftChild, dev_rightChild, dev_parent, dev_arrivals, dev_bounds);
+        kernPreorder<<<nodeBlocks, blockSize>>>(n, numNodes, dev_leftChild, dev_parent, dev_leafCount, dev_preorder);
+        kernEmitNodes<<<nodeBlocks, blockSize>>>(n, dev_order, dev_rightChild, dev_preorder, dev_bounds, nodes, primIndices);
+        checkCUDAError("LBVH build");
+    }
+
+    // Levels in the deepest leaf of a tree in depth-first layout
+    static int treeDepth(const std::vector<BvhNode>& nodes)
+    {
+        int depth = 0;
+        std::vector<glm::ivec2> stack;   // node, level
+        if (!nodes.empty())
+        {
+            stack.push_back(glm::ivec2(0, 1));
+        }
+        while (!stack.empty())
+        {
+            const glm::ivec2 entry = stack.back();
+            stack.pop_back();
+            const BvhNode& node = nodes[entry.x];
+            depth = std::max(depth, entry.y);
+            if (node.primCount == 0)
+            {
+                stack.push_back(glm::ivec2(entry.x + 1, entry.y + 1));
+                stack.push_back(glm::ivec2(node.rightOrFirst, entry.y + 1));
+            }
+        }
+        return depth;
+    }
+
+    bool buildOnDevice(const std::vector<Geom>& geoms, std::vector<BvhNode>& nodes, std::vector<int>& primIndices,
+        int& depth)
+    {
+        int devices = 0;
+        if (cudaGetDeviceCount(&devices) != cudaSuccess || devices == 0)
+        {
+            return false;
+        }
+        const int n = (int)geoms.size();
+        nodes.resize(n > 0 ? 2 * n - 1 : 0);
+        primIndices.resize(n);
+        depth = 0;
+        if (n == 0)
+        {
+            return true;
+        }
+
+        reserve(n);
+        cudaMemcpy(dev_geoms, geoms.data(), n * sizeof(Geom), cudaMemcpyHostToDevice);
+        buildDevice(n, dev_geoms, dev_nodes, dev_primIndices);
+        cudaMemcpy(nodes.data(), dev_nodes, nodes.size() * sizeof(BvhNode), cudaMemcpyDeviceToHost);
+        cudaMemcpy(primIndices.data(), dev_primIndices, n * sizeof(int), cudaMemcpyDeviceToHost);
+        checkCUDAError("LBVH download");
+        depth = treeDepth(nodes);
+        return true;
+    }
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <vector>
+#include "bvh.h"
+
+class ThreadPool;
+
+/**
+ * Linear BVH builder (Karras 2012, "Maximizing Parallelism in the
+ * Construction of BVHs, Octrees, and k-d Trees").
+ *
+ * Geom centroids get 30-bit Morton codes within the scene bounds and are
+ * radix sorted. Every inner node of the binary radix tree over the sorted
+ * codes is then found independently, bounds are fitted bottom-up, and the
+ * tree is written out in the same depth-first BvhNode layout as the SAH
+ * builder, one primitive per leaf. It traces slower than a SAH tree but
+ * builds in a few linear passes, for scenes that move every frame.
+ *
+ * The host and device versions run the same steps and give the same tree,
+ * up to the last bit of the bounds where the device contracts to FMAs.
+ */
+namespace Lbvh
+{
+    // Build on the host, each step spread over `pool` if there is one.
+    // `depth` is set to the levels in the deepest leaf.
+    void build(const std::vector<Geom>& geoms, ThreadPool* pool,
+        std::vector<BvhNode>& nodes, std::vector<int>& primIndices, int& depth);
+
+    // Build on the device over the `n` geoms in device memory. `nodes` has
+    // room for 2n - 1 nodes and `primIndices` for n entries.
+    void buildDevice(int n, const Geom* geoms, BvhNode* nodes, int* primIndices);
+
+    /**
+     * Build on the device and read the tree back, so that refits and the CPU
+     * backend work on exactly the tree the device built. The scratch memory
+     * stays allocated for the next build.
+     *
+     * @return  false, leaving the outputs alone, if there is no device.
+     */
+    bool buildOnDevice(const std::vector<Geom>& geoms, std::vector<BvhNode>& nodes, std::vector<int>& primIndices,
+        int& depth);
+
+    // Release the cached device scratch memory.
+    void freeScratch();
+}
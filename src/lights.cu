@@ -0,0 +1,620 @@
+#include "lights.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <glm/gtc/matrix_inverse.hpp>
+
+#include "bvh.h"
+#include "utilities.h"
+
+// Steps in polar angle of the quadrature over a non-uniformly scaled sphere;
+// twice as many go around
+#define EMITTER_AREA_STEPS 64
+// The largest stretch the quadrature finds is raised by this share, as the
+// true maximum may lie between its points
+#define EMITTER_STRETCH_SLACK 1.01f
+// Number of bins the light tree's split is evaluated on, per axis
+#define LIGHT_TREE_NUM_BINS 12
+// Distances to a node count as at least this share of the radius of its
+// bounding sphere, so a point near its center does not make it arbitrarily
+// important; clamping to the whole radius hides which nearby light matters
+#define LIGHT_TREE_MIN_DISTANCE 0.1f
+
+namespace
+{
+    // Whether the columns of `m` are orthogonal and of one length
+    bool uniformlyScaled(const glm::mat3& m)
+    {
+        const float length = glm::length(m[0]);
+        for (int i = 0; i < 3; i++)
+        {
+            if (std::abs(glm::length(m[i]) - length) > 1e-4f * length
+                || std::abs(glm::dot(m[i], m[(i + 1) % 3])) > 1e-4f * length * length)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Area of the transformed sphere of diameter 1, and the largest factor
+     * by which the normal matrix stretches a unit normal. The area element
+     * of the sphere grows by |det| * |normalMatrix * n| under the transform,
+     * which is integrated over the directions with the midpoint rule.
+     */
+    void sphereArea(const Emitter& e, float& area, float& maxStretch)
+    {
+        const double dTheta = PI / EMITTER_AREA_STEPS;
+        const double dPhi = TWO_PI / (2 * EMITTER_AREA_STEPS);
+        double sum = 0.0;
+        maxStretch = 0.0f;
+        for (int i = 0; i < EMITTER_AREA_STEPS; i++)
+        {
+            const double theta = (i + 0.5) * dTheta;
+            for (int j = 0; j < 2 * EMITTER_AREA_STEPS; j++)
+            {
+                const double phi = (j + 0.5) * dPhi;
+                const glm::vec3 n((float)(std::sin(theta) * std::cos(phi)), (float)(std::sin(theta) * std::sin(phi)),
+                    (float)std::cos(theta));
+                const float stretch = glm::length(e.normalMatrix * n);
+                sum += stretch * std::sin(theta) * dTheta * dPhi;
+                maxStretch = glm::max(maxStretch, stretch);
+            }
+        }
+        area = (float)(std::abs(glm::determinant(e.linear)) * 0.25 * sum);
+        maxStretch *= EMITTER_STRETCH_SLACK;
+    }
+
+    // Uniformly distributed unit vector
+    __host__ __device__ glm::vec3 uniformSphereDirection(Sampler& rng)
+    {
+        const float z = 1.0f - 2.0f * rng.next();
+        const float r = sqrt(glm::max(0.0f, 1.0f - z * z));
+        const float phi = TWO_PI * rng.next();
+        return glm::vec3(r * cos(phi), r * sin(phi), z);
+    }
+
+    float luminance(const glm::vec3& c)
+    {
+        return 0.2126f * c.r + 0.7152f * c.g + 0.0722f * c.b;
+    }
+
+    /**
+     * Normals within thetaO of `axis`, each emitting up to thetaE from the
+     * normal. Cubes and spheres emit from every side, so their cones hold
+     * every direction.
+     */
+    struct NormalCone
+    {
+        glm::vec3 axis;
+        float thetaO;
+        float thetaE;
+
+        static NormalCone all()
+        {
+            NormalCone c;
+            c.axis = glm::vec3(0.0f, 0.0f, 1.0f);
+            c.thetaO = PI;
+            c.thetaE = 0.5f * PI;
+            return c;
+        }
+
+        // Smallest cone holding both (Conty Estevez and Kulla, 2018)
+        static NormalCone merge(const NormalCone& a, const NormalCone& b)
+        {
+            NormalCone c = a;
+            c.thetaE = glm::max(a.thetaE, b.thetaE);
+            const float thetaD = std::acos(glm::clamp(glm::dot(a.axis, b.axis), -1.0f, 1.0f));
+            if (glm::min(thetaD + b.thetaO, PI) <= a.thetaO)
+            {
+                return c;
+            }
+            if (glm::min(thetaD + a.thetaO, PI) <= b.thetaO)
+            {
+                c.axis = b.axis;
+                c.thetaO = b.thetaO;
+                return c;
+            }
+            c.thetaO = 0.5f * (a.thetaO + thetaD + b.thetaO);
+            const glm::vec3 turn = glm::cross(a.axis, b.axis);
+            if (c.thetaO >= PI || glm::length(turn) < 1e-6f)
+            {
+                c.thetaO = PI;
+                return c;
+            }
+            // Turn a's axis towards b's by the part of the new angle a lacks
+            const float thetaR = c.thetaO - a.thetaO;
+            const glm::vec3 k = glm::normalize(turn);
+            c.axis = glm::normalize(a.axis * std::cos(thetaR) + glm::cross(k, a.axis) * std::sin(thetaR));
+            return c;
+        }
+
+        // Solid angle the cone emits into, weighted by the cosine to each
+        // normal: the orientation measure of the SAOH
+        float measure() const
+        {
+            const float thetaW = glm::min(thetaO + thetaE, PI);
+            return TWO_PI * (1.0f - std::cos(thetaO)) + 0.5f * PI * (2.0f * thetaW * std::sin(thetaO)
+                - std::cos(thetaO - 2.0f * thetaW) - 2.0f * thetaO * std::sin(thetaO) + std::cos(thetaO));
+        }
+    };
+
+    // Bounds, power and cone of a set of emitters
+    struct LightBounds
+    {
+        AABB bounds;
+        float power;
+        NormalCone cone;
+        bool empty;
+
+        LightBounds() : bounds(AABB::empty()), power(0.0f), empty(true)
+        {
+        }
+
+        void grow(const LightBounds& b)
+        {
+            if (b.empty)
+            {
+                return;
+            }
+            bounds.grow(b.bounds);
+            power += b.power;
+            cone = empty ? b.cone : NormalCone::merge(cone, b.cone);
+            empty = false;
+        }
+
+        // Surface area orientation heuristic of the set, without the
+        // regularization along the split axis
+        float cost() const
+        {
+            return empty ? 0.0f : power * bounds.surfaceArea() * cone.measure();
+        }
+    };
+
+    struct LightBuild
+    {
+        std::vector<Emitter>& emitters;
+        std::vector<LightNode>& nodes;
+        std::vector<LightBounds> leaves;    // per emitter
+        std::vector<glm::vec3> centroids;   // per emitter
+        std::vector<int> order;
+
+        LightBuild(std::vector<Emitter>& e, std::vector<LightNode>& n) : emitters(e), nodes(n)
+        {
+        }
+    };
+
+    int lightBin(float centroid, float lo, float scale)
+    {
+        return std::min(LIGHT_TREE_NUM_BINS - 1, (int)((centroid - lo) * scale));
+    }
+
+    /**
+     * Split order[first, first + count) at the cheapest bin boundary of the
+     * surface area orientation heuristic, with the cost of an axis raised by
+     * how much shorter the node is along it than along its longest axis.
+     * Falls back to the median centroid on the longest axis if every
+     * centroid lands in one bin. Returns where the right side starts.
+     */
+    int splitLights(LightBuild& build, int first, int count, const AABB& bounds)
+    {
+        AABB centroidBounds = AABB::empty();
+        for (int i = first; i < first + count; i++)
+        {
+            centroidBounds.grow(build.centroids[build.order[i]]);
+        }
+        const glm::vec3 extent = bounds.max - bounds.min;
+        const float maxExtent = glm::max(extent.x, glm::max(extent.y, extent.z));
+
+        int bestAxis = -1;
+        int bestBin = 0;
+        float bestCost = FLT_MAX;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            const float lo = centroidBounds.min[axis];
+            const float width = centroidBounds.max[axis] - lo;
+            if (width <= 0.0f)
+            {
+                continue;
+            }
+            const float scale = LIGHT_TREE_NUM_BINS / width;
+            LightBounds bins[LIGHT_TREE_NUM_BINS];
+            for (int i = first; i < first + count; i++)
+            {
+                const int e = build.order[i];
+                bins[lightBin(build.centroids[e][axis], lo, scale)].grow(build.leaves[e]);
+            }
+
+            float rightCost[LIGHT_TREE_NUM_BINS];
+            LightBounds right;
+            for (int b = LIGHT_TREE_NUM_BINS - 1; b > 0; b--)
+            {
+                right.grow(bins[b]);
+                rightCost[b] = right.empty ? -1.0f : right.cost();
+            }
+            const float regularize = extent[axis] > 0.0f ? maxExtent / extent[axis] : 1.0f;
+            LightBounds left;
+            for (int b = 1; b < LIGHT_TREE_NUM_BINS; b++)
+            {
+                left.grow(bins[b - 1]);
+                if (left.empty || rightCost[b] < 0.0f)
+                {
+                    continue;
+                }
+                const float cost = regularize * (left.cost() + rightCost[b]);
+                if (cost < bestCost)
+                {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestBin = b;
+                }
+            }
+        }
+
+        int* begin = build.order.data() + first;
+        int* end = begin + count;
+        if (bestAxis >= 0)
+        {
+            const float lo = centroidBounds.min[bestAxis];
+            const float scale = LIGHT_TREE_NUM_BINS / (centroidBounds.max[bestAxis] - lo);
+            return (int)(std::partition(begin, end,
+                [&](int e)
+                {
+                    return lightBin(build.centroids[e][bestAxis], lo, scale) < bestBin;
+                }) - build.order.data());
+        }
+        const glm::vec3 spread = centroidBounds.max - centroidBounds.min;
+        const int axis = spread.x >= spread.y && spread.x >= spread.z ? 0 : spread.y >= spread.z ? 1 : 2;
+        int* mid = begin + count / 2;
+        std::nth_element(begin, mid, end,
+            [&](int a, int b)
+            {
+                return build.centroids[a][axis] < build.centroids[b][axis];
+            });
+        return (int)(mid - build.order.data());
+    }
+
+    // Append the subtree over order[first, first + count) and return its root
+    int buildLightNode(LightBuild& build, int first, int count, int parent)
+    {
+        LightBounds all;
+        for (int i = first; i < first + count; i++)
+        {
+            all.grow(build.leaves[build.order[i]]);
+        }
+        const int index = (int)build.nodes.size();
+        LightNode node;
+        node.boundsMin = all.bounds.min;
+        node.boundsMax = all.bounds.max;
+        node.power = all.power;
+        node.axis = all.cone.axis;
+        node.cosThetaO = std::cos(all.cone.thetaO);
+        node.cosThetaE = std::cos(all.cone.thetaE);
+        node.right = -1;
+        node.emitter = -1;
+        node.parent = parent;
+        build.nodes.push_back(node);
+
+        if (count == 1)
+        {
+            build.nodes[index].emitter = build.order[first];
+            build.emitters[build.order[first]].node = index;
+            return index;
+        }
+        const int mid = splitLights(build, first, count, all.bounds);
+        buildLightNode(build, first, mid - first, index);
+        const int right = buildLightNode(build, mid, first + count - mid, index);
+        build.nodes[index].right = right;
+        return index;
+    }
+
+    // cos(max(0, a - b)) and sin(max(0, a - b)) from the sines and cosines
+    // of angles a and b in [0, pi]
+    __host__ __device__ float cosSubClamped(float sinA, float cosA, float sinB, float cosB)
+    {
+        return cosA > cosB ? 1.0f : cosA * cosB + sinA * sinB;
+    }
+
+    __host__ __device__ float sinSubClamped(float sinA, float cosA, float sinB, float cosB)
+    {
+        return cosA > cosB ? 0.0f : sinA * cosB - cosA * sinB;
+    }
+
+    /**
+     * How much the emitters below `node` may light `point`: the power over
+     * the squared distance to the node, times the cosine of the smallest
+     * angle between the direction to the point and a normal of the cone,
+     * once the node's bounding sphere is taken into account. Zero if that
+     * angle is past where the emitters emit. Inside the bounding sphere
+     * every direction counts.
+     */
+    __host__ __device__ float lightImportance(const LightNode& node, const glm::vec3& point)
+    {
+        const glm::vec3 diagonal = node.boundsMax - node.boundsMin;
+        const glm::vec3 toPoint = point - 0.5f * (node.boundsMin + node.boundsMax);
+        const float radius2 = 0.25f * glm::dot(diagonal, diagonal);
+        const float d2 = glm::dot(toPoint, toPoint);
+        const float clamped = glm::max(d2, LIGHT_TREE_MIN_DISTANCE * LIGHT_TREE_MIN_DISTANCE * radius2);
+        if (d2 <= radius2)
+        {
+            return clamped > 0.0f ? node.power / clamped : node.power;
+        }
+
+        float cosP = 1.0f;
+        if (node.cosThetaO > -1.0f)
+        {
+            const float cosW = glm::dot(node.axis, toPoint) / sqrt(d2);
+            const float sinW = sqrt(glm::max(0.0f, 1.0f - cosW * cosW));
+            const float sinO = sqrt(glm::max(0.0f, 1.0f - node.cosThetaO * node.cosThetaO));
+            const float cosX = cosSubClamped(sinW, cosW, sinO, node.cosThetaO);
+            const float sinX = sinSubClamped(sinW, cosW, sinO, node.cosThetaO);
+            const float sinB2 = radius2 / d2;
+            cosP = cosSubClamped(sinX, cosX, sqrt(sinB2), sqrt(1.0f - sinB2));
+            if (cosP <= node.cosThetaE)
+            {
+                return 0.0f;
+            }
+        }
+        return node.power * cosP / clamped;
+    }
+
+    // Chance of going to the left child of inner node `node` from `point`,
+    // or -1 if neither child can light it
+    __host__ __device__ float leftChance(const EmitterView& lights, int node, const glm::vec3& point)
+    {
+        const float left = lightImportance(lights.nodes[node + 1], point);
+        const float right = lightImportance(lights.nodes[lights.nodes[node].right], point);
+        return left + right > 0.0f ? left / (left + right) : -1.0f;
+    }
+
+    // Chance of picking emitter `e` from `point`
+    __host__ __device__ float selectPdf(const EmitterView& lights, int e, const glm::vec3& point)
+    {
+        if (lights.numNodes == 0)
+        {
+            return lights.emitters[e].cdf - (e > 0 ? lights.emitters[e - 1].cdf : 0.0f);
+        }
+        float pdf = 1.0f;
+        for (int node = lights.emitters[e].node; lights.nodes[node].parent >= 0; node = lights.nodes[node].parent)
+        {
+            const int parent = lights.nodes[node].parent;
+            const float chance = leftChance(lights, parent, point);
+            if (chance < 0.0f)
+            {
+                return 0.0f;
+            }
+            pdf *= node == parent + 1 ? chance : 1.0f - chance;
+        }
+        return pdf;
+    }
+}
+
+EmitterTable::EmitterTable() : totalPower(0.0f), unsampled(0)
+{
+}
+
+void EmitterTable::build(const std::vector<Geom>& geoms, const std::vector<Material>& materials)
+{
+    emitters.clear();
+    nodes.clear();
+    totalPower = 0.0f;
+    unsampled = 0;
+    for (size_t i = 0; i < geoms.size(); i++)
+    {
+        const Geom& geom = geoms[i];
+        const Material& material = materials[geom.materialid];
+        if (material.emittance <= 0.0f)
+        {
+            continue;
+        }
+        if (geom.type == MESH)
+        {
+            unsampled++;
+            continue;
+        }
+
+        Emitter e;
+        e.linear = glm::mat3(geom.transform);
+        e.normalMatrix = glm::inverseTranspose(e.linear);
+        e.center = glm::vec3(geom.transform[3]);
+        e.emission = material.color * material.emittance;
+        e.type = geom.type;
+        e.geom = (int)i;
+        e.node = -1;
+        e.maxStretch = 0.0f;
+        if (geom.type == CUBE)
+        {
+            // Two faces of area |c_j x c_k| across each axis i
+            float faces[3];
+            for (int axis = 0; axis < 3; axis++)
+            {
+                faces[axis] = 2.0f * glm::length(glm::cross(e.linear[(axis + 1) % 3], e.linear[(axis + 2) % 3]));
+            }
+            e.area = faces[0] + faces[1] + faces[2];
+            e.faceCdf[0] = faces[0] / e.area;
+            e.faceCdf[1] = (faces[0] + faces[1]) / e.area;
+        }
+        else if (uniformlyScaled(e.linear))
+        {
+            const float diameter = glm::length(e.linear[0]);
+            e.area = PI * diameter * diameter;
+        }
+        else
+        {
+            sphereArea(e, e.area, e.maxStretch);
+        }
+        e.power = luminance(e.emission) * e.area;
+        if (e.power <= 0.0f)
+        {
+            continue;
+        }
+        totalPower += e.power;
+        e.cdf = totalPower;
+        emitters.push_back(e);
+    }
+
+    for (size_t i = 0; i < emitters.size(); i++)
+    {
+        emitters[i].cdf = i + 1 < emitters.size() ? emitters[i].cdf / totalPower : 1.0f;
+    }
+    buildTree(geoms);
+}
+
+void EmitterTable::buildTree(const std::vector<Geom>& geoms)
+{
+    nodes.clear();
+    if (emitters.empty())
+    {
+        return;
+    }
+
+    LightBuild tree(emitters, nodes);
+    tree.leaves.resize(emitters.size());
+    tree.centroids.resize(emitters.size());
+    tree.order.resize(emitters.size());
+    for (size_t i = 0; i < emitters.size(); i++)
+    {
+        LightBounds& leaf = tree.leaves[i];
+        leaf.bounds = geomBounds(geoms[emitters[i].geom]);
+        leaf.power = emitters[i].power;
+        leaf.cone = NormalCone::all();
+        leaf.empty = false;
+        tree.centroids[i] = leaf.bounds.center();
+        tree.order[i] = (int)i;
+    }
+    nodes.reserve(2 * emitters.size() - 1);
+    buildLightNode(tree, 0, (int)emitters.size(), -1);
+}
+
+EmitterView EmitterTable::view(bool tree) const
+{
+    EmitterView v;
+    v.emitters = emitters.data();
+    v.nodes = tree ? nodes.data() : NULL;
+    v.count = (int)emitters.size();
+    v.numNodes = tree ? (int)nodes.size() : 0;
+    return v;
+}
+
+__host__ __device__ bool sampleEmitter(
+    const EmitterView& lights,
+    const glm::vec3& shadingPoint,
+    Sampler& rng,
+    LightSample& sample)
+{
+    if (lights.count == 0)
+    {
+        return false;
+    }
+    int index;
+    float selected = 1.0f;
+    if (lights.numNodes == 0)
+    {
+        // First emitter whose cdf reaches u
+        const float u = rng.next();
+        int lo = 0;
+        int hi = lights.count - 1;
+        while (lo < hi)
+        {
+            const int mid = (lo + hi) / 2;
+            if (lights.emitters[mid].cdf < u)
+            {
+                lo = mid + 1;
+            }
+            else
+            {
+                hi = mid;
+            }
+        }
+        index = lo;
+        selected = selectPdf(lights, index, shadingPoint);
+    }
+    else
+    {
+        // Down the tree, each child in proportion to its importance
+        int node = 0;
+        while (lights.nodes[node].emitter < 0)
+        {
+            const float chance = leftChance(lights, node, shadingPoint);
+            if (chance < 0.0f)
+            {
+                return false;
+            }
+            if (rng.next() < chance)
+            {
+                node = node + 1;
+                selected *= chance;
+            }
+            else
+            {
+                node = lights.nodes[node].right;
+                selected *= 1.0f - chance;
+            }
+        }
+        index = lights.nodes[node].emitter;
+    }
+    const Emitter& e = lights.emitters[index];
+    if (selected <= 0.0f)
+    {
+        return false;
+    }
+
+    glm::vec3 objectPoint;
+    glm::vec3 objectNormal;
+    if (e.type == CUBE)
+    {
+        const float f = rng.next();
+        const int axis = f < e.faceCdf[0] ? 0 : f < e.faceCdf[1] ? 1 : 2;
+        const float side = rng.next() < 0.5f ? -1.0f : 1.0f;
+        objectNormal = glm::vec3(0.0f);
+        objectNormal[axis] = side;
+        objectPoint = 0.5f * objectNormal;
+        objectPoint[(axis + 1) % 3] = rng.next() - 0.5f;
+        objectPoint[(axis + 2) % 3] = rng.next() - 0.5f;
+    }
+    else
+    {
+        // Keeping a direction in proportion to the area element there makes
+        // the points uniform by area, as the pdf below assumes. maxStretch
+        // bounds the element, so a try is kept at least as often as the
+        // shortest axis is long relative to the longest.
+        objectNormal = uniformSphereDirection(rng);
+        while (e.maxStretch > 0.0f && rng.next() * e.maxStretch > glm::length(e.normalMatrix * objectNormal))
+        {
+            objectNormal = uniformSphereDirection(rng);
+        }
+        objectPoint = 0.5f * objectNormal;
+    }
+
+    sample.point = e.center + e.linear * objectPoint;
+    sample.normal = glm::normalize(e.normalMatrix * objectNormal);
+    sample.emission = e.emission;
+    sample.pdf = selected / e.area;
+    return true;
+}
+
+__host__ __device__ float emitterAreaPdf(const EmitterView& lights, int geom, const glm::vec3& shadingPoint)
+{
+    // Emitters are in the order of their geoms
+    int lo = 0;
+    int hi = lights.count - 1;
+    while (lo < hi)
+    {
+        const int mid = (lo + hi) / 2;
+        if (lights.emitters[mid].geom < geom)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    if (lights.count == 0 || lights.emitters[lo].geom != geom)
+    {
+        return 0.0f;
+    }
+    return selectPdf(lights, lo, shadingPoint) / lights.emitters[lo].area;
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <vector>
+#include "glm/glm.hpp"
+#include "sampler.h"
+#include "sceneStructs.h"
+
+// Shadow rays stop this share of the distance short of the light, so they
+// do not hit the point they were aimed at
+#define SHADOW_RAY_SHORTEN 1e-3f
+
+/**
+ * An emissive cube or sphere that light sampling can pick a point on. The
+ * shape is the unit cube or the sphere of diameter 1 in object space; the
+ * linear part of its transform and the inverse transpose of that map points
+ * and normals to world space.
+ */
+struct Emitter
+{
+    glm::mat3 linear;
+    glm::mat3 normalMatrix;
+    glm::vec3 center;
+    glm::vec3 emission;     // material color times emittance
+    int type;               // CUBE or SPHERE
+    int geom;               // index in the scene's geoms
+    int node;               // leaf of the light tree that holds it
+    float area;             // world space
+    float power;            // luminance of the emission times the area
+    float cdf;              // power of this emitter and every one before it, over the total
+    float faceCdf[2];       // CUBE: share of the area on the x faces, and on the x and y faces
+    float maxStretch;       // SPHERE: largest |normalMatrix * n| over unit n, or 0 if uniformly scaled
+};
+
+/**
+ * One node of the light tree: the bounds, power and normal cone of the
+ * emitters below it. The cone holds every normal of their surfaces within
+ * cosThetaO of `axis`; each point emits up to cosThetaE from its normal.
+ * Nodes are in depth-first order like BvhNode, and every leaf holds one
+ * emitter.
+ */
+struct LightNode
+{
+    glm::vec3 boundsMin;
+    float power;
+    glm::vec3 boundsMax;
+    float cosThetaO;
+    glm::vec3 axis;
+    float cosThetaE;
+    int right;              // inner: index of the right child
+    int emitter;            // leaf: index in the emitters, -1 for inner nodes
+    int parent;             // -1 for the root
+};
+
+/**
+ * Plain pointers to the emitters and light tree of an EmitterTable, in host
+ * or device memory, passed to the shading routines by value. Without nodes
+ * emitters are picked from the flat power CDF. A value-initialized view has
+ * no emitters and turns light sampling off.
+ */
+struct EmitterView
+{
+    const Emitter* emitters;
+    const LightNode* nodes;
+    int count;
+    int numNodes;
+};
+
+/**
+ * A point picked on an emitter for a shadow ray
+ */
+struct LightSample
+{
+    glm::vec3 point;
+    glm::vec3 normal;       // outwards, unit length
+    glm::vec3 emission;
+    float pdf;              // density of picking the point, per unit area
+};
+
+/**
+ * The emissive geoms of a scene, for next-event estimation. An emitter is
+ * picked either in proportion to its power, or by walking the light tree
+ * from the root towards the children that matter most at the shading point
+ * (Conty Estevez and Kulla, 2018); the point on it is then uniform by area.
+ * Either way the density of a point depends only on which emitter it is on
+ * and where it is seen from, so a path that hits a light by chance can weigh
+ * its emission against light sampling.
+ */
+class EmitterTable
+{
+public:
+    EmitterTable();
+
+    /**
+     * Rebuild from the geoms whose material emits. Meshes cannot be sampled
+     * and are left out, so they are only found by chance: their emitter pdf
+     * is 0 and bounces that hit them keep their full weight. `unsampled`
+     * counts them.
+     */
+    void build(const std::vector<Geom>& geoms, const std::vector<Material>& materials);
+
+    // Rebuild the light tree over the emitters, from the geoms they were
+    // built from; build() does this already
+    void buildTree(const std::vector<Geom>& geoms);
+
+    // Host view, valid until the next build; with `tree` false it samples
+    // from the flat power CDF
+    EmitterView view(bool tree = true) const;
+
+    std::vector<Emitter> emitters;      // in the order of their geoms
+    std::vector<LightNode> nodes;
+    float totalPower;
+    int unsampled;          // emissive MESH geoms left out of the table
+};
+
+/**
+ * Pick an emitter as seen from `shadingPoint` and a point on it uniformly
+ * by area. Cubes pick a face by area, then a point on it; spheres pick a
+ * direction uniformly and, if the sphere is scaled unevenly, keep it with a
+ * probability proportional to how much the transform stretches the surface
+ * there.
+ *
+ * @return  false if `lights` has no emitters, or none can light the point.
+ */
+__host__ __device__ bool sampleEmitter(
+    const EmitterView& lights,
+    const glm::vec3& shadingPoint,
+    Sampler& rng,
+    LightSample& sample);
+
+/**
+ * Density per unit area with which sampleEmitter() picks a point on the
+ * emitter of geom `geom` from `shadingPoint`: 0 if the geom is no emitter.
+ */
+__host__ __device__ float emitterAreaPdf(const EmitterView& lights, int geom, const glm::vec3& shadingPoint);
+
+/**
+ * Convert a density per unit area on a light to one per solid angle as seen
+ * from `distance` away with `cosLight` between the light's normal and the
+ * direction to the viewer.
+ */
+__host__ __device__ inline float emitterPdf(float areaPdf, float distance, float cosLight)
+{
+    return cosLight > 0.0f ? areaPdf * distance * distance / cosLight : 0.0f;
+}
+/**
+ * Power heuristic weight of a sample drawn from the strategy with density
+ * `pdf` against one with density `otherPdf` (Veach, 1997).
+ */
+__host__ __device__ inline float powerHeuristic(float pdf, float otherPdf)
+{
+    const float a = pdf * pdf;
+    const float b = otherPdf * otherPdf;
+    return a + b > 0.0f ? a / (a + b) : 0.0f;
+}
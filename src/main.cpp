@@ -1,6 +1,8 @@
 #include "main.h"
 #include "preview.h"
+#include <climits>
 #include <cstring>
+#include <sstream>
 
 static std::string startTimeString;
 
@@ -37,14 +39,223 @@ int main(int argc, char** argv)
 
     if (argc < 2)
     {
-        printf("Usage: %s SCENEFILE.json\n", argv[0]);
+        printf("Usage: %s SCENEFILE.json [--cpu] [--threads N] [--wavefront] [--sort off|on|ab] [--no-first-hit-cache] [--bench NAME] [--readback N] [--samples-per-launch N] [--roulette-depth N] [--bvh sah|lbvh|lbvh-gpu] [--bvh-nodes binary|wide] [--packets] [--ray-order off|all|D,D,...] [--no-next-event] [--no-light-tree] [--sampler pcg|minstd]\n", argv[0]);
         return 1;
     }
 
     const char* sceneFile = argv[1];
 
+    // Optional flags after the scene file
+    bool useCpu = false;
+    int cpuThreads = 0;
+    CpuPipeline cpuPipeline = CPU_PIPELINE_TILES;
+    MaterialSortMode materialSort = SORT_OFF;
+    bool cacheFirstHits = true;
+    bool packetRays = false;
+    bool nextEvent = true;
+    bool lightTree = true;
+    const char* benchmark = NULL;
+    int readbackInterval = 0;
+    int samplesPerLaunch = 0;
+    int rouletteDepth = INT_MIN;
+    int bvhBuilder = -1;
+    int wideBvh = -1;
+    long long rayOrderDepths = -1;
+    int sampler = -1;
+    for (int i = 2; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--cpu") == 0)
+        {
+            useCpu = true;
+        }
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+        {
+            cpuThreads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--wavefront") == 0)
+        {
+            cpuPipeline = CPU_PIPELINE_WAVEFRONT;
+        }
+        else if (strcmp(argv[i], "--sort") == 0 && i + 1 < argc)
+        {
+            // Material sort before shading; "ab" alternates per iteration
+            // and reports the bounce loop time of each variant.
+            const char* mode = argv[++i];
+            if (strcmp(mode, "on") == 0)
+            {
+                materialSort = SORT_ON;
+            }
+            else if (strcmp(mode, "ab") == 0)
+            {
+                materialSort = SORT_AB;
+            }
+            else if (strcmp(mode, "off") != 0)
+            {
+                printf("Unknown sort mode %s\n", mode);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc)
+        {
+            benchmark = argv[++i];
+        }
+        else if (strcmp(argv[i], "--readback") == 0 && i + 1 < argc)
+        {
+            // Download the GPU image in the background every N iterations
+            readbackInterval = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--samples-per-launch") == 0 && i + 1 < argc)
+        {
+            // Samples per pixel traced by one GPU launch, overrides the scene
+            samplesPerLaunch = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--roulette-depth") == 0 && i + 1 < argc)
+        {
+            // Bounces before Russian roulette, -1 disables it; overrides the scene
+            rouletteDepth = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--bvh") == 0 && i + 1 < argc)
+        {
+            // BVH builder, overrides the scene
+            const char* builder = argv[++i];
+            if (strcmp(builder, "sah") == 0)
+            {
+                bvhBuilder = BVH_BUILDER_SAH;
+            }
+            else if (strcmp(builder, "lbvh") == 0)
+            {
+                bvhBuilder = BVH_BUILDER_LBVH;
+            }
+            else if (strcmp(builder, "lbvh-gpu") == 0)
+            {
+                bvhBuilder = BVH_BUILDER_LBVH_GPU;
+            }
+            else
+            {
+                printf("Unknown BVH builder %s\n", builder);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--bvh-nodes") == 0 && i + 1 < argc)
+        {
+            // Binary or compressed wide BVH nodes, overrides the scene
+            const char* nodes = argv[++i];
+            if (strcmp(nodes, "binary") == 0 || strcmp(nodes, "wide") == 0)
+            {
+                wideBvh = strcmp(nodes, "wide") == 0;
+            }
+            else
+            {
+                printf("Unknown BVH node format %s\n", nodes);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--no-first-hit-cache") == 0)
+        {
+            cacheFirstHits = false;
+        }
+        else if (strcmp(argv[i], "--sampler") == 0 && i + 1 < argc)
+        {
+            // Random number generator, overrides the scene
+            const char* kind = argv[++i];
+            if (strcmp(kind, "pcg") == 0 || strcmp(kind, "minstd") == 0)
+            {
+                sampler = strcmp(kind, "pcg") == 0 ? SAMPLER_PCG : SAMPLER_MINSTD;
+            }
+            else
+            {
+                printf("Unknown sampler %s\n", kind);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--no-next-event") == 0)
+        {
+            // Find lights only by bouncing into them
+            nextEvent = false;
+        }
+        else if (strcmp(argv[i], "--no-light-tree") == 0)
+        {
+            // Pick lights by power from a flat table
+            lightTree = false;
+        }
+        else if (strcmp(argv[i], "--packets") == 0)
+        {
+            // CPU tiles: trace camera rays as 8x8 packets
+            packetRays = true;
+        }
+        else if (strcmp(argv[i], "--ray-order") == 0 && i + 1 < argc)
+        {
+            // Depths to sort paths by ray before, overrides the scene
+            const char* depths = argv[++i];
+            if (strcmp(depths, "off") == 0)
+            {
+                rayOrderDepths = 0;
+            }
+            else if (strcmp(depths, "all") == 0)
+            {
+                rayOrderDepths = 0xFFFFFFFEu;
+            }
+            else
+            {
+                rayOrderDepths = 0;
+                std::stringstream list(depths);
+                std::string depth;
+                while (std::getline(list, depth, ','))
+                {
+                    int d = atoi(depth.c_str());
+                    if (d <= 0 || d >= 32)
+                    {
+                        printf("Ray order depths must be between 1 and 31: %s\n", depths);
+                        return 1;
+                    }
+                    rayOrderDepths |= 1u << d;
+                }
+            }
+        }
+        else
+        {
+            printf("Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
     // Load scene file
     scene = new Scene(sceneFile);
+    scene->state.materialSort = materialSort;
+    scene->state.cacheFirstHits = cacheFirstHits;
+    scene->state.packetRays = packetRays;
+    scene->state.nextEvent = scene->state.nextEvent && nextEvent;
+    scene->state.lightTree = scene->state.lightTree && lightTree;
+    scene->state.readbackInterval = readbackInterval;
+    if (samplesPerLaunch > 0)
+    {
+        scene->state.samplesPerLaunch = samplesPerLaunch;
+    }
+    if (rouletteDepth != INT_MIN)
+    {
+        scene->state.rouletteDepth = rouletteDepth;
+    }
+    if (rayOrderDepths >= 0)
+    {
+        scene->state.rayOrderDepths = (unsigned int)rayOrderDepths;
+    }
+    if (sampler >= 0)
+    {
+        scene->state.sampler = (SamplerKind)sampler;
+    }
+    if ((bvhBuilder >= 0 && bvhBuilder != scene->state.bvhBuilder)
+        || (wideBvh >= 0 && (wideBvh != 0) != scene->state.wideBvh))
+    {
+        if (bvhBuilder >= 0)
+        {
+            scene->state.bvhBuilder = (BvhBuilder)bvhBuilder;
+        }
+        if (wideBvh >= 0)
+        {
+            scene->state.wideBvh = wideBvh != 0;
+        }
+        scene->buildBvh();
+    }
 
     //Create Instance for ImGUIData
     guiData = new GuiDataContainer();
@@ -72,6 +283,25 @@ int main(int argc, char** argv)
     ogLookAt = cam.lookAt;
     zoom = glm::length(cam.position - ogLookAt);
 
+    if (benchmark != NULL)
+    {
+        updateCamera();
+        if (!runBenchmark(benchmark, scene, cpuThreads))
+        {
+            printf("Unknown benchmark %s\n", benchmark);
+            return 1;
+        }
+        return 0;
+    }
+
+    // The CPU backend renders headless, so it also works on machines with
+    // neither a GPU nor a display.
+    if (useCpu)
+    {
+        runCpu(cpuThreads, cpuPipeline);
+        return 0;
+    }
+
     // Initialize CUDA and GL components
     init();
 
@@ -111,60 +341,140 @@ void saveImage()
     //img.saveHDR(filename);  // Save a Radiance HDR file
 }
 
+// The GPU image is read back on demand, so fetch it before saving
+void saveGpuImage()
+{
+    ImageSnapshot snapshot;
+    pathtraceReadImage(snapshot);
+    renderState->image.swap(snapshot.image);
+    saveImage();
+}
+
+void updateCamera()
+{
+    Camera& cam = renderState->camera;
+    cameraPosition.x = zoom * sin(phi) * sin(theta);
+    cameraPosition.y = zoom * cos(theta);
+    cameraPosition.z = zoom * cos(phi) * sin(theta);
+
+    cam.view = -glm::normalize(cameraPosition);
+    glm::vec3 v = cam.view;
+    glm::vec3 u = glm::vec3(0, 1, 0);//glm::normalize(cam.up);
+    glm::vec3 r = glm::cross(v, u);
+    cam.up = glm::cross(r, v);
+    cam.right = r;
+
+    cam.position = cameraPosition;
+    cameraPosition += cam.lookAt;
+    cam.position = cameraPosition;
+}
+
 void runCuda()
 {
     if (camchanged)
     {
         iteration = 0;
-        Camera& cam = renderState->camera;
-        cameraPosition.x = zoom * sin(phi) * sin(theta);
-        cameraPosition.y = zoom * cos(theta);
-        cameraPosition.z = zoom * cos(phi) * sin(theta);
-
-        cam.view = -glm::normalize(cameraPosition);
-        glm::vec3 v = cam.view;
-        glm::vec3 u = glm::vec3(0, 1, 0);//glm::normalize(cam.up);
-        glm::vec3 r = glm::cross(v, u);
-        cam.up = glm::cross(r, v);
-        cam.right = r;
-
-        cam.position = cameraPosition;
-        cameraPosition += cam.lookAt;
-        cam.position = cameraPosition;
+        updateCamera();
         camchanged = false;
     }
 
     // Map OpenGL buffer object for writing from CUDA on a single GPU
     // No data is moved (Win & Linux). When mapped to CUDA, OpenGL should not use this buffer
 
+    // Geoms moved with Scene::setGeomTransform() restart the render, which
+    // uploads just the refitted ranges unless the BVH had to be rebuilt
+    if (scene->updateGeoms() || !scene->dirtyGeomRanges.empty())
+    {
+        iteration = 0;
+    }
+
+    // Restarting only clears the image; buffers and scene data are kept
     if (iteration == 0)
     {
-        pathtraceFree();
         pathtraceInit(scene);
     }
 
     if (iteration < renderState->iterations)
     {
         uchar4* pbo_dptr = NULL;
-        iteration++;
+        int samples = glm::min(renderState->samplesPerLaunch, (int)renderState->iterations - iteration);
         cudaGLMapBufferObject((void**)&pbo_dptr, pbo);
 
         // execute the kernel
         int frame = 0;
-        pathtrace(pbo_dptr, frame, iteration);
+        pathtrace(pbo_dptr, frame, iteration + 1, samples);
+        iteration += samples;
 
         // unmap buffer object
         cudaGLUnmapBufferObject(pbo);
     }
     else
     {
-        saveImage();
+        saveGpuImage();
         pathtraceFree();
         cudaDeviceReset();
         exit(EXIT_SUCCESS);
     }
 }
 
+void runCpu(int numThreads, CpuPipeline pipeline)
+{
+    updateCamera();
+    pathtraceCpuInit(scene, numThreads, pipeline);
+
+    CpuRenderStats stats = pathtraceCpuStats();
+    printf("Rendering %d iterations on the CPU with %d threads\n", renderState->iterations, stats.threads);
+
+    while (iteration < renderState->iterations)
+    {
+        iteration++;
+        pathtraceCpu(iteration);
+
+        if (iteration % 100 == 0 || iteration == renderState->iterations)
+        {
+            stats = pathtraceCpuStats();
+            double raysPerSec = stats.rays / stats.seconds;
+            printf("%5d iterations | %.2f Mrays/s | %.2f Mrays/s/thread | %d tasks stolen\n",
+                iteration, raysPerSec * 1e-6, raysPerSec * 1e-6 / stats.threads, stats.steals);
+        }
+    }
+
+    printf("Active paths per depth in the last iteration:\n");
+    for (size_t depth = 0; depth < stats.activePaths.size(); depth++)
+    {
+        printf("  depth %2d: %d\n", (int)depth, stats.activePaths[depth]);
+    }
+    printf("Average path length: %.2f segments (DEPTH %d, Russian roulette from bounce %d)\n",
+        utilityCore::averagePathLength(stats.activePaths), renderState->traceDepth, renderState->rouletteDepth);
+
+    if (pipeline == CPU_PIPELINE_WAVEFRONT)
+    {
+        printf("Average time per iteration by wavefront stage:\n");
+        for (int i = 0; i < NUM_WAVEFRONT_STAGES; i++)
+        {
+            printf("  %-18s %8.3f ms\n", wavefrontStageNames[i], stats.stageMs[i] / iteration);
+        }
+        const SortTimings& sort = stats.materialSort;
+        for (int sorted = 0; sorted < 2; sorted++)
+        {
+            if (sort.iterations[sorted] > 0)
+            {
+                printf("Bounce loop, %s: %8.3f ms per iteration (%d iterations)\n",
+                    sorted ? "material sorted" : "unsorted",
+                    sort.ms[sorted] / sort.iterations[sorted], sort.iterations[sorted]);
+            }
+        }
+        if (sort.iterations[0] > 0 && sort.iterations[1] > 0)
+        {
+            printf("Material sort speedup: %.2fx\n",
+                (sort.ms[0] / sort.iterations[0]) / (sort.ms[1] / sort.iterations[1]));
+        }
+    }
+
+    saveImage();
+    pathtraceCpuFree();
+}
+
 void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods)
 {
     if (action == GLFW_PRESS)
@@ -172,11 +482,11 @@ void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods
         switch (key)
         {
 	        case GLFW_KEY_ESCAPE:
-	            saveImage();
+	            saveGpuImage();
 	            glfwSetWindowShouldClose(window, GL_TRUE);
 	            break;
 	        case GLFW_KEY_S:
-	            saveImage();
+	            saveGpuImage();
 	            break;
 	        case GLFW_KEY_SPACE:
 	            camchanged = true;
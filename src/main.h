@@ -19,6 +19,8 @@
 #include "pathtrace.h"
 #include "utilities.h"
 #include "scene.h"
+#include "pathtraceCpu.h"
+#include "benchmark.h"
 
 using namespace std;
 
@@ -33,6 +35,8 @@ extern int width;
 extern int height;
 
 void runCuda();
+void updateCamera();
+void runCpu(int numThreads, CpuPipeline pipeline);
 void keyCallback(GLFWwindow *window, int key, int scancode, int action, int mods);
 void mousePositionCallback(GLFWwindow* window, double xpos, double ypos);
 void mouseButtonCallback(GLFWwindow* window, int button, int action, int mods);
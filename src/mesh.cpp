@@ -0,0 +1,268 @@
+#include "mesh.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+
+namespace
+{
+    // Position of a 1-based or negative (relative) OBJ index among `count`
+    // elements, or -1 if it is out of range
+    int objIndex(long i, int count)
+    {
+        if (i > 0 && i <= count)
+        {
+            return (int)i - 1;
+        }
+        if (i < 0 && -i <= count)
+        {
+            return count + (int)i;
+        }
+        return -1;
+    }
+
+    const char* skipSpaces(const char* p)
+    {
+        while (*p == ' ' || *p == '\t' || *p == '\r')
+        {
+            p++;
+        }
+        return p;
+    }
+
+    const char* nextLine(const char* p)
+    {
+        while (*p != '\0' && *p != '\n')
+        {
+            p++;
+        }
+        return *p == '\n' ? p + 1 : p;
+    }
+
+    glm::vec3 parseVec3(const char* p)
+    {
+        char* end;
+        glm::vec3 v;
+        for (int i = 0; i < 3; i++)
+        {
+            v[i] = strtof(p, &end);
+            p = end;
+        }
+        return v;
+    }
+}
+
+MeshSet::MeshSet() : lastLoadMs(0.0), lastBuildMs(0.0)
+{
+}
+
+int MeshSet::load(const std::string& filename, ThreadPool* pool)
+{
+    std::unordered_map<std::string, int>::const_iterator found = loaded.find(filename);
+    if (found != loaded.end())
+    {
+        return found->second;
+    }
+
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+    std::ifstream f(filename, std::ios::binary);
+    if (!f)
+    {
+        return -1;
+    }
+    std::string text((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+
+    Mesh mesh;
+    mesh.firstTriangle = (int)triangles.size();
+    mesh.firstVertex = (int)positions.size();
+
+    // Vertices are the distinct (position, normal) index pairs used by faces
+    std::vector<glm::vec3> objPositions;
+    std::vector<glm::vec3> objNormals;
+    std::unordered_map<long long, int> vertexIds;
+    std::vector<int> vertexNormals;
+    std::vector<int> face;
+    bool allNormals = true;
+    for (const char* p = text.c_str(); *p != '\0'; p = nextLine(p))
+    {
+        p = skipSpaces(p);
+        if (p[0] == 'v' && p[1] == ' ')
+        {
+            objPositions.push_back(parseVec3(p + 2));
+        }
+        else if (p[0] == 'v' && p[1] == 'n' && p[2] == ' ')
+        {
+            objNormals.push_back(parseVec3(p + 3));
+        }
+        else if (p[0] == 'f' && p[1] == ' ')
+        {
+            // Corners are v, v/vt, v//vn or v/vt/vn
+            face.clear();
+            p = skipSpaces(p + 2);
+            while (*p != '\0' && *p != '\n')
+            {
+                char* end;
+                int position = objIndex(strtol(p, &end, 10), (int)objPositions.size());
+                int normal = -1;
+                p = end;
+                if (*p == '/')
+                {
+                    strtol(p + 1, &end, 10);
+                    p = end;
+                    if (*p == '/')
+                    {
+                        normal = objIndex(strtol(p + 1, &end, 10), (int)objNormals.size());
+                        p = end;
+                    }
+                }
+                while (*p != '\0' && *p != '\n' && *p != ' ' && *p != '\t' && *p != '\r')
+                {
+                    p++;
+                }
+                p = skipSpaces(p);
+                if (position < 0)
+                {
+                    continue;
+                }
+                allNormals = allNormals && normal >= 0;
+
+                long long key = ((long long)position << 32) | (unsigned int)(normal + 1);
+                std::unordered_map<long long, int>::iterator vertex = vertexIds.find(key);
+                if (vertex == vertexIds.end())
+                {
+                    vertex = vertexIds.insert(std::make_pair(key, (int)positions.size())).first;
+                    positions.push_back(objPositions[position]);
+                    vertexNormals.push_back(normal);
+                }
+                face.push_back(vertex->second);
+            }
+            for (size_t i = 2; i < face.size(); i++)
+            {
+                triangles.push_back(glm::ivec3(face[0], face[i - 1], face[i]));
+            }
+        }
+    }
+    mesh.numTriangles = (int)triangles.size() - mesh.firstTriangle;
+    mesh.numVertices = (int)positions.size() - mesh.firstVertex;
+    if (mesh.numTriangles == 0)
+    {
+        positions.resize(mesh.firstVertex);
+        return -1;
+    }
+
+    mesh.firstNormal = -1;
+    if (allNormals && !objNormals.empty())
+    {
+        mesh.firstNormal = (int)normals.size();
+        for (int v = 0; v < mesh.numVertices; v++)
+        {
+            normals.push_back(glm::normalize(objNormals[vertexNormals[v]]));
+        }
+    }
+    std::chrono::high_resolution_clock::time_point parsed = std::chrono::high_resolution_clock::now();
+    lastLoadMs = std::chrono::duration<double, std::milli>(parsed - start).count();
+    return finishMesh(filename, mesh, pool);
+}
+
+int MeshSet::add(
+    const std::string& name,
+    const std::vector<glm::vec3>& meshPositions,
+    const std::vector<glm::vec3>& meshNormals,
+    const std::vector<glm::ivec3>& meshTriangles,
+    ThreadPool* pool)
+{
+    std::unordered_map<std::string, int>::const_iterator found = loaded.find(name);
+    if (found != loaded.end())
+    {
+        return found->second;
+    }
+    if (meshTriangles.empty())
+    {
+        return -1;
+    }
+
+    Mesh mesh;
+    mesh.firstTriangle = (int)triangles.size();
+    mesh.numTriangles = (int)meshTriangles.size();
+    mesh.firstVertex = (int)positions.size();
+    mesh.numVertices = (int)meshPositions.size();
+    mesh.firstNormal = meshNormals.size() == meshPositions.size() ? (int)normals.size() : -1;
+    positions.insert(positions.end(), meshPositions.begin(), meshPositions.end());
+    if (mesh.firstNormal >= 0)
+    {
+        normals.insert(normals.end(), meshNormals.begin(), meshNormals.end());
+    }
+    for (size_t i = 0; i < meshTriangles.size(); i++)
+    {
+        triangles.push_back(meshTriangles[i] + mesh.firstVertex);
+    }
+    lastLoadMs = 0.0;
+    return finishMesh(name, mesh, pool);
+}
+
+int MeshSet::finishMesh(const std::string& name, Mesh& mesh, ThreadPool* pool)
+{
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+    AABB bounds = AABB::empty();
+    for (int v = mesh.firstVertex; v < mesh.firstVertex + mesh.numVertices; v++)
+    {
+        bounds.grow(positions[v]);
+    }
+    mesh.boundsMin = bounds.min;
+    mesh.boundsMax = bounds.max;
+
+    // BVH over the triangles in object space, appended to the shared buffers
+    // with its child and triangle indices made absolute
+    std::vector<AABB> triangleBounds(mesh.numTriangles);
+    for (int i = 0; i < mesh.numTriangles; i++)
+    {
+        const glm::ivec3& tri = triangles[mesh.firstTriangle + i];
+        triangleBounds[i] = AABB::empty();
+        triangleBounds[i].grow(positions[tri.x]);
+        triangleBounds[i].grow(positions[tri.y]);
+        triangleBounds[i].grow(positions[tri.z]);
+    }
+    Bvh bvh;
+    bvh.build(triangleBounds, pool);
+    mesh.rootNode = (int)nodes.size();
+    mesh.numNodes = (int)bvh.nodes.size();
+    const int firstPrim = (int)primIndices.size();
+    for (size_t i = 0; i < bvh.nodes.size(); i++)
+    {
+        BvhNode node = bvh.nodes[i];
+        node.rightOrFirst += node.primCount > 0 ? firstPrim : mesh.rootNode;
+        nodes.push_back(node);
+    }
+    for (size_t i = 0; i < bvh.primIndices.size(); i++)
+    {
+        primIndices.push_back(mesh.firstTriangle + bvh.primIndices[i]);
+    }
+
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+    lastBuildMs = elapsed.count();
+
+    int id = (int)meshes.size();
+    meshes.push_back(mesh);
+    loaded[name] = id;
+    return id;
+}
+
+MeshView MeshSet::view() const
+{
+    MeshView v;
+    v.meshes = meshes.data();
+    v.positions = positions.data();
+    v.normals = normals.data();
+    v.triangles = triangles.data();
+    v.nodes = nodes.data();
+    v.primIndices = primIndices.data();
+    return v;
+}
+
+size_t MeshSet::meshBytes(int id) const
+{
+    const Mesh& m = meshes[id];
+    size_t vertexBytes = m.numVertices * sizeof(glm::vec3) * (m.firstNormal >= 0 ? 2 : 1);
+    return m.numTriangles * (sizeof(glm::ivec3) + sizeof(int)) + vertexBytes + m.numNodes * sizeof(BvhNode);
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "glm/glm.hpp"
+#include "bvh.h"
+
+class ThreadPool;
+
+/**
+ * One triangle mesh in a MeshSet. Its triangles, vertices and BVH nodes are
+ * ranges of the set's shared buffers, so every geom that shows the mesh
+ * refers to the same data by meshId.
+ */
+struct Mesh
+{
+    int firstTriangle;
+    int numTriangles;
+    int firstVertex;
+    int numVertices;
+    int firstNormal;        // normal of vertex v is at firstNormal + v - firstVertex, -1 for face normals
+    int rootNode;           // root of the mesh's BVH in the node buffer
+    int numNodes;
+    glm::vec3 boundsMin;    // object space
+    glm::vec3 boundsMax;
+};
+
+/**
+ * Plain pointers to the buffers of a MeshSet, in host or device memory,
+ * passed to the intersection tests by value. Triangles hold absolute vertex
+ * indices, and leaves of the per-mesh BVHs hold absolute triangle indices.
+ */
+struct MeshView
+{
+    const Mesh* meshes;
+    const glm::vec3* positions;
+    const glm::vec3* normals;
+    const glm::ivec3* triangles;
+    const BvhNode* nodes;
+    const int* primIndices;
+};
+
+/**
+ * Triangle meshes loaded from OBJ files, in indexed vertex buffers shared by
+ * all meshes. Each mesh gets a SAH BVH over its triangles in object space,
+ * built once at load time; moving a geom that shows it only changes the
+ * geom's transform.
+ *
+ * These are the bottom level of a two-level hierarchy: MESH geoms are the
+ * instances, each a transform and a meshId, and the scene BVH over the geoms
+ * is the top level. A ray goes into object space once per instance it
+ * reaches, so memory grows with the triangles of the distinct meshes and
+ * only by one Geom and a scene BVH leaf per instance.
+ */
+class MeshSet
+{
+public:
+    MeshSet();
+
+    /**
+     * Load the OBJ file at `filename`, or find the mesh already loaded from
+     * it, so instances share one copy. Polygons are split into fans, and
+     * vertices are shared between faces wherever their position and normal
+     * indices match.
+     *
+     * @param pool  Threads for the BVH build, if any.
+     * @return      The mesh's index, or -1 if the file could not be read or
+     *              has no faces.
+     */
+    int load(const std::string& filename, ThreadPool* pool = NULL);
+
+    /**
+     * Add a mesh made in memory under `name`, or find the one already added
+     * under it. Triangles index `meshPositions`; `meshNormals` is either
+     * empty or has one normal per position.
+     *
+     * @return  The mesh's index, or -1 if it has no triangles.
+     */
+    int add(
+        const std::string& name,
+        const std::vector<glm::vec3>& meshPositions,
+        const std::vector<glm::vec3>& meshNormals,
+        const std::vector<glm::ivec3>& meshTriangles,
+        ThreadPool* pool = NULL);
+
+    MeshView view() const;
+
+    // Bytes of triangles, vertices and BVH data held for mesh `id`
+    size_t meshBytes(int id) const;
+
+    std::vector<Mesh> meshes;
+    std::vector<glm::vec3> positions;
+    std::vector<glm::vec3> normals;
+    std::vector<glm::ivec3> triangles;
+    std::vector<BvhNode> nodes;
+    std::vector<int> primIndices;
+
+    double lastLoadMs;      // reading and parsing the last file loaded, 0 after add()
+    double lastBuildMs;     // building the last mesh's BVH
+
+private:
+    // Fit the bounds and BVH of `mesh`, whose triangles and vertices are
+    // already in the buffers, and register it under `name`
+    int finishMesh(const std::string& name, Mesh& mesh, ThreadPool* pool);
+
+    std::unordered_map<std::string, int> loaded;
+};
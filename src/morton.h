@@ -0,0 +1,48 @@
+#pragma once
+
+#include "bvh.h"
+#include "sceneStructs.h"
+
+// Bits of mortonCode(), 10 per axis
+#define MORTON_BITS 30
+
+// Origin cells per axis of a ray order key are 2^RAY_ORDER_AXIS_BITS; the
+// direction octant adds three more bits on top
+#define RAY_ORDER_AXIS_BITS 6
+#define RAY_ORDER_KEY_BITS (3 * RAY_ORDER_AXIS_BITS + 3)
+
+// Spread the low 10 bits of v so there are two zero bits between each
+__host__ __device__ inline unsigned int expandBits(unsigned int v)
+{
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+// 30-bit Morton code of a point, 10 bits per axis within `sceneBounds`
+__host__ __device__ inline int mortonCode(const glm::vec3& p, const AABB& sceneBounds)
+{
+    glm::vec3 extent = sceneBounds.max - sceneBounds.min;
+    glm::vec3 unit;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        unit[axis] = extent[axis] > 0.0f ? (p[axis] - sceneBounds.min[axis]) / extent[axis] : 0.0f;
+    }
+    glm::uvec3 cell = glm::uvec3(glm::clamp(unit * 1024.0f, glm::vec3(0.0f), glm::vec3(1023.0f)));
+    return (int)(expandBits(cell.x) * 4 + expandBits(cell.y) * 2 + expandBits(cell.z));
+}
+
+/**
+ * Sort key that puts rays with the same direction octant and nearby origins
+ * next to each other: the octant in the top three bits, then the Morton
+ * code of the origin on a 2^RAY_ORDER_AXIS_BITS grid over `sceneBounds`.
+ * Origins outside the bounds are clamped to the nearest cell.
+ */
+__host__ __device__ inline int rayOrderKey(const Ray& r, const AABB& sceneBounds)
+{
+    const int octant = (r.direction.x < 0.0f ? 4 : 0) + (r.direction.y < 0.0f ? 2 : 0) + (r.direction.z < 0.0f ? 1 : 0);
+    const int cell = mortonCode(r.origin, sceneBounds) >> (MORTON_BITS - 3 * RAY_ORDER_AXIS_BITS);
+    return (octant << (3 * RAY_ORDER_AXIS_BITS)) | cell;
+}
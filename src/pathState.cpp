@@ -0,0 +1,70 @@
+#include "pathState.h"
+
+// Size of one array of `capacity` elements, rounded up so the next array
+// starts on a PATH_STATE_ALIGNMENT boundary.
+static size_t arrayBytes(int capacity, size_t elementSize)
+{
+    size_t bytes = (size_t)capacity * elementSize;
+    return (bytes + PATH_STATE_ALIGNMENT - 1) / PATH_STATE_ALIGNMENT * PATH_STATE_ALIGNMENT;
+}
+
+// Hand out consecutive arrays of one allocation.
+template <typename T>
+static T* carve(char*& storage, int capacity)
+{
+    T* array = reinterpret_cast<T*>(storage);
+    storage += arrayBytes(capacity, sizeof(T));
+    return array;
+}
+
+static void carveVec3(char*& storage, int capacity, Vec3Array& array)
+{
+    array.x = carve<float>(storage, capacity);
+    array.y = carve<float>(storage, capacity);
+    array.z = carve<float>(storage, capacity);
+}
+
+size_t PathView::bytes(int capacity)
+{
+    return 13 * arrayBytes(capacity, sizeof(float)) + 3 * arrayBytes(capacity, sizeof(int));
+}
+
+void PathView::bind(void* storage, int capacity)
+{
+    char* next = static_cast<char*>(storage);
+    carveVec3(next, capacity, origin);
+    carveVec3(next, capacity, direction);
+    carveVec3(next, capacity, throughput);
+    carveVec3(next, capacity, radiance);
+    bsdfPdf = carve<float>(next, capacity);
+    pixelIndex = carve<int>(next, capacity);
+    remainingBounces = carve<int>(next, capacity);
+    iteration = carve<int>(next, capacity);
+}
+
+size_t HitView::bytes(int capacity)
+{
+    return arrayBytes(capacity, sizeof(float4)) + 2 * arrayBytes(capacity, sizeof(int));
+}
+
+void HitView::bind(void* storage, int capacity)
+{
+    char* next = static_cast<char*>(storage);
+    normalT = carve<float4>(next, capacity);
+    materialId = carve<int>(next, capacity);
+    geomId = carve<int>(next, capacity);
+}
+
+size_t ShadowView::bytes(int capacity)
+{
+    return 10 * arrayBytes(capacity, sizeof(float));
+}
+
+void ShadowView::bind(void* storage, int capacity)
+{
+    char* next = static_cast<char*>(storage);
+    carveVec3(next, capacity, origin);
+    carveVec3(next, capacity, direction);
+    carveVec3(next, capacity, radiance);
+    tMax = carve<float>(next, capacity);
+}
@@ -0,0 +1,230 @@
+#pragma once
+
+#include <cstddef>
+#include <cuda_runtime.h>
+#include "glm/glm.hpp"
+#include "sceneStructs.h"
+
+// Every array of a path state allocation starts on this byte boundary, so
+// loads of consecutive elements by a warp are aligned and fully coalesced.
+#define PATH_STATE_ALIGNMENT 256
+
+/**
+ * One glm::vec3 per element, stored as three separate component arrays, so a
+ * warp reading component k of 32 consecutive elements touches exactly one
+ * aligned 128-byte segment and no padding.
+ */
+struct Vec3Array
+{
+    float* x;
+    float* y;
+    float* z;
+
+    __host__ __device__ glm::vec3 get(int i) const
+    {
+        return glm::vec3(x[i], y[i], z[i]);
+    }
+
+    __host__ __device__ void set(int i, const glm::vec3& v) const
+    {
+        x[i] = v.x;
+        y[i] = v.y;
+        z[i] = v.z;
+    }
+
+    __host__ __device__ void copy(int i, const Vec3Array& src, int from) const
+    {
+        x[i] = src.x[from];
+        y[i] = src.y[from];
+        z[i] = src.z[from];
+    }
+};
+
+/**
+ * Structure-of-arrays view of the wavefront path state. Each field of
+ * PathSegment lives in its own arrays, so a stage only moves the fields it
+ * uses; the extend stage, for example, reads origin and direction but never
+ * the throughput, and the gather stage reads only throughput and pixel.
+ *
+ * A view only holds pointers: it is passed to kernels by value and copying it
+ * does not copy any paths. PathSegment remains the per-thread working copy
+ * that the shading routines operate on, see load() and store().
+ */
+struct PathView
+{
+    Vec3Array origin;
+    Vec3Array direction;
+    Vec3Array throughput;   // PathSegment::color
+    Vec3Array radiance;
+    float* bsdfPdf;
+    int* pixelIndex;
+    int* remainingBounces;
+    int* iteration;
+
+    __host__ __device__ Ray ray(int i) const
+    {
+        Ray r;
+        r.origin = origin.get(i);
+        r.direction = direction.get(i);
+        return r;
+    }
+
+    // What the path adds to its pixel once it has terminated
+    __host__ __device__ glm::vec3 result(int i) const
+    {
+        return radiance.get(i);
+    }
+
+    __host__ __device__ PathSegment load(int i) const
+    {
+        PathSegment segment;
+        segment.ray = ray(i);
+        segment.color = throughput.get(i);
+        segment.radiance = radiance.get(i);
+        segment.bsdfPdf = bsdfPdf[i];
+        segment.pixelIndex = pixelIndex[i];
+        segment.remainingBounces = remainingBounces[i];
+        segment.iteration = iteration[i];
+        return segment;
+    }
+
+    __host__ __device__ void store(int i, const PathSegment& segment) const
+    {
+        storeBounce(i, segment);
+        pixelIndex[i] = segment.pixelIndex;
+        iteration[i] = segment.iteration;
+    }
+
+    // Store the fields a bounce changes; the pixel and sample of a path never do.
+    __host__ __device__ void storeBounce(int i, const PathSegment& segment) const
+    {
+        origin.set(i, segment.ray.origin);
+        direction.set(i, segment.ray.direction);
+        throughput.set(i, segment.color);
+        radiance.set(i, segment.radiance);
+        bsdfPdf[i] = segment.bsdfPdf;
+        remainingBounces[i] = segment.remainingBounces;
+    }
+
+    // Copy path `from` of `src` to slot `i` of this view.
+    __host__ __device__ void copy(int i, const PathView& src, int from) const
+    {
+        origin.copy(i, src.origin, from);
+        direction.copy(i, src.direction, from);
+        throughput.copy(i, src.throughput, from);
+        bsdfPdf[i] = src.bsdfPdf[from];
+        copyResult(i, src, from);
+        remainingBounces[i] = src.remainingBounces[from];
+    }
+
+    // Copy only what the gather stage needs of a terminated path.
+    __host__ __device__ void copyResult(int i, const PathView& src, int from) const
+    {
+        radiance.copy(i, src.radiance, from);
+        pixelIndex[i] = src.pixelIndex[from];
+        iteration[i] = src.iteration[from];
+    }
+
+    // Bytes of storage needed for `capacity` paths, including alignment padding.
+    static size_t bytes(int capacity);
+
+    // Point the arrays into `storage`, which holds at least bytes(capacity).
+    void bind(void* storage, int capacity);
+
+    // The allocation bound by bind()
+    void* storage() const
+    {
+        return origin.x;
+    }
+};
+
+/**
+ * Structure-of-arrays view of the extend stage's output, one entry per path.
+ * The surface normal and t share a float4, since shading reads both, so they
+ * are a single aligned 16-byte load.
+ */
+struct HitView
+{
+    float4* normalT;        // xyz: ShadeableIntersection::surfaceNormal, w: t
+    int* materialId;
+    int* geomId;
+
+    __host__ __device__ float t(int i) const
+    {
+        return normalT[i].w;
+    }
+
+    __host__ __device__ ShadeableIntersection load(int i) const
+    {
+        ShadeableIntersection intersection;
+        float4 nt = normalT[i];
+        intersection.t = nt.w;
+        intersection.surfaceNormal = glm::vec3(nt.x, nt.y, nt.z);
+        intersection.materialId = materialId[i];
+        intersection.geomId = geomId[i];
+        return intersection;
+    }
+
+    __host__ __device__ void store(int i, const ShadeableIntersection& intersection) const
+    {
+        const glm::vec3& n = intersection.surfaceNormal;
+        normalT[i] = make_float4(n.x, n.y, n.z, intersection.t);
+        materialId[i] = intersection.materialId;
+        geomId[i] = intersection.geomId;
+    }
+
+    __host__ __device__ void copy(int i, const HitView& src, int from) const
+    {
+        normalT[i] = src.normalT[from];
+        materialId[i] = src.materialId[from];
+        geomId[i] = src.geomId[from];
+    }
+
+    static size_t bytes(int capacity);
+    void bind(void* storage, int capacity);
+
+    void* storage() const
+    {
+        return normalT;
+    }
+};
+
+/**
+ * Structure-of-arrays view of the shadow rays left by the shade stage for
+ * the shadow stage to trace, one slot per path.
+ */
+struct ShadowView
+{
+    Vec3Array origin;
+    Vec3Array direction;
+    Vec3Array radiance;
+    float* tMax;
+
+    __host__ __device__ Ray ray(int i) const
+    {
+        Ray r;
+        r.origin = origin.get(i);
+        r.direction = direction.get(i);
+        return r;
+    }
+
+    // Only tMax is written when there is no shadow ray
+    __host__ __device__ void store(int i, const ShadowRay& shadow) const
+    {
+        tMax[i] = shadow.tMax;
+        if (shadow.tMax > 0.0f)
+        {
+            origin.set(i, shadow.ray.origin);
+            direction.set(i, shadow.ray.direction);
+            radiance.set(i, shadow.radiance);
+        }
+    }
+
+    static size_t bytes(int capacity);
+    void bind(void* storage, int capacity);
+
+    void* storage() const
+    {
+        return origin.x;
+    }
+};
@@ -3,6 +3,8 @@
 #include <cstdio>
 #include <cuda.h>
 #include <cmath>
+#include <algorithm>
+#include <vector>
 #include <thrust/execution_policy.h>
 #include <thrust/random.h>
 #include <thrust/remove.h>
@@ -14,15 +16,30 @@
 #include "utilities.h"
 #include "intersections.h"
 #include "interactions.h"
+#include "firstHitCache.h"
+#include "pathState.h"
+#include "bufferPool.h"
+#include "lbvh.h"
+#include "lights.h"
+#include "morton.h"
+#include "../stream_compaction/efficient.h"
+#include "../stream_compaction/radix.h"
 
 #define ERRORCHECK 1
 
 #define FILENAME (strrchr(__FILE__, '/') ? strrchr(__FILE__, '/') + 1 : __FILE__)
-#define checkCUDAError(msg) checkCUDAErrorFn(msg, FILENAME, __LINE__)
-void checkCUDAErrorFn(const char* msg, const char* file, int line)
+#define checkCUDAError(msg) checkCUDAErrorFn(msg, FILENAME, __LINE__, true)
+// Reports launch errors without waiting for the device, for the wavefront
+// stages, which must not block one another. Errors raised while a kernel
+// runs surface at the next checkCUDAError or blocking copy.
+#define checkCUDALaunch(msg) checkCUDAErrorFn(msg, FILENAME, __LINE__, false)
+void checkCUDAErrorFn(const char* msg, const char* file, int line, bool sync)
 {
 #if ERRORCHECK
-    cudaDeviceSynchronize();
+    if (sync)
+    {
+        cudaDeviceSynchronize();
+    }
     cudaError_t err = cudaGetLastError();
     if (cudaSuccess == err)
     {
@@ -42,13 +59,6 @@ void checkCUDAErrorFn(const char* msg, const char* file, int line)
 #endif // ERRORCHECK
 }
 
-__host__ __device__
-thrust::default_random_engine makeSeededRandomEngine(int iter, int index, int depth)
-{
-    int h = utilhash((1 << 31) | (depth << 22) | iter) ^ utilhash(index);
-    return thrust::default_random_engine(h);
-}
-
 //Kernel that writes the image to the OpenGL PBO directly.
 __global__ void sendImageToPBO(uchar4* pbo, glm::ivec2 resolution, int iter, glm::vec3* image)
 {
@@ -76,56 +86,334 @@ __global__ void sendImageToPBO(uchar4* pbo, glm::ivec2 resolution, int iter, glm
 static Scene* hst_scene = NULL;
 static GuiDataContainer* guiData = NULL;
 static glm::vec3* dev_image = NULL;
-static Geom* dev_geoms = NULL;
+static CompactGeom* dev_geoms = NULL;
+static std::vector<CompactGeom> hst_geoms;   // host copy of dev_geoms
+// Scene BVH, built on the host; nodes and primitive indices in device memory
+static BvhView dev_bvh;
+static WideBvhView dev_wideBvh;
+// Shared triangle buffers and per-mesh BVHs, uploaded once per scene
+static MeshView dev_meshes;
+static EmitterView dev_lights;
 static Material* dev_materials = NULL;
-static PathSegment* dev_paths = NULL;
-static ShadeableIntersection* dev_intersections = NULL;
-// TODO: static variables for device memory, any extra info you need, etc
-// ...
+// Path state and intersections are structure-of-arrays, see pathState.h
+static PathView dev_paths;
+static HitView dev_intersections;
+// Active paths are kept at the front of dev_paths. After shading they are
+// partitioned into dev_paths_scratch by their dev_path_alive flag and the two
+// buffers are swapped.
+static PathView dev_paths_scratch;
+static int* dev_path_alive = NULL;
+static int* dev_partition_indices = NULL;
+// Wavefront queues of path indices into dev_paths. dev_shadeQueues holds
+// NUM_SHADE_QUEUES queues of one entry per path each, dev_queueCounts their
+// lengths.
+static int* dev_shadeQueues = NULL;
+static int* dev_queueCounts = NULL;
+// Material sort and ray order: keys and the resulting order of path indices,
+// plus a second intersection buffer to reorder into.
+static int* dev_sort_keys = NULL;
+static int* dev_sort_order = NULL;
+static HitView dev_intersections_scratch;
+// Shadow rays left by the shade stage, one slot per path
+static ShadowView dev_shadow_rays;
+// Depth-0 intersections in pixel order, reused while the camera is unchanged
+static HitView dev_first_hits;
+// Colors of the paths of one launch by sample and pixel, so several samples
+// of a pixel can be added to dev_image without atomics (see finalGather)
+static glm::vec3* dev_sample_colors = NULL;
+static int launches = 0;
+static FirstHitCache firstHitCache;
+// Timed stages of the current pathtrace() call. Each stage records its own
+// pair of events and they are all read once at the end of the call, so no
+// stage waits for the one before it to finish.
+struct StageTiming
+{
+    WavefrontStage stage;
+    cudaEvent_t start;
+    cudaEvent_t stop;
+};
+static std::vector<StageTiming> stageTimings;
+static int stagesTimed = 0;
+// Every buffer above is reserved from this pool, see pathtraceInit()
+static BufferPool devicePool;
+
+// Image readback. dev_image is copied to dev_image_snapshot between
+// iterations, then downloaded on readbackStream into one of two pinned
+// buffers while the next iterations render. The other buffer holds the last
+// finished download, so snapshots never read memory that is being written.
+static BufferPool pinnedPool(BUFFER_PINNED_HOST);
+static glm::vec3* dev_image_snapshot = NULL;
+static glm::vec3* hst_readback[2] = { NULL, NULL };
+static int readbackIteration[2] = { 0, 0 };
+static int readbackInFlight = -1;   // buffer being downloaded into, or -1
+static int readbackReady = -1;      // buffer with the newest finished download, or -1
+static bool readbackStreamCreated = false;
+static cudaStream_t readbackStream;
+static cudaEvent_t snapshotTaken;
+static cudaEvent_t readbackStart[2];
+static cudaEvent_t readbackDone[2];
+static float lastReadbackMs = 0.0f;
+static int lastIteration = 0;
+static int uploadedVersion = 0;
+static int sceneUploads = 0;
+static int geomUpdates = 0;
+static int lastGeomUpdateBytes = 0;
 
 void InitDataContainer(GuiDataContainer* imGuiData)
 {
     guiData = imGuiData;
 }
 
-void pathtraceInit(Scene* scene)
+template <typename View>
+static void reserveView(View& view, const char* name, int capacity)
 {
-    hst_scene = scene;
+    view.bind(devicePool.reserve(name, View::bytes(capacity)), capacity);
+}
 
-    const Camera& cam = hst_scene->state.camera;
+/**
+ * Point the path buffers at pool storage for `capacity` paths, i.e. every
+ * sample of one launch. Buffers are reused while they are big enough.
+ */
+static void reservePathPool(int capacity)
+{
+    reserveView(dev_paths, "paths", capacity);
+    reserveView(dev_paths_scratch, "paths scratch", capacity);
+    reserveView(dev_intersections, "intersections", capacity);
+    reserveView(dev_intersections_scratch, "intersections scratch", capacity);
+    reserveView(dev_shadow_rays, "shadow rays", capacity);
+    dev_path_alive = devicePool.reserve<int>("path alive", capacity);
+    dev_partition_indices = devicePool.reserve<int>("partition indices", capacity);
+    dev_shadeQueues = devicePool.reserve<int>("shade queues", NUM_SHADE_QUEUES * capacity);
+    dev_sort_keys = devicePool.reserve<int>("sort keys", capacity);
+    dev_sort_order = devicePool.reserve<int>("sort order", capacity);
+    dev_sample_colors = devicePool.reserve<glm::vec3>("sample colors", capacity);
+}
+
+// Pool buffer `name` holding a copy of `host`
+template <typename T>
+static T* uploadBuffer(const char* name, const std::vector<T>& host)
+{
+    T* buffer = devicePool.reserve<T>(name, host.size());
+    cudaMemcpy(buffer, host.data(), host.size() * sizeof(T), cudaMemcpyHostToDevice);
+    return buffer;
+}
+
+// Copy `ranges` of the host array `src` into the same places in `dst`, and
+// return the bytes copied
+template <typename T>
+static int uploadRanges(T* dst, const T* src, const std::vector<IndexRange>& ranges)
+{
+    int bytes = 0;
+    for (size_t i = 0; i < ranges.size(); i++)
+    {
+        const int count = ranges[i].end - ranges[i].begin;
+        cudaMemcpy(dst + ranges[i].begin, src + ranges[i].begin, count * sizeof(T), cudaMemcpyHostToDevice);
+        bytes += count * sizeof(T);
+    }
+    return bytes;
+}
+
+/**
+ * Prepare for rendering `scene` from iteration 1. Called on startup and on
+ * every camera reset, so it only clears the image: buffers come from the
+ * pool and are allocated once per resolution, and the scene is uploaded only
+ * when it is new or its version changed. Geoms moved by Scene::updateGeoms()
+ * without a rebuild are copied over on their own.
+ */
+void pathtraceInit(Scene* scene)
+{
+    const Camera& cam = scene->state.camera;
     const int pixelcount = cam.resolution.x * cam.resolution.y;
 
-    cudaMalloc(&dev_image, pixelcount * sizeof(glm::vec3));
+    // Wait for a pending download before the buffers it uses are reused
+    if (readbackInFlight >= 0)
+    {
+        cudaEventSynchronize(readbackDone[readbackInFlight]);
+    }
+    readbackInFlight = readbackReady = -1;
+    lastIteration = 0;
+
+    dev_image = devicePool.reserve<glm::vec3>("image", pixelcount);
     cudaMemset(dev_image, 0, pixelcount * sizeof(glm::vec3));
+    dev_image_snapshot = devicePool.reserve<glm::vec3>("image snapshot", pixelcount);
+    hst_readback[0] = pinnedPool.reserve<glm::vec3>("readback 0", pixelcount);
+    hst_readback[1] = pinnedPool.reserve<glm::vec3>("readback 1", pixelcount);
 
-    cudaMalloc(&dev_paths, pixelcount * sizeof(PathSegment));
+    reserveView(dev_first_hits, "first hits", pixelcount);
+    dev_queueCounts = devicePool.reserve<int>("queue counts", NUM_SHADE_QUEUES);
+    reservePathPool(pixelcount * scene->state.samplesPerLaunch);
 
-    cudaMalloc(&dev_geoms, scene->geoms.size() * sizeof(Geom));
-    cudaMemcpy(dev_geoms, scene->geoms.data(), scene->geoms.size() * sizeof(Geom), cudaMemcpyHostToDevice);
+    if (scene != hst_scene || scene->version != uploadedVersion)
+    {
+        hst_geoms = compactGeoms(scene->geoms);
+        dev_geoms = uploadBuffer("geoms", hst_geoms);
 
-    cudaMalloc(&dev_materials, scene->materials.size() * sizeof(Material));
-    cudaMemcpy(dev_materials, scene->materials.data(), scene->materials.size() * sizeof(Material), cudaMemcpyHostToDevice);
+        const Bvh& bvh = scene->bvh;
+        BvhNode* nodes = devicePool.reserve<BvhNode>("bvh nodes", bvh.nodes.size());
+        int* primIndices = devicePool.reserve<int>("bvh prims", bvh.primIndices.size());
+        cudaMemcpy(nodes, bvh.nodes.data(), bvh.nodes.size() * sizeof(BvhNode), cudaMemcpyHostToDevice);
+        cudaMemcpy(primIndices, bvh.primIndices.data(), bvh.primIndices.size() * sizeof(int), cudaMemcpyHostToDevice);
+        dev_bvh.nodes = nodes;
+        dev_bvh.primIndices = primIndices;
+        dev_bvh.numNodes = (int)bvh.nodes.size();
 
-    cudaMalloc(&dev_intersections, pixelcount * sizeof(ShadeableIntersection));
-    cudaMemset(dev_intersections, 0, pixelcount * sizeof(ShadeableIntersection));
+        // Converted on the host
+        const WideBvh& wideBvh = scene->wideBvh;
+        dev_wideBvh = WideBvhView();
+        if (!wideBvh.nodes.empty())
+        {
+            dev_wideBvh.nodes = uploadBuffer("wide bvh nodes", wideBvh.nodes);
+            dev_wideBvh.primIndices = uploadBuffer("wide bvh prims", wideBvh.primIndices);
+            dev_wideBvh.numNodes = (int)wideBvh.nodes.size();
+        }
+
+        const MeshSet& meshes = scene->meshes;
+        dev_meshes.meshes = uploadBuffer("meshes", meshes.meshes);
+        dev_meshes.positions = uploadBuffer("mesh positions", meshes.positions);
+        dev_meshes.normals = uploadBuffer("mesh normals", meshes.normals);
+        dev_meshes.triangles = uploadBuffer("mesh triangles", meshes.triangles);
+        dev_meshes.nodes = uploadBuffer("mesh nodes", meshes.nodes);
+        dev_meshes.primIndices = uploadBuffer("mesh prims", meshes.primIndices);
+
+        dev_lights = scene->emitters.view();
+        dev_lights.emitters = uploadBuffer("emitters", scene->emitters.emitters);
+        dev_lights.nodes = uploadBuffer("light nodes", scene->emitters.nodes);
 
-    // TODO: initialize any extra device memeory you need
+        dev_materials = devicePool.reserve<Material>("materials", scene->materials.size());
+        cudaMemcpy(dev_materials, scene->materials.data(), scene->materials.size() * sizeof(Material), cudaMemcpyHostToDevice);
+
+        hst_scene = scene;
+        uploadedVersion = scene->version;
+        sceneUploads++;
+        firstHitCache.invalidate();
+        scene->dirtyGeomRanges.clear();
+        scene->dirtyNodeRanges.clear();
+    }
+    else if (!scene->dirtyGeomRanges.empty())
+    {
+        // Only transforms changed and the BVH was refitted: copy just the
+        // geoms and nodes that moved
+        for (size_t r = 0; r < scene->dirtyGeomRanges.size(); r++)
+        {
+            for (int i = scene->dirtyGeomRanges[r].begin; i < scene->dirtyGeomRanges[r].end; i++)
+            {
+                hst_geoms[i] = compactGeom(scene->geoms[i]);
+            }
+        }
+        BvhNode* nodes = devicePool.reserve<BvhNode>("bvh nodes", scene->bvh.nodes.size());
+        int bytes = uploadRanges(dev_geoms, hst_geoms.data(), scene->dirtyGeomRanges)
+            + uploadRanges(nodes, scene->bvh.nodes.data(), scene->dirtyNodeRanges);
+        if (!scene->wideBvh.nodes.empty())
+        {
+            // Quantized boxes depend on their parent's, so the converted
+            // nodes go up whole; they are a fraction of the binary ones
+            dev_wideBvh.nodes = uploadBuffer("wide bvh nodes", scene->wideBvh.nodes);
+            bytes += (int)(scene->wideBvh.nodes.size() * sizeof(WideBvhNode));
+        }
+        // Moved lights change the whole table, which is small
+        dev_lights = scene->emitters.view();
+        dev_lights.emitters = uploadBuffer("emitters", scene->emitters.emitters);
+        dev_lights.nodes = uploadBuffer("light nodes", scene->emitters.nodes);
+        bytes += (int)(scene->emitters.emitters.size() * sizeof(Emitter) + scene->emitters.nodes.size() * sizeof(LightNode));
+        scene->dirtyGeomRanges.clear();
+        scene->dirtyNodeRanges.clear();
+        geomUpdates++;
+        lastGeomUpdateBytes = bytes;
+        firstHitCache.invalidate();
+    }
+
+    if (!readbackStreamCreated)
+    {
+        cudaStreamCreateWithFlags(&readbackStream, cudaStreamNonBlocking);
+        cudaEventCreateWithFlags(&snapshotTaken, cudaEventDisableTiming);
+        for (int i = 0; i < 2; i++)
+        {
+            cudaEventCreate(&readbackStart[i]);
+            cudaEventCreate(&readbackDone[i]);
+        }
+        readbackStreamCreated = true;
+    }
 
     checkCUDAError("pathtraceInit");
 }
 
 void pathtraceFree()
 {
-    cudaFree(dev_image);  // no-op if dev_image is null
-    cudaFree(dev_paths);
-    cudaFree(dev_geoms);
-    cudaFree(dev_materials);
-    cudaFree(dev_intersections);
-    // TODO: clean up any extra device memory you created
+    if (readbackStreamCreated)
+    {
+        cudaStreamSynchronize(readbackStream);
+        cudaStreamDestroy(readbackStream);
+        cudaEventDestroy(snapshotTaken);
+        for (int i = 0; i < 2; i++)
+        {
+            cudaEventDestroy(readbackStart[i]);
+            cudaEventDestroy(readbackDone[i]);
+        }
+        readbackStreamCreated = false;
+    }
+    readbackInFlight = readbackReady = -1;
+    pinnedPool.release();
+    devicePool.release();
+    Lbvh::freeScratch();
+    dev_image = NULL;
+    dev_geoms = NULL;
+    std::vector<CompactGeom>().swap(hst_geoms);
+    dev_bvh = BvhView();
+    dev_wideBvh = WideBvhView();
+    dev_meshes = MeshView();
+    dev_materials = NULL;
+    hst_scene = NULL;
+    firstHitCache.invalidate();
+    for (size_t i = 0; i < stageTimings.size(); i++)
+    {
+        cudaEventDestroy(stageTimings[i].start);
+        cudaEventDestroy(stageTimings[i].stop);
+    }
+    stageTimings.clear();
+    stagesTimed = 0;
+    StreamCompaction::Efficient::freeScratch();
+    StreamCompaction::Radix::freeScratch();
 
     checkCUDAError("pathtraceFree");
 }
 
+static void beginStage()
+{
+    if (stagesTimed == (int)stageTimings.size())
+    {
+        StageTiming timing;
+        cudaEventCreate(&timing.start);
+        cudaEventCreate(&timing.stop);
+        stageTimings.push_back(timing);
+    }
+    cudaEventRecord(stageTimings[stagesTimed].start);
+}
+
+// Closes the stage opened by beginStage() without waiting for it.
+static void endStage(WavefrontStage stage)
+{
+    StageTiming& timing = stageTimings[stagesTimed++];
+    timing.stage = stage;
+    cudaEventRecord(timing.stop);
+}
+
+// Waits for the last timed stage and adds up the time of every stage since
+// the previous call.
+static void resolveStages(float* stageMs)
+{
+    if (stagesTimed > 0)
+    {
+        cudaEventSynchronize(stageTimings[stagesTimed - 1].stop);
+    }
+    for (int i = 0; i < stagesTimed; i++)
+    {
+        float ms = 0.0f;
+        cudaEventElapsedTime(&ms, stageTimings[i].start, stageTimings[i].stop);
+        stageMs[stageTimings[i].stage] += ms;
+    }
+    stagesTimed = 0;
+}
+
 /**
 * Generate PathSegments with rays from the camera through the screen into the
 * scene, which is the first bounce of rays.
@@ -134,261 +422,552 @@ void pathtraceFree()
 * motion blur - jitter rays "in time"
 * lens effect - jitter ray origin positions based on a lens
 */
-__global__ void generateRayFromCamera(Camera cam, int iter, int traceDepth, PathSegment* pathSegments)
+__global__ void generateRayFromCamera(Camera cam, int iter, int traceDepth, bool jitter, SamplerKind sampler,
+    PathView pathSegments)
 {
     int x = (blockIdx.x * blockDim.x) + threadIdx.x;
     int y = (blockIdx.y * blockDim.y) + threadIdx.y;
+    int sample = blockIdx.z;
 
     if (x < cam.resolution.x && y < cam.resolution.y) {
         int index = x + (y * cam.resolution.x);
-        PathSegment& segment = pathSegments[index];
+        PathSegment segment;
+        generateCameraPath(cam, iter + sample, x, y, traceDepth, jitter, sampler, segment);
+        pathSegments.store(sample * cam.resolution.x * cam.resolution.y + index, segment);
+    }
+}
 
-        segment.ray.origin = cam.position;
-        segment.color = glm::vec3(1.0f, 1.0f, 1.0f);
+// computeIntersections is the "extend" stage: it intersects the first
+// num_paths (active) paths with the scene and sorts each one into a shade
+// queue. Queue slots are reserved once per block per queue rather than once
+// per path. If shadeQueues is null the paths are only counted per queue; the
+// material sort then makes every queue a contiguous range. With useCachedHits
+// (depth 0 only) the intersections are copied from cachedHits, which holds
+// one entry per pixel, instead of traced.
+__global__ void computeIntersections(
+    int depth,
+    int num_paths,
+    PathView pathSegments,
+    const CompactGeom* geoms,
+    BvhView bvh,
+    WideBvhView wideBvh,
+    MeshView meshes,
+    Material* materials,
+    HitView intersections,
+    bool useCachedHits,
+    HitView cachedHits,
+    int num_pixels,
+    int* shadeQueues,
+    int* queueCounts)
+{
+    __shared__ int blockCounts[NUM_SHADE_QUEUES];
+    __shared__ int blockOffsets[NUM_SHADE_QUEUES];
 
-        // TODO: implement antialiasing by jittering the ray
-        segment.ray.direction = glm::normalize(cam.view
-            - cam.right * cam.pixelLength.x * ((float)x - (float)cam.resolution.x * 0.5f)
-            - cam.up * cam.pixelLength.y * ((float)y - (float)cam.resolution.y * 0.5f)
-        );
+    if (threadIdx.x < NUM_SHADE_QUEUES)
+    {
+        blockCounts[threadIdx.x] = 0;
+    }
+    __syncthreads();
+
+    int queue = -1;
+    int slot = 0;
+    int path_index = blockIdx.x * blockDim.x + threadIdx.x;
+    if (path_index < num_paths)
+    {
+        ShadeableIntersection intersection;
+        if (useCachedHits)
+        {
+            // Depth-0 paths are in generation order: sample-major, then pixel
+            intersection = cachedHits.load(path_index % num_pixels);
+        }
+        else
+        {
+            intersectScene(pathSegments.ray(path_index), geoms, bvh, wideBvh, meshes, intersection);
+        }
+        intersections.store(path_index, intersection);
+        queue = classifyIntersection(intersection, materials);
+        slot = atomicAdd(&blockCounts[queue], 1);
+    }
+    __syncthreads();
+
+    if (threadIdx.x < NUM_SHADE_QUEUES)
+    {
+        blockOffsets[threadIdx.x] = atomicAdd(&queueCounts[threadIdx.x], blockCounts[threadIdx.x]);
+    }
+    __syncthreads();
 
-        segment.pixelIndex = index;
-        segment.remainingBounces = traceDepth;
+    if (queue >= 0 && shadeQueues != NULL)
+    {
+        shadeQueues[queue * num_paths + blockOffsets[queue] + slot] = path_index;
     }
 }
 
-// TODO:
-// computeIntersections handles generating ray intersections ONLY.
-// Generating new rays is handled in your shader(s).
-// Feel free to modify the code below.
-__global__ void computeIntersections(
-    int depth,
+__global__ void kernMaterialSortKeys(
     int num_paths,
-    PathSegment* pathSegments,
-    Geom* geoms,
-    int geoms_size,
-    ShadeableIntersection* intersections)
+    HitView intersections,
+    Material* materials,
+    int num_materials,
+    int* keys,
+    int* order)
 {
     int path_index = blockIdx.x * blockDim.x + threadIdx.x;
+    if (path_index < num_paths)
+    {
+        // The key only depends on t and the material, so skip the normal
+        ShadeableIntersection intersection;
+        intersection.t = intersections.t(path_index);
+        intersection.materialId = intersections.materialId[path_index];
+        keys[path_index] = materialSortKey(intersection, materials, num_materials);
+        order[path_index] = path_index;
+    }
+}
 
+// Ray order keys of the active paths, see rayOrderKey()
+__global__ void kernRayOrderKeys(int num_paths, PathView paths, AABB sceneBounds, int* keys, int* order)
+{
+    int path_index = blockIdx.x * blockDim.x + threadIdx.x;
     if (path_index < num_paths)
     {
-        PathSegment pathSegment = pathSegments[path_index];
+        keys[path_index] = rayOrderKey(paths.ray(path_index), sceneBounds);
+        order[path_index] = path_index;
+    }
+}
 
-        float t;
-        glm::vec3 intersect_point;
-        glm::vec3 normal;
-        float t_min = FLT_MAX;
-        int hit_geom_index = -1;
-        bool outside = true;
+__global__ void kernCopyHits(int n, HitView dst, HitView src)
+{
+    int index = blockIdx.x * blockDim.x + threadIdx.x;
+    if (index < n)
+    {
+        dst.copy(index, src, index);
+    }
+}
 
-        glm::vec3 tmp_intersect;
-        glm::vec3 tmp_normal;
+// Reorder paths and their intersections into sorted order
+__global__ void kernGatherSortedPaths(
+    int num_paths,
+    const int* order,
+    PathView paths,
+    HitView intersections,
+    PathView sortedPaths,
+    HitView sortedIntersections)
+{
+    int index = blockIdx.x * blockDim.x + threadIdx.x;
+    if (index < num_paths)
+    {
+        sortedPaths.copy(index, paths, order[index]);
+        sortedIntersections.copy(index, intersections, order[index]);
+    }
+}
 
-        // naive parse through global geoms
+// Reorder paths alone, before they have intersections
+__global__ void kernGatherPaths(int num_paths, const int* order, PathView paths, PathView sortedPaths)
+{
+    int index = blockIdx.x * blockDim.x + threadIdx.x;
+    if (index < num_paths)
+    {
+        sortedPaths.copy(index, paths, order[index]);
+    }
+}
 
-        for (int i = 0; i < geoms_size; i++)
+// Move path i to slot indices[i], the path state counterpart of
+// StreamCompaction::Efficient::kernScatterByIndex. Paths that land past
+// num_alive only wait for the gather stage, so only their result is moved.
+__global__ void kernScatterPaths(int num_paths, int num_alive, PathView scattered, PathView paths, const int* indices)
+{
+    int index = blockIdx.x * blockDim.x + threadIdx.x;
+    if (index < num_paths)
+    {
+        int slot = indices[index];
+        if (slot < num_alive)
         {
-            Geom& geom = geoms[i];
+            scattered.copy(slot, paths, index);
+        }
+        else
+        {
+            scattered.copyResult(slot, paths, index);
+        }
+    }
+}
 
-            if (geom.type == CUBE)
-            {
-                t = boxIntersectionTest(geom, pathSegment.ray, tmp_intersect, tmp_normal, outside);
-            }
-            else if (geom.type == SPHERE)
-            {
-                t = sphereIntersectionTest(geom, pathSegment.ray, tmp_intersect, tmp_normal, outside);
-            }
-            // TODO: add more intersection tests here... triangle? metaball? CSG?
+/**
+ * Shade every path in one material queue. Each queue gets its own kernel, so
+ * all threads in a warp run the same BSDF. Whether the path survives the
+ * bounce is recorded in `alive` for the compaction stage. The queue is either
+ * a list of path indices or, when queuedPaths is null, the contiguous range of
+ * paths starting at firstPath.
+ */
+template <ShadeQueue queue>
+__global__ void shadeQueue(
+    int depth,
+    int rouletteDepth,
+    SamplerKind sampler,
+    int num_queued,
+    const int* queuedPaths,
+    int firstPath,
+    HitView shadeableIntersections,
+    PathView pathSegments,
+    Material* materials,
+    EmitterView lights,
+    ShadowView shadowRays,
+    int* alive)
+{
+    int idx = blockIdx.x * blockDim.x + threadIdx.x;
+    if (idx < num_queued)
+    {
+        int path = queuedPaths != NULL ? queuedPaths[idx] : firstPath + idx;
+        PathSegment segment = pathSegments.load(path);
+        ShadowRay shadow;
+        alive[path] = shadePath<queue>(depth, rouletteDepth, sampler, segment, shadeableIntersections.load(path), materials,
+            lights, shadow);
+        pathSegments.storeBounce(path, segment);
+        shadowRays.store(path, shadow);
+    }
+}
 
-            // Compute the minimum t from the intersection tests to determine what
-            // scene geometry object was hit first.
-            if (t > 0.0f && t_min > t)
-            {
-                t_min = t;
-                hit_geom_index = i;
-                intersect_point = tmp_intersect;
-                normal = tmp_normal;
-            }
+// Add the light of each unblocked shadow ray to its path. Paths without one
+// have tMax 0.
+__global__ void kernTraceShadowRays(
+    int num_paths,
+    ShadowView shadowRays,
+    const CompactGeom* geoms,
+    BvhView bvh,
+    WideBvhView wideBvh,
+    MeshView meshes,
+    PathView paths)
+{
+    int path = blockIdx.x * blockDim.x + threadIdx.x;
+    if (path < num_paths)
+    {
+        const float tMax = shadowRays.tMax[path];
+        if (tMax > 0.0f && !occludedScene(shadowRays.ray(path), tMax, geoms, bvh, wideBvh, meshes))
+        {
+            paths.radiance.set(path, paths.radiance.get(path) + shadowRays.radiance.get(path));
         }
+    }
+}
+
+/**
+ * Add the color of the paths in [first, last) to the overall image. With
+ * several samples per launch, two paths may share a pixel, so each color is
+ * written to its own slot in sampleColors instead (sample `iteration - iter`)
+ * and kernAccumulateSamples adds them up once every path has terminated.
+ */
+__global__ void finalGather(
+    int first,
+    int last,
+    int iter,
+    int num_pixels,
+    glm::vec3* image,
+    glm::vec3* sampleColors,
+    PathView iterationPaths)
+{
+    int index = first + (blockIdx.x * blockDim.x) + threadIdx.x;
 
-        if (hit_geom_index == -1)
+    if (index < last)
+    {
+        int pixel = iterationPaths.pixelIndex[index];
+        if (sampleColors == NULL)
         {
-            intersections[path_index].t = -1.0f;
+            image[pixel] += iterationPaths.result(index);
         }
         else
         {
-            // The ray hits something
-            intersections[path_index].t = t_min;
-            intersections[path_index].materialId = geoms[hit_geom_index].materialid;
-            intersections[path_index].surfaceNormal = normal;
+            int sample = iterationPaths.iteration[index] - iter;
+            sampleColors[sample * num_pixels + pixel] = iterationPaths.result(index);
         }
     }
 }
 
-// LOOK: "fake" shader demonstrating what you might do with the info in
-// a ShadeableIntersection, as well as how to use thrust's random number
-// generator. Observe that since the thrust random number generator basically
-// adds "noise" to the iteration, the image should start off noisy and get
-// cleaner as more iterations are computed.
-//
-// Note that this shader does NOT do a BSDF evaluation!
-// Your shaders should handle that - this can allow techniques such as
-// bump mapping.
-__global__ void shadeFakeMaterial(
-    int iter,
-    int num_paths,
-    ShadeableIntersection* shadeableIntersections,
-    PathSegment* pathSegments,
-    Material* materials)
+// Add the samples of one launch to the image in sample order, so the result
+// matches one launch per sample exactly.
+__global__ void kernAccumulateSamples(int num_pixels, int samples, glm::vec3* image, const glm::vec3* sampleColors)
 {
-    int idx = blockIdx.x * blockDim.x + threadIdx.x;
-    if (idx < num_paths)
+    int pixel = blockIdx.x * blockDim.x + threadIdx.x;
+    if (pixel < num_pixels)
     {
-        ShadeableIntersection intersection = shadeableIntersections[idx];
-        if (intersection.t > 0.0f) // if the intersection exists...
+        glm::vec3 sum = image[pixel];
+        for (int sample = 0; sample < samples; sample++)
         {
-          // Set up the RNG
-          // LOOK: this is how you use thrust's RNG! Please look at
-          // makeSeededRandomEngine as well.
-            thrust::default_random_engine rng = makeSeededRandomEngine(iter, idx, 0);
-            thrust::uniform_real_distribution<float> u01(0, 1);
-
-            Material material = materials[intersection.materialId];
-            glm::vec3 materialColor = material.color;
-
-            // If the material indicates that the object was a light, "light" the ray
-            if (material.emittance > 0.0f) {
-                pathSegments[idx].color *= (materialColor * material.emittance);
-            }
-            // Otherwise, do some pseudo-lighting computation. This is actually more
-            // like what you would expect from shading in a rasterizer like OpenGL.
-            // TODO: replace this! you should be able to start with basically a one-liner
-            else {
-                float lightTerm = glm::dot(intersection.surfaceNormal, glm::vec3(0.0f, 1.0f, 0.0f));
-                pathSegments[idx].color *= (materialColor * lightTerm) * 0.3f + ((1.0f - intersection.t * 0.02f) * materialColor) * 0.7f;
-                pathSegments[idx].color *= u01(rng); // apply some noise because why not
-            }
-            // If there was no intersection, color the ray black.
-            // Lots of renderers use 4 channel color, RGBA, where A = alpha, often
-            // used for opacity, in which case they can indicate "no opacity".
-            // This can be useful for post-processing and image compositing.
-        }
-        else {
-            pathSegments[idx].color = glm::vec3(0.0f);
+            sum += sampleColors[sample * num_pixels + pixel];
         }
+        image[pixel] = sum;
     }
 }
 
-// Add the current iteration's output to the overall image
-__global__ void finalGather(int nPaths, glm::vec3* image, PathSegment* iterationPaths)
+// Retire the download in flight if the copy engine has finished it.
+static void pollReadback()
 {
-    int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+    if (readbackInFlight >= 0 && cudaEventQuery(readbackDone[readbackInFlight]) == cudaSuccess)
+    {
+        cudaEventElapsedTime(&lastReadbackMs, readbackStart[readbackInFlight], readbackDone[readbackInFlight]);
+        readbackReady = readbackInFlight;
+        readbackInFlight = -1;
+    }
+}
 
-    if (index < nPaths)
+/**
+ * Start downloading the image as of iteration `iter` (the last one enqueued)
+ * without waiting for it. Skipped if the previous download has not finished
+ * yet, so a slow copy never stalls rendering.
+ */
+static bool startReadback(int iter)
+{
+    pollReadback();
+    if (readbackInFlight >= 0)
     {
-        PathSegment iterationPath = iterationPaths[index];
-        image[iterationPath.pixelIndex] += iterationPath.color;
+        return false;
     }
+
+    const Camera& cam = hst_scene->state.camera;
+    const size_t bytes = cam.resolution.x * cam.resolution.y * sizeof(glm::vec3);
+    const int buffer = readbackReady == 0 ? 1 : 0;
+
+    // A device-side copy keeps the download consistent while later
+    // iterations keep accumulating into dev_image
+    cudaMemcpyAsync(dev_image_snapshot, dev_image, bytes, cudaMemcpyDeviceToDevice, 0);
+    cudaEventRecord(snapshotTaken, 0);
+    cudaStreamWaitEvent(readbackStream, snapshotTaken, 0);
+    cudaEventRecord(readbackStart[buffer], readbackStream);
+    cudaMemcpyAsync(hst_readback[buffer], dev_image_snapshot, bytes, cudaMemcpyDeviceToHost, readbackStream);
+    cudaEventRecord(readbackDone[buffer], readbackStream);
+
+    readbackIteration[buffer] = iter;
+    readbackInFlight = buffer;
+    return true;
+}
+
+static void copySnapshot(int buffer, ImageSnapshot& snapshot)
+{
+    const Camera& cam = hst_scene->state.camera;
+    const int pixelcount = cam.resolution.x * cam.resolution.y;
+    snapshot.image.assign(hst_readback[buffer], hst_readback[buffer] + pixelcount);
+    snapshot.iteration = readbackIteration[buffer];
 }
 
 /**
  * Wrapper for the __global__ call that sets up the kernel calls and does a ton
  * of memory management
  */
-void pathtrace(uchar4* pbo, int frame, int iter)
+void pathtrace(uchar4* pbo, int frame, int iter, int samples)
 {
     const int traceDepth = hst_scene->state.traceDepth;
     const Camera& cam = hst_scene->state.camera;
     const int pixelcount = cam.resolution.x * cam.resolution.y;
+    const int lastIter = iter + samples - 1;
+
+    // Every sample of this launch gets its own paths in one pool
+    reservePathPool(pixelcount * samples);
 
     // 2D block for generating ray from camera
     const dim3 blockSize2d(8, 8);
     const dim3 blocksPerGrid2d(
         (cam.resolution.x + blockSize2d.x - 1) / blockSize2d.x,
         (cam.resolution.y + blockSize2d.y - 1) / blockSize2d.y);
+    const dim3 blocksPerGridSamples(blocksPerGrid2d.x, blocksPerGrid2d.y, samples);
 
     // 1D block for path tracing
     const int blockSize1d = 128;
 
+    float stageMs[NUM_WAVEFRONT_STAGES] = {};
+    std::vector<int> activePaths;
+
+    // Sorting by material makes each shade queue a contiguous, material-coherent
+    // range of paths. SORT_AB alternates so both variants can be timed.
+    const MaterialSortMode sortMode = hst_scene->state.materialSort;
+    const bool sortByMaterial = sortMode == SORT_ON || (sortMode == SORT_AB && launches % 2 == 0);
+    launches++;
+    const int numMaterials = hst_scene->materials.size();
+
+    const RenderState& state = hst_scene->state;
+    const bool cacheFirstHits = FirstHitCache::enabled(state);
+    const bool firstHitsCached = firstHitCache.valid(state);
+    // The host tree has the same root box as dev_bvh, also after refits
+    const AABB sceneBounds = hst_scene->bvh.bounds();
+    EmitterView lights = state.nextEvent ? dev_lights : EmitterView();
+    if (!state.lightTree)
+    {
+        lights.nodes = NULL;
+        lights.numNodes = 0;
+    }
+
     ///////////////////////////////////////////////////////////////////////////
 
-    // Recap:
-    // * Initialize array of path rays (using rays that come out of the camera)
-    //   * You can pass the Camera object to that kernel.
-    //   * Each path ray must carry at minimum a (ray, color) pair,
-    //   * where color starts as the multiplicative identity, white = (1, 1, 1).
-    //   * This has already been done for you.
-    // * For each depth:
-    //   * Compute an intersection in the scene for each path ray.
-    //     A very naive version of this has been implemented for you, but feel
-    //     free to add more primitives and/or a better algorithm.
-    //     Currently, intersection distance is recorded as a parametric distance,
-    //     t, or a "distance along the ray." t = -1.0 indicates no intersection.
-    //     * Color is attenuated (multiplied) by reflections off of any object
-    //   * TODO: Stream compact away all of the terminated paths.
-    //     You may use either your implementation or `thrust::remove_if` or its
-    //     cousins.
-    //     * Note that you can't really use a 2D kernel launch any more - switch
-    //       to 1D.
-    //   * TODO: Shade the rays that intersected something or didn't bottom out.
-    //     That is, color the ray by performing a color computation according
-    //     to the shader, then generate a new ray to continue the ray path.
-    //     We recommend just updating the ray's PathSegment in place.
-    //     Note that this step may come before or after stream compaction,
-    //     since some shaders you write may also cause a path to terminate.
-    // * Finally, add this iteration's results to the image. This has been done
-    //   for you.
-
-    // TODO: perform one iteration of path tracing
-
-    generateRayFromCamera<<<blocksPerGrid2d, blockSize2d>>>(cam, iter, traceDepth, dev_paths);
-    checkCUDAError("generate camera ray");
+    // The bounce loop is split into wavefront stages, each its own kernel:
+    // * Generate: one camera path per pixel and sample; every path starts
+    //   out active.
+    // * Ray order (optional, per depth): sort the active paths by direction
+    //   octant and origin, so neighbouring threads walk the same BVH nodes.
+    // * Extend: intersect the active paths and sort each one into a shade
+    //   queue by the kind of material it hit. Escaped paths and paths that
+    //   hit a light go into QUEUE_TERMINATED.
+    // * Shade: one kernel per queue, so no warp diverges on material type.
+    //   Each path is flagged alive if it needs another bounce. Diffuse hits
+    //   also pick a point on a light and leave a shadow ray towards it.
+    // * Shadow: trace those shadow rays as any-hit queries and add the light
+    //   of the unblocked ones to their paths.
+    // * Compact: stable-partition the active paths by that flag, so the
+    //   survivors are contiguous at the front of dev_paths and the next
+    //   depth only launches threads for them.
+    // * Gather: add the paths that just terminated to the image, or with
+    //   several samples per launch, stash them until the launch is done.
+
+    beginStage();
+    generateRayFromCamera<<<blocksPerGridSamples, blockSize2d>>>(cam, iter, traceDepth, state.antialias, state.sampler,
+        dev_paths);
+    checkCUDALaunch("generate camera ray");
+    endStage(STAGE_GENERATE);
 
     int depth = 0;
-    PathSegment* dev_path_end = dev_paths + pixelcount;
-    int num_paths = dev_path_end - dev_paths;
+    int num_paths = pixelcount * samples;
 
     // --- PathSegment Tracing Stage ---
     // Shoot ray into scene, bounce between objects, push shading chunks
 
-    bool iterationComplete = false;
-    while (!iterationComplete)
+    while (num_paths > 0)
     {
-        // clean shading chunks
-        cudaMemset(dev_intersections, 0, pixelcount * sizeof(ShadeableIntersection));
-
-        // tracing
+        activePaths.push_back(num_paths);
         dim3 numblocksPathSegmentTracing = (num_paths + blockSize1d - 1) / blockSize1d;
+
+        // --- Ray Order Stage ---
+        if (rayOrderAtDepth(state, depth))
+        {
+            beginStage();
+            kernRayOrderKeys<<<numblocksPathSegmentTracing, blockSize1d>>>(
+                num_paths, dev_paths, sceneBounds, dev_sort_keys, dev_sort_order);
+            StreamCompaction::Radix::sortByKey(num_paths, RAY_ORDER_KEY_BITS, dev_sort_keys, dev_sort_order);
+            kernGatherPaths<<<numblocksPathSegmentTracing, blockSize1d>>>(
+                num_paths, dev_sort_order, dev_paths, dev_paths_scratch);
+            std::swap(dev_paths, dev_paths_scratch);
+            checkCUDALaunch("ray order");
+            endStage(STAGE_RAY_ORDER);
+        }
+
+        // --- Extend Stage ---
+        beginStage();
+        cudaMemset(dev_queueCounts, 0, NUM_SHADE_QUEUES * sizeof(int));
         computeIntersections<<<numblocksPathSegmentTracing, blockSize1d>>> (
             depth,
             num_paths,
             dev_paths,
             dev_geoms,
-            hst_scene->geoms.size(),
-            dev_intersections
+            dev_bvh,
+            dev_wideBvh,
+            dev_meshes,
+            dev_materials,
+            dev_intersections,
+            depth == 0 && firstHitsCached,
+            dev_first_hits,
+            pixelcount,
+            sortByMaterial ? NULL : dev_shadeQueues,
+            dev_queueCounts
         );
-        checkCUDAError("trace one bounce");
-        cudaDeviceSynchronize();
-        depth++;
+        checkCUDALaunch("trace one bounce");
+
+        // Paths are still in pixel order at depth 0, so the hits of the
+        // first sample can be reused as they are
+        if (depth == 0 && cacheFirstHits && !firstHitsCached)
+        {
+            dim3 numBlocksPixels = (pixelcount + blockSize1d - 1) / blockSize1d;
+            kernCopyHits<<<numBlocksPixels, blockSize1d>>>(pixelcount, dev_first_hits, dev_intersections);
+            firstHitCache.store(state);
+        }
+
+        int queueCounts[NUM_SHADE_QUEUES];
+        cudaMemcpy(queueCounts, dev_queueCounts, NUM_SHADE_QUEUES * sizeof(int), cudaMemcpyDeviceToHost);
+        endStage(STAGE_EXTEND);
+
+        // --- Material Sort Stage ---
+        if (sortByMaterial)
+        {
+            beginStage();
+            kernMaterialSortKeys<<<numblocksPathSegmentTracing, blockSize1d>>>(
+                num_paths, dev_intersections, dev_materials, numMaterials, dev_sort_keys, dev_sort_order);
+            StreamCompaction::Radix::sortByKey(
+                num_paths, materialSortKeyBits(numMaterials), dev_sort_keys, dev_sort_order);
+            kernGatherSortedPaths<<<numblocksPathSegmentTracing, blockSize1d>>>(
+                num_paths, dev_sort_order, dev_paths, dev_intersections,
+                dev_paths_scratch, dev_intersections_scratch);
+            std::swap(dev_paths, dev_paths_scratch);
+            std::swap(dev_intersections, dev_intersections_scratch);
+            checkCUDALaunch("material sort");
+            endStage(STAGE_SORT);
+        }
 
-        // TODO:
         // --- Shading Stage ---
         // Shade path segments based on intersections and generate new rays by
-        // evaluating the BSDF.
-        // Start off with just a big kernel that handles all the different
-        // materials you have in the scenefile.
-        // TODO: compare between directly shading the path segments and shading
-        // path segments that have been reshuffled to be contiguous in memory.
-
-        shadeFakeMaterial<<<numblocksPathSegmentTracing, blockSize1d>>>(
-            iter,
-            num_paths,
-            dev_intersections,
-            dev_paths,
-            dev_materials
-        );
-        iterationComplete = true; // TODO: should be based off stream compaction results.
+        // evaluating the BSDF, one queue at a time. Queue q starts at
+        // q * num_paths in dev_shadeQueues (see computeIntersections), or is
+        // the range of sorted paths starting at firstPath.
+        int firstPath = 0;
+        for (int q = 0; q < NUM_SHADE_QUEUES; firstPath += queueCounts[q], q++)
+        {
+            if (queueCounts[q] == 0)
+            {
+                continue;
+            }
+
+            beginStage();
+            dim3 numblocksShading = (queueCounts[q] + blockSize1d - 1) / blockSize1d;
+            const int* queue = sortByMaterial ? NULL : dev_shadeQueues + q * num_paths;
+            switch (q)
+            {
+            case QUEUE_DIFFUSE:
+                shadeQueue<QUEUE_DIFFUSE><<<numblocksShading, blockSize1d>>>(
+                    depth, state.rouletteDepth, state.sampler, queueCounts[q], queue, firstPath, dev_intersections, dev_paths,
+                    dev_materials, lights, dev_shadow_rays, dev_path_alive);
+                break;
+            case QUEUE_SPECULAR:
+                shadeQueue<QUEUE_SPECULAR><<<numblocksShading, blockSize1d>>>(
+                    depth, state.rouletteDepth, state.sampler, queueCounts[q], queue, firstPath, dev_intersections, dev_paths,
+                    dev_materials, lights, dev_shadow_rays, dev_path_alive);
+                break;
+            default:
+                shadeQueue<QUEUE_TERMINATED><<<numblocksShading, blockSize1d>>>(
+                    depth, state.rouletteDepth, state.sampler, queueCounts[q], queue, firstPath, dev_intersections, dev_paths,
+                    dev_materials, lights, dev_shadow_rays, dev_path_alive);
+                break;
+            }
+            checkCUDALaunch("shade queue");
+            endStage((WavefrontStage)(STAGE_SHADE_DIFFUSE + q));
+        }
+
+        // --- Shadow Ray Stage ---
+        // Every path shaded above left a slot in dev_shadow_rays, used or not
+        if (lights.count > 0 && queueCounts[QUEUE_DIFFUSE] > 0)
+        {
+            beginStage();
+            kernTraceShadowRays<<<numblocksPathSegmentTracing, blockSize1d>>>(
+                num_paths, dev_shadow_rays, dev_geoms, dev_bvh, dev_wideBvh, dev_meshes, dev_paths);
+            checkCUDALaunch("shadow rays");
+            endStage(STAGE_SHADOW);
+        }
+
+        // --- Compaction Stage ---
+        beginStage();
+        const int num_alive = StreamCompaction::Efficient::partition(num_paths, dev_partition_indices, dev_path_alive);
+        if (num_alive < num_paths)
+        {
+            kernScatterPaths<<<numblocksPathSegmentTracing, blockSize1d>>>(
+                num_paths, num_alive, dev_paths_scratch, dev_paths, dev_partition_indices);
+            std::swap(dev_paths, dev_paths_scratch);
+        }
+        checkCUDALaunch("compact paths");
+        endStage(STAGE_COMPACT);
+
+        // --- Gather Stage ---
+        // Paths that terminated at this depth now sit in [num_alive, num_paths)
+        if (num_alive < num_paths)
+        {
+            beginStage();
+            dim3 numBlocksGather = (num_paths - num_alive + blockSize1d - 1) / blockSize1d;
+            finalGather<<<numBlocksGather, blockSize1d>>>(num_alive, num_paths, iter, pixelcount,
+                dev_image, samples > 1 ? dev_sample_colors : NULL, dev_paths);
+            checkCUDALaunch("gather");
+            endStage(STAGE_GATHER);
+        }
+
+        num_paths = num_alive;
+        depth++;
 
         if (guiData != NULL)
         {
@@ -396,18 +975,107 @@ void pathtrace(uchar4* pbo, int frame, int iter)
         }
     }
 
-    // Assemble this iteration and apply it to the image
-    dim3 numBlocksPixels = (pixelcount + blockSize1d - 1) / blockSize1d;
-    finalGather<<<numBlocksPixels, blockSize1d>>>(num_paths, dev_image, dev_paths);
+    if (samples > 1)
+    {
+        beginStage();
+        dim3 numBlocksPixels = (pixelcount + blockSize1d - 1) / blockSize1d;
+        kernAccumulateSamples<<<numBlocksPixels, blockSize1d>>>(pixelcount, samples, dev_image, dev_sample_colors);
+        checkCUDALaunch("accumulate samples");
+        endStage(STAGE_GATHER);
+    }
+
+    resolveStages(stageMs);
+    if (guiData != NULL)
+    {
+        std::copy(stageMs, stageMs + NUM_WAVEFRONT_STAGES, guiData->StageMs);
+        guiData->ActivePaths = activePaths;
+        guiData->DevicePool = devicePool.stats();
+        guiData->SceneUploads = sceneUploads;
+        guiData->GeomUpdates = geomUpdates;
+        guiData->GeomUpdateBytes = lastGeomUpdateBytes;
+
+        // Bounce loop time, i.e. everything but ray generation
+        float bounceMs = 0.0f;
+        for (int stage = STAGE_RAY_ORDER; stage < NUM_WAVEFRONT_STAGES; stage++)
+        {
+            bounceMs += stageMs[stage];
+        }
+        guiData->MaterialSortTimings.ms[sortByMaterial] += bounceMs;
+        guiData->MaterialSortTimings.iterations[sortByMaterial]++;
+    }
 
     ///////////////////////////////////////////////////////////////////////////
 
     // Send results to OpenGL buffer for rendering
-    sendImageToPBO<<<blocksPerGrid2d, blockSize2d>>>(pbo, cam.resolution, iter, dev_image);
+    sendImageToPBO<<<blocksPerGrid2d, blockSize2d>>>(pbo, cam.resolution, lastIter, dev_image);
+
+    // The image is no longer copied back every iteration. Readback is on
+    // demand, or in the background every readbackInterval iterations.
+    lastIteration = lastIter;
+    const int interval = hst_scene->state.readbackInterval;
+    if (interval > 0 && lastIter / interval > (iter - 1) / interval)
+    {
+        startReadback(lastIter);
+    }
+    if (guiData != NULL)
+    {
+        guiData->ReadbackMs = lastReadbackMs;
+    }
 
-    // Retrieve image from GPU
-    cudaMemcpy(hst_scene->state.image.data(), dev_image,
-        pixelcount * sizeof(glm::vec3), cudaMemcpyDeviceToHost);
+    // No device-wide sync here, it would wait for the download just started
+    checkCUDALaunch("pathtrace");
+}
 
-    checkCUDAError("pathtrace");
+bool pathtraceLatestSnapshot(ImageSnapshot& snapshot)
+{
+    pollReadback();
+    if (readbackReady < 0 || readbackIteration[readbackReady] <= snapshot.iteration)
+    {
+        return false;
+    }
+    copySnapshot(readbackReady, snapshot);
+    return true;
+}
+
+void pathtraceReadImage(ImageSnapshot& snapshot)
+{
+    if (readbackInFlight >= 0)
+    {
+        cudaEventSynchronize(readbackDone[readbackInFlight]);
+    }
+    pollReadback();
+    if (readbackReady < 0 || readbackIteration[readbackReady] != lastIteration)
+    {
+        startReadback(lastIteration);
+        cudaEventSynchronize(readbackDone[readbackInFlight]);
+        pollReadback();
+    }
+    copySnapshot(readbackReady, snapshot);
+    checkCUDAError("read image");
+}
+
+__global__ void kernOccluded(
+    int n,
+    const Ray* rays,
+    const float* tMax,
+    const CompactGeom* geoms,
+    BvhView bvh,
+    WideBvhView wideBvh,
+    MeshView meshes,
+    int* occluded)
+{
+    int index = blockIdx.x * blockDim.x + threadIdx.x;
+    if (index < n)
+    {
+        occluded[index] = occludedScene(rays[index], tMax[index], geoms, bvh, wideBvh, meshes);
+    }
+}
+
+void pathtraceOccluded(const Ray* rays, const float* tMax, int count, int* occluded)
+{
+    const int blockSize1d = 128;
+    dim3 numBlocks = (count + blockSize1d - 1) / blockSize1d;
+    kernOccluded<<<numBlocks, blockSize1d>>>(count, rays, tMax, dev_geoms, dev_bvh, dev_wideBvh, dev_meshes,
+        occluded);
+    checkCUDAError("occluded");
 }
@@ -6,4 +6,36 @@
 void InitDataContainer(GuiDataContainer* guiData);
 void pathtraceInit(Scene *scene);
 void pathtraceFree();
-void pathtrace(uchar4 *pbo, int frame, int iteration);
+// Render samples iteration, ..., iteration + samples - 1 into the image. A
+// background readback it starts is still running when it returns.
+void pathtrace(uchar4 *pbo, int frame, int iteration, int samples);
+
+/**
+ * Any-hit queries against the uploaded scene, one thread per ray: sets
+ * occluded[i] to 1 if something blocks rays[i] before tMax[i], else 0. All
+ * three are device arrays of `count` elements. Runs on the default stream
+ * and does not wait for it.
+ */
+void pathtraceOccluded(const Ray* rays, const float* tMax, int count, int* occluded);
+
+/**
+ * Accumulated image read back from the device: the sum of `iteration`
+ * samples per pixel, taken between two iterations so it is consistent.
+ */
+struct ImageSnapshot
+{
+    ImageSnapshot() : iteration(0) {}
+    int iteration;
+    std::vector<glm::vec3> image;
+};
+
+/**
+ * Copy the newest finished background readback into `snapshot` if it is
+ * newer than what `snapshot` holds. Never waits for the device.
+ *
+ * @return  Whether `snapshot` was updated.
+ */
+bool pathtraceLatestSnapshot(ImageSnapshot& snapshot);
+
+// Read back the image of the last rendered iteration, waiting for the copy.
+void pathtraceReadImage(ImageSnapshot& snapshot);
@@ -0,0 +1,727 @@
+#include "pathtraceCpu.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+#include "sceneStructs.h"
+#include "scene.h"
+#include "glm/glm.hpp"
+#include "utilities.h"
+#include "intersections.h"
+#include "interactions.h"
+#include "firstHitCache.h"
+#include "morton.h"
+#include "pathState.h"
+#include "rayPacket.h"
+#include "threadPool.h"
+#include "../stream_compaction/cpu.h"
+
+#define TILE_SIZE 16
+#define WAVEFRONT_CHUNK_SIZE 4096
+
+typedef std::chrono::high_resolution_clock Clock;
+
+/**
+ * Fixed-capacity queue of path indices that many threads append to. Each
+ * task collects its indices locally and reserves space with one atomic add,
+ * like the per-block slot reservation in computeIntersections.
+ */
+struct HostQueue
+{
+    std::vector<int> items;
+    std::atomic<int> count;
+
+    HostQueue() : count(0) {}
+
+    void append(const std::vector<int>& batch)
+    {
+        if (batch.empty())
+        {
+            return;
+        }
+        int offset = count.fetch_add((int)batch.size());
+        std::copy(batch.begin(), batch.end(), items.begin() + offset);
+    }
+};
+
+/**
+ * Host allocation behind a PathView or HitView. Swapping two of these swaps
+ * their storage and their views together.
+ */
+template <typename View>
+struct HostView : View
+{
+    std::vector<float4> storage;
+
+    void resize(int capacity)
+    {
+        storage.resize((View::bytes(capacity) + sizeof(float4) - 1) / sizeof(float4));
+        View::bind(storage.data(), capacity);
+    }
+
+    void release()
+    {
+        std::vector<float4>().swap(storage);
+    }
+};
+
+static Scene* hst_scene = NULL;
+// What the intersection tests read of hst_scene->geoms, built at init and
+// kept up to date by pathtraceCpuUpdateScene()
+static std::vector<CompactGeom> hst_geoms;
+static int compactedVersion = 0;
+static ThreadPool* pool = NULL;
+static CpuPipeline hst_pipeline = CPU_PIPELINE_TILES;
+static std::atomic<long long> raysTraced(0);
+static double renderSeconds = 0.0;
+static double stageMs[NUM_WAVEFRONT_STAGES];
+static SortTimings materialSortTimings;
+static std::vector<double> extendMsByDepth;
+static std::vector<double> rayOrderMsByDepth;
+
+static std::vector<int> activePaths;
+
+// Wavefront state, the host counterparts of the path, intersection, flag and
+// queue buffers in pathtrace.cu.
+static HostView<PathView> hst_paths;
+static HostView<PathView> hst_paths_scratch;
+static HostView<HitView> hst_intersections;
+static std::vector<int> hst_path_alive;
+static std::vector<int> hst_partition_indices;
+static HostQueue hst_shadeQueues[NUM_SHADE_QUEUES];
+static std::vector<int> hst_sort_keys;
+static std::vector<int> hst_sort_order;
+static HostView<HitView> hst_intersections_scratch;
+static HostView<ShadowView> hst_shadow_rays;
+
+// Depth-0 intersections in pixel order, shared by both pipelines
+static HostView<HitView> hst_first_hits;
+static FirstHitCache firstHitCache;
+
+void pathtraceCpuInit(Scene* scene, int numThreads, CpuPipeline pipeline)
+{
+    hst_scene = scene;
+    hst_geoms = compactGeoms(scene->geoms);
+    compactedVersion = scene->version;
+    scene->dirtyGeomRanges.clear();
+    scene->dirtyNodeRanges.clear();
+    hst_pipeline = pipeline;
+    pool = new ThreadPool(numThreads);
+    raysTraced = 0;
+    renderSeconds = 0.0;
+    std::fill(stageMs, stageMs + NUM_WAVEFRONT_STAGES, 0.0);
+    materialSortTimings = SortTimings();
+    extendMsByDepth.clear();
+    rayOrderMsByDepth.clear();
+
+    std::fill(scene->state.image.begin(), scene->state.image.end(), glm::vec3(0.0f));
+
+    const Camera& cam = scene->state.camera;
+    hst_first_hits.resize(cam.resolution.x * cam.resolution.y);
+    firstHitCache.invalidate();
+
+    if (pipeline == CPU_PIPELINE_WAVEFRONT)
+    {
+        const Camera& cam = hst_scene->state.camera;
+        const int pixelcount = cam.resolution.x * cam.resolution.y;
+
+        hst_paths.resize(pixelcount);
+        hst_paths_scratch.resize(pixelcount);
+        hst_intersections.resize(pixelcount);
+        hst_path_alive.resize(pixelcount);
+        hst_partition_indices.resize(pixelcount);
+        for (int q = 0; q < NUM_SHADE_QUEUES; q++)
+        {
+            hst_shadeQueues[q].items.resize(pixelcount);
+        }
+        hst_sort_keys.resize(pixelcount);
+        hst_sort_order.resize(pixelcount);
+        hst_intersections_scratch.resize(pixelcount);
+        hst_shadow_rays.resize(pixelcount);
+    }
+}
+
+void pathtraceCpuFree()
+{
+    delete pool;
+    pool = NULL;
+    std::vector<CompactGeom>().swap(hst_geoms);
+
+    hst_paths.release();
+    hst_paths_scratch.release();
+    hst_intersections.release();
+    std::vector<int>().swap(hst_path_alive);
+    std::vector<int>().swap(hst_partition_indices);
+    for (int q = 0; q < NUM_SHADE_QUEUES; q++)
+    {
+        std::vector<int>().swap(hst_shadeQueues[q].items);
+    }
+    std::vector<int>().swap(hst_sort_keys);
+    std::vector<int>().swap(hst_sort_order);
+    hst_intersections_scratch.release();
+    hst_shadow_rays.release();
+    hst_first_hits.release();
+    firstHitCache.invalidate();
+}
+
+// Adds the time since `start` to the stage's counter and returns it in ms
+static double addStageTime(WavefrontStage stage, Clock::time_point start)
+{
+    std::chrono::duration<double, std::milli> elapsed = Clock::now() - start;
+    stageMs[stage] += elapsed.count();
+    return elapsed.count();
+}
+
+static void addDepthTime(std::vector<double>& byDepth, int depth, double ms)
+{
+    if ((int)byDepth.size() <= depth)
+    {
+        byDepth.resize(depth + 1, 0.0);
+    }
+    byDepth[depth] += ms;
+}
+
+// Run fn(begin, end, thread) over [0, n) in chunks of WAVEFRONT_CHUNK_SIZE.
+template <typename Fn>
+static void forEachChunk(int n, const Fn& fn)
+{
+    const int chunks = (n + WAVEFRONT_CHUNK_SIZE - 1) / WAVEFRONT_CHUNK_SIZE;
+    pool->run(chunks, [&](int chunk, int thread)
+    {
+        const int begin = chunk * WAVEFRONT_CHUNK_SIZE;
+        const int end = glm::min(begin + WAVEFRONT_CHUNK_SIZE, n);
+        fn(begin, end, thread);
+    });
+}
+
+// The lights shading samples, none if next-event estimation is off
+static EmitterView sceneLights()
+{
+    const RenderState& state = hst_scene->state;
+    return state.nextEvent ? hst_scene->emitters.view(state.lightTree) : EmitterView();
+}
+
+// Shade one queue: the paths listed in hst_shadeQueues[queue], or, after a
+// material sort, the `count` paths starting at firstPath. Shadow rays go to
+// hst_shadow_rays.
+template <ShadeQueue queue>
+static void shadeHostQueue(int depth, bool sorted, int firstPath, int count)
+{
+    const Material* materials = hst_scene->materials.data();
+    const EmitterView lights = sceneLights();
+    const int rouletteDepth = hst_scene->state.rouletteDepth;
+    const SamplerKind sampler = hst_scene->state.sampler;
+    const HostQueue& queued = hst_shadeQueues[queue];
+
+    forEachChunk(count, [&](int begin, int end, int thread)
+    {
+        for (int i = begin; i < end; i++)
+        {
+            int path = sorted ? firstPath + i : queued.items[i];
+            PathSegment segment = hst_paths.load(path);
+            ShadowRay shadow;
+            hst_path_alive[path] = shadePath<queue>(depth, rouletteDepth, sampler, segment, hst_intersections.load(path),
+                materials, lights, shadow);
+            hst_paths.storeBounce(path, segment);
+            hst_shadow_rays.store(path, shadow);
+        }
+    });
+}
+
+/**
+ * Host copy of the wavefront bounce loop in pathtrace(): the same stages,
+ * queues, compaction and shading routines, with each stage spread over the
+ * thread pool.
+ */
+static void pathtraceWavefront(int iter)
+{
+    const int traceDepth = hst_scene->state.traceDepth;
+    const Camera& cam = hst_scene->state.camera;
+    const int pixelcount = cam.resolution.x * cam.resolution.y;
+    const CompactGeom* geoms = hst_geoms.data();
+    const BvhView bvh = hst_scene->bvh.view();
+    const WideBvhView wideBvh = hst_scene->wideBvh.view();
+    const MeshView meshes = hst_scene->meshes.view();
+    const Material* materials = hst_scene->materials.data();
+    glm::vec3* image = hst_scene->state.image.data();
+    const MaterialSortMode sortMode = hst_scene->state.materialSort;
+    const bool sortByMaterial = sortMode == SORT_ON || (sortMode == SORT_AB && iter % 2 == 0);
+    const int numMaterials = (int)hst_scene->materials.size();
+    const RenderState& state = hst_scene->state;
+    const bool cacheFirstHits = FirstHitCache::enabled(state);
+    const bool firstHitsCached = firstHitCache.valid(state);
+    const AABB sceneBounds = hst_scene->bvh.bounds();
+    const EmitterView lights = sceneLights();
+
+    // --- Generate ---
+    Clock::time_point start = Clock::now();
+    forEachChunk(pixelcount, [&](int begin, int end, int thread)
+    {
+        for (int index = begin; index < end; index++)
+        {
+            PathSegment segment;
+            generateCameraPath(cam, iter, index % cam.resolution.x, index / cam.resolution.x,
+                traceDepth, state.antialias, state.sampler, segment);
+            hst_paths.store(index, segment);
+        }
+    });
+    addStageTime(STAGE_GENERATE, start);
+
+    Clock::time_point bounceStart = Clock::now();
+    activePaths.clear();
+    int depth = 0;
+    int num_paths = pixelcount;
+    while (num_paths > 0)
+    {
+        activePaths.push_back(num_paths);
+
+        // --- Ray order ---
+        if (rayOrderAtDepth(state, depth))
+        {
+            start = Clock::now();
+            forEachChunk(num_paths, [&](int begin, int end, int thread)
+            {
+                for (int path = begin; path < end; path++)
+                {
+                    hst_sort_keys[path] = rayOrderKey(hst_paths.ray(path), sceneBounds);
+                    hst_sort_order[path] = path;
+                }
+            });
+            StreamCompaction::CPU::sortByKey(num_paths, RAY_ORDER_KEY_BITS, hst_sort_keys.data(), hst_sort_order.data(), pool);
+            forEachChunk(num_paths, [&](int begin, int end, int thread)
+            {
+                for (int i = begin; i < end; i++)
+                {
+                    hst_paths_scratch.copy(i, hst_paths, hst_sort_order[i]);
+                }
+            });
+            std::swap(hst_paths, hst_paths_scratch);
+            addDepthTime(rayOrderMsByDepth, depth, addStageTime(STAGE_RAY_ORDER, start));
+        }
+
+        // --- Extend ---
+        start = Clock::now();
+        for (int q = 0; q < NUM_SHADE_QUEUES; q++)
+        {
+            hst_shadeQueues[q].count = 0;
+        }
+        // Paths are still in pixel order at depth 0, so cached hits line up
+        const bool useCachedHits = depth == 0 && firstHitsCached;
+        const bool storeHits = depth == 0 && cacheFirstHits && !firstHitsCached;
+        forEachChunk(num_paths, [&](int begin, int end, int thread)
+        {
+            std::vector<int> queued[NUM_SHADE_QUEUES];
+            for (int path = begin; path < end; path++)
+            {
+                ShadeableIntersection intersection;
+                if (useCachedHits)
+                {
+                    intersection = hst_first_hits.load(path);
+                }
+                else
+                {
+                    intersectScene(hst_paths.ray(path), geoms, bvh, wideBvh, meshes, intersection);
+                }
+                hst_intersections.store(path, intersection);
+                if (storeHits)
+                {
+                    hst_first_hits.store(path, intersection);
+                }
+                queued[classifyIntersection(intersection, materials)].push_back(path);
+            }
+            for (int q = 0; q < NUM_SHADE_QUEUES; q++)
+            {
+                hst_shadeQueues[q].append(queued[q]);
+            }
+        });
+        if (storeHits)
+        {
+            firstHitCache.store(state);
+        }
+        if (!useCachedHits)
+        {
+            raysTraced += num_paths;
+        }
+        addDepthTime(extendMsByDepth, depth, addStageTime(STAGE_EXTEND, start));
+
+        // --- Material sort ---
+        if (sortByMaterial)
+        {
+            start = Clock::now();
+            forEachChunk(num_paths, [&](int begin, int end, int thread)
+            {
+                for (int path = begin; path < end; path++)
+                {
+                    ShadeableIntersection intersection;
+                    intersection.t = hst_intersections.t(path);
+                    intersection.materialId = hst_intersections.materialId[path];
+                    hst_sort_keys[path] = materialSortKey(intersection, materials, numMaterials);
+                    hst_sort_order[path] = path;
+                }
+            });
+            StreamCompaction::CPU::sortByKey(
+                num_paths, materialSortKeyBits(numMaterials), hst_sort_keys.data(), hst_sort_order.data(), pool);
+            forEachChunk(num_paths, [&](int begin, int end, int thread)
+            {
+                for (int i = begin; i < end; i++)
+                {
+                    hst_paths_scratch.copy(i, hst_paths, hst_sort_order[i]);
+                    hst_intersections_scratch.copy(i, hst_intersections, hst_sort_order[i]);
+                }
+            });
+            std::swap(hst_paths, hst_paths_scratch);
+            std::swap(hst_intersections, hst_intersections_scratch);
+            addStageTime(STAGE_SORT, start);
+        }
+
+        // --- Shade, one queue at a time ---
+        const int numDiffuse = hst_shadeQueues[QUEUE_DIFFUSE].count;
+        const int numSpecular = hst_shadeQueues[QUEUE_SPECULAR].count;
+        const int numTerminated = hst_shadeQueues[QUEUE_TERMINATED].count;
+        start = Clock::now();
+        shadeHostQueue<QUEUE_DIFFUSE>(depth, sortByMaterial, 0, numDiffuse);
+        addStageTime(STAGE_SHADE_DIFFUSE, start);
+        start = Clock::now();
+        shadeHostQueue<QUEUE_SPECULAR>(depth, sortByMaterial, numDiffuse, numSpecular);
+        addStageTime(STAGE_SHADE_SPECULAR, start);
+        start = Clock::now();
+        shadeHostQueue<QUEUE_TERMINATED>(depth, sortByMaterial, numDiffuse + numSpecular, numTerminated);
+        addStageTime(STAGE_SHADE_TERMINATED, start);
+
+        // --- Shadow rays of the diffuse hits ---
+        if (lights.count > 0)
+        {
+            start = Clock::now();
+            forEachChunk(num_paths, [&](int begin, int end, int thread)
+            {
+                int traced = 0;
+                for (int path = begin; path < end; path++)
+                {
+                    const float tMax = hst_shadow_rays.tMax[path];
+                    if (tMax > 0.0f)
+                    {
+                        traced++;
+                        if (!occludedScene(hst_shadow_rays.ray(path), tMax, geoms, bvh, wideBvh, meshes))
+                        {
+                            hst_paths.radiance.set(path, hst_paths.radiance.get(path) + hst_shadow_rays.radiance.get(path));
+                        }
+                    }
+                }
+                raysTraced += traced;
+            });
+            addStageTime(STAGE_SHADOW, start);
+        }
+
+        // --- Compact ---
+        start = Clock::now();
+        const int num_alive = StreamCompaction::CPU::partition(num_paths, hst_partition_indices.data(), hst_path_alive.data(), pool);
+        if (num_alive < num_paths)
+        {
+            forEachChunk(num_paths, [&](int begin, int end, int thread)
+            {
+                for (int i = begin; i < end; i++)
+                {
+                    // Terminated paths only need their result for the gather
+                    int slot = hst_partition_indices[i];
+                    if (slot < num_alive)
+                    {
+                        hst_paths_scratch.copy(slot, hst_paths, i);
+                    }
+                    else
+                    {
+                        hst_paths_scratch.copyResult(slot, hst_paths, i);
+                    }
+                }
+            });
+            std::swap(hst_paths, hst_paths_scratch);
+        }
+        addStageTime(STAGE_COMPACT, start);
+
+        // --- Gather the paths that terminated at this depth ---
+        start = Clock::now();
+        forEachChunk(num_paths - num_alive, [&](int begin, int end, int thread)
+        {
+            for (int i = num_alive + begin; i < num_alive + end; i++)
+            {
+                image[hst_paths.pixelIndex[i]] += hst_paths.result(i);
+            }
+        });
+        addStageTime(STAGE_GATHER, start);
+
+        num_paths = num_alive;
+        depth++;
+    }
+
+    std::chrono::duration<double, std::milli> bounceMs = Clock::now() - bounceStart;
+    materialSortTimings.ms[sortByMaterial] += bounceMs.count();
+    materialSortTimings.iterations[sortByMaterial]++;
+}
+
+/**
+ * Trace a single path from its camera ray until it escapes, hits a light or
+ * runs out of bounces, with the shadow ray of each diffuse hit traced right
+ * away. This is the host equivalent of one thread's work across every depth
+ * of the CUDA bounce loop.
+ *
+ * @param firstHits  Depth-0 intersections by pixel: used as is if `cached`,
+ *                   otherwise traced and written back.
+ * @param active     Paths entering each depth, incremented for this path.
+ * @return  Number of rays that were intersected with the scene.
+ */
+static int tracePath(
+    PathSegment& segment,
+    const CompactGeom* geoms,
+    BvhView bvh,
+    WideBvhView wideBvh,
+    MeshView meshes,
+    const Material* materials,
+    const EmitterView& lights,
+    int rouletteDepth,
+    SamplerKind sampler,
+    const HitView& firstHits,
+    bool cached,
+    std::vector<int>& active)
+{
+    int rays = 0;
+    int depth = 0;
+    bool alive = true;
+    while (alive)
+    {
+        if ((int)active.size() <= depth)
+        {
+            active.push_back(0);
+        }
+        active[depth]++;
+
+        ShadeableIntersection intersection;
+        if (depth == 0 && cached)
+        {
+            intersection = firstHits.load(segment.pixelIndex);
+        }
+        else
+        {
+            intersectScene(segment.ray, geoms, bvh, wideBvh, meshes, intersection);
+            rays++;
+            if (depth == 0)
+            {
+                firstHits.store(segment.pixelIndex, intersection);
+            }
+        }
+
+        ShadeQueue queue = classifyIntersection(intersection, materials);
+        ShadowRay shadow;
+        alive = shadePath(queue, depth, rouletteDepth, sampler, segment, intersection, materials, lights, shadow);
+        if (shadow.tMax > 0.0f)
+        {
+            rays++;
+            if (!occludedScene(shadow.ray, shadow.tMax, geoms, bvh, wideBvh, meshes))
+            {
+                segment.radiance += shadow.radiance;
+            }
+        }
+        depth++;
+    }
+    return rays;
+}
+
+/**
+ * Intersect the camera rays of `count` paths as one packet and store the
+ * hits in `firstHits`, from where tracePath continues each path with single
+ * rays. Bounced rays scatter too much to share a traversal.
+ */
+static void tracePacket(
+    const PathSegment* segments,
+    int count,
+    const CompactGeom* geoms,
+    BvhView bvh,
+    MeshView meshes,
+    const HitView& firstHits)
+{
+    RayPacket packet;
+    packet.count = count;
+    for (int i = 0; i < count; i++)
+    {
+        packet.rays[i] = segments[i].ray;
+    }
+    packet.prepare();
+
+    ShadeableIntersection hits[PACKET_RAYS];
+    intersectPacket(packet, geoms, bvh, meshes, hits);
+    for (int i = 0; i < count; i++)
+    {
+        firstHits.store(segments[i].pixelIndex, hits[i]);
+    }
+}
+
+/**
+ * Render one iteration tile by tile. Each task traces complete paths for
+ * every pixel of one TILE_SIZE x TILE_SIZE tile, in blocks of PACKET_SIZE x
+ * PACKET_SIZE pixels whose camera rays may go through tracePacket.
+ */
+static void pathtraceTiles(int iter)
+{
+    const int traceDepth = hst_scene->state.traceDepth;
+    const Camera& cam = hst_scene->state.camera;
+    const CompactGeom* geoms = hst_geoms.data();
+    const BvhView bvh = hst_scene->bvh.view();
+    const WideBvhView wideBvh = hst_scene->wideBvh.view();
+    const MeshView meshes = hst_scene->meshes.view();
+    const Material* materials = hst_scene->materials.data();
+    const EmitterView lights = sceneLights();
+    glm::vec3* image = hst_scene->state.image.data();
+    const RenderState& state = hst_scene->state;
+    const bool firstHitsCached = firstHitCache.valid(state);
+
+    const int tilesX = (cam.resolution.x + TILE_SIZE - 1) / TILE_SIZE;
+    const int tilesY = (cam.resolution.y + TILE_SIZE - 1) / TILE_SIZE;
+
+    // Per-thread path counts by depth, merged into activePaths afterwards
+    std::vector<std::vector<int> > threadActive(pool->size());
+
+    // Each tile writes a disjoint set of pixels, so no synchronization is
+    // needed on the accumulation buffer.
+    pool->run(tilesX * tilesY, [&](int tile, int thread)
+    {
+        const int x0 = (tile % tilesX) * TILE_SIZE;
+        const int y0 = (tile / tilesX) * TILE_SIZE;
+        const int x1 = glm::min(x0 + TILE_SIZE, cam.resolution.x);
+        const int y1 = glm::min(y0 + TILE_SIZE, cam.resolution.y);
+
+        long long rays = 0;
+        for (int by = y0; by < y1; by += PACKET_SIZE)
+        {
+            for (int bx = x0; bx < x1; bx += PACKET_SIZE)
+            {
+                PathSegment segments[PACKET_RAYS];
+                int count = 0;
+                for (int y = by; y < glm::min(by + PACKET_SIZE, y1); y++)
+                {
+                    for (int x = bx; x < glm::min(bx + PACKET_SIZE, x1); x++)
+                    {
+                        generateCameraPath(cam, iter, x, y, traceDepth, state.antialias, state.sampler,
+                            segments[count++]);
+                    }
+                }
+
+                bool cached = firstHitsCached;
+                if (state.packetRays && !cached)
+                {
+                    tracePacket(segments, count, geoms, bvh, meshes, hst_first_hits);
+                    rays += count;
+                    cached = true;
+                }
+                for (int i = 0; i < count; i++)
+                {
+                    rays += tracePath(segments[i], geoms, bvh, wideBvh, meshes, materials, lights, state.rouletteDepth,
+                        state.sampler, hst_first_hits, cached, threadActive[thread]);
+                    image[segments[i].pixelIndex] += segments[i].radiance;
+                }
+            }
+        }
+        raysTraced += rays;
+    });
+
+    activePaths.clear();
+    for (size_t t = 0; t < threadActive.size(); t++)
+    {
+        const std::vector<int>& active = threadActive[t];
+        activePaths.resize(glm::max(activePaths.size(), active.size()), 0);
+        for (size_t depth = 0; depth < active.size(); depth++)
+        {
+            activePaths[depth] += active[depth];
+        }
+    }
+
+    // Every camera ray traced above wrote its hit to hst_first_hits, also
+    // with jitter, when the hits must not be reused later
+    if (!firstHitsCached && FirstHitCache::enabled(state))
+    {
+        firstHitCache.store(state);
+    }
+    else if (!firstHitsCached)
+    {
+        firstHitCache.invalidate();
+    }
+}
+
+int pathtraceCpuUpdateScene()
+{
+    int bytes = 0;
+    if (hst_scene->version != compactedVersion)
+    {
+        hst_geoms = compactGeoms(hst_scene->geoms);
+        compactedVersion = hst_scene->version;
+        bytes = (int)(hst_geoms.size() * sizeof(CompactGeom));
+    }
+    else
+    {
+        const std::vector<IndexRange>& ranges = hst_scene->dirtyGeomRanges;
+        for (size_t r = 0; r < ranges.size(); r++)
+        {
+            for (int i = ranges[r].begin; i < ranges[r].end; i++)
+            {
+                hst_geoms[i] = compactGeom(hst_scene->geoms[i]);
+            }
+            bytes += (ranges[r].end - ranges[r].begin) * sizeof(CompactGeom);
+        }
+    }
+    // The BVH, meshes and emitters are read from the scene as they are
+    hst_scene->dirtyGeomRanges.clear();
+    hst_scene->dirtyNodeRanges.clear();
+    if (bytes > 0)
+    {
+        firstHitCache.invalidate();
+    }
+    return bytes;
+}
+
+void pathtraceCpu(int iter)
+{
+    pathtraceCpuUpdateScene();
+    Clock::time_point start = Clock::now();
+
+    if (hst_pipeline == CPU_PIPELINE_WAVEFRONT)
+    {
+        pathtraceWavefront(iter);
+    }
+    else
+    {
+        pathtraceTiles(iter);
+    }
+
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+    renderSeconds += elapsed.count();
+}
+
+CpuRenderStats pathtraceCpuStats()
+{
+    CpuRenderStats stats;
+    stats.threads = pool ? pool->size() : 0;
+    stats.rays = raysTraced;
+    stats.seconds = renderSeconds;
+    stats.steals = pool ? pool->lastStealCount() : 0;
+    std::copy(stageMs, stageMs + NUM_WAVEFRONT_STAGES, stats.stageMs);
+    stats.activePaths = activePaths;
+    stats.materialSort = materialSortTimings;
+    stats.extendMs = extendMsByDepth;
+    stats.rayOrderMs = rayOrderMsByDepth;
+    return stats;
+}
+
+void pathtraceCpuOccluded(const Ray* rays, const float* tMax, int count, int* occluded)
+{
+    pathtraceCpuUpdateScene();
+    const CompactGeom* geoms = hst_geoms.data();
+    const BvhView bvh = hst_scene->bvh.view();
+    const WideBvhView wideBvh = hst_scene->wideBvh.view();
+    const MeshView meshes = hst_scene->meshes.view();
+    forEachChunk(count, [&](int begin, int end, int thread)
+    {
+        for (int i = begin; i < end; i++)
+        {
+            occluded[i] = occludedScene(rays[i], tMax[i], geoms, bvh, wideBvh, meshes);
+        }
+    });
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <vector>
+#include "scene.h"
+
+/**
+ * Multithreaded host backend for machines without a CUDA device.
+ *
+ * It runs the same __host__ __device__ intersection and shading routines as
+ * the CUDA kernels, either one image tile per task or as a host copy of the
+ * wavefront queue pipeline, and accumulates into
+ * `scene->state.image` using the same layout as `dev_image` (one summed
+ * radiance value per pixel, row-major).
+ */
+
+enum CpuPipeline
+{
+    CPU_PIPELINE_TILES,     // each task traces whole paths for one image tile
+    CPU_PIPELINE_WAVEFRONT  // the same queue-based stages as the CUDA bounce loop
+};
+
+struct CpuRenderStats
+{
+    int threads;
+    long long rays;         // ray-scene intersection queries, all iterations
+    double seconds;         // wall-clock time spent inside pathtraceCpu()
+    int steals;             // tasks stolen in the most recent iteration
+    double stageMs[NUM_WAVEFRONT_STAGES]; // wavefront pipeline only, all iterations
+    std::vector<int> activePaths;   // paths entering each depth in the last iteration
+    SortTimings materialSort;       // wavefront pipeline only, bounce loop time with and without material sort
+    std::vector<double> extendMs;   // wavefront pipeline only, extend stage time per depth, all iterations
+    std::vector<double> rayOrderMs; // wavefront pipeline only, ray order stage time per depth, all iterations
+};
+
+void pathtraceCpuInit(Scene* scene, int numThreads, CpuPipeline pipeline);
+void pathtraceCpuFree();
+void pathtraceCpu(int iteration);
+
+/**
+ * Pick up the geoms Scene::updateGeoms() moved since the last call: compact
+ * just the dirty ranges, or every geom after a rebuild bumped the scene's
+ * version, and clear the ranges like pathtraceInit() does. Rendering and
+ * occlusion queries call this first; moved geoms also invalidate the
+ * first-hit cache. The caller restarts the image.
+ *
+ * @return  Bytes of compacted geoms rewritten.
+ */
+int pathtraceCpuUpdateScene();
+
+CpuRenderStats pathtraceCpuStats();
+
+/**
+ * Any-hit queries against the scene given to pathtraceCpuInit, on its
+ * threads: sets occluded[i] to 1 if something blocks rays[i] before
+ * tMax[i], else 0.
+ */
+void pathtraceCpuOccluded(const Ray* rays, const float* tMax, int count, int* occluded);
@@ -1,4 +1,5 @@
 //#define _CRT_SECURE_NO_DEPRECATE
+#include <cstdio>
 #include <ctime>
 #include "main.h"
 #include "preview.h"
@@ -235,6 +236,92 @@ void RenderImGui()
     //ImGui::SameLine();
     //ImGui::Text("counter = %d", counter);
     ImGui::Text("Traced Depth %d", imguiData->TracedDepth);
+    if (ImGui::CollapsingHeader("Wavefront stages (ms)", ImGuiTreeNodeFlags_DefaultOpen))
+    {
+        for (int i = 0; i < NUM_WAVEFRONT_STAGES; i++)
+        {
+            ImGui::Text("%-18s %8.3f", wavefrontStageNames[i], imguiData->StageMs[i]);
+        }
+    }
+    if (ImGui::CollapsingHeader("Active paths per depth") && !imguiData->ActivePaths.empty())
+    {
+        std::vector<float> counts(imguiData->ActivePaths.begin(), imguiData->ActivePaths.end());
+        ImGui::Text("Average path length %.2f", utilityCore::averagePathLength(imguiData->ActivePaths));
+        ImGui::PlotHistogram("##activepaths", counts.data(), (int)counts.size(), 0, NULL, 0.0f, counts[0], ImVec2(0, 80));
+        for (size_t depth = 0; depth < imguiData->ActivePaths.size(); depth++)
+        {
+            ImGui::Text("Depth %2d: %d", (int)depth, imguiData->ActivePaths[depth]);
+        }
+    }
+    if (ImGui::CollapsingHeader("Device memory"))
+    {
+        const BufferPoolStats& pool = imguiData->DevicePool;
+        ImGui::Text("Live buffers   %d (%.1f MB)", pool.liveBuffers, pool.liveBytes / (1024.0 * 1024.0));
+        ImGui::Text("Allocations    %d (%.1f MB total)", pool.allocations, pool.bytesAllocated / (1024.0 * 1024.0));
+        ImGui::Text("Scene uploads  %d", imguiData->SceneUploads);
+        ImGui::Text("Geom updates   %d (%.1f KB last)", imguiData->GeomUpdates, imguiData->GeomUpdateBytes / 1024.0);
+        // Used to be a blocking copy at the end of every iteration
+        ImGui::Text("Image readback %.3f ms, in the background", imguiData->ReadbackMs);
+    }
+    // Cached and traced first hits are identical, so this does not restart
+    // accumulation. It has no effect while antialiasing jitters the rays.
+    ImGui::Checkbox("Cache first hits", &scene->state.cacheFirstHits);
+    // Does not change the image either; path buffers grow on the next launch.
+    ImGui::SliderInt("Samples per launch", &scene->state.samplesPerLaunch, 1, 16);
+    // Roulette keeps the image unbiased, so changing it does not restart
+    // accumulation either; -1 turns it off.
+    ImGui::SliderInt("Roulette depth", &scene->state.rouletteDepth, -1, scene->state.traceDepth);
+    // Light sampling is weighed against finding the lights by chance, so
+    // both converge to the same image and accumulation keeps going too.
+    ImGui::Checkbox("Next-event estimation", &scene->state.nextEvent);
+    ImGui::Checkbox("Light tree", &scene->state.lightTree);
+    // Either generator gives independent samples, so switching mid-run
+    // keeps accumulating as well.
+    static const char* samplers[] = { "PCG (counter-based)", "minstd (thrust)" };
+    int sampler = scene->state.sampler;
+    if (ImGui::Combo("Sampler", &sampler, samplers, IM_ARRAYSIZE(samplers)))
+    {
+        scene->state.sampler = (SamplerKind)sampler;
+    }
+    if (ImGui::CollapsingHeader("Material sort"))
+    {
+        // Changing the mode takes effect on the next iteration; the image
+        // does not depend on it, so accumulation keeps going.
+        static const char* sortModes[] = { "Off", "On", "A/B (alternate)" };
+        int mode = scene->state.materialSort;
+        if (ImGui::Combo("Mode", &mode, sortModes, IM_ARRAYSIZE(sortModes)))
+        {
+            scene->state.materialSort = (MaterialSortMode)mode;
+            imguiData->MaterialSortTimings = SortTimings();
+        }
+        const SortTimings& sort = imguiData->MaterialSortTimings;
+        double avgMs[2] = {};
+        for (int sorted = 0; sorted < 2; sorted++)
+        {
+            avgMs[sorted] = sort.iterations[sorted] > 0 ? sort.ms[sorted] / sort.iterations[sorted] : 0.0;
+        }
+        ImGui::Text("Bounce loop unsorted %8.3f ms (%d iterations)", avgMs[0], sort.iterations[0]);
+        ImGui::Text("Bounce loop sorted   %8.3f ms (%d iterations)", avgMs[1], sort.iterations[1]);
+        if (avgMs[0] > 0.0 && avgMs[1] > 0.0)
+        {
+            ImGui::Text("Speedup %.2fx", avgMs[0] / avgMs[1]);
+        }
+    }
+    if (ImGui::CollapsingHeader("Ray order"))
+    {
+        // Sorting paths by ray before a depth does not change the image
+        // either; its cost shows up as the "Ray order" stage.
+        for (int depth = 1; depth < std::min(scene->state.traceDepth, 32); depth++)
+        {
+            bool sorted = rayOrderAtDepth(scene->state, depth);
+            char label[32];
+            snprintf(label, sizeof(label), "Before depth %d", depth);
+            if (ImGui::Checkbox(label, &sorted))
+            {
+                scene->state.rayOrderDepths ^= 1u << depth;
+            }
+        }
+    }
     ImGui::Text("Application average %.3f ms/frame (%.1f FPS)", 1000.0f / ImGui::GetIO().Framerate, ImGui::GetIO().Framerate);
     ImGui::End();
 
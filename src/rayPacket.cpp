@@ -0,0 +1,225 @@
+#include "rayPacket.h"
+
+#include <algorithm>
+#include <cfloat>
+
+#include "intersections.h"
+
+// Side planes are pushed out by this share of the packet's extent, plus an
+// absolute amount, so rounding never culls a box an edge ray touches
+#define PACKET_FRUSTUM_SLACK 1e-4f
+#define PACKET_FRUSTUM_MIN_SLACK 1e-6f
+
+namespace
+{
+    // Whether the whole box is on the outer side of one of the planes
+    bool outsideFrustum(const RayPacket& packet, const glm::vec3& boxMin, const glm::vec3& boxMax)
+    {
+        for (int p = 0; p < 5; p++)
+        {
+            const glm::vec3& n = packet.planes[p];
+            const glm::vec3 corner(n.x >= 0.0f ? boxMax.x : boxMin.x, n.y >= 0.0f ? boxMax.y : boxMin.y,
+                n.z >= 0.0f ? boxMax.z : boxMin.z);
+            if (glm::dot(n, corner - packet.origin) < 0.0f)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    struct PacketEntry
+    {
+        int node;
+        int firstActive;    // rays before this one missed an ancestor
+    };
+}
+
+void RayPacket::prepare()
+{
+    hasFrustum = count > 0;
+    glm::vec3 sum(0.0f);
+    for (int i = 0; i < count && hasFrustum; i++)
+    {
+        hasFrustum = rays[i].origin == rays[0].origin;
+        sum += glm::normalize(rays[i].direction);
+    }
+    if (!hasFrustum || glm::length(sum) == 0.0f)
+    {
+        hasFrustum = false;
+        return;
+    }
+    origin = rays[0].origin;
+
+    // A basis around the mean direction, and each ray's slopes in it
+    const glm::vec3 view = glm::normalize(sum);
+    const glm::vec3 a = glm::abs(view);
+    const glm::vec3 axis = a.x < a.y ? (a.x < a.z ? glm::vec3(1, 0, 0) : glm::vec3(0, 0, 1))
+        : (a.y < a.z ? glm::vec3(0, 1, 0) : glm::vec3(0, 0, 1));
+    const glm::vec3 right = glm::normalize(glm::cross(view, axis));
+    const glm::vec3 up = glm::cross(right, view);
+    float uMin = FLT_MAX;
+    float uMax = -FLT_MAX;
+    float vMin = FLT_MAX;
+    float vMax = -FLT_MAX;
+    for (int i = 0; i < count; i++)
+    {
+        const glm::vec3& d = rays[i].direction;
+        const float forward = glm::dot(d, view);
+        if (!(forward > 0.0f))
+        {
+            hasFrustum = false;
+            return;
+        }
+        const float u = glm::dot(d, right) / forward;
+        const float v = glm::dot(d, up) / forward;
+        uMin = std::min(uMin, u);
+        uMax = std::max(uMax, u);
+        vMin = std::min(vMin, v);
+        vMax = std::max(vMax, v);
+    }
+    const float uSlack = PACKET_FRUSTUM_SLACK * (uMax - uMin) + PACKET_FRUSTUM_MIN_SLACK * (1.0f + std::abs(uMin) + std::abs(uMax));
+    const float vSlack = PACKET_FRUSTUM_SLACK * (vMax - vMin) + PACKET_FRUSTUM_MIN_SLACK * (1.0f + std::abs(vMin) + std::abs(vMax));
+    uMin -= uSlack;
+    uMax += uSlack;
+    vMin -= vSlack;
+    vMax += vSlack;
+
+    // Inside means u >= uMin etc. for points ahead of the origin
+    planes[0] = right - uMin * view;
+    planes[1] = uMax * view - right;
+    planes[2] = up - vMin * view;
+    planes[3] = vMax * view - up;
+    planes[4] = view;
+}
+
+void intersectPacket(
+    const RayPacket& packet,
+    const CompactGeom* geoms,
+    BvhView bvh,
+    MeshView meshes,
+    ShadeableIntersection* hits,
+    PacketStats* stats)
+{
+    glm::vec3 invDir[PACKET_RAYS];
+    float tMin[PACKET_RAYS];
+    int hitGeom[PACKET_RAYS];
+    glm::vec3 normal[PACKET_RAYS];
+    for (int i = 0; i < packet.count; i++)
+    {
+        invDir[i] = 1.0f / glm::normalize(packet.rays[i].direction);
+        tMin[i] = FLT_MAX;
+        hitGeom[i] = -1;
+    }
+
+    // Both children go on the stack, so it holds at most one more entry
+    // than the tree has levels
+    PacketEntry stack[BVH_STACK_SIZE + 1];
+    int stackSize = 0;
+    if (bvh.numNodes > 0 && packet.count > 0)
+    {
+        stack[stackSize++] = { 0, 0 };
+    }
+    glm::vec3 tmp_intersect;
+    glm::vec3 tmp_normal;
+    bool outside;
+    while (stackSize > 0)
+    {
+        const PacketEntry entry = stack[--stackSize];
+        const BvhNode& n = bvh.nodes[entry.node];
+        if (stats)
+        {
+            stats->nodes++;
+        }
+        if (packet.hasFrustum && outsideFrustum(packet, n.boundsMin, n.boundsMax))
+        {
+            if (stats)
+            {
+                stats->culled++;
+            }
+            continue;
+        }
+
+        int first = entry.firstActive;
+        float tEntry;
+        while (first < packet.count && !rayIntersectsBox(n.boundsMin, n.boundsMax, packet.rays[first].origin,
+            invDir[first], tMin[first], tEntry))
+        {
+            first++;
+        }
+        if (stats)
+        {
+            stats->rayBoxTests += std::min(first + 1, packet.count) - entry.firstActive;
+        }
+        if (first == packet.count)
+        {
+            continue;
+        }
+
+        if (n.primCount > 0)
+        {
+            for (int r = first; r < packet.count; r++)
+            {
+                if (r > first)
+                {
+                    if (stats)
+                    {
+                        stats->rayBoxTests++;
+                    }
+                    if (!rayIntersectsBox(n.boundsMin, n.boundsMax, packet.rays[r].origin, invDir[r], tMin[r], tEntry))
+                    {
+                        continue;
+                    }
+                }
+                for (int i = 0; i < n.primCount; i++)
+                {
+                    int g = bvh.primIndices[n.rightOrFirst + i];
+                    float t = geomIntersectionTest(geoms[g], packet.rays[r], meshes, tmp_intersect, tmp_normal, outside);
+
+                    // On a tie the lowest index wins, as in the linear search
+                    if (t > 0.0f && (t < tMin[r] || (t == tMin[r] && g < hitGeom[r])))
+                    {
+                        tMin[r] = t;
+                        hitGeom[r] = g;
+                        normal[r] = tmp_normal;
+                    }
+                }
+            }
+            continue;
+        }
+
+        // Nearer child for the first active ray on top
+        int near = entry.node + 1;
+        int far = n.rightOrFirst;
+        float tNear;
+        float tFar;
+        const Ray& lead = packet.rays[first];
+        bool hitNear = rayIntersectsBox(bvh.nodes[near].boundsMin, bvh.nodes[near].boundsMax, lead.origin,
+            invDir[first], tMin[first], tNear);
+        bool hitFar = rayIntersectsBox(bvh.nodes[far].boundsMin, bvh.nodes[far].boundsMax, lead.origin,
+            invDir[first], tMin[first], tFar);
+        if ((hitFar && !hitNear) || (hitNear && hitFar && tFar < tNear))
+        {
+            int swap = near;
+            near = far;
+            far = swap;
+        }
+        stack[stackSize++] = { far, first };
+        stack[stackSize++] = { near, first };
+    }
+
+    for (int i = 0; i < packet.count; i++)
+    {
+        if (hitGeom[i] == -1)
+        {
+            hits[i].t = -1.0f;
+        }
+        else
+        {
+            hits[i].t = tMin[i];
+            hits[i].materialId = geoms[hitGeom[i]].materialId();
+            hits[i].geomId = hitGeom[i];
+            hits[i].surfaceNormal = normal[i];
+        }
+    }
+}
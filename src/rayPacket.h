@@ -0,0 +1,59 @@
+#pragma once
+
+#include "bvh.h"
+#include "mesh.h"
+#include "sceneStructs.h"
+
+// Edge of the square pixel block traced as one packet
+#define PACKET_SIZE 8
+#define PACKET_RAYS (PACKET_SIZE * PACKET_SIZE)
+
+/**
+ * Up to PACKET_RAYS coherent rays traced through the BVH together. When
+ * they share an origin, as camera rays do, prepare() bounds them with a
+ * frustum of four side planes and a near plane through the origin, so a
+ * node outside it is dropped with one test for the whole packet.
+ */
+struct RayPacket
+{
+    Ray rays[PACKET_RAYS];
+    int count;
+
+    // Set by prepare()
+    bool hasFrustum;
+    glm::vec3 origin;
+    glm::vec3 planes[5];    // normals through `origin`, pointing inwards
+
+    // Compute the frustum after the rays are filled in
+    void prepare();
+};
+
+/**
+ * Work done by one packet traversal
+ */
+struct PacketStats
+{
+    int nodes;              // nodes the packet visited
+    int culled;             // of those, dropped by the frustum alone
+    int rayBoxTests;
+};
+
+/**
+ * Closest hit of every ray of `packet` with `geoms`: the same result per
+ * ray as intersectBvh. The packet walks the BVH as one, nearest child first
+ * for its first active ray. Each node is first tested against the frustum,
+ * then the rays are tested from the first one still active in the parent
+ * until one enters its box, and rays before that one are skipped further
+ * down (Wald, Boulos and Shirley, 2007). In a leaf each remaining ray that
+ * enters the box tests the primitives on its own.
+ *
+ * @param hits   Output parameter, one intersection per ray.
+ * @param stats  Where to count the work, or NULL.
+ */
+void intersectPacket(
+    const RayPacket& packet,
+    const CompactGeom* geoms,
+    BvhView bvh,
+    MeshView meshes,
+    ShadeableIntersection* hits,
+    PacketStats* stats = NULL);
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <thrust/random.h>
+#include "intersections.h"
+#include "sceneStructs.h"
+
+/**
+ * Build a random engine seeded uniquely for one path at one bounce of one
+ * iteration. Both the CUDA kernels and the CPU backend seed through here so
+ * that they draw the same random sequences.
+ */
+__host__ __device__ inline thrust::default_random_engine makeSeededRandomEngine(int iter, int index, int depth)
+{
+    int h = utilhash((1 << 31) | (depth << 22) | iter) ^ utilhash(index);
+    return thrust::default_random_engine(h);
+}
+
+/**
+ * The pcg4d hash of Jarzynski and Olano (2020), in place: every output word
+ * depends on every input bit. Each step can be undone, so distinct inputs
+ * never give the same output.
+ */
+__host__ __device__ inline void pcg4d(unsigned int& x, unsigned int& y, unsigned int& z, unsigned int& w)
+{
+    x = x * 1664525u + 1013904223u;
+    y = y * 1664525u + 1013904223u;
+    z = z * 1664525u + 1013904223u;
+    w = w * 1664525u + 1013904223u;
+    x += y * w;
+    y += z * x;
+    z += x * y;
+    w += y * z;
+    x ^= x >> 16;
+    y ^= y >> 16;
+    z ^= z >> 16;
+    w ^= w >> 16;
+    x += y * w;
+    y += z * x;
+    z += x * y;
+    w += y * z;
+}
+
+/**
+ * Uniform random numbers in [0, 1) for one path at one bounce of one
+ * iteration, drawn with the generator `kind` picks.
+ *
+ * SAMPLER_PCG is counter-based: number d of the path is word d % 4 of
+ * pcg4d(pixel, sample, depth, d / 4), so the key and a counter are all the
+ * state there is, and setting one up costs nothing. Paths never share a
+ * sequence. SAMPLER_MINSTD is the thrust engine seeded by
+ * makeSeededRandomEngine, which hashes the key down to one 31-bit seed.
+ */
+struct Sampler
+{
+    __host__ __device__ Sampler(SamplerKind kind, int iter, int index, int depth)
+        : kind(kind), pixel(index), sample(iter), depth(depth), block(0), remaining(0)
+    {
+        if (kind == SAMPLER_MINSTD)
+        {
+            engine = makeSeededRandomEngine(iter, index, depth);
+        }
+    }
+
+    __host__ __device__ float next()
+    {
+        if (kind == SAMPLER_MINSTD)
+        {
+            thrust::uniform_real_distribution<float> u01(0, 1);
+            return u01(engine);
+        }
+        if (remaining == 0)
+        {
+            words[0] = pixel;
+            words[1] = sample;
+            words[2] = depth;
+            words[3] = block++;
+            pcg4d(words[0], words[1], words[2], words[3]);
+            remaining = 4;
+        }
+        // Shift the words down rather than index them, which keeps them in
+        // registers on the device
+        const unsigned int word = words[0];
+        words[0] = words[1];
+        words[1] = words[2];
+        words[2] = words[3];
+        remaining--;
+        return (word >> 8) * (1.0f / 16777216.0f);
+    }
+
+    SamplerKind kind;
+    unsigned int pixel;
+    unsigned int sample;
+    unsigned int depth;
+    unsigned int block;     // next group of four numbers
+    int remaining;          // numbers of the current group still in `words`
+    unsigned int words[4];
+    thrust::default_random_engine engine;
+};
@@ -1,13 +1,56 @@
+#include <algorithm>
 #include <iostream>
+#include <cstdio>
 #include <cstring>
 #include <glm/gtc/matrix_inverse.hpp>
 #include <glm/gtx/string_cast.hpp>
+#include <memory>
 #include <unordered_map>
 #include "json.hpp"
 #include "scene.h"
+#include "threadPool.h"
 using json = nlohmann::json;
 
-Scene::Scene(string filename)
+// Dirty indices this close together are uploaded as one range, since a few
+// extra bytes are cheaper than another copy
+#define DIRTY_RANGE_MERGE_GAP 8
+
+static void updateTransform(Geom& geom)
+{
+    geom.transform = utilityCore::buildTransformationMatrix(geom.translation, geom.rotation, geom.scale);
+    geom.inverseTransform = glm::inverse(geom.transform);
+    geom.invTranspose = glm::inverseTranspose(geom.transform);
+}
+
+// Add sorted `indices` to the sorted `ranges`, merging ranges that overlap or
+// nearly touch
+static void addDirtyRanges(std::vector<IndexRange>& ranges, const std::vector<int>& indices)
+{
+    for (size_t i = 0; i < indices.size(); i++)
+    {
+        IndexRange r = { indices[i], indices[i] + 1 };
+        ranges.push_back(r);
+    }
+    std::sort(ranges.begin(), ranges.end(), [](const IndexRange& a, const IndexRange& b)
+    {
+        return a.begin < b.begin;
+    });
+    size_t merged = 0;
+    for (size_t i = 1; i < ranges.size(); i++)
+    {
+        if (ranges[i].begin <= ranges[merged].end + DIRTY_RANGE_MERGE_GAP)
+        {
+            ranges[merged].end = std::max(ranges[merged].end, ranges[i].end);
+        }
+        else
+        {
+            ranges[++merged] = ranges[i];
+        }
+    }
+    ranges.resize(ranges.empty() ? 0 : merged + 1);
+}
+
+Scene::Scene(string filename) : version(0)
 {
     cout << "Reading scene from " << filename << " ..." << endl;
     cout << " " << endl;
@@ -15,6 +58,8 @@ Scene::Scene(string filename)
     if (ext == ".json")
     {
         loadFromJSON(filename);
+        buildBvh();
+        buildEmitters();
         return;
     }
     else
@@ -24,6 +69,106 @@ Scene::Scene(string filename)
     }
 }
 
+Scene::~Scene()
+{
+}
+
+ThreadPool* Scene::threadPool()
+{
+    if (!pool)
+    {
+        pool.reset(new ThreadPool());
+    }
+    return pool.get();
+}
+
+void Scene::buildBvh()
+{
+    static const char* builderNames[] = { "SAH", "LBVH", "LBVH (GPU)" };
+    bvh.build(geoms, threadPool(), state.bvhBuilder);
+    version++;
+    dirtyGeomRanges.clear();
+    dirtyNodeRanges.clear();
+    cout << "Built " << builderNames[state.bvhBuilder] << " BVH over " << geoms.size() << " geoms: "
+        << bvh.nodes.size() << " nodes, depth " << bvh.depth << ", SAH cost " << bvh.sahCost() << ", "
+        << bvh.buildMs << " ms on " << bvh.buildThreads << " threads" << endl;
+    updateWideBvh();
+    if (state.wideBvh)
+    {
+        const double prims = (double)std::max((size_t)1, bvh.primIndices.size());
+        cout << "Converted to " << WIDE_BVH_WIDTH << "-wide compressed nodes: " << wideBvh.nodes.size()
+            << " nodes, depth " << wideBvh.depth << ", "
+            << wideBvh.bytes() / prims << " bytes per geom against "
+            << (bvh.nodes.size() * sizeof(BvhNode) + bvh.primIndices.size() * sizeof(int)) / prims
+            << ", " << wideBvh.buildMs << " ms" << endl;
+    }
+}
+
+void Scene::updateWideBvh()
+{
+    if (state.wideBvh)
+    {
+        wideBvh.build(bvh);
+    }
+    else
+    {
+        wideBvh.clear();
+    }
+}
+
+void Scene::buildEmitters()
+{
+    emitters.build(geoms, materials);
+    if (emitters.unsampled > 0)
+    {
+        cout << emitters.unsampled << " emissive meshes cannot be sampled, they are only found by chance" << endl;
+    }
+}
+
+void Scene::setGeomTransform(int index, const glm::vec3& translation, const glm::vec3& rotation,
+    const glm::vec3& scale)
+{
+    Geom& geom = geoms[index];
+    geom.translation = translation;
+    geom.rotation = rotation;
+    geom.scale = scale;
+    movedGeoms.push_back(index);
+}
+
+bool Scene::updateGeoms()
+{
+    if (movedGeoms.empty())
+    {
+        return false;
+    }
+    std::sort(movedGeoms.begin(), movedGeoms.end());
+    movedGeoms.erase(std::unique(movedGeoms.begin(), movedGeoms.end()), movedGeoms.end());
+    for (size_t i = 0; i < movedGeoms.size(); i++)
+    {
+        updateTransform(geoms[movedGeoms[i]]);
+    }
+
+    std::vector<int> changedNodes;
+    bvh.refit(geoms, movedGeoms, changedNodes);
+    bool rebuild = bvh.refitCostRatio() > BVH_REFIT_MAX_COST_RATIO;
+    if (rebuild)
+    {
+        bvh.build(geoms, threadPool(), state.bvhBuilder);
+        version++;
+        dirtyGeomRanges.clear();
+        dirtyNodeRanges.clear();
+    }
+    else
+    {
+        addDirtyRanges(dirtyGeomRanges, movedGeoms);
+        addDirtyRanges(dirtyNodeRanges, changedNodes);
+    }
+    updateWideBvh();
+    buildEmitters();
+    movedGeoms.clear();
+    return rebuild;
+}
+
 void Scene::loadFromJSON(const std::string& jsonName)
 {
     std::ifstream f(jsonName);
@@ -51,19 +196,48 @@ void Scene::loadFromJSON(const std::string& jsonName)
         {
             const auto& col = p["RGB"];
             newMaterial.color = glm::vec3(col[0], col[1], col[2]);
+            newMaterial.specular.color = newMaterial.color;
+            newMaterial.hasReflective = 1.0f;
         }
         MatNameToID[name] = materials.size();
         materials.emplace_back(newMaterial);
     }
     const auto& objectsData = data["Objects"];
+    // Mesh files are relative to the scene file
+    const std::string sceneDir = jsonName.substr(0, jsonName.find_last_of("/\\") + 1);
     for (const auto& p : objectsData)
     {
         const auto& type = p["TYPE"];
         Geom newGeom;
+        newGeom.meshId = -1;
         if (type == "cube")
         {
             newGeom.type = CUBE;
         }
+        else if (type == "mesh")
+        {
+            const std::string file = p["FILE"];
+            const int loadedMeshes = (int)meshes.meshes.size();
+            newGeom.type = MESH;
+            newGeom.meshId = meshes.load(sceneDir + file, threadPool());
+            if (newGeom.meshId < 0)
+            {
+                cout << "Couldn't read mesh " << file << endl;
+                exit(-1);
+            }
+            const Mesh& mesh = meshes.meshes[newGeom.meshId];
+            newGeom.meshMin = mesh.boundsMin;
+            newGeom.meshMax = mesh.boundsMax;
+            if ((int)meshes.meshes.size() > loadedMeshes)
+            {
+                const double seconds = (meshes.lastLoadMs + meshes.lastBuildMs) / 1000.0;
+                printf("Loaded %s: %d triangles, %d vertices%s, %.1f bytes per triangle, "
+                    "%.2f M triangles/s (%.1f ms parsing, %.1f ms BVH)\n", file.c_str(), mesh.numTriangles,
+                    mesh.numVertices, mesh.firstNormal >= 0 ? " with normals" : "",
+                    (double)meshes.meshBytes(newGeom.meshId) / mesh.numTriangles,
+                    mesh.numTriangles / seconds * 1e-6, meshes.lastLoadMs, meshes.lastBuildMs);
+            }
+        }
         else
         {
             newGeom.type = SPHERE;
@@ -75,10 +249,7 @@ void Scene::loadFromJSON(const std::string& jsonName)
         newGeom.translation = glm::vec3(trans[0], trans[1], trans[2]);
         newGeom.rotation = glm::vec3(rotat[0], rotat[1], rotat[2]);
         newGeom.scale = glm::vec3(scale[0], scale[1], scale[2]);
-        newGeom.transform = utilityCore::buildTransformationMatrix(
-            newGeom.translation, newGeom.rotation, newGeom.scale);
-        newGeom.inverseTransform = glm::inverse(newGeom.transform);
-        newGeom.invTranspose = glm::inverseTranspose(newGeom.transform);
+        updateTransform(newGeom);
 
         geoms.push_back(newGeom);
     }
@@ -90,6 +261,51 @@ void Scene::loadFromJSON(const std::string& jsonName)
     float fovy = cameraData["FOVY"];
     state.iterations = cameraData["ITERATIONS"];
     state.traceDepth = cameraData["DEPTH"];
+    state.materialSort = SORT_OFF;
+    state.antialias = cameraData.value("ANTIALIAS", false);
+    state.cacheFirstHits = true;
+    state.packetRays = false;
+    state.readbackInterval = 0;
+    state.samplesPerLaunch = glm::max(1, cameraData.value("SAMPLES_PER_LAUNCH", 1));
+    state.rouletteDepth = cameraData.value("ROULETTE_DEPTH", 3);
+    state.nextEvent = cameraData.value("NEXT_EVENT", true);
+    state.lightTree = cameraData.value("LIGHT_TREE", true);
+    state.sampler = cameraData.value("SAMPLER", std::string("pcg")) == "minstd" ? SAMPLER_MINSTD : SAMPLER_PCG;
+    std::string builder = cameraData.value("BVH_BUILDER", std::string("sah"));
+    if (builder == "lbvh")
+    {
+        state.bvhBuilder = BVH_BUILDER_LBVH;
+    }
+    else if (builder == "lbvh-gpu")
+    {
+        state.bvhBuilder = BVH_BUILDER_LBVH_GPU;
+    }
+    else
+    {
+        if (builder != "sah")
+        {
+            cout << "Unknown BVH_BUILDER " << builder << ", using sah" << endl;
+        }
+        state.bvhBuilder = BVH_BUILDER_SAH;
+    }
+    std::string nodes = cameraData.value("BVH_NODES", std::string("binary"));
+    if (nodes != "binary" && nodes != "wide")
+    {
+        cout << "Unknown BVH_NODES " << nodes << ", using binary" << endl;
+    }
+    state.wideBvh = nodes == "wide";
+    state.rayOrderDepths = 0;
+    if (cameraData.contains("RAY_ORDER_DEPTHS"))
+    {
+        for (const auto& depth : cameraData["RAY_ORDER_DEPTHS"])
+        {
+            int d = depth;
+            if (d > 0 && d < 32)
+            {
+                state.rayOrderDepths |= 1u << d;
+            }
+        }
+    }
     state.imageName = cameraData["FILE"];
     const auto& pos = cameraData["EYE"];
     const auto& lookat = cameraData["LOOKAT"];
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <memory>
 #include <vector>
 #include <sstream>
 #include <fstream>
@@ -7,19 +8,80 @@
 #include "glm/glm.hpp"
 #include "utilities.h"
 #include "sceneStructs.h"
+#include "bvh.h"
+#include "lights.h"
+#include "mesh.h"
+#include "wideBvh.h"
 
 using namespace std;
 
+// Half-open range [begin, end) of array indices
+struct IndexRange
+{
+    int begin;
+    int end;
+};
+
 class Scene
 {
 private:
     ifstream fp_in;
     void loadFromJSON(const std::string& jsonName);
+    std::vector<int> movedGeoms;
+    // Convert bvh into wideBvh, or clear it, following state.wideBvh
+    void updateWideBvh();
+    // Rebuild emitters from the geoms
+    void buildEmitters();
+    // Threads for loading and BVH builds, started on first use and kept for
+    // the rebuilds updateGeoms() falls back to
+    ThreadPool* threadPool();
+    std::unique_ptr<ThreadPool> pool;
 public:
     Scene(string filename);
     ~Scene();
 
+    // Rebuild bvh with state.bvhBuilder, and wideBvh from it if
+    // state.wideBvh is set, and bump version
+    void buildBvh();
+
+    // Move geom `index`. Takes effect at the next updateGeoms().
+    void setGeomTransform(int index, const glm::vec3& translation, const glm::vec3& rotation,
+        const glm::vec3& scale);
+
+    /**
+     * Apply the transforms set since the last call. Only the moved geoms get
+     * new matrices, and the BVH is refitted around them. Once refits have made
+     * it BVH_REFIT_MAX_COST_RATIO times as costly as when it was built, it is
+     * rebuilt and version is bumped instead. The render has to restart to
+     * pick up the change. A wide BVH is converted again either way.
+     *
+     * @return  true if the BVH was rebuilt.
+     */
+    bool updateGeoms();
+
     std::vector<Geom> geoms;
     std::vector<Material> materials;
+    // Triangle data of the MESH geoms, one copy per file
+    MeshSet meshes;
     RenderState state;
+
+    // Built over geoms after loading. Rebuild it with buildBvh() when geoms
+    // change.
+    Bvh bvh;
+    // Compressed copy of bvh when state.wideBvh is set, converted again
+    // whenever bvh changes; empty otherwise
+    WideBvh wideBvh;
+    // The emissive geoms, for light sampling. Built after loading and again
+    // by updateGeoms().
+    EmitterTable emitters;
+
+    // Bumped by anything that edits geoms or materials after loading, so
+    // renderers know to upload them again.
+    int version;
+
+    // Geoms and BVH nodes refitted by updateGeoms() since the last full
+    // upload, sorted. Renderers that keep a copy upload these ranges and
+    // clear them; a version bump makes them moot.
+    std::vector<IndexRange> dirtyGeomRanges;
+    std::vector<IndexRange> dirtyNodeRanges;
 };
@@ -10,7 +10,46 @@
 enum GeomType
 {
     SPHERE,
-    CUBE
+    CUBE,
+    MESH
+};
+
+// Queues that the wavefront bounce loop sorts paths into after intersecting
+// them. Paths that escaped the scene and paths that hit a light share a queue
+// because both terminate at this bounce.
+enum ShadeQueue
+{
+    QUEUE_DIFFUSE,
+    QUEUE_SPECULAR,
+    QUEUE_TERMINATED,
+    NUM_SHADE_QUEUES
+};
+
+// Whether the wavefront loop sorts paths by material before shading. SORT_AB
+// alternates between unsorted and sorted iterations so both can be timed on
+// the same scene and view.
+enum MaterialSortMode
+{
+    SORT_OFF,
+    SORT_ON,
+    SORT_AB
+};
+
+// How the scene BVH is built. The LBVH builders trade trace speed for a much
+// faster build; LBVH_GPU builds on the device and reads the tree back.
+enum BvhBuilder
+{
+    BVH_BUILDER_SAH,
+    BVH_BUILDER_LBVH,
+    BVH_BUILDER_LBVH_GPU
+};
+
+// Random number generator the shading and camera routines draw from
+// (sampler.h). MINSTD is the thrust engine the renderer started with.
+enum SamplerKind
+{
+    SAMPLER_PCG,
+    SAMPLER_MINSTD
 };
 
 struct Ray
@@ -29,8 +68,62 @@ struct Geom
     glm::mat4 transform;
     glm::mat4 inverseTransform;
     glm::mat4 invTranspose;
+    int meshId;             // MESH: index into the scene's meshes
+    glm::vec3 meshMin;      // MESH: object-space bounds of the mesh
+    glm::vec3 meshMax;
 };
 
+// Low bits of CompactGeom::typeMaterial that hold the GeomType
+#define GEOM_TYPE_BITS 2
+
+/**
+ * The part of a Geom the intersection tests read, built from it when the
+ * scene goes to a backend: 56 bytes against 264. The world-to-object
+ * transform is kept as the three rows of a 3x4 affine matrix; the normal
+ * matrix is its transpose and the tests need no object-to-world transform,
+ * so neither is stored.
+ */
+struct CompactGeom
+{
+    glm::vec4 inverse[3];   // rows of inverseTransform without the last
+    int typeMaterial;       // GeomType below GEOM_TYPE_BITS, material id above
+    int meshId;             // MESH: index into the scene's meshes
+
+    __host__ __device__ GeomType type() const
+    {
+        return (GeomType)(typeMaterial & ((1 << GEOM_TYPE_BITS) - 1));
+    }
+
+    __host__ __device__ int materialId() const
+    {
+        return typeMaterial >> GEOM_TYPE_BITS;
+    }
+};
+
+inline CompactGeom compactGeom(const Geom& geom)
+{
+    CompactGeom c;
+    for (int row = 0; row < 3; row++)
+    {
+        const glm::mat4& m = geom.inverseTransform;
+        c.inverse[row] = glm::vec4(m[0][row], m[1][row], m[2][row], m[3][row]);
+    }
+    c.typeMaterial = (geom.materialid << GEOM_TYPE_BITS) | geom.type;
+    c.meshId = geom.meshId;
+    return c;
+}
+
+// compactGeom of each of `geoms`
+inline std::vector<CompactGeom> compactGeoms(const std::vector<Geom>& geoms)
+{
+    std::vector<CompactGeom> compact(geoms.size());
+    for (size_t i = 0; i < geoms.size(); i++)
+    {
+        compact[i] = compactGeom(geoms[i]);
+    }
+    return compact;
+}
+
 struct Material
 {
     glm::vec3 color;
@@ -62,16 +155,40 @@ struct RenderState
     Camera camera;
     unsigned int iterations;
     int traceDepth;
+    MaterialSortMode materialSort;
+    bool antialias;         // jitter camera rays within each pixel
+    bool cacheFirstHits;    // reuse depth-0 intersections while rays are not jittered
+    int readbackInterval;   // iterations between background image readbacks, 0 for on demand only
+    int samplesPerLaunch;   // samples per pixel traced together by one pathtrace() call
+    int rouletteDepth;      // bounces before Russian roulette may end a path, -1 to disable
+    BvhBuilder bvhBuilder;
+    bool wideBvh;           // trace through the compressed wide nodes (wideBvh.h)
+    bool packetRays;        // CPU tiles: trace camera rays in packets (rayPacket.h)
+    unsigned int rayOrderDepths;    // bit d: sort paths by ray (morton.h) before tracing depth d
+    bool nextEvent;         // sample the lights at diffuse hits (lights.h)
+    bool lightTree;         // pick them with the light tree rather than by power alone
+    SamplerKind sampler;
     std::vector<glm::vec3> image;
     std::string imageName;
 };
 
+// Whether the wavefront loop reorders the active paths before tracing
+// `depth`. Camera rays are coherent already and the first-hit cache relies
+// on their pixel order, so depth 0 never is.
+inline bool rayOrderAtDepth(const RenderState& state, int depth)
+{
+    return depth > 0 && depth < 32 && ((state.rayOrderDepths >> depth) & 1u) != 0;
+}
+
 struct PathSegment
 {
     Ray ray;
-    glm::vec3 color;
+    glm::vec3 color;        // throughput
+    glm::vec3 radiance;     // light gathered so far, the path's result
+    float bsdfPdf;          // solid angle density of the bounce that made `ray`, 0 if it was not sampled
     int pixelIndex;
     int remainingBounces;
+    int iteration;          // sample number the path belongs to, seeds its RNG
 };
 
 // Use with a corresponding PathSegment to do:
@@ -82,4 +199,14 @@ struct ShadeableIntersection
   float t;
   glm::vec3 surfaceNormal;
   int materialId;
+  int geomId;             // geom hit, for the light sampling density of emitters
+};
+
+// Light a path receives from a sampled point on an emitter if nothing
+// blocks `ray` before `tMax`. A tMax of 0 means there is no shadow ray.
+struct ShadowRay
+{
+    Ray ray;
+    float tMax;
+    glm::vec3 radiance;
 };
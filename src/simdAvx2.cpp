@@ -0,0 +1,50 @@
+#include "simdKernels.h"
+
+// Built with AVX2 code generation (see CMakeLists.txt) and only called after
+// the CPU has been checked for it
+#if defined(__AVX2__)
+
+#include <immintrin.h>
+
+namespace
+{
+    // Eight lanes of AVX
+    struct Avx2
+    {
+        typedef __m256 Float;
+        typedef __m256 Mask;
+        static const int width = 8;
+
+        static Float load(const float* p) { return _mm256_loadu_ps(p); }
+        static void store(float* p, Float a) { _mm256_storeu_ps(p, a); }
+        static Float set1(float a) { return _mm256_set1_ps(a); }
+        static Float add(Float a, Float b) { return _mm256_add_ps(a, b); }
+        static Float sub(Float a, Float b) { return _mm256_sub_ps(a, b); }
+        static Float mul(Float a, Float b) { return _mm256_mul_ps(a, b); }
+        static Float div(Float a, Float b) { return _mm256_div_ps(a, b); }
+        static Float sqrt(Float a) { return _mm256_sqrt_ps(a); }
+        static Mask lt(Float a, Float b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+        static Mask le(Float a, Float b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+        static Mask gt(Float a, Float b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+        static Mask ge(Float a, Float b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+        static Mask eq(Float a, Float b) { return _mm256_cmp_ps(a, b, _CMP_EQ_OQ); }
+        static Mask band(Mask a, Mask b) { return _mm256_and_ps(a, b); }
+        static Mask bor(Mask a, Mask b) { return _mm256_or_ps(a, b); }
+        static Mask bnot(Mask a) { return _mm256_xor_ps(a, _mm256_castsi256_ps(_mm256_set1_epi32(-1))); }
+        static Float select(Mask m, Float a, Float b) { return _mm256_blendv_ps(b, a, m); }
+    };
+}
+
+void Simd::intersectAvx2(const PackedGeomView& g, int first, int count, const PackedRay& r, float* t)
+{
+    intersectRange<Avx2>(g, first, count, r, t);
+}
+
+#else
+
+void Simd::intersectAvx2(const PackedGeomView& g, int first, int count, const PackedRay& r, float* t)
+{
+    intersectSse(g, first, count, r, t);
+}
+
+#endif
@@ -0,0 +1,251 @@
+#include "simdIntersections.h"
+
+#include <algorithm>
+#include <cmath>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#include "intersections.h"
+
+namespace
+{
+    // One lane of plain floats, for CPUs without SSE and as the reference
+    // the vector kernels are checked against
+    struct Scalar
+    {
+        typedef float Float;
+        typedef bool Mask;
+        static const int width = 1;
+
+        static Float load(const float* p) { return *p; }
+        static void store(float* p, Float a) { *p = a; }
+        static Float set1(float a) { return a; }
+        static Float add(Float a, Float b) { return a + b; }
+        static Float sub(Float a, Float b) { return a - b; }
+        static Float mul(Float a, Float b) { return a * b; }
+        static Float div(Float a, Float b) { return a / b; }
+        static Float sqrt(Float a) { return std::sqrt(a); }
+        static Mask lt(Float a, Float b) { return a < b; }
+        static Mask le(Float a, Float b) { return a <= b; }
+        static Mask gt(Float a, Float b) { return a > b; }
+        static Mask ge(Float a, Float b) { return a >= b; }
+        static Mask eq(Float a, Float b) { return a == b; }
+        static Mask band(Mask a, Mask b) { return a && b; }
+        static Mask bor(Mask a, Mask b) { return a || b; }
+        static Mask bnot(Mask a) { return !a; }
+        static Float select(Mask m, Float a, Float b) { return m ? a : b; }
+    };
+
+    SimdIsa detectSimdIsa()
+    {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+        int info[4];
+        __cpuid(info, 0);
+        if (info[0] >= 7)
+        {
+            __cpuid(info, 1);
+            const bool osSavesYmm = (info[2] & (1 << 27)) && (_xgetbv(0) & 6) == 6;
+            __cpuidex(info, 7, 0);
+            if (osSavesYmm && (info[1] & (1 << 5)))
+            {
+                return SIMD_ISA_AVX2;
+            }
+        }
+        return SIMD_ISA_SSE;
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+        {
+            return SIMD_ISA_AVX2;
+        }
+        return __builtin_cpu_supports("sse2") ? SIMD_ISA_SSE : SIMD_ISA_SCALAR;
+#else
+        return SIMD_ISA_SCALAR;
+#endif
+    }
+
+    void packMatrix(const glm::vec4* rows, float* const* arrays, int lane)
+    {
+        for (int c = 0; c < 4; c++)
+        {
+            for (int r = 0; r < 3; r++)
+            {
+                arrays[c * 3 + r][lane] = rows[r][c];
+            }
+        }
+    }
+}
+
+void Simd::intersectScalar(const PackedGeomView& g, int first, int count, const PackedRay& r, float* t)
+{
+    intersectRange<Scalar>(g, first, count, r, t);
+}
+
+SimdIsa bestSimdIsa()
+{
+    static const SimdIsa isa = detectSimdIsa();
+    return isa;
+}
+
+const char* simdIsaName(SimdIsa isa)
+{
+    static const char* names[] = { "scalar", "SSE2", "AVX2" };
+    return names[isa];
+}
+
+int simdIsaWidth(SimdIsa isa)
+{
+    return isa == SIMD_ISA_AVX2 ? 8 : isa == SIMD_ISA_SSE ? 4 : 1;
+}
+
+PackedGeoms::PackedGeoms() : stride(0), count(0)
+{
+}
+
+void PackedGeoms::pack(const CompactGeom* geoms, int count, const int* order)
+{
+    this->count = count;
+    stride = count + SIMD_MAX_WIDTH;
+    lanes.assign(13 * (size_t)stride, 0.0f);
+    float* inverse[12];
+    for (int k = 0; k < 12; k++)
+    {
+        inverse[k] = &lanes[k * stride];
+    }
+    float* kind = &lanes[12 * stride];
+    std::fill(kind, kind + stride, -1.0f);
+
+    for (int i = 0; i < count; i++)
+    {
+        const CompactGeom& geom = geoms[order ? order[i] : i];
+        packMatrix(geom.inverse, inverse, i);
+        kind[i] = geom.type() == SPHERE ? 0.0f : geom.type() == CUBE ? 1.0f : -1.0f;
+    }
+}
+
+PackedGeomView PackedGeoms::view() const
+{
+    PackedGeomView v;
+    const float* base = lanes.data();
+    for (int k = 0; k < 12; k++)
+    {
+        v.inverse[k] = base + k * stride;
+    }
+    v.kind = base + 12 * stride;
+    v.count = count;
+    return v;
+}
+
+void intersectPacked(const PackedGeomView& geoms, int first, int count, const Ray& r, float* t, SimdIsa isa)
+{
+    PackedRay ray;
+    for (int i = 0; i < 3; i++)
+    {
+        ray.origin[i] = r.origin[i];
+        ray.direction[i] = r.direction[i];
+    }
+    ray.length = glm::length(r.direction);
+    if (isa == SIMD_ISA_AVX2)
+    {
+        Simd::intersectAvx2(geoms, first, count, ray, t);
+    }
+    else if (isa == SIMD_ISA_SSE)
+    {
+        Simd::intersectSse(geoms, first, count, ray, t);
+    }
+    else
+    {
+        Simd::intersectScalar(geoms, first, count, ray, t);
+    }
+}
+
+int intersectBvhPacked(
+    const Ray& r,
+    const CompactGeom* geoms,
+    BvhView bvh,
+    const PackedGeomView& packed,
+    MeshView meshes,
+    ShadeableIntersection& intersection,
+    SimdIsa isa)
+{
+    glm::vec3 invDir = 1.0f / glm::normalize(r.direction);
+    float t_min = FLT_MAX;
+    int hit_geom_index = -1;
+    glm::vec3 tmp_intersect;
+    glm::vec3 tmp_normal;
+    bool outside;
+
+    // The same walk as intersectBvh
+    float laneT[BVH_MAX_LEAF_SIZE + SIMD_MAX_WIDTH];
+    int stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    float tEntry;
+    int node = bvh.numNodes > 0 && rayIntersectsBox(bvh.nodes[0].boundsMin, bvh.nodes[0].boundsMax,
+        r.origin, invDir, t_min, tEntry) ? 0 : -1;
+    while (node >= 0)
+    {
+        const BvhNode& n = bvh.nodes[node];
+        if (n.primCount > 0)
+        {
+            intersectPacked(packed, n.rightOrFirst, n.primCount, r, laneT, isa);
+            for (int i = 0; i < n.primCount; i++)
+            {
+                const int lane = n.rightOrFirst + i;
+                const int g = bvh.primIndices[lane];
+                float t = packed.kind[lane] >= 0.0f ? laneT[i]
+                    : geomIntersectionTest(geoms[g], r, meshes, tmp_intersect, tmp_normal, outside);
+                if (t > 0.0f && (t < t_min || (t == t_min && g < hit_geom_index)))
+                {
+                    t_min = t;
+                    hit_geom_index = g;
+                }
+            }
+            node = stackSize > 0 ? stack[--stackSize] : -1;
+            continue;
+        }
+
+        int near = node + 1;
+        int far = n.rightOrFirst;
+        float tNear;
+        float tFar;
+        bool hitNear = rayIntersectsBox(bvh.nodes[near].boundsMin, bvh.nodes[near].boundsMax,
+            r.origin, invDir, t_min, tNear);
+        bool hitFar = rayIntersectsBox(bvh.nodes[far].boundsMin, bvh.nodes[far].boundsMax,
+            r.origin, invDir, t_min, tFar);
+        if (hitNear && hitFar)
+        {
+            if (tFar < tNear)
+            {
+                int swap = near;
+                near = far;
+                far = swap;
+            }
+            stack[stackSize++] = far;
+            node = near;
+        }
+        else if (hitNear || hitFar)
+        {
+            node = hitNear ? near : far;
+        }
+        else
+        {
+            node = stackSize > 0 ? stack[--stackSize] : -1;
+        }
+    }
+
+    if (hit_geom_index == -1)
+    {
+        intersection.t = -1.0f;
+    }
+    else
+    {
+        // Only the closest hit needs a normal
+        geomIntersectionTest(geoms[hit_geom_index], r, meshes, tmp_intersect, tmp_normal, outside);
+        intersection.t = t_min;
+        intersection.materialId = geoms[hit_geom_index].materialId();
+        intersection.geomId = hit_geom_index;
+        intersection.surfaceNormal = tmp_normal;
+    }
+    return hit_geom_index;
+}
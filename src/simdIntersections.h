@@ -0,0 +1,66 @@
+#pragma once
+
+#include <vector>
+#include "bvh.h"
+#include "mesh.h"
+#include "sceneStructs.h"
+#include "simdKernels.h"
+
+// Instruction sets the packed tests can run on, narrowest first
+enum SimdIsa
+{
+    SIMD_ISA_SCALAR,
+    SIMD_ISA_SSE,
+    SIMD_ISA_AVX2
+};
+
+// Widest instruction set this CPU supports, detected once
+SimdIsa bestSimdIsa();
+
+const char* simdIsaName(SimdIsa isa);
+
+// Lanes one call of the packed tests handles on `isa`
+int simdIsaWidth(SimdIsa isa);
+
+/**
+ * Host copy of the sphere and cube geoms as structure of arrays, for the
+ * packed ray tests. Packed in Bvh::primIndices order, every BVH leaf is a
+ * run of at most BVH_MAX_LEAF_SIZE lanes and takes one AVX2 call. Meshes
+ * get lanes too, marked so the tests skip them.
+ */
+class PackedGeoms
+{
+public:
+    PackedGeoms();
+
+    // Pack `count` geoms, lane i holding geoms[order[i]], or geoms[i]
+    // without an order. Call again after the geoms move.
+    void pack(const CompactGeom* geoms, int count, const int* order = NULL);
+
+    PackedGeomView view() const;
+
+    std::vector<float> lanes;   // the 13 arrays of the view, `stride` floats apart
+    int stride;
+    int count;
+};
+
+/**
+ * Ray `r` against packed geoms [first, first + count) on `isa`: the `t`
+ * sphereIntersectionTest or boxIntersectionTest gives each of them, or -1.
+ * `t` needs room for `count` rounded up to SIMD_MAX_WIDTH.
+ */
+void intersectPacked(const PackedGeomView& geoms, int first, int count, const Ray& r, float* t, SimdIsa isa);
+
+/**
+ * intersectBvh on the host with every leaf's spheres and cubes tested in
+ * one packed call. `packed` holds the geoms in `bvh.primIndices` order.
+ * Meshes and the normal of the closest hit go through the scalar tests.
+ */
+int intersectBvhPacked(
+    const Ray& r,
+    const CompactGeom* geoms,
+    BvhView bvh,
+    const PackedGeomView& packed,
+    MeshView meshes,
+    ShadeableIntersection& intersection,
+    SimdIsa isa);
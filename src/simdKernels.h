@@ -0,0 +1,144 @@
+#pragma once
+
+/**
+ * Ray tests against several packed spheres and cubes at once, written once
+ * over a vector type V and compiled for each instruction set in its own
+ * file (simdSse.cpp, simdAvx2.cpp, and the scalar fallback in
+ * simdIntersections.cpp). Those files get their own ISA flags, so nothing
+ * here may use glm or other inline code that the rest of the program also
+ * compiles; the linker could keep the AVX2 copy for everyone.
+ *
+ * V provides Float and Mask types of V::width lanes and the operations used
+ * below. Masks select like `m ? a : b`.
+ */
+
+// Widest vector any kernel uses. Packed arrays are padded so that a kernel
+// may read this many lanes past any valid first lane.
+#define SIMD_MAX_WIDTH 8
+
+/**
+ * Sphere and cube geoms as structure of arrays: one array per matrix entry,
+ * so lane i of every array belongs to packed geom i. The 3x4 world-to-object
+ * matrix of CompactGeom is stored by column, entry (column c, row r) at
+ * c * 3 + r.
+ */
+struct PackedGeomView
+{
+    const float* inverse[12];       // CompactGeom::inverse
+    const float* kind;              // 0 sphere, 1 cube, -1 anything else
+    int count;
+};
+
+struct PackedRay
+{
+    float origin[3];
+    float direction[3];
+    float length;                   // of direction
+};
+
+namespace Simd
+{
+    /**
+     * `t` of ray `r` against packed geoms [first, first + count), as
+     * sphereIntersectionTest and boxIntersectionTest compute it, or -1 for a
+     * miss or a lane that is neither. `t` needs room for `count` rounded up
+     * to SIMD_MAX_WIDTH.
+     */
+    void intersectScalar(const PackedGeomView& g, int first, int count, const PackedRay& r, float* t);
+    void intersectSse(const PackedGeomView& g, int first, int count, const PackedRay& r, float* t);
+    void intersectAvx2(const PackedGeomView& g, int first, int count, const PackedRay& r, float* t);
+
+    template <typename V>
+    inline void normalize3(typename V::Float v[3])
+    {
+        typename V::Float len2 = V::add(V::add(V::mul(v[0], v[0]), V::mul(v[1], v[1])), V::mul(v[2], v[2]));
+        typename V::Float s = V::div(V::set1(1.0f), V::sqrt(len2));
+        for (int i = 0; i < 3; i++)
+        {
+            v[i] = V::mul(v[i], s);
+        }
+    }
+
+    /**
+     * Lanes [first, first + V::width). Follows the scalar tests operation by
+     * operation, in glm's order of evaluation, so the results agree to the
+     * bit unless the compiler contracts the scalar code into FMAs.
+     */
+    template <typename V>
+    inline void intersectLanes(const PackedGeomView& g, int first, const PackedRay& r, float* out)
+    {
+        typedef typename V::Float F;
+        typedef typename V::Mask M;
+        const F zero = V::set1(0.0f);
+
+        F ro[3];
+        F rd[3];
+        for (int i = 0; i < 3; i++)
+        {
+            ro[i] = V::set1(r.origin[i]);
+            rd[i] = V::set1(r.direction[i]);
+        }
+
+        // Into object space as transformPoint and transformDirection do,
+        // ((c0 x + c1 y) + c2 z) + c3
+        F o[3];
+        F d[3];
+        for (int i = 0; i < 3; i++)
+        {
+            const F c0 = V::load(g.inverse[i] + first);
+            const F c1 = V::load(g.inverse[3 + i] + first);
+            const F c2 = V::load(g.inverse[6 + i] + first);
+            const F c3 = V::load(g.inverse[9 + i] + first);
+            o[i] = V::add(V::add(V::add(V::mul(c0, ro[0]), V::mul(c1, ro[1])), V::mul(c2, ro[2])), c3);
+            d[i] = V::add(V::add(V::mul(c0, rd[0]), V::mul(c1, rd[1])), V::mul(c2, rd[2]));
+        }
+        const F rdLength = V::sqrt(V::add(V::add(V::mul(d[0], d[0]), V::mul(d[1], d[1])), V::mul(d[2], d[2])));
+        normalize3<V>(d);
+
+        // Cube: slabs of the unit cube
+        F tmin = V::set1(-1e38f);
+        F tmax = V::set1(1e38f);
+        for (int i = 0; i < 3; i++)
+        {
+            const F t1 = V::div(V::sub(V::set1(-0.5f), o[i]), d[i]);
+            const F t2 = V::div(V::sub(V::set1(0.5f), o[i]), d[i]);
+            const F ta = V::select(V::lt(t2, t1), t2, t1);
+            const F tb = V::select(V::lt(t1, t2), t2, t1);
+            tmin = V::select(V::band(V::gt(ta, zero), V::gt(ta, tmin)), ta, tmin);
+            tmax = V::select(V::lt(tb, tmax), tb, tmax);
+        }
+        const M boxHit = V::band(V::ge(tmax, tmin), V::gt(tmax, zero));
+        const F tBox = V::select(V::le(tmin, zero), tmax, tmin);
+
+        // Sphere of radius 0.5
+        const F vd = V::add(V::add(V::mul(o[0], d[0]), V::mul(o[1], d[1])), V::mul(o[2], d[2]));
+        const F oo = V::add(V::add(V::mul(o[0], o[0]), V::mul(o[1], o[1])), V::mul(o[2], o[2]));
+        const F radicand = V::sub(V::mul(vd, vd), V::sub(oo, V::set1(0.25f)));
+        const F root = V::sqrt(radicand);
+        const F t1 = V::add(V::sub(zero, vd), root);
+        const F t2 = V::sub(V::sub(zero, vd), root);
+        const M sphereMiss = V::bor(V::lt(radicand, zero), V::band(V::lt(t1, zero), V::lt(t2, zero)));
+        const M bothAhead = V::band(V::gt(t1, zero), V::gt(t2, zero));
+        const F tSphere = V::select(bothAhead, V::select(V::lt(t2, t1), t2, t1), V::select(V::lt(t1, t2), t2, t1));
+
+        const F kind = V::load(g.kind + first);
+        const M isSphere = V::eq(kind, zero);
+        const M isCube = V::eq(kind, V::set1(1.0f));
+        const M hit = V::bor(V::band(isSphere, V::bnot(sphereMiss)), V::band(isCube, boxHit));
+        const F t = V::select(isSphere, tSphere, tBox);
+
+        // World distance to the point short of the surface, as worldDistance
+        const F u = V::div(V::sub(t, V::set1(0.0001f)), rdLength);
+        const F len = V::mul(V::select(V::lt(u, zero), V::sub(zero, u), u), V::set1(r.length));
+        V::store(out, V::select(hit, len, V::set1(-1.0f)));
+    }
+
+    template <typename V>
+    inline void intersectRange(const PackedGeomView& g, int first, int count, const PackedRay& r, float* t)
+    {
+        for (int i = 0; i < count; i += V::width)
+        {
+            intersectLanes<V>(g, first + i, r, t + i);
+        }
+    }
+}
@@ -0,0 +1,48 @@
+#include "simdKernels.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+
+#include <emmintrin.h>
+
+namespace
+{
+    // Four lanes of SSE2, which every x86-64 CPU has
+    struct Sse
+    {
+        typedef __m128 Float;
+        typedef __m128 Mask;
+        static const int width = 4;
+
+        static Float load(const float* p) { return _mm_loadu_ps(p); }
+        static void store(float* p, Float a) { _mm_storeu_ps(p, a); }
+        static Float set1(float a) { return _mm_set1_ps(a); }
+        static Float add(Float a, Float b) { return _mm_add_ps(a, b); }
+        static Float sub(Float a, Float b) { return _mm_sub_ps(a, b); }
+        static Float mul(Float a, Float b) { return _mm_mul_ps(a, b); }
+        static Float div(Float a, Float b) { return _mm_div_ps(a, b); }
+        static Float sqrt(Float a) { return _mm_sqrt_ps(a); }
+        static Mask lt(Float a, Float b) { return _mm_cmplt_ps(a, b); }
+        static Mask le(Float a, Float b) { return _mm_cmple_ps(a, b); }
+        static Mask gt(Float a, Float b) { return _mm_cmpgt_ps(a, b); }
+        static Mask ge(Float a, Float b) { return _mm_cmpge_ps(a, b); }
+        static Mask eq(Float a, Float b) { return _mm_cmpeq_ps(a, b); }
+        static Mask band(Mask a, Mask b) { return _mm_and_ps(a, b); }
+        static Mask bor(Mask a, Mask b) { return _mm_or_ps(a, b); }
+        static Mask bnot(Mask a) { return _mm_xor_ps(a, _mm_castsi128_ps(_mm_set1_epi32(-1))); }
+        static Float select(Mask m, Float a, Float b) { return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b)); }
+    };
+}
+
+void Simd::intersectSse(const PackedGeomView& g, int first, int count, const PackedRay& r, float* t)
+{
+    intersectRange<Sse>(g, first, count, r, t);
+}
+
+#else
+
+void Simd::intersectSse(const PackedGeomView& g, int first, int count, const PackedRay& r, float* t)
+{
+    intersectScalar(g, first, count, r, t);
+}
+
+#endif
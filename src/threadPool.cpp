@@ -0,0 +1,141 @@
+#include "threadPool.h"
+
+int ThreadPool::hardwareThreadCount()
+{
+    unsigned int n = std::thread::hardware_concurrency();
+    return n > 0 ? (int)n : 1;
+}
+
+ThreadPool::ThreadPool(int numThreads)
+    : numThreads(numThreads > 0 ? numThreads : hardwareThreadCount()),
+      currentFn(nullptr),
+      steals(0),
+      generation(0),
+      busyWorkers(0),
+      stopping(false)
+{
+    for (int i = 0; i < this->numThreads; i++)
+    {
+        deques.emplace_back(new WorkDeque());
+    }
+
+    // Worker 0 is whichever thread calls run().
+    for (int i = 1; i < this->numThreads; i++)
+    {
+        workers.emplace_back(&ThreadPool::workerLoop, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread& worker : workers)
+    {
+        worker.join();
+    }
+}
+
+void ThreadPool::run(int numTasks, const TaskFn& fn)
+{
+    if (numTasks <= 0)
+    {
+        return;
+    }
+
+    // Hand each worker a contiguous run of tasks.
+    for (int i = 0; i < numThreads; i++)
+    {
+        int begin = (int)((long long)numTasks * i / numThreads);
+        int end = (int)((long long)numTasks * (i + 1) / numThreads);
+        std::lock_guard<std::mutex> lock(deques[i]->mutex);
+        for (int task = begin; task < end; task++)
+        {
+            deques[i]->tasks.push_back(task);
+        }
+    }
+
+    steals = 0;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        currentFn = &fn;
+        busyWorkers = numThreads - 1;
+        generation++;
+    }
+    wake.notify_all();
+
+    drain(0);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    finished.wait(lock, [this] { return busyWorkers == 0; });
+    currentFn = nullptr;
+}
+
+void ThreadPool::workerLoop(int thread)
+{
+    unsigned int seenGeneration = 0;
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&] { return stopping || generation != seenGeneration; });
+            if (stopping)
+            {
+                return;
+            }
+            seenGeneration = generation;
+        }
+
+        drain(thread);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--busyWorkers == 0)
+        {
+            finished.notify_all();
+        }
+    }
+}
+
+void ThreadPool::drain(int thread)
+{
+    // Tasks never spawn new tasks, so once every deque is empty this worker
+    // has nothing left to do in the current batch.
+    int task;
+    while (popLocal(thread, task) || steal(thread, task))
+    {
+        (*currentFn)(task, thread);
+    }
+}
+
+bool ThreadPool::popLocal(int thread, int& task)
+{
+    WorkDeque& own = *deques[thread];
+    std::lock_guard<std::mutex> lock(own.mutex);
+    if (own.tasks.empty())
+    {
+        return false;
+    }
+    task = own.tasks.back();
+    own.tasks.pop_back();
+    return true;
+}
+
+bool ThreadPool::steal(int thread, int& task)
+{
+    for (int i = 1; i < numThreads; i++)
+    {
+        WorkDeque& victim = *deques[(thread + i) % numThreads];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty())
+        {
+            task = victim.tasks.front();
+            victim.tasks.pop_front();
+            steals++;
+            return true;
+        }
+    }
+    return false;
+}
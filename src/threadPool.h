@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Fixed-size pool of worker threads that executes batches of indexed tasks.
+ *
+ * Every worker owns a deque of task indices. A batch is split into contiguous
+ * runs, one per deque, so neighbouring tasks (e.g. adjacent image tiles) start
+ * out on the same thread. A worker pops from the back of its own deque and,
+ * once that runs dry, steals from the front of another worker's deque, which
+ * keeps all cores busy when some tasks are much more expensive than others.
+ */
+class ThreadPool
+{
+public:
+    typedef std::function<void(int task, int thread)> TaskFn;
+
+    // numThreads <= 0 uses one thread per hardware core.
+    explicit ThreadPool(int numThreads = 0);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int size() const { return numThreads; }
+
+    /**
+     * Run fn(task, thread) for every task in [0, numTasks) and block until all
+     * of them have finished. The calling thread takes part as worker 0, so
+     * `thread` is always in [0, size()).
+     */
+    void run(int numTasks, const TaskFn& fn);
+
+    // Number of tasks that were stolen from another worker's deque in the
+    // most recent run().
+    int lastStealCount() const { return steals.load(); }
+
+    static int hardwareThreadCount();
+
+private:
+    struct WorkDeque
+    {
+        std::mutex mutex;
+        std::deque<int> tasks;
+    };
+
+    void workerLoop(int thread);
+    void drain(int thread);
+    bool popLocal(int thread, int& task);
+    bool steal(int thread, int& task);
+
+    int numThreads;
+    std::vector<std::thread> workers;
+    std::vector<std::unique_ptr<WorkDeque>> deques;
+
+    const TaskFn* currentFn;
+    std::atomic<int> steals;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    unsigned int generation;
+    int busyWorkers;
+    bool stopping;
+};
@@ -11,6 +11,19 @@
 
 #include "utilities.h"
 
+const char* wavefrontStageNames[NUM_WAVEFRONT_STAGES] = {
+    "Generate",
+    "Ray order",
+    "Extend",
+    "Material sort",
+    "Shade diffuse",
+    "Shade specular",
+    "Escaped/emissive",
+    "Shadow rays",
+    "Compact",
+    "Gather"
+};
+
 float utilityCore::clamp(float f, float min, float max)
 {
     if (f < min)
@@ -138,3 +151,17 @@ std::istream& utilityCore::safeGetline(std::istream& is, std::string& t)
         }
     }
 }
+
+float utilityCore::averagePathLength(const std::vector<int>& activePaths)
+{
+    if (activePaths.empty() || activePaths[0] == 0)
+    {
+        return 0.0f;
+    }
+    long long segments = 0;
+    for (size_t depth = 0; depth < activePaths.size(); depth++)
+    {
+        segments += activePaths[depth];
+    }
+    return (float)((double)segments / activePaths[0]);
+}
@@ -8,17 +8,55 @@
 #include <sstream>
 #include <string>
 #include <vector>
+#include "bufferPool.h"
 
 #define PI                3.1415926535897932384626422832795028841971f
 #define TWO_PI            6.2831853071795864769252867665590057683943f
 #define SQRT_OF_ONE_THIRD 0.5773502691896257645091487805019574556476f
 #define EPSILON           0.00001f
 
+// Stages of the wavefront bounce loop. The shading stages are in the same
+// order as the ShadeQueue they consume.
+enum WavefrontStage
+{
+    STAGE_GENERATE,
+    STAGE_RAY_ORDER,
+    STAGE_EXTEND,
+    STAGE_SORT,
+    STAGE_SHADE_DIFFUSE,
+    STAGE_SHADE_SPECULAR,
+    STAGE_SHADE_TERMINATED,
+    STAGE_SHADOW,
+    STAGE_COMPACT,
+    STAGE_GATHER,
+    NUM_WAVEFRONT_STAGES
+};
+
+extern const char* wavefrontStageNames[NUM_WAVEFRONT_STAGES];
+
+// Bounce loop time (every stage but generate) split by whether the paths were
+// sorted by material, for comparing the two with SORT_AB.
+struct SortTimings
+{
+    SortTimings() : ms(), iterations() {}
+    double ms[2];           // [0] unsorted, [1] sorted
+    int iterations[2];
+};
+
 class GuiDataContainer
 {
 public:
-    GuiDataContainer() : TracedDepth(0) {}
+    GuiDataContainer() : TracedDepth(0), StageMs(), SceneUploads(0), GeomUpdates(0), GeomUpdateBytes(0),
+        ReadbackMs(0.0f) {}
     int TracedDepth;
+    float StageMs[NUM_WAVEFRONT_STAGES]; // time per stage in the last iteration
+    std::vector<int> ActivePaths;        // paths entering each depth, last iteration
+    SortTimings MaterialSortTimings;
+    BufferPoolStats DevicePool;
+    int SceneUploads;
+    int GeomUpdates;                     // partial uploads after refits
+    int GeomUpdateBytes;                 // bytes copied by the last one
+    float ReadbackMs;                    // duration of the last background image download
 };
 
 namespace utilityCore
@@ -31,4 +69,6 @@ namespace utilityCore
     extern glm::mat4 buildTransformationMatrix(glm::vec3 translation, glm::vec3 rotation, glm::vec3 scale);
     extern std::string convertIntToString(int number);
     extern std::istream& safeGetline(std::istream& is, std::string& t); //Thanks to http://stackoverflow.com/a/6089413
+    // Path segments per path, from the number of paths entering each depth
+    extern float averagePathLength(const std::vector<int>& activePaths);
 }
@@ -0,0 +1,178 @@
+#include "wideBvh.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+namespace
+{
+    // A binary node waiting to become a child of a wide node, `level`s below it
+    struct Candidate
+    {
+        int node;
+        int level;
+    };
+
+    float nodeArea(const BvhNode& n)
+    {
+        AABB b;
+        b.min = n.boundsMin;
+        b.max = n.boundsMax;
+        return b.surfaceArea();
+    }
+
+    // Smallest exponent whose 255 steps from `lo` reach `hi`
+    int stepExponent(float lo, float hi)
+    {
+        const float extent = hi - lo;
+        int e = extent > 0.0f ? (int)std::ceil(std::log2(extent / 255.0f)) : -126;
+        e = std::max(e, -126);
+        while (e < 127 && lo + 255.0f * std::ldexp(1.0f, e) < hi)
+        {
+            e++;
+        }
+        return e;
+    }
+
+    // Child box coordinates along one axis, rounded outwards
+    void quantize(float lo, float step, float boxMin, float boxMax, unsigned char& qMin, unsigned char& qMax)
+    {
+        int q0 = std::min(255, std::max(0, (int)std::floor((boxMin - lo) / step)));
+        int q1 = std::min(255, std::max(0, (int)std::ceil((boxMax - lo) / step)));
+        while (q0 > 0 && lo + q0 * step > boxMin)
+        {
+            q0--;
+        }
+        while (q1 < 255 && lo + q1 * step < boxMax)
+        {
+            q1++;
+        }
+        qMin = (unsigned char)q0;
+        qMax = (unsigned char)q1;
+    }
+}
+
+WideBvh::WideBvh() : depth(0), buildMs(0.0)
+{
+}
+
+void WideBvh::build(const Bvh& bvh)
+{
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+    nodes.clear();
+    primIndices = bvh.primIndices;
+    depth = 0;
+    if (!bvh.nodes.empty())
+    {
+        collapse(bvh, 0, 1);
+    }
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+    buildMs = elapsed.count();
+}
+
+void WideBvh::clear()
+{
+    nodes.clear();
+    primIndices.clear();
+    depth = 0;
+}
+
+int WideBvh::collapse(const Bvh& bvh, int binaryNode, int level)
+{
+    const BvhNode& parent = bvh.nodes[binaryNode];
+
+    // Open the shallowest inner candidate, the largest on a tie, until the
+    // node is full. A lone leaf only happens at the root.
+    Candidate children[WIDE_BVH_WIDTH];
+    int numChildren = 0;
+    if (parent.primCount > 0)
+    {
+        children[numChildren++] = { binaryNode, 0 };
+    }
+    else
+    {
+        children[numChildren++] = { binaryNode + 1, 1 };
+        children[numChildren++] = { parent.rightOrFirst, 1 };
+    }
+    while (numChildren < WIDE_BVH_WIDTH)
+    {
+        int open = -1;
+        for (int c = 0; c < numChildren; c++)
+        {
+            const BvhNode& n = bvh.nodes[children[c].node];
+            if (n.primCount > 0)
+            {
+                continue;
+            }
+            if (open < 0 || children[c].level < children[open].level
+                || (children[c].level == children[open].level
+                    && nodeArea(n) > nodeArea(bvh.nodes[children[open].node])))
+            {
+                open = c;
+            }
+        }
+        if (open < 0)
+        {
+            break;
+        }
+        const Candidate opened = children[open];
+        children[open] = { opened.node + 1, opened.level + 1 };
+        children[numChildren++] = { bvh.nodes[opened.node].rightOrFirst, opened.level + 1 };
+    }
+
+    const int index = (int)nodes.size();
+    nodes.push_back(WideBvhNode());
+    WideBvhNode node;
+    node.origin = parent.boundsMin;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        node.exponent[axis] = (signed char)stepExponent(parent.boundsMin[axis], parent.boundsMax[axis]);
+    }
+    const glm::vec3 step = node.scale();
+    node.numChildren = (unsigned char)numChildren;
+    for (int c = 0; c < WIDE_BVH_WIDTH; c++)
+    {
+        node.child[c] = 0;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            node.qMin[axis][c] = 0;
+            node.qMax[axis][c] = 0;
+        }
+    }
+
+    // Children are emitted after their parent, in the order they were found
+    for (int c = 0; c < numChildren; c++)
+    {
+        const BvhNode& n = bvh.nodes[children[c].node];
+        for (int axis = 0; axis < 3; axis++)
+        {
+            quantize(node.origin[axis], step[axis], n.boundsMin[axis], n.boundsMax[axis],
+                node.qMin[axis][c], node.qMax[axis][c]);
+        }
+        if (n.primCount > 0)
+        {
+            node.child[c] = ~((n.rightOrFirst << WIDE_BVH_LEAF_BITS) | n.primCount);
+            depth = std::max(depth, level + 1);
+        }
+        else
+        {
+            node.child[c] = collapse(bvh, children[c].node, level + 1);
+        }
+    }
+    nodes[index] = node;
+    return index;
+}
+
+WideBvhView WideBvh::view() const
+{
+    WideBvhView v;
+    v.nodes = nodes.data();
+    v.primIndices = primIndices.data();
+    v.numNodes = (int)nodes.size();
+    return v;
+}
+
+size_t WideBvh::bytes() const
+{
+    return nodes.size() * sizeof(WideBvhNode) + primIndices.size() * sizeof(int);
+}
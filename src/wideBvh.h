@@ -0,0 +1,114 @@
+#pragma once
+
+#include <vector>
+#include "glm/glm.hpp"
+#include "bvh.h"
+
+// Children per compressed node, 4 or 8
+#define WIDE_BVH_WIDTH 4
+// Low bits of a leaf entry that hold its primitive count
+#define WIDE_BVH_LEAF_BITS 4
+// The converter collapses at least two binary levels into every wide node
+// above a leaf, and each node visited leaves at most WIDTH - 1 more entries
+// on the stack
+#define WIDE_BVH_STACK_SIZE ((WIDE_BVH_WIDTH - 1) * (BVH_STACK_SIZE / 2 + 1) + 1)
+
+static_assert(BVH_MAX_LEAF_SIZE < (1 << WIDE_BVH_LEAF_BITS), "leaf counts must fit WIDE_BVH_LEAF_BITS");
+
+/**
+ * One node of a compressed wide BVH: 56 bytes for four children, against
+ * 32 bytes for each child of a binary node. Child boxes are stored as 8-bit
+ * offsets from the node's min corner, in steps of a power of two per axis
+ * that fits the node's box in 255 steps. They are rounded outwards, so a
+ * decoded box always contains the exact one.
+ *
+ * A child entry is the index of an inner node, or for a leaf the bitwise
+ * complement of its first entry in primIndices, shifted left by
+ * WIDE_BVH_LEAF_BITS, with its primitive count in the low bits. Nodes are
+ * stored in depth-first order from the root at 0.
+ */
+struct WideBvhNode
+{
+    glm::vec3 origin;
+    signed char exponent[3];            // step along each axis is 2^exponent
+    unsigned char numChildren;
+    int child[WIDE_BVH_WIDTH];
+    unsigned char qMin[3][WIDE_BVH_WIDTH];
+    unsigned char qMax[3][WIDE_BVH_WIDTH];
+
+    __host__ __device__ glm::vec3 scale() const
+    {
+        return glm::vec3(ldexpf(1.0f, exponent[0]), ldexpf(1.0f, exponent[1]), ldexpf(1.0f, exponent[2]));
+    }
+
+    // Decoded box of child c. The products are exact, so this rounds the
+    // same with or without FMA contraction.
+    __host__ __device__ void childBounds(int c, const glm::vec3& step, glm::vec3& boxMin, glm::vec3& boxMax) const
+    {
+        boxMin = origin + glm::vec3(qMin[0][c], qMin[1][c], qMin[2][c]) * step;
+        boxMax = origin + glm::vec3(qMax[0][c], qMax[1][c], qMax[2][c]) * step;
+    }
+};
+
+__host__ __device__ inline bool wideBvhIsLeaf(int entry)
+{
+    return entry < 0;
+}
+
+__host__ __device__ inline int wideBvhLeafFirst(int entry)
+{
+    return ~entry >> WIDE_BVH_LEAF_BITS;
+}
+
+__host__ __device__ inline int wideBvhLeafCount(int entry)
+{
+    return ~entry & ((1 << WIDE_BVH_LEAF_BITS) - 1);
+}
+
+/**
+ * Plain pointers to a WideBvh, in host or device memory, passed to the
+ * traversal by value. numNodes is 0 when there is none, so renderers can
+ * pass an empty view to trace the binary nodes instead.
+ */
+struct WideBvhView
+{
+    const WideBvhNode* nodes;
+    const int* primIndices;
+    int numNodes;
+};
+
+/**
+ * Compressed WIDE_BVH_WIDTH-wide copy of a binary Bvh, for traversals that
+ * are limited by memory bandwidth. Every node pulls up the shallowest inner
+ * nodes below it, largest first, until it has WIDTH children, so one node
+ * fetch replaces about log2(WIDTH) binary levels. Leaves and primIndices are
+ * the binary tree's. The quantized boxes are looser, so rays may visit a
+ * few more nodes and primitives.
+ */
+class WideBvh
+{
+public:
+    WideBvh();
+
+    // Convert `bvh`. Call again after it is rebuilt or refitted.
+    void build(const Bvh& bvh);
+
+    // Drop the nodes, so view() is empty
+    void clear();
+
+    // Host view, valid until the next build
+    WideBvhView view() const;
+
+    // Bytes of nodes and primitive indices
+    size_t bytes() const;
+
+    std::vector<WideBvhNode> nodes;
+    std::vector<int> primIndices;
+    int depth;              // levels in the deepest leaf
+    double buildMs;         // duration of the last conversion
+
+private:
+    // Emit the wide node for binary inner node `binaryNode`, then its
+    // subtrees, and return its index
+    int collapse(const Bvh& bvh, int binaryNode, int level);
+};
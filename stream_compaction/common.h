@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cuda.h>
+#include <cuda_runtime.h>
+
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+#define FILENAME (strrchr(__FILE__, '/') ? strrchr(__FILE__, '/') + 1 : __FILE__)
+#define checkCUDAError(msg) StreamCompaction::Common::checkCUDAErrorFn(msg, FILENAME, __LINE__)
+
+/**
+ * Internal helpers shared by the stream compaction implementations. Users of
+ * the library only need cpu.h and efficient.h.
+ */
+
+inline int ilog2(int x)
+{
+    int lg = 0;
+    while (x >>= 1)
+    {
+        ++lg;
+    }
+    return lg;
+}
+
+inline int ilog2ceil(int x)
+{
+    return x == 1 ? 0 : ilog2(x - 1) + 1;
+}
+
+namespace StreamCompaction
+{
+    namespace Common
+    {
+        /**
+         * Check for CUDA errors; print and exit if there was a problem.
+         */
+        void checkCUDAErrorFn(const char* msg, const char* file = NULL, int line = -1);
+
+        __global__ void kernMapToBoolean(int n, int* bools, const int* idata);
+
+        __global__ void kernScatter(int n, int* odata,
+            const int* idata, const int* bools, const int* indices);
+    }
+}
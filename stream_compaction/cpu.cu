@@ -0,0 +1,210 @@
+#include <vector>
+#include "common.h"
+#include "cpu.h"
+#include "../src/threadPool.h"
+
+// Inputs are split into one contiguous chunk per pool thread, but never into
+// chunks smaller than this.
+#define MIN_CHUNK_SIZE 16384
+
+#define RADIX_BITS 8
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+
+namespace StreamCompaction
+{
+    namespace CPU
+    {
+        static int chunkCount(int n, ThreadPool* pool)
+        {
+            const int threads = pool != NULL ? pool->size() : 1;
+            return std::max(1, std::min(threads, n / MIN_CHUNK_SIZE));
+        }
+
+        static int chunkBegin(int n, int chunks, int chunk)
+        {
+            return (int)((long long)n * chunk / chunks);
+        }
+
+        // Run fn(chunk, begin, end) for every chunk on `pool`.
+        template <typename Fn>
+        static void forEachChunk(int n, int chunks, ThreadPool* pool, const Fn& fn)
+        {
+            if (chunks == 1)
+            {
+                fn(0, 0, n);
+                return;
+            }
+
+            pool->run(chunks, [&](int c, int thread)
+            {
+                fn(c, chunkBegin(n, chunks, c), chunkBegin(n, chunks, c + 1));
+            });
+        }
+
+        /**
+         * Two-pass parallel exclusive scan of `flag(i)` values: each chunk sums
+         * its elements, the chunk sums are scanned serially, then each chunk
+         * scans itself starting from its offset. Returns the total.
+         */
+        template <typename Flag>
+        static int scanChunks(int n, int* odata, ThreadPool* pool, const Flag& flag)
+        {
+            const int chunks = chunkCount(n, pool);
+            std::vector<int> offsets(chunks + 1, 0);
+
+            forEachChunk(n, chunks, pool, [&](int c, int begin, int end)
+            {
+                int sum = 0;
+                for (int i = begin; i < end; i++)
+                {
+                    sum += flag(i);
+                }
+                offsets[c + 1] = sum;
+            });
+
+            for (int c = 0; c < chunks; c++)
+            {
+                offsets[c + 1] += offsets[c];
+            }
+
+            forEachChunk(n, chunks, pool, [&](int c, int begin, int end)
+            {
+                int sum = offsets[c];
+                for (int i = begin; i < end; i++)
+                {
+                    // Read before writing so odata may alias the input.
+                    int value = flag(i);
+                    odata[i] = sum;
+                    sum += value;
+                }
+            });
+
+            return offsets[chunks];
+        }
+
+        void scan(int n, int* odata, const int* idata, ThreadPool* pool)
+        {
+            if (n <= 0)
+            {
+                return;
+            }
+            scanChunks(n, odata, pool, [idata](int i) { return idata[i]; });
+        }
+
+        int compact(int n, int* odata, const int* idata, ThreadPool* pool)
+        {
+            if (n <= 0)
+            {
+                return 0;
+            }
+
+            std::vector<int> indices(n);
+            const int count = scanChunks(n, indices.data(), pool, [idata](int i) { return idata[i] != 0 ? 1 : 0; });
+
+            forEachChunk(n, chunkCount(n, pool), pool, [&](int c, int begin, int end)
+            {
+                for (int i = begin; i < end; i++)
+                {
+                    if (idata[i] != 0)
+                    {
+                        odata[indices[i]] = idata[i];
+                    }
+                }
+            });
+
+            return count;
+        }
+
+        int partition(int n, int* odata, const int* bools, ThreadPool* pool)
+        {
+            if (n <= 0)
+            {
+                return 0;
+            }
+
+            const int numTrue = scanChunks(n, odata, pool, [bools](int i) { return bools[i] ? 1 : 0; });
+
+            forEachChunk(n, chunkCount(n, pool), pool, [&](int c, int begin, int end)
+            {
+                for (int i = begin; i < end; i++)
+                {
+                    if (!bools[i])
+                    {
+                        odata[i] = numTrue + i - odata[i];
+                    }
+                }
+            });
+
+            return numTrue;
+        }
+
+        void sortByKey(int n, int keyBits, int* keys, int* values, ThreadPool* pool)
+        {
+            if (n <= 1 || keyBits <= 0)
+            {
+                return;
+            }
+
+            const int chunks = chunkCount(n, pool);
+            std::vector<int> tmpKeys(n);
+            std::vector<int> tmpValues(n);
+            // offsets[chunk * RADIX_BUCKETS + digit]: where this chunk's
+            // elements with this digit start in the output
+            std::vector<int> offsets(chunks * RADIX_BUCKETS);
+
+            int* srcKeys = keys;
+            int* srcValues = values;
+            int* dstKeys = tmpKeys.data();
+            int* dstValues = tmpValues.data();
+
+            for (int shift = 0; shift < keyBits; shift += RADIX_BITS)
+            {
+                const int mask = (1 << std::min(RADIX_BITS, keyBits - shift)) - 1;
+
+                // Per-chunk digit histograms
+                forEachChunk(n, chunks, pool, [&](int c, int begin, int end)
+                {
+                    int* histogram = &offsets[c * RADIX_BUCKETS];
+                    std::fill(histogram, histogram + RADIX_BUCKETS, 0);
+                    for (int i = begin; i < end; i++)
+                    {
+                        histogram[(srcKeys[i] >> shift) & mask]++;
+                    }
+                });
+
+                // Exclusive scan in digit-major, chunk-minor order keeps the
+                // sort stable across chunks
+                int sum = 0;
+                for (int digit = 0; digit < RADIX_BUCKETS; digit++)
+                {
+                    for (int c = 0; c < chunks; c++)
+                    {
+                        int count = offsets[c * RADIX_BUCKETS + digit];
+                        offsets[c * RADIX_BUCKETS + digit] = sum;
+                        sum += count;
+                    }
+                }
+
+                forEachChunk(n, chunks, pool, [&](int c, int begin, int end)
+                {
+                    int* offset = &offsets[c * RADIX_BUCKETS];
+                    for (int i = begin; i < end; i++)
+                    {
+                        int dst = offset[(srcKeys[i] >> shift) & mask]++;
+                        dstKeys[dst] = srcKeys[i];
+                        dstValues[dst] = srcValues[i];
+                    }
+                });
+
+                std::swap(srcKeys, dstKeys);
+                std::swap(srcValues, dstValues);
+            }
+
+            if (srcKeys != keys)
+            {
+                std::copy(srcKeys, srcKeys + n, keys);
+                std::copy(srcValues, srcValues + n, values);
+            }
+        }
+    }
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+class ThreadPool;
+
+namespace StreamCompaction
+{
+    namespace CPU
+    {
+        /**
+         * Multithreaded host implementations with the same semantics as
+         * StreamCompaction::Efficient, operating on host pointers. The
+         * chunks run on `pool`, or all on the calling thread if it is NULL;
+         * inputs smaller than a few chunks also stay on the calling thread.
+         */
+
+        // Exclusive prefix sum. odata and idata may be the same array.
+        void scan(int n, int* odata, const int* idata, ThreadPool* pool = NULL);
+
+        // Copy the nonzero elements of idata to the front of odata, keeping
+        // their order. Returns the number of elements kept.
+        int compact(int n, int* odata, const int* idata, ThreadPool* pool = NULL);
+
+        /**
+         * Stable partition by a 0/1 flag array. Writes to odata[i] the position
+         * element i moves to so that flagged elements come first and unflagged
+         * ones after them, each group keeping its order. The caller applies
+         * the permutation to its own data. Returns the number of flagged
+         * elements.
+         */
+        int partition(int n, int* odata, const int* bools, ThreadPool* pool = NULL);
+
+        /**
+         * Stable LSD radix sort of `keys`, carrying `values` along. Sorts on
+         * the low `keyBits` bits, 8 bits per counting-sort pass, so key spaces
+         * of up to 256 keys need a single pass.
+         */
+        void sortByKey(int n, int keyBits, int* keys, int* values, ThreadPool* pool = NULL);
+    }
+}
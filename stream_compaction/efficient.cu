@@ -0,0 +1,238 @@
+#include <vector>
+#include "common.h"
+#include "efficient.h"
+
+// Each block scans SCAN_BLOCK_ELEMENTS elements in shared memory, two per
+// thread. Shared memory is padded by one slot every NUM_BANKS elements so the
+// strided tree accesses of the up- and down-sweep do not hit the same bank
+// (GPU Gems 3, chapter 39).
+#define SCAN_BLOCK_SIZE 128
+#define SCAN_BLOCK_ELEMENTS (2 * SCAN_BLOCK_SIZE)
+#define NUM_BANKS 32
+#define LOG_NUM_BANKS 5
+#define CONFLICT_FREE_OFFSET(n) ((n) >> LOG_NUM_BANKS)
+
+#define blockSize 128
+
+namespace StreamCompaction
+{
+    namespace Efficient
+    {
+        // scratch[level] holds the block sums of recursion level `level`.
+        static std::vector<int*> scratch;
+        static std::vector<int> scratchSize;
+        static int* dev_bools = NULL;
+        static int* dev_indices = NULL;
+        static int flagCapacity = 0;
+
+        static int* levelScratch(int level, int n)
+        {
+            if ((int)scratch.size() <= level)
+            {
+                scratch.resize(level + 1, NULL);
+                scratchSize.resize(level + 1, 0);
+            }
+            if (scratchSize[level] < n)
+            {
+                cudaFree(scratch[level]);
+                cudaMalloc(&scratch[level], n * sizeof(int));
+                scratchSize[level] = n;
+            }
+            return scratch[level];
+        }
+
+        static void reserveFlags(int n)
+        {
+            if (flagCapacity < n)
+            {
+                cudaFree(dev_bools);
+                cudaFree(dev_indices);
+                cudaMalloc(&dev_bools, n * sizeof(int));
+                cudaMalloc(&dev_indices, n * sizeof(int));
+                flagCapacity = n;
+            }
+        }
+
+        void freeScratch()
+        {
+            for (int* buffer : scratch)
+            {
+                cudaFree(buffer);
+            }
+            scratch.clear();
+            scratchSize.clear();
+            cudaFree(dev_bools);
+            cudaFree(dev_indices);
+            dev_bools = dev_indices = NULL;
+            flagCapacity = 0;
+        }
+
+        /**
+         * Exclusive scan of one SCAN_BLOCK_ELEMENTS chunk per block. If
+         * blockSums is not null, the total of each chunk is written to it.
+         * Safe to run in place since every block only touches its own chunk.
+         */
+        __global__ void kernScanBlock(int n, int* odata, const int* idata, int* blockSums)
+        {
+            __shared__ int temp[SCAN_BLOCK_ELEMENTS + CONFLICT_FREE_OFFSET(SCAN_BLOCK_ELEMENTS)];
+
+            const int thid = threadIdx.x;
+            const int blockOffset = blockIdx.x * SCAN_BLOCK_ELEMENTS;
+            const int ai = thid;
+            const int bi = thid + SCAN_BLOCK_SIZE;
+            const int bankOffsetA = CONFLICT_FREE_OFFSET(ai);
+            const int bankOffsetB = CONFLICT_FREE_OFFSET(bi);
+
+            temp[ai + bankOffsetA] = blockOffset + ai < n ? idata[blockOffset + ai] : 0;
+            temp[bi + bankOffsetB] = blockOffset + bi < n ? idata[blockOffset + bi] : 0;
+
+            // Up-sweep: build partial sums in place up the tree
+            int offset = 1;
+            for (int d = SCAN_BLOCK_ELEMENTS >> 1; d > 0; d >>= 1)
+            {
+                __syncthreads();
+                if (thid < d)
+                {
+                    int a = offset * (2 * thid + 1) - 1;
+                    int b = offset * (2 * thid + 2) - 1;
+                    a += CONFLICT_FREE_OFFSET(a);
+                    b += CONFLICT_FREE_OFFSET(b);
+                    temp[b] += temp[a];
+                }
+                offset <<= 1;
+            }
+
+            if (thid == 0)
+            {
+                const int last = SCAN_BLOCK_ELEMENTS - 1 + CONFLICT_FREE_OFFSET(SCAN_BLOCK_ELEMENTS - 1);
+                if (blockSums)
+                {
+                    blockSums[blockIdx.x] = temp[last];
+                }
+                temp[last] = 0;
+            }
+
+            // Down-sweep: traverse back down the tree building the scan
+            for (int d = 1; d < SCAN_BLOCK_ELEMENTS; d <<= 1)
+            {
+                offset >>= 1;
+                __syncthreads();
+                if (thid < d)
+                {
+                    int a = offset * (2 * thid + 1) - 1;
+                    int b = offset * (2 * thid + 2) - 1;
+                    a += CONFLICT_FREE_OFFSET(a);
+                    b += CONFLICT_FREE_OFFSET(b);
+                    int t = temp[a];
+                    temp[a] = temp[b];
+                    temp[b] += t;
+                }
+            }
+            __syncthreads();
+
+            if (blockOffset + ai < n)
+            {
+                odata[blockOffset + ai] = temp[ai + bankOffsetA];
+            }
+            if (blockOffset + bi < n)
+            {
+                odata[blockOffset + bi] = temp[bi + bankOffsetB];
+            }
+        }
+
+        // Add the scanned total of all preceding chunks to every element.
+        __global__ void kernAddBlockSums(int n, int* data, const int* blockSums)
+        {
+            const int blockOffset = blockIdx.x * SCAN_BLOCK_ELEMENTS;
+            const int sum = blockSums[blockIdx.x];
+            if (blockOffset + threadIdx.x < n)
+            {
+                data[blockOffset + threadIdx.x] += sum;
+            }
+            if (blockOffset + threadIdx.x + SCAN_BLOCK_SIZE < n)
+            {
+                data[blockOffset + threadIdx.x + SCAN_BLOCK_SIZE] += sum;
+            }
+        }
+
+        __global__ void kernPartitionIndices(int n, int numTrue, int* indices, const int* bools)
+        {
+            int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+            if (index < n && !bools[index])
+            {
+                // indices holds the exclusive scan of bools, so index - scan is
+                // the number of unflagged elements before this one.
+                indices[index] = numTrue + index - indices[index];
+            }
+        }
+
+        static void scanLevel(int level, int n, int* odata, const int* idata)
+        {
+            const int numBlocks = (n + SCAN_BLOCK_ELEMENTS - 1) / SCAN_BLOCK_ELEMENTS;
+            if (numBlocks == 1)
+            {
+                kernScanBlock<<<1, SCAN_BLOCK_SIZE>>>(n, odata, idata, NULL);
+                return;
+            }
+
+            int* blockSums = levelScratch(level, numBlocks);
+            kernScanBlock<<<numBlocks, SCAN_BLOCK_SIZE>>>(n, odata, idata, blockSums);
+            scanLevel(level + 1, numBlocks, blockSums, blockSums);
+            kernAddBlockSums<<<numBlocks, SCAN_BLOCK_SIZE>>>(n, odata, blockSums);
+        }
+
+        void scan(int n, int* odata, const int* idata)
+        {
+            if (n <= 0)
+            {
+                return;
+            }
+            scanLevel(0, n, odata, idata);
+            checkCUDAError("scan");
+        }
+
+        // Total of an exclusive scan: last scanned value plus the last flag.
+        static int scanTotal(int n, const int* indices, const int* bools)
+        {
+            int lastIndex = 0;
+            int lastBool = 0;
+            cudaMemcpy(&lastIndex, indices + n - 1, sizeof(int), cudaMemcpyDeviceToHost);
+            cudaMemcpy(&lastBool, bools + n - 1, sizeof(int), cudaMemcpyDeviceToHost);
+            return lastIndex + lastBool;
+        }
+
+        int compact(int n, int* odata, const int* idata)
+        {
+            if (n <= 0)
+            {
+                return 0;
+            }
+            reserveFlags(n);
+
+            dim3 fullBlocksPerGrid((n + blockSize - 1) / blockSize);
+            Common::kernMapToBoolean<<<fullBlocksPerGrid, blockSize>>>(n, dev_bools, idata);
+            scan(n, dev_indices, dev_bools);
+            Common::kernScatter<<<fullBlocksPerGrid, blockSize>>>(n, odata, idata, dev_bools, dev_indices);
+            checkCUDAError("compact");
+
+            return scanTotal(n, dev_indices, dev_bools);
+        }
+
+        int partition(int n, int* odata, const int* bools)
+        {
+            if (n <= 0)
+            {
+                return 0;
+            }
+
+            scan(n, odata, bools);
+            const int numTrue = scanTotal(n, odata, bools);
+
+            dim3 fullBlocksPerGrid((n + blockSize - 1) / blockSize);
+            kernPartitionIndices<<<fullBlocksPerGrid, blockSize>>>(n, numTrue, odata, bools);
+            checkCUDAError("partition");
+
+            return numTrue;
+        }
+    }
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cuda_runtime.h>
+
+namespace StreamCompaction
+{
+    namespace Efficient
+    {
+        /**
+         * Work-efficient (up-sweep/down-sweep) implementations. All pointers
+         * are device pointers. Scratch memory is allocated on first use and
+         * reused by later calls of the same or smaller size.
+         */
+
+        // Exclusive prefix sum. odata and idata may be the same array.
+        void scan(int n, int* odata, const int* idata);
+
+        // Copy the nonzero elements of idata to the front of odata, keeping
+        // their order. Returns the number of elements kept.
+        int compact(int n, int* odata, const int* idata);
+
+        // Stable partition destinations; see StreamCompaction::CPU::partition.
+        int partition(int n, int* odata, const int* bools);
+
+        // Release the cached scratch memory.
+        void freeScratch();
+
+        /**
+         * Move idata[i] to odata[indices[i]], e.g. with the destinations
+         * computed by partition().
+         */
+        template <typename T>
+        __global__ void kernScatterByIndex(int n, T* odata, const T* idata, const int* indices)
+        {
+            int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+            if (index < n)
+            {
+                odata[indices[index]] = idata[index];
+            }
+        }
+    }
+}
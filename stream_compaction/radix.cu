@@ -0,0 +1,160 @@
+#include "common.h"
+#include "efficient.h"
+#include "radix.h"
+
+#define blockSize 128
+
+// Key bits sorted per pass. Each block sorts a tile of blockSize elements,
+// so the digit histograms of all tiles hold RADIX_BUCKETS entries per
+// blockSize elements.
+#define RADIX_BITS 4
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+#define WARP_SIZE 32
+#define RADIX_WARPS (blockSize / WARP_SIZE)
+
+namespace StreamCompaction
+{
+    namespace Radix
+    {
+        static int* dev_histograms = NULL;
+        static int* dev_keys = NULL;
+        static int* dev_values = NULL;
+        static int capacity = 0;
+
+        static int tileCount(int n)
+        {
+            return (n + blockSize - 1) / blockSize;
+        }
+
+        static void reserve(int n)
+        {
+            if (capacity < n)
+            {
+                freeScratch();
+                cudaMalloc(&dev_histograms, RADIX_BUCKETS * tileCount(n) * sizeof(int));
+                cudaMalloc(&dev_keys, n * sizeof(int));
+                cudaMalloc(&dev_values, n * sizeof(int));
+                capacity = n;
+            }
+        }
+
+        void freeScratch()
+        {
+            cudaFree(dev_histograms);
+            cudaFree(dev_keys);
+            cudaFree(dev_values);
+            dev_histograms = dev_keys = dev_values = NULL;
+            capacity = 0;
+        }
+
+        // Count the digits of each tile into histograms[digit * numTiles + tile],
+        // digit-major, so that an exclusive scan of the whole array gives every
+        // tile the first output position of each of its digits.
+        __global__ void kernTileHistograms(int n, int numTiles, int shift, int mask, const int* keys, int* histograms)
+        {
+            __shared__ int counts[RADIX_BUCKETS];
+            if (threadIdx.x < RADIX_BUCKETS)
+            {
+                counts[threadIdx.x] = 0;
+            }
+            __syncthreads();
+
+            int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+            if (index < n)
+            {
+                atomicAdd(&counts[(keys[index] >> shift) & mask], 1);
+            }
+            __syncthreads();
+
+            if (threadIdx.x < RADIX_BUCKETS)
+            {
+                histograms[threadIdx.x * numTiles + blockIdx.x] = counts[threadIdx.x];
+            }
+        }
+
+        /**
+         * Move each element of a tile to its tile's offset for its digit plus
+         * the number of elements of the tile with the same digit before it.
+         * Within a warp, that count comes from ballots over the digit bits;
+         * the warps before it add their per-digit counts from shared memory.
+         */
+        __global__ void kernScatterDigits(int n, int numTiles, int shift, int mask, const int* offsets,
+            const int* srcKeys, const int* srcValues, int* dstKeys, int* dstValues)
+        {
+            __shared__ int warpCounts[RADIX_WARPS][RADIX_BUCKETS];
+            int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+            const int lane = threadIdx.x % WARP_SIZE;
+            const int warp = threadIdx.x / WARP_SIZE;
+            const bool valid = index < n;
+            const int key = valid ? srcKeys[index] : 0;
+            const int digit = (key >> shift) & mask;
+
+            // Lanes of this warp with the same digit, one bit at a time
+            unsigned int peers = __ballot_sync(0xffffffffu, valid);
+            for (int bit = 0; bit < RADIX_BITS; bit++)
+            {
+                const bool set = ((digit >> bit) & 1) != 0;
+                const unsigned int lanes = __ballot_sync(0xffffffffu, set);
+                peers &= set ? lanes : ~lanes;
+            }
+
+            if (threadIdx.x < RADIX_WARPS * RADIX_BUCKETS)
+            {
+                warpCounts[threadIdx.x / RADIX_BUCKETS][threadIdx.x % RADIX_BUCKETS] = 0;
+            }
+            __syncthreads();
+            const unsigned int lowerLanes = (1u << lane) - 1u;
+            if (valid && (peers & lowerLanes) == 0)
+            {
+                warpCounts[warp][digit] = __popc(peers);
+            }
+            __syncthreads();
+
+            if (valid)
+            {
+                int rank = __popc(peers & lowerLanes);
+                for (int w = 0; w < warp; w++)
+                {
+                    rank += warpCounts[w][digit];
+                }
+                const int dst = offsets[digit * numTiles + blockIdx.x] + rank;
+                dstKeys[dst] = key;
+                dstValues[dst] = srcValues[index];
+            }
+        }
+
+        void sortByKey(int n, int keyBits, int* keys, int* values)
+        {
+            if (n <= 1 || keyBits <= 0)
+            {
+                return;
+            }
+            reserve(n);
+
+            const int numTiles = tileCount(n);
+            int* srcKeys = keys;
+            int* srcValues = values;
+            int* dstKeys = dev_keys;
+            int* dstValues = dev_values;
+
+            for (int shift = 0; shift < keyBits; shift += RADIX_BITS)
+            {
+                const int mask = (1 << std::min(RADIX_BITS, keyBits - shift)) - 1;
+                kernTileHistograms<<<numTiles, blockSize>>>(n, numTiles, shift, mask, srcKeys, dev_histograms);
+                Efficient::scan(RADIX_BUCKETS * numTiles, dev_histograms, dev_histograms);
+                kernScatterDigits<<<numTiles, blockSize>>>(n, numTiles, shift, mask, dev_histograms,
+                    srcKeys, srcValues, dstKeys, dstValues);
+                std::swap(srcKeys, dstKeys);
+                std::swap(srcValues, dstValues);
+            }
+
+            // After an odd number of passes the result sits in scratch memory
+            if (srcKeys != keys)
+            {
+                cudaMemcpyAsync(keys, srcKeys, n * sizeof(int), cudaMemcpyDeviceToDevice);
+                cudaMemcpyAsync(values, srcValues, n * sizeof(int), cudaMemcpyDeviceToDevice);
+            }
+            checkCUDAError("radix sort");
+        }
+    }
+}
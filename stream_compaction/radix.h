@@ -0,0 +1,20 @@
+#pragma once
+
+namespace StreamCompaction
+{
+    namespace Radix
+    {
+        /**
+         * Stable LSD radix sort of `keys` on device, carrying `values` along.
+         * Only the low `keyBits` bits of each key are sorted on, 4 bits per
+         * pass, so small key spaces (e.g. a handful of material IDs) take a
+         * single pass. A pass counts the digits of every 128-element tile,
+         * scans the counts with StreamCompaction::Efficient::scan and
+         * scatters each tile; nothing is read back to the host.
+         */
+        void sortByKey(int n, int keyBits, int* keys, int* values);
+
+        // Release the cached scratch memory.
+        void freeScratch();
+    }
+}